@@ -97,6 +97,8 @@ int main(int argc, char *argv[])
 	int specified_lz2 = FALSE;
 	int iz1 = -1;
 	int iz2 = -1;
+	int snap_layers = FALSE; /* Flag for snapping the layer boundaries 
+	                            to fall midway between grid points */
 	int nolayer = FALSE; /* layer flag (simplifies numerical 
 	                        calculation of a homogeneous case) */
 	double ez1 = -1.;	/* Location of lower edge of cylinder */
@@ -117,6 +119,20 @@ int main(int argc, char *argv[])
 	double dr = -1.;
 	double dz = -1.;
 	double dt = -1.;
+	int stencil = 2;	/* Order of the spatial discretization (2 or 4) */
+	int use_zmirror = TRUE;	/* Flag for using z-mirror symmetry if possible */
+	int exp_clearance = FALSE;	/* Flag for exact integration of the 
+	                             source and clearance */
+	int zmirror = 0;	/* Number of ghost rows below the source (0 = no symmetry) */
+	int izshift = 0;	/* Row of the full grid that is row 0 of the model grid */
+	int iprobe_model = -1;	/* z-index of the probe on the model grid */
+	int solver = 0;	/* Solver: 2 (2D axisymmetric), 3 (3D Cartesian), or 
+	                   0 (3D only if a source is off the z-axis) */
+	int parareal = 0;	/* Number of parareal time slices (0 = no parareal) */
+	double parareal_tol = 1.0e-6;	/* Relative tolerance of the parareal iterations */
+	int parareal_iter = 0;	/* Number of parareal iterations */
+	int mpi_rank = 0;	/* MPI rank of this process (only rank 0 writes output) */
+	int mpi_size = 1;	/* Number of MPI processes */
 
 	/* Source */
 	double trn = 0.35;
@@ -136,6 +152,9 @@ int main(int argc, char *argv[])
 	int specified_pz = FALSE;
 	int iprobe, jprobe;
 	iprobe = jprobe = -1;
+	int nprobes = 1;	/* Number of probes of the model */
+	int *iprobes = NULL;	/* z- and r-indices of the probes of the model */
+	int *jprobes = NULL;
 
 	/* ECS parameters -- got defaults from paper -- p. 12 and Table 1 
 	   of manuscript submitted in summer 2011 */
@@ -149,10 +168,28 @@ int main(int argc, char *argv[])
 	double alpha_sr = 0.218;
 	double theta_sr = 0.447;
 	double kappa_sr = 0.0;
+	double theta_z_so = -1.;	/* Axial permeabilities (< 0: same as theta) */
+	double theta_z_sp = -1.;
+	double theta_z_sr = -1.;
 	double kappa_outside = 0.0;
 	int specified_kappa_outside = FALSE;
-	double dstar_so, dstar_sp, dstar_sr, dstar_max;
-	dstar_so = dstar_sp = dstar_sr = dstar_max = -1.;
+	double vmax_so = 0.0;	/* Michaelis-Menten uptake: Vmax in mM/s, */
+	double km_so = 1.0;	/* Km in mM */
+	double vmax_sp = 0.0;
+	double km_sp = 1.0;
+	double vmax_sr = 0.0;
+	double km_sr = 1.0;
+	double dstar_max = -1.;
+
+	/* Layer table. By default it has the SR, SP, and SO layers; 
+	   if the user specifies layers (from the bottom up), they 
+	   replace the 3 layers. */
+	layer_table_struct_type layers;
+	layers.n = 0;
+	int specified_layers = FALSE;	/* Layers specified by the user */
+	int anisotropic = FALSE;	/* Flag for theta_z != theta in any layer */
+	int cmdline_layers = FALSE;	/* Layers specified on the command line */
+	layer_table_struct_type model_layers;	/* Layers on the model grid */
 
 	double dfree = 1.24e-09;
 
@@ -179,6 +216,40 @@ int main(int argc, char *argv[])
 	more_sources.source = NULL;
 	source_struct_type new_source;
 
+	/* Candidate source positions of the reciprocal mode */
+	char reciprocal_string[ADDITIONAL_SOURCES_STRING_LENGTH];
+	memset(reciprocal_string, '\0', ADDITIONAL_SOURCES_STRING_LENGTH);
+	more_sources_struct_type candidates;
+	candidates.n = 0;
+	candidates.source = NULL;
+
+	/* Experimental design: candidate probe positions and source 
+	   durations */
+	int design = FALSE;	/* Flag for the experimental design mode */
+	double design_dmin = 50.0e-6;	/* Range of the distances of the candidate probes (m) */
+	double design_dmax = 300.0e-6;
+	double design_spacing = 25.0e-6;	/* Spacing of the candidate probes (m) */
+	int design_ndur = 10;	/* Number of source durations */
+	double design_noise = 0.01;	/* Standard deviation of the noise of the data (mM) */
+	int ncell = 1;	/* Spacing of the candidate probes in cells */
+	int ncand = 0;	/* Number of candidate probes */
+	int *icand = NULL;	/* z- and r-indices of the candidate probes */
+	int *jcand = NULL;
+	int kstride = 1;	/* Time-steps between the recorded times */
+	int nsample = 0;	/* Number of recorded times */
+	int dur_step = 1;	/* Spacing of the durations (in recorded times) */
+	int best = -1;	/* Best candidate */
+	int *best_dur = NULL;	/* Best duration of each candidate */
+	double *best_det = NULL;	/* Determinant of the Fisher information */
+	double *se = NULL;	/* Standard errors of each candidate */
+	double *pc = NULL;	/* Concentration and sensitivities at the candidates */
+	double *sens = NULL;
+
+	int nsources3d = 0;	/* Sources of the 3D solver */
+	int *isources3d = NULL;
+	int *xsources3d = NULL;
+	double *samounts3d = NULL;
+
 	/* Parameters to send to calc_mse_rti */
 	double spdist = -1.;
 
@@ -209,6 +280,11 @@ int main(int argc, char *argv[])
 	gsl_vector *simplex = NULL;
 	double alpha_step = 0.1;
 	double theta_step = 0.2;
+	int fit_kappa = FALSE;	/* Flag for fitting the apparent kappa too */
+	int nfit = 2;	/* Number of fitted apparent parameters */
+	double kappa_start = 0.;	/* Starting value of the apparent kappa */
+	double kappa_step = 0.005;
+	double kappa_fit = 0.;
 	const gsl_multimin_fminimizer_type *fit_algorithm = 
 		gsl_multimin_fminimizer_nmsimplex;
 	gsl_multimin_fminimizer *fit_state = NULL;
@@ -218,11 +294,20 @@ int main(int argc, char *argv[])
 	int fit_status = -1;
 	double fit_size = -1.;
 	double fit_tol = 1.e-4;
+	int fit_lm = FALSE;	/* Flag for Levenberg-Marquardt instead of simplex */
+	double fit_mu = 1.e-3;	/* Levenberg-Marquardt damping */
+	double fit_se[3] = {-1., -1., -1.};	/* Standard errors of the apparent parameters */
 
 
 	/* Get start time of program */
 	start_time = time(NULL);
 
+#ifdef USE_MPI
+	MPI_Init(&argc, &argv);
+	MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+#endif
+
 	/* If no arguments are given, or if there is on argument 
 	   beginning with - (like -h), print the usage statement 
 	    ((argc == 2) &&(argv[argc-1][0] == '-'))) 
@@ -321,6 +406,7 @@ Currently it just checks if the first character of the last arg is -
 				pr *= 1e-6;	/* Input in microns; convert to m */
 			}
 			if (STREQ(parameter, "nolayer")) nolayer = atoi(value);
+			if (STREQ(parameter, "snap_layers")) snap_layers = atoi(value);
 			if (STREQ(parameter, "lz1")) {
 				lz1 = atof(value);
 				specified_lz1 = TRUE;
@@ -347,13 +433,32 @@ Currently it just checks if the first character of the last arg is -
 			if (STREQ(parameter, "theta_so")) theta_so = atof(value);
 			if (STREQ(parameter, "theta_sp")) theta_sp = atof(value);
 			if (STREQ(parameter, "theta_sr")) theta_sr = atof(value);
+			if (STREQ(parameter, "theta_z_so")) theta_z_so = atof(value);
+			if (STREQ(parameter, "theta_z_sp")) theta_z_sp = atof(value);
+			if (STREQ(parameter, "theta_z_sr")) theta_z_sr = atof(value);
 			if (STREQ(parameter, "kappa_so")) kappa_so = atof(value);
 			if (STREQ(parameter, "kappa_sp")) kappa_sp = atof(value);
 			if (STREQ(parameter, "kappa_sr")) kappa_sr = atof(value);
+			if (STREQ(parameter, "vmax_so")) vmax_so = atof(value);
+			if (STREQ(parameter, "vmax_sp")) vmax_sp = atof(value);
+			if (STREQ(parameter, "vmax_sr")) vmax_sr = atof(value);
+			if (STREQ(parameter, "km_so")) km_so = atof(value);
+			if (STREQ(parameter, "km_sp")) km_sp = atof(value);
+			if (STREQ(parameter, "km_sr")) km_sr = atof(value);
+			if (STREQ(parameter, "layer")) {
+				add_layer(value, &layers);
+				specified_layers = TRUE;
+			}
 			if (STREQ(parameter, "nt")) {
 				nt = atoi(value);
 				specified_nt = TRUE;
 			}
+			if (STREQ(parameter, "stencil")) stencil = atoi(value);
+			if (STREQ(parameter, "zmirror")) use_zmirror = atoi(value);
+			if (STREQ(parameter, "exp_clearance")) exp_clearance = atoi(value);
+			if (STREQ(parameter, "solver")) solver = read_solver(value);
+			if (STREQ(parameter, "parareal")) parareal = atoi(value);
+			if (STREQ(parameter, "parareal_tol")) parareal_tol = atof(value);
 			if (STREQ(parameter, "nt_scale")) {
 				nt_scale = atof(value);
 				specified_nt_scale = TRUE;
@@ -389,32 +494,61 @@ Currently it just checks if the first character of the last arg is -
 		{"nz", required_argument, NULL, 0},
 		{"nt", required_argument, NULL, 0},
 		{"nt_scale", required_argument, NULL, 0},
+		{"stencil", required_argument, NULL, 0},
+		{"no_zmirror", no_argument, NULL, 0},
+		{"exp_clearance", no_argument, NULL, 0},
+		{"solver", required_argument, NULL, 0},
+		{"parareal", required_argument, NULL, 0},
+		{"parareal_tol", required_argument, NULL, 0},
 		{"probe_z", required_argument, NULL, 0},
 		{"probe_r", required_argument, NULL, 0},
 		{"ez1", required_argument, NULL, 0},
 		{"ez2", required_argument, NULL, 0},
+		{"snap_layers", no_argument, NULL, 0},
 		{"alpha_so", required_argument, NULL, 0},
 		{"alpha_sp", required_argument, NULL, 0},
 		{"alpha_sr", required_argument, NULL, 0},
 		{"theta_so", required_argument, NULL, 0},
 		{"theta_sp", required_argument, NULL, 0},
 		{"theta_sr", required_argument, NULL, 0},
+		{"theta_z_so", required_argument, NULL, 0},
+		{"theta_z_sp", required_argument, NULL, 0},
+		{"theta_z_sr", required_argument, NULL, 0},
 		{"kappa_so", required_argument, NULL, 0},
 		{"kappa_sp", required_argument, NULL, 0},
 		{"kappa_sr", required_argument, NULL, 0},
 		{"kappa_outside", required_argument, NULL, 0},
+		{"vmax_so", required_argument, NULL, 0},
+		{"vmax_sp", required_argument, NULL, 0},
+		{"vmax_sr", required_argument, NULL, 0},
+		{"km_so", required_argument, NULL, 0},
+		{"km_sp", required_argument, NULL, 0},
+		{"km_sr", required_argument, NULL, 0},
+		{"layer", required_argument, NULL, 0},
 		{"alpha_start", required_argument, NULL, 0},
 		{"theta_start", required_argument, NULL, 0},
 		{"alpha_step", required_argument, NULL, 0},
 		{"theta_step", required_argument, NULL, 0},
+		{"fit_kappa", no_argument, NULL, 0},
+		{"kappa_start", required_argument, NULL, 0},
+		{"kappa_step", required_argument, NULL, 0},
 		{"tmax", required_argument, NULL, 0},
 		{"fit_tol", required_argument, NULL, 0},
+		{"lm", no_argument, NULL, 0},
+		{"optimizer", required_argument, NULL, 0},
 		{"itermax", required_argument, NULL, 0},
 		{"outfile", required_argument, NULL, 0},
 		{"pathfile", required_argument, NULL, 0},
 		{"images", required_argument, NULL, 0},
 		{"image_spacing", required_argument, NULL, 0},
 		{"additional_sources", required_argument, NULL, 0},
+		{"reciprocal", required_argument, NULL, 0},
+		{"design", no_argument, NULL, 0},
+		{"design_dmin", required_argument, NULL, 0},
+		{"design_dmax", required_argument, NULL, 0},
+		{"design_spacing", required_argument, NULL, 0},
+		{"design_durations", required_argument, NULL, 0},
+		{"design_noise", required_argument, NULL, 0},
 		{NULL, no_argument, NULL, 0}
 	};
 
@@ -445,6 +579,18 @@ Currently it just checks if the first character of the last arg is -
 			} else if (STREQ("nt_scale", long_opts[opt_index].name)) {
 				nt_scale = atof(optarg);
 				specified_nt_scale = TRUE;
+			} else if (STREQ("stencil", long_opts[opt_index].name)) {
+				stencil = atoi(optarg);
+			} else if (STREQ("no_zmirror", long_opts[opt_index].name)) {
+				use_zmirror = FALSE;
+			} else if (STREQ("exp_clearance", long_opts[opt_index].name)) {
+				exp_clearance = TRUE;
+			} else if (STREQ("solver", long_opts[opt_index].name)) {
+				solver = read_solver(optarg);
+			} else if (STREQ("parareal", long_opts[opt_index].name)) {
+				parareal = atoi(optarg);
+			} else if (STREQ("parareal_tol", long_opts[opt_index].name)) {
+				parareal_tol = atof(optarg);
 			} else if (STREQ("probe_z", long_opts[opt_index].name)) {
 				pz = atof(optarg);
 				specified_pz = TRUE;
@@ -460,6 +606,8 @@ Currently it just checks if the first character of the last arg is -
 				ez2 = atof(optarg);
 				specified_ez2 = TRUE;
 				ez2 *= 1e-6;	/* Input in microns; convert to m */
+			} else if (STREQ("snap_layers", long_opts[opt_index].name)) {
+				snap_layers = TRUE;
 			} else if (STREQ("alpha_so", long_opts[opt_index].name)) {
 				alpha_so = atof(optarg);
 			} else if (STREQ("alpha_sp", long_opts[opt_index].name)) {
@@ -472,6 +620,12 @@ Currently it just checks if the first character of the last arg is -
 				theta_sp = atof(optarg);
 			} else if (STREQ("theta_sr", long_opts[opt_index].name)) {
 				theta_sr = atof(optarg);
+			} else if (STREQ("theta_z_so", long_opts[opt_index].name)) {
+				theta_z_so = atof(optarg);
+			} else if (STREQ("theta_z_sp", long_opts[opt_index].name)) {
+				theta_z_sp = atof(optarg);
+			} else if (STREQ("theta_z_sr", long_opts[opt_index].name)) {
+				theta_z_sr = atof(optarg);
 			} else if (STREQ("kappa_so", long_opts[opt_index].name)) {
 				kappa_so = atof(optarg);
 			} else if (STREQ("kappa_sp", long_opts[opt_index].name)) {
@@ -481,6 +635,25 @@ Currently it just checks if the first character of the last arg is -
 			} else if (STREQ("kappa_outside", long_opts[opt_index].name)) {
 				kappa_outside = atof(optarg);
 				specified_kappa_outside = TRUE;
+			} else if (STREQ("vmax_so", long_opts[opt_index].name)) {
+				vmax_so = atof(optarg);
+			} else if (STREQ("vmax_sp", long_opts[opt_index].name)) {
+				vmax_sp = atof(optarg);
+			} else if (STREQ("vmax_sr", long_opts[opt_index].name)) {
+				vmax_sr = atof(optarg);
+			} else if (STREQ("km_so", long_opts[opt_index].name)) {
+				km_so = atof(optarg);
+			} else if (STREQ("km_sp", long_opts[opt_index].name)) {
+				km_sp = atof(optarg);
+			} else if (STREQ("km_sr", long_opts[opt_index].name)) {
+				km_sr = atof(optarg);
+			} else if (STREQ("layer", long_opts[opt_index].name)) {
+				/* Layers on the command line replace the layers 
+				   in the input file */
+				if (! cmdline_layers) layers.n = 0;
+				cmdline_layers = TRUE;
+				add_layer(optarg, &layers);
+				specified_layers = TRUE;
 			} else if (STREQ("alpha_start", long_opts[opt_index].name)) {
 				alpha_start = atof(optarg);
 			} else if (STREQ("theta_start", long_opts[opt_index].name)) {
@@ -489,10 +662,25 @@ Currently it just checks if the first character of the last arg is -
 				alpha_step = atof(optarg);
 			} else if (STREQ("theta_step", long_opts[opt_index].name)) {
 				theta_step = atof(optarg);
+			} else if (STREQ("fit_kappa", long_opts[opt_index].name)) {
+				fit_kappa = TRUE;
+			} else if (STREQ("kappa_start", long_opts[opt_index].name)) {
+				kappa_start = atof(optarg);
+			} else if (STREQ("kappa_step", long_opts[opt_index].name)) {
+				kappa_step = atof(optarg);
 			} else if (STREQ("tmax", long_opts[opt_index].name)) {
 				tmax = atof(optarg);
 			} else if (STREQ("fit_tol", long_opts[opt_index].name)) {
 				fit_tol = atof(optarg);
+			} else if (STREQ("lm", long_opts[opt_index].name)) {
+				fit_lm = TRUE;
+			} else if (STREQ("optimizer", long_opts[opt_index].name)) {
+				/* --lm is --optimizer lm */
+				fit_lm = STREQ(optarg, "lm");
+				if (STREQ(optarg, "nmsimplex2"))
+					fit_algorithm = gsl_multimin_fminimizer_nmsimplex2;
+				else if ( ! (fit_lm || STREQ(optarg, "nmsimplex")) )
+					error("Unknown optimizer %s", optarg);
 			} else if (STREQ("itermax", long_opts[opt_index].name)) {
 				itermax = atoi(optarg);
 			} else if (STREQ("outfile", long_opts[opt_index].name)) {
@@ -530,6 +718,47 @@ Currently it just checks if the first character of the last arg is -
 							read_source_parameter("crnt", nsource) * 1e-9; 
 					}
 				}
+			} else if (STREQ("reciprocal", long_opts[opt_index].name)) {
+				if (strlen (optarg) < ADDITIONAL_SOURCES_STRING_LENGTH)
+					strcpy(reciprocal_string, optarg);
+				else
+					error("reciprocal string is too long");
+
+				token = strtok(reciprocal_string, " ,");
+				candidates.n = atoi(token);
+				if (candidates.n < 0)
+					error("reciprocal: number of candidate sources < 0");
+
+				if (candidates.n > 0) {
+					candidates.source = 
+						(source_struct_type *)
+							malloc( sizeof(source_struct_type) * candidates.n );
+					if (candidates.source == NULL)
+						error("Cannot allocate memory for the candidate sources");
+					/* Read position of each candidate source */
+					for (nsource = 0; nsource < candidates.n; nsource++) {
+						candidates.source[nsource].sz = 
+							read_source_parameter("sz", nsource) * 1e-6; 
+						candidates.source[nsource].sr = 
+							read_source_parameter("sr", nsource) * 1e-6; 
+						candidates.source[nsource].crnt = crnt;
+					}
+				}
+			} else if (STREQ("design", long_opts[opt_index].name)) {
+				design = TRUE;
+			} else if (STREQ("design_dmin", long_opts[opt_index].name)) {
+				design_dmin = atof(optarg);
+				design_dmin *= 1e-6;	/* Input in microns; convert to m */
+			} else if (STREQ("design_dmax", long_opts[opt_index].name)) {
+				design_dmax = atof(optarg);
+				design_dmax *= 1e-6;	/* Input in microns; convert to m */
+			} else if (STREQ("design_spacing", long_opts[opt_index].name)) {
+				design_spacing = atof(optarg);
+				design_spacing *= 1e-6;	/* Input in microns; convert to m */
+			} else if (STREQ("design_durations", long_opts[opt_index].name)) {
+				design_ndur = atoi(optarg);
+			} else if (STREQ("design_noise", long_opts[opt_index].name)) {
+				design_noise = atof(optarg);
 			}
 			break;
 
@@ -571,6 +800,14 @@ Currently it just checks if the first character of the last arg is -
 	if (STREQ(outfilename, pathfilename)) 
 		error("The output and simplex path filenames cannot be the same.");
 
+	/* With MPI, every rank calculates the curve and fits the 
+	   characteristic curve, but only rank 0 prints and writes files */
+	if (mpi_rank > 0) {
+		strcpy(outfilename, "/dev/null");
+		opt_verbose = FALSE;
+		opt_pathfile = FALSE;
+	}
+
 	if (specified_ez1 && !specified_ez2) 
 		error("You specified ez1 but did not specify ez2");
 	if (specified_ez2 && !specified_ez1) 
@@ -581,10 +818,28 @@ Currently it just checks if the first character of the last arg is -
 	if (specified_ez1) {
 		if (ez1 > 0) error("Bottom of cylinder ez1 = %f > 0\n", ez1);
 		if (ez2 < 0) error("Top of cylinder ez2 = %f < 0\n", ez2);
-		if (ez1 > lz1) error("Bottom of cylinder ez1 = %f > lz1 = %f\n", 
-		                      ez1, lz1);
-		if (ez2 < lz2) error("Top of cylinder ez2 = %f < lz2 = %f\n", 
-		                      ez2, lz2);
+		if (specified_layers) {
+			if ( (layers.n > 1) && (ez1 > layers.zbound[0]) ) 
+				error("Bottom of cylinder ez1 = %f > lowest layer "
+					"boundary = %f\n", ez1, layers.zbound[0]);
+			if ( (layers.n > 1) && (ez2 < layers.zbound[layers.n-2]) ) 
+				error("Top of cylinder ez2 = %f < highest layer "
+					"boundary = %f\n", ez2, layers.zbound[layers.n-2]);
+		} else {
+			if (ez1 > lz1) error("Bottom of cylinder ez1 = %f > lz1 = %f\n", 
+			                      ez1, lz1);
+			if (ez2 < lz2) error("Top of cylinder ez2 = %f < lz2 = %f\n", 
+			                      ez2, lz2);
+		}
+	}
+
+	/* The layers of a layer table have their own kappa values */
+	if (specified_layers) {
+		if (nolayer)
+			error("nolayer cannot be used with specified layers");
+		if (opt_global_kappa || specified_kappa_outside)
+			error("global_kappa and kappa_outside cannot be used with "
+				"specified layers");
 	}
 
 
@@ -636,8 +891,14 @@ if (opt_verbose)
 		alpha_sp = alpha_sr;
 		theta_so = theta_sr;
 		theta_sp = theta_sr;
+		theta_z_so = theta_z_sr;
+		theta_z_sp = theta_z_sr;
 		kappa_so = kappa_sr;
 		kappa_sp = kappa_sr;
+		vmax_so = vmax_sr;
+		vmax_sp = vmax_sr;
+		km_so = km_sr;
+		km_sp = km_sr;
 		if (opt_verbose)
 			printf("\nNOTE: nolayer option given; the diffusion "
 					"parameters of \nthe homogeneous environment "
@@ -676,6 +937,11 @@ if (opt_verbose)
 	if (specified_ez1) {
 		zmax = ez2 + (-ez1);	/* Calculate the cylinder length */
 		coord_shift = (-ez1);
+	} else if (specified_layers) {
+		/* Center the boundaries of the specified layers */
+		coord_shift = (layers.n > 1) ? 
+			(zmax - (layers.zbound[0] + layers.zbound[layers.n-2]))/2. : 
+			zmax/2.;
 	} else {
 		coord_shift = (zmax - (lz1+lz2))/2.;
 	}
@@ -683,6 +949,9 @@ if (opt_verbose)
 	pz += coord_shift;
 	lz1 += coord_shift;
 	lz2 += coord_shift;
+	if (specified_layers) 
+		for (k=0; k<layers.n-1; k++) 
+			layers.zbound[k] += coord_shift;
 
 	/* Discretization intervals in r, z */
 	dr = rmax / nr;
@@ -696,29 +965,218 @@ if (opt_verbose)
 	pz = round(pz / dz) * dz;
 	pr = round(pr / dr) * dr;
 
-	/* Layer geometry */
-	iz1 = (int) round((lz1 / dz));
-	lz1 = iz1 * dz + dz / 2.0;
+	/* Layer geometry. The layer boundaries are used as specified, 
+	   and rows that contain a boundary get interface coefficients 
+	   (see layers.c), unless the user wants the boundaries to be 
+	   snapped to fall midway between grid points, as in previous 
+	   versions of this program. iz1 and iz2 are the indices of 
+	   the last rows below the boundaries. */
+	if (snap_layers) {
+		iz1 = (int) round((lz1 / dz));
+		lz1 = iz1 * dz + dz / 2.0;
+
+		iz2 = (int) round((lz2 / dz));
+		lz2 = iz2 * dz + dz / 2.0;
+	} else {
+		iz1 = (int) ceil(lz1 / dz) - 1;
+		iz2 = (int) ceil(lz2 / dz) - 1;
+	}
 
-	iz2 = (int) round((lz2 / dz));
-	lz2 = iz2 * dz + dz / 2.0;
+	/* Set up the layer table of the 3 layers (with nolayer, only 
+	   the bottom layer, SR, is kept), or check the specified layers */
+	if (specified_layers) {
+		for (k=0; k<layers.n; k++) {
+			if ( (layers.alpha[k] <= 0.) || (layers.theta[k] <= 0.) 
+			  || (layers.theta_z[k] <= 0.) )
+				error("Layer %d: alpha, theta, and theta_z should be > 0", k+1);
+			if (k == layers.n-1) break;
+			if (snap_layers) 
+				layers.zbound[k] = floor(layers.zbound[k] / dz) * dz + dz / 2.0;
+			if ( (k > 0) && (layers.zbound[k] <= layers.zbound[k-1]) )
+				error("Layer %d: thickness (%f microns) should be > 0", 
+					k+1, 1.0e6 * (layers.zbound[k] - layers.zbound[k-1]));
+		}
+	} else {
+		if (theta_z_so < 0.) theta_z_so = theta_so;
+		if (theta_z_sp < 0.) theta_z_sp = theta_sp;
+		if (theta_z_sr < 0.) theta_z_sr = theta_sr;
+		if ( IS_ZERO(theta_z_so) || IS_ZERO(theta_z_sp) || IS_ZERO(theta_z_sr) )
+			error("theta_z should be > 0");
+		set_three_layers(lz1, lz2, 
+			alpha_so, theta_so, theta_z_so, kappa_so, vmax_so, km_so, 
+			alpha_sp, theta_sp, theta_z_sp, kappa_sp, vmax_sp, km_sp, 
+			alpha_sr, theta_sr, theta_z_sr, kappa_sr, vmax_sr, km_sr, &layers);
+		if (nolayer) layers.n = 1;
+	}
 
 
 	/* D* */
-	dstar_so = theta_so * dfree;
-	dstar_sp = theta_sp * dfree;
-	dstar_sr = theta_sr * dfree;
-	dstar_max = MAX(dstar_so, dstar_sp);
-	dstar_max = MAX(dstar_max, dstar_sr);
+	for (k=0; k<layers.n; k++)
+		dstar_max = MAX(dstar_max, MAX(layers.theta[k], layers.theta_z[k]) * dfree);
 
 
 	/* Check if layer thickness is numerically reasonable */
-	if ( ((iz2 - iz1) < 2) && (nolayer == 0) ) 
+	if ( (lz2 <= lz1) && (nolayer == 0) && (! specified_layers) ) 
+		error("Layer thickness (%f microns) should be > 0", 
+			1.0e6 * (lz2 - lz1));
+	if ( snap_layers && ((iz2 - iz1) < 2) && (nolayer == 0) && (! specified_layers) ) 
 		error("Layer has too few discrete steps to continue.");
 
-	/* Calculate time step from nt or from von Neumann criterion */
+	/* Apparent kappa (the characteristic curve with clearance) */
+	if (fit_kappa) {
+		nfit = 3;
+		if (kappa_start < 0.)
+			error("kappa_start should be >= 0");
+	}
+
+	/* Check the order of the spatial discretization */
+	if ( (stencil != 2) && (stencil != 4) )
+		error("stencil = %d, but it should be 2 or 4", stencil);
+
+	/* Solver. A source off the z-axis is a ring around the axis in 
+	   the cylindrical coordinates of the 2D solver, so by default 
+	   the 3D solver is used if there is one; otherwise the 2D 
+	   solver gives the same result much faster. The 3D solver 
+	   only has the second-order stencil. */
+	if (solver == 0) {
+		solver = 2;
+		for (nsource = 0; nsource < more_sources.n; nsource++) 
+			if (lround(more_sources.source[nsource].sr / dr) != 0) 
+				solver = 3;
+	}
+	if (solver == 3) {
+		if (stencil != 2)
+			error("The 3D solver only works with stencil = 2");
+		if (opt_output_conc_image)
+			error("Concentration images cannot be output with the 3D solver");
+	}
+
+	/* Parareal (parallel in time) solution of the 2D model */
+	if (parareal < 0)
+		error("parareal (number of time slices) should be >= 0");
+	if (parareal > 0) {
+		if (solver == 3)
+			error("parareal cannot be used with the 3D solver");
+		if (opt_output_conc_image)
+			error("Concentration images cannot be output with parareal");
+		if (parareal_tol <= 0.)
+			error("parareal_tol should be > 0");
+	}
+
+	/* Rows of the 2D model divided among MPI processes */
+	if (mpi_size > 1) {
+		if (solver == 3)
+			error("The 3D solver cannot be used with MPI");
+		if (parareal)
+			error("parareal cannot be used with MPI");
+	}
+
+	/* Reciprocal mode. The weighted diffusion operator is 
+	   self-adjoint, so the concentration at the probe from a source 
+	   at X is the concentration at X from the same source at the 
+	   probe. With the source on the probe, one solution of the 2D 
+	   model gives the curves of all candidate source positions 
+	   (also off the z-axis: the probe on the axis sees a point 
+	   source and a ring source of the same amount alike). This 
+	   needs a linear model with a symmetric discretization. */
+	if (candidates.n > 0) {
+		if (solver == 0)
+			solver = 2;
+		if (solver == 3)
+			error("reciprocal cannot be used with the 3D solver");
+		if (lround(pr/dr) != 0)
+			error("reciprocal: the probe should be on the z-axis (probe_r = 0)");
+		if (more_sources.n > 0)
+			error("reciprocal cannot be used with additional sources");
+		if (parareal)
+			error("reciprocal cannot be used with parareal");
+		if (mpi_size > 1)
+			error("reciprocal cannot be used with MPI");
+		for (k=0; k<layers.n; k++) 
+			if (layers.vmax[k] > 0.)
+				error("reciprocal cannot be used with Michaelis-Menten uptake");
+		use_zmirror = FALSE;
+	}
+
+	/* Experimental design mode. The sensitivities to the parameters 
+	   of the SP layer are calculated along with the concentration 
+	   (see design.c), with the plain second-order time-step, and 
+	   the durations are evaluated from the curve of a step, which 
+	   needs a linear model. */
+	if (design) {
+		if (specified_layers || nolayer)
+			error("design needs the 3-layer model (it uses the parameters "
+				"of the SP layer)");
+		if (solver == 3)
+			error("design cannot be used with the 3D solver");
+		if (stencil != 2)
+			error("design only works with stencil = 2");
+		if (exp_clearance)
+			error("design cannot be used with exp_clearance");
+		if (parareal)
+			error("design cannot be used with parareal");
+		if (mpi_size > 1)
+			error("design cannot be used with MPI");
+		if ( (more_sources.n > 0) || (candidates.n > 0) )
+			error("design cannot be used with additional or reciprocal sources");
+		for (k=0; k<layers.n; k++) 
+			if (layers.vmax[k] > 0.)
+				error("design cannot be used with Michaelis-Menten uptake");
+		if ( (design_dmin < 0.) || (design_dmax <= design_dmin) )
+			error("design: the distances should be 0 <= design_dmin < design_dmax");
+		if (design_spacing <= 0.)
+			error("design_spacing should be > 0");
+		if (design_ndur < 1)
+			error("design_durations should be >= 1");
+		if (design_noise <= 0.)
+			error("design_noise should be > 0");
+		use_zmirror = FALSE;
+
+		/* The candidates are on the grid */
+		ncell = MAX(1, lround(design_spacing / dr));
+		design_spacing = ncell * dr;
+	}
+
+	/* Check the Michaelis-Menten uptake parameters */
+	for (k=0; k<layers.n; k++) {
+		if (layers.vmax[k] < 0.)
+			error("Vmax should be >= 0");
+		if (layers.km[k] <= 0.)
+			error("Km should be > 0");
+		if (! IS_ZERO(layers.theta_z[k] - layers.theta[k]))
+			anisotropic = TRUE;
+	}
+
+	/* Z-mirror symmetry. If the layers are symmetric about the 
+	   source (e.g. SR and SO have the same parameters and the SP 
+	   layer is centered on the source) and the source is in the middle 
+	   of the cylinder, the concentration is symmetric about the 
+	   plane of the source. Then only the rows from the source up 
+	   are solved, and the model keeps zmirror ghost rows below the 
+	   source row equal to their mirror images above it. (If nz is 
+	   even, this moves the bottom of the cylinder by one row.) 
+	   A probe below the source is replaced by its mirror image. */
+	isource = lround(sz/dz);
+	iprobe = lround(pz/dz);
+	if ( use_zmirror && (solver == 2) && (more_sources.n == 0) 
+	  && (! opt_output_conc_image) && (abs(nz - 1 - 2*isource) <= 1) 
+	  && layers_symmetric(&layers, sz, 1.0e-6 * dz) ) {
+		iprobe_model = (iprobe < isource) ? 2*isource - iprobe : iprobe;
+		if (iprobe_model < nz) {
+			zmirror = stencil / 2;
+			izshift = isource - zmirror;
+			iprobe_model -= izshift;
+		}
+	}
+
+	/* Calculate time step from nt or from von Neumann criterion. 
+	   The fourth-order kernels have a 1.5 times larger maximum 
+	   eigenvalue than the second-order ones (mostly because of 
+	   the r=0 row), so dt is smaller by 2/3. */
 	if (specified_nt == TRUE)
 		dt = tmax / nt;
+	else if (stencil == 4)
+		dt = 0.9 * dr*dr / (9.0 * dstar_max);
 	else
 		dt = 0.9 * dr*dr / (6.0 * dstar_max);
 
@@ -774,23 +1232,73 @@ if (opt_verbose)
 		printf("(pr, pz) = (%f, %f) microns\n", 1.0e6 * pr, 1.0e6 * pz);
 		printf("Electrode distance = %f microns\n", 
 			1.0e6 * sqrt(SQR(pr-sr) + SQR(pz-sz)));
-		printf("(iz1, iz2) = (%d, %d)\n", iz1, iz2);
-		printf("(lz1, lz2) = (%f, %f) microns\n", 1.0e6 * lz1, 1.0e6 * lz2);
-		printf("Layer thickness = %f microns\n", 1.0e6 * (lz2 - lz1));
-		printf("Layer discrete steps = %d\n", iz2 - iz1);
+		if (! specified_layers) {
+			printf("(iz1, iz2) = (%d, %d)\n", iz1, iz2);
+			printf("(lz1, lz2) = (%f, %f) microns\n", 1.0e6 * lz1, 1.0e6 * lz2);
+			printf("Layer thickness = %f microns\n", 1.0e6 * (lz2 - lz1));
+			printf("Layer discrete steps = %d\n", iz2 - iz1);
+		}
+		if (snap_layers)
+			printf("Layer boundaries snapped to fall midway between grid points\n");
 		printf("Nolayer flag = %d\n" , nolayer);
+		printf("Stencil order = %d\n" , stencil);
+		if (exp_clearance)
+			printf("Exact integration of source and clearance\n");
+		if (zmirror)
+			printf("Z-mirror symmetry: solving rows %d to %d\n", izshift + zmirror, nz-1);
+		if (solver == 3)
+			printf("3D Cartesian solver: %d x %d x %d grid\n", 
+				2*nr-1, 2*nr-1, nz);
+		if (parareal)
+			printf("Parareal: %d time slices, tolerance = %g\n", 
+				parareal, parareal_tol);
+		if (mpi_size > 1)
+			printf("MPI: rows divided among %d processes\n", mpi_size);
+		if (candidates.n > 0)
+			printf("Reciprocal mode: source at the probe, %d candidate sources\n", 
+				candidates.n);
+		if (design)
+			printf("Experimental design: probes %f to %f microns from the source, "
+				"spacing %f microns, %d durations, noise = %g mM\n", 
+				1.0e6 * design_dmin, 1.0e6 * design_dmax, 
+				1.0e6 * design_spacing, design_ndur, design_noise);
 		printf("dfree = %g m^2/s\n", dfree);
-		printf("alpha_so = %.4f, theta_so = %.4f, "
-			"lambda_so = %.4f, kappa_so = %.6f\n",
-			alpha_so, theta_so, 1.0/sqrt(theta_so), kappa_so);
-		printf("alpha_sp = %.4f, theta_sp = %.4f, "
-			"lambda_sp = %.4f, kappa_sp = %.6f\n",
-			alpha_sp, theta_sp, 1.0/sqrt(theta_sp), kappa_sp);
-		printf("alpha_sr = %.4f, theta_sr = %.4f, "
-			"lambda_sr = %.4f, kappa_sr = %.6f\n",
-			alpha_sr, theta_sr, 1.0/sqrt(theta_sr), kappa_sr);
-		if (opt_global_kappa)
-			printf("NOTE: kappa_sr and kappa_so set to kappa_sp (-g)\n");
+		if (specified_layers) {
+			printf("Layers (from the bottom up):\n");
+			for (k=0; k<layers.n; k++) {
+				printf("Layer %d: alpha = %.4f, theta = %.4f, lambda = %.4f, "
+					"kappa = %.6f", k+1, layers.alpha[k], layers.theta[k], 
+					1.0/sqrt(layers.theta[k]), layers.kappa[k]);
+				if (! IS_ZERO(layers.theta_z[k] - layers.theta[k]))
+					printf(", theta_z = %.4f", layers.theta_z[k]);
+				if (layers.vmax[k] > 0.)
+					printf(", vmax = %g mM/s, km = %g mM", layers.vmax[k], layers.km[k]);
+				if (k < layers.n-1)
+					printf(", top at z = %f microns", 1.0e6 * layers.zbound[k]);
+				printf("\n");
+			}
+		} else {
+			printf("alpha_so = %.4f, theta_so = %.4f, "
+				"lambda_so = %.4f, kappa_so = %.6f\n",
+				alpha_so, theta_so, 1.0/sqrt(theta_so), kappa_so);
+			printf("alpha_sp = %.4f, theta_sp = %.4f, "
+				"lambda_sp = %.4f, kappa_sp = %.6f\n",
+				alpha_sp, theta_sp, 1.0/sqrt(theta_sp), kappa_sp);
+			printf("alpha_sr = %.4f, theta_sr = %.4f, "
+				"lambda_sr = %.4f, kappa_sr = %.6f\n",
+				alpha_sr, theta_sr, 1.0/sqrt(theta_sr), kappa_sr);
+			if (anisotropic)
+				printf("Axial permeability: theta_z_so = %.4f, theta_z_sp = %.4f, "
+					"theta_z_sr = %.4f\n", theta_z_so, theta_z_sp, theta_z_sr);
+			if (opt_global_kappa)
+				printf("NOTE: kappa_sr and kappa_so set to kappa_sp (-g)\n");
+			if ( (vmax_so > 0.) || (vmax_sp > 0.) || (vmax_sr > 0.) ) {
+				printf("Michaelis-Menten uptake:\n");
+				printf("vmax_so = %g mM/s, km_so = %g mM\n", vmax_so, km_so);
+				printf("vmax_sp = %g mM/s, km_sp = %g mM\n", vmax_sp, km_sp);
+				printf("vmax_sr = %g mM/s, km_sr = %g mM\n", vmax_sr, km_sr);
+			}
+		}
 		printf("nt = %d\n", nt);
 		printf("tmax = %f s\n", tmax);
 		printf("dt = %f ms\n", 1.0e3 * dt);
@@ -843,23 +1351,73 @@ if (opt_verbose)
 	fprintf(file_ptr, "# (pr, pz) = (%f, %f) microns\n", 1.0e6 * pr, 1.0e6 * pz);
 	fprintf(file_ptr, "# Electrode distance = %f microns\n", 
 		1.0e6 * sqrt(SQR(pr-sr) + SQR(pz-sz)));
-	fprintf(file_ptr, "# (iz1, iz2) = (%d, %d)\n", iz1, iz2);
-	fprintf(file_ptr, "# (lz1, lz2) = (%f, %f) microns\n", 1.0e6 * lz1, 1.0e6 * lz2);
-	fprintf(file_ptr, "# Layer thickness = %f microns\n", 1.0e6 * (lz2 - lz1));
-	fprintf(file_ptr, "# Layer discrete steps = %d\n", iz2 - iz1);
+	if (! specified_layers) {
+		fprintf(file_ptr, "# (iz1, iz2) = (%d, %d)\n", iz1, iz2);
+		fprintf(file_ptr, "# (lz1, lz2) = (%f, %f) microns\n", 1.0e6 * lz1, 1.0e6 * lz2);
+		fprintf(file_ptr, "# Layer thickness = %f microns\n", 1.0e6 * (lz2 - lz1));
+		fprintf(file_ptr, "# Layer discrete steps = %d\n", iz2 - iz1);
+	}
+	if (snap_layers)
+		fprintf(file_ptr, "# Layer boundaries snapped to fall midway between grid points\n");
 	fprintf(file_ptr, "# Nolayer flag = %d\n" , nolayer);
+	fprintf(file_ptr, "# Stencil order = %d\n" , stencil);
+	if (exp_clearance)
+		fprintf(file_ptr, "# Exact integration of source and clearance\n");
+	if (zmirror)
+		fprintf(file_ptr, "# Z-mirror symmetry: solving rows %d to %d\n", izshift + zmirror, nz-1);
+	if (solver == 3)
+		fprintf(file_ptr, "# 3D Cartesian solver: %d x %d x %d grid\n", 
+			2*nr-1, 2*nr-1, nz);
+	if (parareal)
+		fprintf(file_ptr, "# Parareal: %d time slices, tolerance = %g\n", 
+			parareal, parareal_tol);
+	if (mpi_size > 1)
+		fprintf(file_ptr, "# MPI: rows divided among %d processes\n", mpi_size);
+	if (candidates.n > 0)
+		fprintf(file_ptr, "# Reciprocal mode: source at the probe, %d candidate sources\n", 
+			candidates.n);
+	if (design)
+		fprintf(file_ptr, "# Experimental design: probes %f to %f microns from the source, "
+			"spacing %f microns, %d durations, noise = %g mM\n", 
+			1.0e6 * design_dmin, 1.0e6 * design_dmax, 
+			1.0e6 * design_spacing, design_ndur, design_noise);
 	fprintf(file_ptr, "# dfree = %g m^2/s\n", dfree);
-	fprintf(file_ptr, "# alpha_so = %.4f, theta_so = %.4f, "
-		"lambda_so = %.4f, kappa_so = %.6f\n",
-		alpha_so, theta_so, 1.0/sqrt(theta_so), kappa_so);
-	fprintf(file_ptr, "# alpha_sp = %.4f, theta_sp = %.4f, "
-		"lambda_sp = %.4f, kappa_sp = %.6f\n",
-		alpha_sp, theta_sp, 1.0/sqrt(theta_sp), kappa_sp);
-	fprintf(file_ptr, "# alpha_sr = %.4f, theta_sr = %.4f, "
-		"lambda_sr = %.4f, kappa_sr = %.6f\n",
-		alpha_sr, theta_sr, 1.0/sqrt(theta_sr), kappa_sr);
-	if (opt_global_kappa)
-		fprintf(file_ptr, "# NOTE: kappa_sr and kappa_so set to kappa_sp (-g)\n");
+	if (specified_layers) {
+		fprintf(file_ptr, "# Layers (from the bottom up):\n");
+		for (k=0; k<layers.n; k++) {
+			fprintf(file_ptr, "# Layer %d: alpha = %.4f, theta = %.4f, lambda = %.4f, "
+				"kappa = %.6f", k+1, layers.alpha[k], layers.theta[k], 
+				1.0/sqrt(layers.theta[k]), layers.kappa[k]);
+			if (! IS_ZERO(layers.theta_z[k] - layers.theta[k]))
+				fprintf(file_ptr, ", theta_z = %.4f", layers.theta_z[k]);
+			if (layers.vmax[k] > 0.)
+				fprintf(file_ptr, ", vmax = %g mM/s, km = %g mM", layers.vmax[k], layers.km[k]);
+			if (k < layers.n-1)
+				fprintf(file_ptr, ", top at z = %f microns", 1.0e6 * layers.zbound[k]);
+			fprintf(file_ptr, "\n");
+		}
+	} else {
+		fprintf(file_ptr, "# alpha_so = %.4f, theta_so = %.4f, "
+			"lambda_so = %.4f, kappa_so = %.6f\n",
+			alpha_so, theta_so, 1.0/sqrt(theta_so), kappa_so);
+		fprintf(file_ptr, "# alpha_sp = %.4f, theta_sp = %.4f, "
+			"lambda_sp = %.4f, kappa_sp = %.6f\n",
+			alpha_sp, theta_sp, 1.0/sqrt(theta_sp), kappa_sp);
+		fprintf(file_ptr, "# alpha_sr = %.4f, theta_sr = %.4f, "
+			"lambda_sr = %.4f, kappa_sr = %.6f\n",
+			alpha_sr, theta_sr, 1.0/sqrt(theta_sr), kappa_sr);
+		if (anisotropic)
+			fprintf(file_ptr, "# Axial permeability: theta_z_so = %.4f, theta_z_sp = %.4f, "
+				"theta_z_sr = %.4f\n", theta_z_so, theta_z_sp, theta_z_sr);
+		if (opt_global_kappa)
+			fprintf(file_ptr, "# NOTE: kappa_sr and kappa_so set to kappa_sp (-g)\n");
+		if ( (vmax_so > 0.) || (vmax_sp > 0.) || (vmax_sr > 0.) ) {
+			fprintf(file_ptr, "# Michaelis-Menten uptake:\n");
+			fprintf(file_ptr, "# vmax_so = %g mM/s, km_so = %g mM\n", vmax_so, km_so);
+			fprintf(file_ptr, "# vmax_sp = %g mM/s, km_sp = %g mM\n", vmax_sp, km_sp);
+			fprintf(file_ptr, "# vmax_sr = %g mM/s, km_sr = %g mM\n", vmax_sr, km_sr);
+		}
+	}
 	fprintf(file_ptr, "# nt = %d\n", nt);
 	fprintf(file_ptr, "# tmax = %f s\n", tmax);
 	fprintf(file_ptr, "# dt = %f ms\n", 1.0e3 * dt);
@@ -880,18 +1438,23 @@ if (opt_verbose)
 			1.0e6 * more_sources.source[nsource].sr,
 			1.0e9 * more_sources.source[nsource].crnt);
 	}
+	for (nsource = 0; nsource < candidates.n; nsource++) 
+		fprintf(file_ptr, "# Candidate source #%d: sz = %lf microns, sr = %lf microns\n",
+			nsource+1, 
+			1.0e6 * (candidates.source[nsource].sz + coord_shift),
+			1.0e6 * candidates.source[nsource].sr);
 	fprintf(file_ptr, "# Start time = %s", string); /* ctime() added the \n */
 
 	/* Close the file */
 	fclose(file_ptr);
 
 	/* Array of alpha values -- use 1D index to access elements of 
-	   the 2D array, so a[i*(nr+1)+j] = a[i][j] (use macro INDEX(i,j) */
+	   the 2D array, so a[i*(nr+1)+j] = a[i][j] (use macro INDEX(i,j). 
+	   Rows that contain a layer boundary get the volume average. */
     alphas = create_array(nz*(nr+1), "alphas array");
-	for (j=0; j<nr+1; j++) {
-		for (i=0;     i<iz1+1; i++) alphas[INDEX(i,j)] = alpha_sr;
-		for (i=iz1+1; i<iz2+1; i++) alphas[INDEX(i,j)] = alpha_sp;
-		for (i=iz2+1; i<nz;    i++) alphas[INDEX(i,j)] = alpha_so;
+	for (i=0; i<nz; i++) {
+		alphas[INDEX(i,0)] = cell_alpha(i * dz, dz, &layers);
+		for (j=1; j<nr+1; j++) alphas[INDEX(i,j)] = alphas[INDEX(i,0)];
 	}
 
 	/* Array of 1/r values, except it is 0 for r=0 */
@@ -905,16 +1468,23 @@ if (opt_verbose)
 	}
 
 
-	/* Source */
+	/* Source. The cell on the z-axis has a volume of 
+	   PI * dr^2 * dz / 4 for the second-order kernels and 
+	   PI * dr^2 * dz / 6 for the fourth-order kernels (see convo.c) */
+	double axis_factor = (stencil == 4) ? 6.0 : 4.0;
     s = create_array(nz*(nr+1), "param s array");
 	isource = lround(sz/dz);   	/* index to z position of source */
 	jsource = 1+lround(sr/dr);	/* index to r position of source */
+	if (candidates.n > 0) {  	/* Reciprocal mode: source at the probe */
+		isource = lround(pz/dz);
+		jsource = 1;
+	}
 	s[INDEX(isource,jsource)] 
 		= (1.0 / alphas[INDEX(isource,jsource)]) * 
-			samplitude * dt * 4.0 / (PI * SQR(dr) * dz);
+			samplitude * dt * axis_factor / (PI * SQR(dr) * dz);
 
 	/* If there are additional sources, add them to the s array */
-	if (more_sources.n > 0) {
+	if ( (solver == 2) && (more_sources.n > 0) ) {
 		for (nsource = 0; nsource < more_sources.n; nsource++) {
 			new_source.sz = more_sources.source[nsource].sz;
 			new_source.sr = more_sources.source[nsource].sr;
@@ -941,20 +1511,74 @@ if (opt_verbose)
 
 			s[INDEX(isource,jsource)] 
 				+= (1.0 / alphas[INDEX(isource,jsource)]) * 
-					samplitude * dt * 4.0 / (PI * SQR(dr) * dz);
+					samplitude * dt * axis_factor / (PI * SQR(dr) * dz);
+		}
+	}
+
+
+	/* Sources of the 3D solver. They are in the plane y = 0, at 
+	   x = sr, and the cell volume is dr^2 * dz. */
+	if (solver == 3) {
+		nsources3d = 1 + more_sources.n;
+		isources3d = malloc( sizeof(int) * nsources3d );
+		xsources3d = malloc( sizeof(int) * nsources3d );
+		if ( (isources3d == NULL) || (xsources3d == NULL) )
+			error("Cannot allocate memory for the sources of the 3D solver");
+		samounts3d = create_array(nsources3d, "3D source amounts");
+
+		isources3d[0] = lround(sz/dz);
+		xsources3d[0] = nr - 1;
+		samounts3d[0] = (1.0 / alphas[INDEX(isources3d[0],1)]) * 
+			samplitude * dt / (SQR(dr) * dz);
+		for (nsource = 0; nsource < more_sources.n; nsource++) {
+			i = lround((more_sources.source[nsource].sz + coord_shift)/dz);
+			j = lround(more_sources.source[nsource].sr/dr);
+			if ( (i < 0) || (i > nz-1) )
+				error("adding additional source %d; isource = %d is "
+					"outside of the cylinder", nsource, i);
+			if (abs(j) > nr - 2)
+				error("adding additional source %d; |sr| = %f microns "
+					"is too large", nsource, 
+					1.0e6 * fabs(more_sources.source[nsource].sr));
+			isources3d[nsource+1] = i;
+			xsources3d[nsource+1] = nr - 1 + j;
+			samounts3d[nsource+1] = (1.0 / alphas[INDEX(i,1)]) * 
+				more_sources.source[nsource].crnt * trn / FARADAY * 
+				dt / (SQR(dr) * dz);
 		}
 	}
 
 
 	/* Time and probe arrays */
 	t = create_array(nt, "time");
-	p = create_array(nt, "p");
 	for (k=0; k<nt; k++) 
 		t[k] = dt * k;
 
 	iprobe = lround(pz/dz);   	/* index to z position of probe */
 	jprobe = 1+lround(pr/dr);	/* index to r position of probe */
 
+	/* In the reciprocal mode, the probes of the model are the source 
+	   (first) and the candidate sources, and p[] is the curve of 
+	   the source at the probe */
+	nprobes = 1 + candidates.n;
+	iprobes = malloc( sizeof(int) * nprobes );
+	jprobes = malloc( sizeof(int) * nprobes );
+	if ( (iprobes == NULL) || (jprobes == NULL) )
+		error("Cannot allocate memory for the probes");
+	p = create_array(nprobes*nt, "p");
+	if (candidates.n > 0) {
+		iprobes[0] = lround(sz/dz);
+		jprobes[0] = 1+lround(sr/dr);
+		for (nsource = 0; nsource < candidates.n; nsource++) {
+			i = lround((candidates.source[nsource].sz + coord_shift)/dz);
+			j = 1+lround(fabs(candidates.source[nsource].sr)/dr);
+			if ( (i < 0) || (i > nz-1) || (j > nr) )
+				error("reciprocal: candidate source %d is outside of the "
+					"cylinder", nsource+1);
+			iprobes[nsource+1] = i;
+			jprobes[nsource+1] = j;
+		}
+	}
 
 
 	/* Calculate p[], the diffusion curve at the probe  */
@@ -967,16 +1591,113 @@ if (opt_verbose)
 		image_spacing = -1.;
 
 
+	/* With z-mirror symmetry, the model grid starts izshift rows 
+	   above the bottom of the cylinder */
+	if (zmirror) 
+		memmove(s, s + izshift*(nr+1), (nz - izshift)*(nr+1)*sizeof(double));
+	else
+		iprobe_model = iprobe;
+	if (candidates.n == 0) {
+		iprobes[0] = iprobe_model;
+		jprobes[0] = jprobe;
+	}
+	model_layers = layers;
+	for (k=0; k<layers.n-1; k++)
+		model_layers.zbound[k] -= izshift*dz;
+
 	/* Calculate the concentration as a function of time and space; 
 	   return the probe concentration as a function of time */
-	calc_diffusion_curve_layer(nt, nz, nr, iprobe, jprobe, 
-		iz1, iz2, nolayer, dt, dr, sdelay, sduration, 
-		alpha_so, theta_so, kappa_so, 
-		alpha_sp, theta_sp, kappa_sp, 
-		alpha_sr, theta_sr, kappa_sr, 
-		dfree, t, s, invr, 
-		imagebasename, image_spacing, 
-		p);
+	if (solver == 3) {
+		if (abs(lround(pr/dr)) > nr - 2)
+			error("probe_r is too large for the 3D solver");
+		calc_diffusion_curve_layer_3d(nt, nz, nr, iprobe, 
+			nr - 1 + lround(pr/dr), &layers, exp_clearance, 
+			nsources3d, isources3d, xsources3d, samounts3d, 
+			dt, dr, sdelay, sduration, dfree, t, p);
+	} else if (parareal) {
+		parareal_iter = calc_diffusion_curve_layer_parareal(nt, nz - izshift, 
+			nr, iprobe_model, jprobe, &model_layers, stencil, zmirror, 
+			exp_clearance, parareal, parareal_tol, dt, dr, sdelay, 
+			sduration, dfree, t, s, invr, p);
+		if (opt_verbose)
+			printf("Parareal: %d iterations\n", parareal_iter);
+#ifdef USE_MPI
+	} else if (mpi_size > 1) {
+		calc_diffusion_curve_layer_mpi(nt, nz - izshift, nr, iprobe_model, 
+			jprobe, &model_layers, stencil, zmirror, exp_clearance, 
+			dt, dr, sdelay, sduration, dfree, t, s, invr, 
+			imagebasename, image_spacing, p);
+#endif
+	} else {
+		calc_diffusion_curve_layer(nt, nz - izshift, nr, nprobes, iprobes, jprobes, 
+			&model_layers, nolayer, stencil, zmirror, 
+			exp_clearance, 
+			dt, dr, sdelay, sduration, 
+			dfree, t, s, invr, 
+			imagebasename, image_spacing, 
+			p);
+	}
+
+
+	/* Experimental design: the sensitivities at the candidate 
+	   probes from one solution, and the Fisher information of 
+	   each candidate and source duration. The candidates are on 
+	   a grid around the source (with r >= 0) and are at least 
+	   one cell from the side of the cylinder. */
+	if (design) {
+		if (opt_verbose)
+			printf("About to calculate the sensitivities for the design\n");
+
+		icand = malloc( sizeof(int) * (2*(nz/ncell)+1) * (nr/ncell+1) );
+		jcand = malloc( sizeof(int) * (2*(nz/ncell)+1) * (nr/ncell+1) );
+		if ( (icand == NULL) || (jcand == NULL) )
+			error("Cannot allocate memory for the candidate probes");
+		for (i=-(nz/ncell); i<=nz/ncell; i++) {
+			for (j=0; j<=nr/ncell; j++) {
+				if ( (isource + i*ncell < 0) || (isource + i*ncell > nz-1) 
+				  || (1 + j*ncell > nr-1) )
+					continue;
+				if ( (ncell * dr * sqrt(SQR(i) + SQR(j)) < design_dmin - 1.0e-3 * dr) 
+				  || (ncell * dr * sqrt(SQR(i) + SQR(j)) > design_dmax + 1.0e-3 * dr) )
+					continue;
+				icand[ncand] = isource + i*ncell;
+				jcand[ncand] = 1 + j*ncell;
+				ncand++;
+			}
+		}
+		if (ncand == 0)
+			error("design: no candidate probes in the cylinder");
+
+		/* At most about 1000 recorded times */
+		kstride = MAX(1, (nt - nds) / 1000);
+		nsample = (nt - nds - 1) / kstride + 1;
+		dur_step = MAX(1, lround((tmax - sdelay) / (design_ndur + 1) / (kstride * dt)));
+
+		pc = create_array(ncand*nsample, "design concentration");
+		sens = create_array(3*ncand*nsample, "design sensitivities");
+		best_det = create_array(ncand, "design determinants");
+		se = create_array(3*ncand, "design standard errors");
+		best_dur = malloc( sizeof(int) * ncand );
+		if (best_dur == NULL)
+			error("Cannot allocate memory for the design durations");
+
+		calc_design_curves(nt, nz, nr, ncand, icand, jcand, &layers, 1, 
+			kstride, dt, dr, sdelay, dfree, s, invr, pc, sens);
+		calc_design_fisher(ncand, nsample, design_ndur, dur_step, design_noise, 
+			sens, best_dur, best_det, se);
+
+		for (k=0; k<ncand; k++)
+			if ( (best_dur[k] > 0) && ((best < 0) || (best_det[k] > best_det[best])) )
+				best = k;
+		if (best < 0)
+			error("design: the Fisher information is singular for all candidates");
+
+		if (opt_verbose)
+			printf("Best design: probe_r = %f microns, probe_z = %f microns, "
+				"duration = %f s\n", 1.0e6 * (jcand[best] - 1) * dr, 
+				1.0e6 * (icand[best] - isource) * dz, 
+				best_dur[best] * kstride * dt);
+	}
 
 
 	/* Fit the traditional model (p_theory[]) to the concentration 
@@ -990,9 +1711,11 @@ if (opt_verbose)
 
 	if (opt_verbose) {
 		printf("\nFitting for apparent parameters/characteristic curve:\n");
-		printf("Iter\talpha_fit\ttheta_fit\tmse      \tfit size\n");
-		printf("%d\t%f\t%f\n", 
-			0, alpha_start, theta_start);
+		printf("Iter\talpha_fit\ttheta_fit%s\tmse      \tfit size\n", 
+			(fit_kappa) ? "\tkappa_fit" : "");
+		printf("%d\t%f\t%f", 0, alpha_start, theta_start);
+		if (fit_kappa) printf("\t%f", kappa_start);
+		printf("\n");
 	}
 
 	if (opt_pathfile) {
@@ -1003,9 +1726,11 @@ if (opt_verbose)
 		}
 		fprintf(pathfile_ptr, "\nFitting for apparent parameters/characteristic curve:\n");
 		fprintf(pathfile_ptr, 
-			"Iter\talpha_fit\ttheta_fit\tmse      \tfit size\n");
-		fprintf(pathfile_ptr, "%d\t%f\t%f\n", 
-			0, alpha_start, theta_start);
+			"Iter\talpha_fit\ttheta_fit%s\tmse      \tfit size\n", 
+			(fit_kappa) ? "\tkappa_fit" : "");
+		fprintf(pathfile_ptr, "%d\t%f\t%f", 0, alpha_start, theta_start);
+		if (fit_kappa) fprintf(pathfile_ptr, "\t%f", kappa_start);
+		fprintf(pathfile_ptr, "\n");
 	}
 
 
@@ -1016,7 +1741,7 @@ if (opt_verbose)
 	mse_rti_params.samplitude = samplitude;
 	mse_rti_params.sdelay = sdelay;
 	mse_rti_params.sduration = sduration;
-	mse_rti_params.kappa = 0.;	/* not using this currently */
+	mse_rti_params.kappa = (fit_kappa) ? kappa_start : 0.;	/* Fitted with --fit_kappa */
 	mse_rti_params.dfree = dfree;
 
     mse_rti_params.t = create_array(nt, "param t array");
@@ -1029,46 +1754,68 @@ if (opt_verbose)
 
 
 	/* Initialize the simplex */
-	simplex = gsl_vector_alloc(2);
+	simplex = gsl_vector_alloc(nfit);
 	gsl_vector_set(simplex, 0, alpha_start);
 	gsl_vector_set(simplex, 1, theta_start);
+	if (fit_kappa) gsl_vector_set(simplex, 2, kappa_start);
 
 	/* Initialize step sizes */
-	steps = gsl_vector_alloc(2);
+	steps = gsl_vector_alloc(nfit);
 	gsl_vector_set(steps, 0, alpha_step);
 	gsl_vector_set(steps, 1, theta_step);
+	if (fit_kappa) gsl_vector_set(steps, 2, kappa_step);
 
 	/* Set up minimization method */
-	fit_func.n = 2;  /* 2 parameters to fit */
+	fit_func.n = nfit;  /* 2 parameters to fit (3 with kappa) */
 	fit_func.f = calc_mse_rti;  /* function to minimize */
 	fit_func.params = &mse_rti_params;  /* extra parameters to function */
 
-	fit_state = gsl_multimin_fminimizer_alloc(fit_algorithm, 2);
+	fit_state = gsl_multimin_fminimizer_alloc(fit_algorithm, nfit);
 	gsl_multimin_fminimizer_set(fit_state, &fit_func, simplex, steps);
 
+	/* Levenberg-Marquardt starts from the same point as the simplex */
+	mse_rti_params.alpha = alpha_start;
+	mse_rti_params.theta = theta_start;
+
 	do {
 		fit_iter++;
-		fit_status = gsl_multimin_fminimizer_iterate(fit_state);
+		if (fit_lm) {
+			/* fit_size is the decrease of the squared error that 
+			   the projected gradient predicts (relative) */
+			fit_size = rti_lm_iterate(&mse_rti_params, nfit, &fit_mu, &mse);
+			fit_status = (fit_size < fit_tol) ? GSL_SUCCESS : GSL_CONTINUE;
+
+			alpha_fit = mse_rti_params.alpha;
+			theta_fit = mse_rti_params.theta;
+			kappa_fit = mse_rti_params.kappa;
+		} else {
+			fit_status = gsl_multimin_fminimizer_iterate(fit_state);
 
-		if (fit_status) break;
+			if (fit_status) break;
 
-		fit_size = gsl_multimin_fminimizer_size(fit_state);
-		fit_status = gsl_multimin_test_size(fit_size, fit_tol);
+			fit_size = gsl_multimin_fminimizer_size(fit_state);
+			fit_status = gsl_multimin_test_size(fit_size, fit_tol);
+
+			alpha_fit = gsl_vector_get(fit_state->x, 0);
+			theta_fit = gsl_vector_get(fit_state->x, 1);
+			if (fit_kappa) kappa_fit = MAX(gsl_vector_get(fit_state->x, 2), 0.);
+			mse = fit_state->fval;
+		}
 
 		if (opt_verbose)
 			if (fit_status == GSL_SUCCESS) printf("Finished fit\n");
 
-		alpha_fit = gsl_vector_get(fit_state->x, 0);
-		theta_fit = gsl_vector_get(fit_state->x, 1);
-		mse = fit_state->fval;
-
-		if (opt_verbose)
-			printf("%d\t%f\t%f\t%g\t%g\n", 
-				(int) fit_iter, alpha_fit, theta_fit, mse, fit_size);
+		if (opt_verbose) {
+			printf("%d\t%f\t%f", (int) fit_iter, alpha_fit, theta_fit);
+			if (fit_kappa) printf("\t%f", kappa_fit);
+			printf("\t%g\t%g\n", mse, fit_size);
+		}
 
-		if (opt_pathfile) 
-			fprintf(pathfile_ptr, "%d\t%f\t%f\t%g\t%g\n", 
-				(int) fit_iter, alpha_fit, theta_fit, mse, fit_size);
+		if (opt_pathfile) {
+			fprintf(pathfile_ptr, "%d\t%f\t%f", (int) fit_iter, alpha_fit, theta_fit);
+			if (fit_kappa) fprintf(pathfile_ptr, "\t%f", kappa_fit);
+			fprintf(pathfile_ptr, "\t%g\t%g\n", mse, fit_size);
+		}
 
 	} while (fit_status == GSL_CONTINUE && fit_iter < itermax);
 
@@ -1083,11 +1830,28 @@ if (opt_verbose)
 	if (opt_pathfile) 
 		fclose(pathfile_ptr);
 
+	/* Standard errors from the Jacobian at the fitted parameters */
+	mse_rti_params.alpha = alpha_fit;
+	mse_rti_params.theta = theta_fit;
+	mse_rti_params.kappa = kappa_fit;
+	rti_standard_errors(&mse_rti_params, nfit, fit_se);
+
+	/* Characteristic curve of the fitted parameters (calc_mse_rti() 
+	   does not store the curves) */
+	rti_theory(nt, spdist, samplitude, sdelay, sduration, 
+		kappa_fit, dfree, alpha_fit, theta_fit, t, 
+		mse_rti_params.p_theory);
+
 	double lambda_fit = 1./sqrt(theta_fit);
 	if (opt_verbose) {
 		printf("Fitted alpha = %f\n", alpha_fit);
 		printf("Fitted theta = %f  (lambda = %f)\n", 
 			theta_fit, lambda_fit);
+		if (fit_kappa)
+			printf("Fitted kappa = %f s^-1\n", kappa_fit);
+		printf("Standard errors: alpha %g, theta %g", fit_se[0], fit_se[1]);
+		if (fit_kappa) printf(", kappa %g s^-1", fit_se[2]);
+		printf("\n");
 	}
 
 
@@ -1113,37 +1877,67 @@ if (opt_verbose)
 	fprintf(file_ptr, "# End time = %s", string); /* ctime() added the \n */
 	fprintf(file_ptr, "# Total time = %d seconds = %f minutes = %f hours\n", 
 		(int) round(total_time), total_time/60., total_time/3600.);
+	if (parareal)
+		fprintf(file_ptr, "# Parareal iterations = %d\n", parareal_iter);
 	fprintf(file_ptr, "# --------------------------------------\n");
 	fprintf(file_ptr, "# Fit for characteristic curve:\n");
 	fprintf(file_ptr, "# Number of iterations = %d\n", (int)fit_iter);
 	fprintf(file_ptr, "# Fitted apparent alpha = %f\n", alpha_fit);
 	fprintf(file_ptr, "# Fitted apparent theta = %f  (lambda = %f)\n", 
 		theta_fit, lambda_fit);
+	if (fit_kappa)
+		fprintf(file_ptr, "# Fitted apparent kappa = %f s^-1\n", kappa_fit);
+	fprintf(file_ptr, "# Standard errors: alpha %g, theta %g", fit_se[0], fit_se[1]);
+	if (fit_kappa) fprintf(file_ptr, ", kappa %g s^-1", fit_se[2]);
+	fprintf(file_ptr, "\n");
 	fprintf(file_ptr, "# Final mean squared error = %g\n", mse);
-	fprintf(file_ptr, "# Final simplex size = %g\n", fit_size);
+	if (fit_lm)
+		fprintf(file_ptr, "# Final predicted relative decrease of the MSE "
+			"(Levenberg-Marquardt) = %g\n", fit_size);
+	else
+		fprintf(file_ptr, "# Final simplex size = %g\n", fit_size);
 	fprintf(file_ptr, "# Solution: apparent alpha\tapparent theta\t"
 	                  "apparent lambda\t     MSE\tsimplex size\t# iter."
 	                  "\tTime (s)\tTime (m)\tTime (h) \n");
 	fprintf(file_ptr, "# Solution: %f\t%f\t%f\t%f\t%g \t%7d\t%8d\t%f\t%f\n",
 		alpha_fit, theta_fit, lambda_fit, mse, fit_size, (int) fit_iter, 
 		(int) round(total_time), total_time/60., total_time/3600.);
+	if (design) {
+		fprintf(file_ptr, "# --------------------------------------\n");
+		fprintf(file_ptr, "# Experimental design (largest det(F), %d candidate probes):\n", 
+			ncand);
+		fprintf(file_ptr, "# Best probe: probe_r = %f microns, probe_z = %f microns, "
+			"duration = %f s\n", 1.0e6 * (jcand[best] - 1) * dr, 
+			1.0e6 * (icand[best] - isource) * dz, best_dur[best] * kstride * dt);
+		fprintf(file_ptr, "# Best standard errors: alpha_sp %.3f%%, theta_sp %.3f%%, "
+			"kappa_sp %g s^-1\n", 100.0 * se[3*best], 100.0 * se[3*best+1], 
+			se[3*best+2]);
+		fprintf(file_ptr, "# probe_r\tprobe_z\tduration (s)\t  det(F)\t"
+			"SE(alpha)/alpha\tSE(theta)/theta\tSE(kappa)\n");
+		for (k=0; k<ncand; k++) 
+			fprintf(file_ptr, "# %f\t%f\t%f\t%g\t%g\t%g\t%g\n", 
+				1.0e6 * (jcand[k] - 1) * dr, 1.0e6 * (icand[k] - isource) * dz, 
+				best_dur[k] * kstride * dt, best_det[k], 
+				se[3*k], se[3*k+1], se[3*k+2]);
+	}
 	fprintf(file_ptr, "# --------------------------------------\n");
 	fprintf(file_ptr, "# Probe concentration data:\n");
-	fprintf(file_ptr, "#   time      \t  c (3-layer model) \t  c (characteristic curve) \n");
+	fprintf(file_ptr, "#   time      \t  c (3-layer model) \t  c (characteristic curve) ");
+	for (nsource = 0; nsource < candidates.n; nsource++) 
+		fprintf(file_ptr, "\t  c (candidate %d) ", nsource+1);
+	fprintf(file_ptr, "\n");
 
 
-	/* Print concentration arrays to output file */
-	if (nt > 1000) 
-		for (i=0; i<1000; i++) {
-			k = (i * nt) / 1000;
-			fprintf(file_ptr, "%#12.8g\t%#12.8g\t%#12.8g\n", 
-					t[k], p[k], mse_rti_params.p_theory[k]);
-		}
-	else
-		for (i=0; i<nt; i++) {
-			fprintf(file_ptr, "%#12.8g\t%#12.8g\t%#12.8g\n", 
-					t[i], p[i], mse_rti_params.p_theory[i]);
-		}
+	/* Print concentration arrays to output file (in the reciprocal 
+	   mode, with a column for each candidate source) */
+	for (i=0; i<MIN(nt, 1000); i++) {
+		k = (nt > 1000) ? (i * nt) / 1000 : i;
+		fprintf(file_ptr, "%#12.8g\t%#12.8g\t%#12.8g", 
+				t[k], p[k], mse_rti_params.p_theory[k]);
+		for (nsource = 0; nsource < candidates.n; nsource++) 
+			fprintf(file_ptr, "\t%#12.8g", p[(nsource+1)*nt + k]);
+		fprintf(file_ptr, "\n");
+	}
 	fprintf(file_ptr, "\n");
 
 	/* Close the file */
@@ -1154,9 +1948,26 @@ if (opt_verbose)
 	/* Deallocate arrays */
 	free(t);
 	free(p);
+	free(iprobes);
+	free(jprobes);
+	free(candidates.source);
+	if (design) {
+		free(icand);
+		free(jcand);
+		free(pc);
+		free(sens);
+		free(best_det);
+		free(se);
+		free(best_dur);
+	}
 	free(s);
 	free(alphas);
 	free(invr);
+	if (solver == 3) {
+		free(isources3d);
+		free(xsources3d);
+		free(samounts3d);
+	}
 
 	free(mse_rti_params.t);
 	free(mse_rti_params.p_model);
@@ -1169,5 +1980,9 @@ if (opt_verbose)
 if (opt_verbose)
 	printf("All done\n");
 
+#ifdef USE_MPI
+	MPI_Finalize();
+#endif
+
 	return(EXIT_SUCCESS);
 }
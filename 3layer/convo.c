@@ -72,6 +72,7 @@ via the scaling factors.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 
 /**
   \def A(i,j)
@@ -85,6 +86,12 @@ via the scaling factors.
  */
 #define OUT(i,j) out[((i)*N+(j))]
 
+/**
+  \def SAME(x,y)
+  True if the coefficients \a x and \a y are equal to within rounding errors.
+ */
+#define SAME(x,y) (fabs((x) - (y)) <= 1.0e-10 * fabs(x))
+
 
 /**
   \brief Calculates updates to the concentration in a layer 
@@ -218,3 +225,224 @@ void convolve3(int M, int N, double *a, double scale1, double scale2, double *in
 			+ A(M-1,N-2) - 4. * A(M-1,N-1)   )
 			+ scale2 * ( -A(M-1,N-2)*invr[N-1] );
 }
+
+
+/**
+  \brief Calculates updates to the concentration in a layered
+         environment by applying the Laplacian in cylindrical
+         coordinates with coefficients that can differ from row
+         to row.
+
+  This is the same calculation as convolve3(), except that the
+  scaling factors are given for each row (z index) of the input
+  matrix and the second derivative in \f$ z \f$ is written in
+  flux form, so that each row has its own coefficient for the
+  interface with the row below it and the row above it:
+
+\f[
+      \mathbf{out}_{i,j} = s_{1,i} \left( a_{i,j-1} - 2 a_{i,j} + a_{i,j+1} \right)
+                         + \frac{s_{2,i}}{r_j} \left( a_{i,j+1} - a_{i,j-1} \right)
+                         + s_{-,i} \left( a_{i-1,j} - a_{i,j} \right)
+                         + s_{+,i} \left( a_{i+1,j} - a_{i,j} \right)
+      \qquad (r \neq 0)
+\f]
+
+  with the r-terms replaced by \f$ 2 s_{1,i} (a_{i,j-1} - 2 a_{i,j} + a_{i,j+1}) \f$
+  at \f$ r = 0 \f$ (see above). When all the rows have the same
+  coefficients (\f$ s_{-,i} = s_{+,i} = s_{1,i} \f$), this
+  gives the same result as convolve3(). Values outside of the
+  input matrix are taken to be 0.
+
+  \param [in] M Number of columns of input matrix (z)
+  \param [in] N Number of rows of input matrix (r)
+  \param [in] a Input matrix (concentration, c)
+  \param [in] scale1 Scaling factors #1 for each row (M elements)
+  \param [in] scale2 Scaling factors #2 for each row (M elements)
+  \param [in] scale_zm Scaling factors for the interface with the previous row (M elements)
+  \param [in] scale_zp Scaling factors for the interface with the next row (M elements)
+  \param [in] invr Vector of 1/r values
+  \param [out] out Output matrix
+ */
+
+void convolve_rows(int M, int N, double *a, double *scale1, double *scale2, double *scale_zm, double *scale_zp, double *invr, double *out)
+{
+	int i, j;
+	double s1, s2, szm, szp;
+
+	for (i=0; i<M; i++) {
+		s1 = scale1[i];
+		s2 = scale2[i];
+		szm = scale_zm[i];
+		szp = scale_zp[i];
+
+		for (j=1; j<N-1; j++) 
+			OUT(i,j) = s1 * ( A(i,j-1) - 2. * A(i,j) + A(i,j+1) )
+				+ s2 * ( (-A(i,j-1) + A(i,j+1))*invr[j] )
+				- (szm + szp) * A(i,j);
+
+		// j=0 
+		OUT(i,0) = s1 * ( - 2. * A(i,0) + A(i,1) )
+			+ s2 * ( A(i,1)*invr[0] )
+			- (szm + szp) * A(i,0);
+
+		// j=N-1 
+		OUT(i,N-1) = s1 * ( A(i,N-2) - 2. * A(i,N-1) )
+			+ s2 * ( -A(i,N-2)*invr[N-1] )
+			- (szm + szp) * A(i,N-1);
+
+		/* j=1: This is the r=0 row, so use L0 rather than L */
+		OUT(i,1) = 2. * s1 * ( A(i,0) - 2. * A(i,1) + A(i,2) )
+			- (szm + szp) * A(i,1);
+
+		/* Interfaces with the previous and next rows 
+		   (the rows outside of the matrix are 0) */
+		if (i > 0)
+			for (j=0; j<N; j++)
+				OUT(i,j) += szm * A(i-1,j);
+		if (i < M-1)
+			for (j=0; j<N; j++)
+				OUT(i,j) += szp * A(i+1,j);
+	}
+}
+
+
+
+/**
+  \brief Returns TRUE if the z-flux between rows \a i and \a i+1 can be
+  calculated with the fourth-order kernel, ie if rows i-1 ... i+2 are
+  in the matrix and have the same interface coefficients.
+
+  \param [in] i Index of the row below the interface
+  \param [in] M Number of columns of input matrix (z)
+  \param [in] scale_zm Scaling factors for the interface with the previous row (M elements)
+  \param [in] scale_zp Scaling factors for the interface with the next row (M elements)
+ */
+
+static int fourth_order_face(int i, int M, double *scale_zm, double *scale_zp)
+{
+	return (i >= 1) && (i <= M-3) 
+		&& SAME(scale_zm[i], scale_zp[i]) 
+		&& SAME(scale_zm[i+1], scale_zp[i+1]);
+}
+
+
+/**
+  \brief Calculates updates to the concentration in a layered
+         environment with a fourth-order accurate Laplacian in
+         cylindrical coordinates.
+
+  This is the same calculation as convolve_rows(), except that the
+  derivatives are fourth-order accurate. In a homogeneous region
+  this amounts to convolving with the wide (5-point) kernels
+
+\f[ \mathbf{L4} = \frac{1}{12}
+\left( \begin{array}{ccccc}
+-1 & 16 & -30 & 16 & -1
+\end{array} \right)
+\qquad
+\mathbf{D4} = \frac{1}{12}
+\left( \begin{array}{ccccc}
+1 & -8 & 0 & 8 & -1
+\end{array} \right) \f]
+
+  (\f$ \mathbf{L4} / \Delta r^2 \f$ in both \f$ r \f$ and \f$ z \f$ ,
+  and \f$ \mathbf{D4} / (r \Delta r) \f$ for the first derivative).
+
+  The update is written as the difference of the fluxes through the 
+  two faces of each cell, so that the amount of substance is 
+  conserved exactly, as with the second-order kernels:
+
+  - In \f$ r \f$ , the flux through the cylinder surface between 
+    columns \f$ j \f$ and \f$ j+1 \f$ (with \f$ \rho = r_j / \Delta r \f$ ) is
+\f[
+G_{j+1/2} = \frac{1}{12} \left( \rho \, a_{j-1} - (15 \rho + 7) \, a_j 
+          + (15 \rho + 8) \, a_{j+1} - (\rho + 1) \, a_{j+2} \right)
+\quad ,
+\f]
+    whose differences \f$ (G_{j+1/2} - G_{j-1/2}) / \rho \f$ are 
+    exactly \f$ \mathbf{L4} + \mathbf{D4}/\rho \f$ . The cell on 
+    the z-axis (\f$ r = 0 \f$ ) then gets the update 
+    \f$ 12 \, G_{3/2} \f$ , which is second-order accurate and 
+    corresponds to a cell volume of \f$ \pi \Delta r^2 \Delta z / 6 \f$ 
+    (rather than \f$ \pi \Delta r^2 \Delta z / 4 \f$ for the 
+    second-order kernels). The last two faces use the second-order 
+    flux.
+
+  - In \f$ z \f$ , the flux between rows \f$ i \f$ and \f$ i+1 \f$ is 
+    \f$ (a_{i-1} - 15 a_i + 15 a_{i+1} - a_{i+2}) / 12 \f$ if 
+    the rows \f$ i-1 \f$ ... \f$ i+2 \f$ lie within a single layer 
+    (see fourth_order_face()), and \f$ a_{i+1} - a_i \f$ otherwise, 
+    scaled by the interface coefficients as in convolve_rows(). 
+    So the rows next to a layer interface or the ends of the 
+    cylinder are second-order accurate.
+
+  Values outside of the input matrix are taken to be 0.
+
+  \param [in] M Number of columns of input matrix (z)
+  \param [in] N Number of rows of input matrix (r), at least 4
+  \param [in] a Input matrix (concentration, c)
+  \param [in] scale1 Scaling factors #1 for each row (M elements)
+  \param [in] scale_zm Scaling factors for the interface with the previous row (M elements)
+  \param [in] scale_zp Scaling factors for the interface with the next row (M elements)
+  \param [out] out Output matrix
+ */
+
+void convolve_rows4(int M, int N, double *a, double *scale1, double *scale_zm, double *scale_zp, double *out)
+{
+	int i, j;
+	int fourth_m, fourth_p;	/* Fourth-order z-fluxes at the two faces */
+	double s1, szm, szp;
+	double rho;
+	double gm, gp;	/* 12 x r-fluxes through the two faces */
+	double dm, dp;	/* z-differences at the two faces */
+
+	for (i=0; i<M; i++) {
+		s1 = scale1[i];
+		szm = scale_zm[i];
+		szp = scale_zp[i];
+
+		fourth_m = (i > 0) && fourth_order_face(i-1, M, scale_zm, scale_zp);
+		fourth_p = fourth_order_face(i, M, scale_zm, scale_zp);
+
+		/* r-terms */
+		gm = 0.;
+		for (j=1; j<N; j++) {
+			rho = j - 1.;
+			if (j < N-2)
+				gp = rho * A(i,j-1) - (15. * rho + 7.) * A(i,j) 
+					+ (15. * rho + 8.) * A(i,j+1) - (rho + 1.) * A(i,j+2);
+			else if (j == N-2)
+				gp = 12. * (rho + 0.5) * ( A(i,j+1) - A(i,j) );
+			else
+				gp = 12. * (rho + 0.5) * ( - A(i,j) );
+
+			if (j == 1)	/* This is the r=0 row */
+				OUT(i,j) = s1 * gp;
+			else
+				OUT(i,j) = s1 * (gp - gm) / (12. * rho);
+
+			gm = gp;
+		}
+
+		/* j=0 holds the values at r = -dr, which are the same 
+		   as at r = dr */
+		OUT(i,0) = OUT(i,2);
+
+		/* z-terms */
+		for (j=0; j<N; j++) {
+			if (fourth_m)
+				dm = ( A(i-2,j) - 15. * A(i-1,j) 
+				       + 15. * A(i,j) - A(i+1,j) ) / 12.;
+			else
+				dm = A(i,j) - ((i > 0) ? A(i-1,j) : 0.);
+
+			if (fourth_p)
+				dp = ( A(i-1,j) - 15. * A(i,j) 
+				       + 15. * A(i+1,j) - A(i+2,j) ) / 12.;
+			else
+				dp = ((i < M-1) ? A(i+1,j) : 0.) - A(i,j);
+
+			OUT(i,j) += szp * dp - szm * dm;
+		}
+	}
+}
@@ -0,0 +1,280 @@
+/**
+  \file 3layer/design.c
+
+  Functions for choosing the probe position and the duration of the
+  source of an experiment (experimental design).
+
+  The parameters of the SP layer are best determined by the
+  experiment that makes the curve most sensitive to them. The
+  sensitivities \f$ \partial c / \partial q \f$ for
+  \f$ q = \ln\alpha, \ln\theta, \kappa \f$ of the layer are
+  calculated together with the concentration, by differentiating
+  each time-step of the explicit scheme of model.c: the kernel of
+  convolve_rows() is linear in its coefficients, so the derivative
+  of the update is the update of the sensitivity plus the kernel
+  with the derivatives of the coefficients applied to the
+  concentration. One solution therefore gives the sensitivities at
+  all grid points, and they are recorded at the candidate probe
+  positions.
+
+  The source is switched on at the source delay and left on (a
+  step). The model is linear and does not change in time, so the
+  curve of a source of duration \f$ T \f$ is the curve of the step
+  minus the curve of the step delayed by \f$ T \f$ , and so are
+  its sensitivities: every duration is evaluated from the same
+  solution. For each candidate position and duration, the Fisher
+  information of the curve (sampled at the recorded times, with
+  Gaussian noise of standard deviation \f$ \sigma \f$ ) is
+
+\f[
+F_{ab} = \frac{1}{\sigma^2} \sum_m
+  \frac{\partial c(t_m)}{\partial q_a} \frac{\partial c(t_m)}{\partial q_b}
+\quad ,
+\f]
+
+  and \f$ F^{-1} \f$ is the smallest covariance of the fitted
+  parameters. The best design has the largest \f$ \det F \f$
+  (D-optimal), i.e. the smallest volume of the confidence region,
+  which does not depend on the units of the parameters.
+
+ */
+
+#include "header.h"
+
+
+/**
+  \brief Calculates the coefficients of the time-step of each row
+  for a layer table (as in calc_diffusion_curve_layer()).
+
+  \param[in] nz Number of rows of concentration matrix
+  \param[in] dr Spacing in r and z
+  \param[in] dt Spacing in time
+  \param[in] dfree Free diffusion coefficient
+  \param[in] layers Layer table
+  \param[out] coef Coefficients (6*nz elements: scale1, scale2, scale_zm, scale_zp, kappa, and alpha of each row)
+ */
+static void design_row_coefficients(int nz, double dr, double dt, double dfree, layer_table_struct_type *layers, double *coef)
+{
+	int i;
+	double *alpha_row = coef + 5*nz;
+	double *dstar_row = create_array(nz, "design dstar_row");
+	double *g = create_array(nz+1, "design g");
+
+	calc_layer_rows(nz, dr, layers, dfree, alpha_row, dstar_row, coef + 4*nz, g);
+	for (i=0; i<nz; i++) {
+		coef[i] = dstar_row[i] * dt / SQR(dr);
+		coef[nz+i] = dstar_row[i] * dt / (2.0 * dr);
+		coef[2*nz+i] = g[i] * dt / (alpha_row[i] * SQR(dr));
+		coef[3*nz+i] = g[i+1] * dt / (alpha_row[i] * SQR(dr));
+	}
+
+	free(dstar_row);
+	free(g);
+}
+
+
+/**
+  \brief Calculates the concentration and its sensitivities to
+  \f$ \ln\alpha \f$ , \f$ \ln\theta \f$ , and \f$ \kappa \f$ of
+  one layer at the candidate probe positions, for a source that
+  is switched on at sdelay and stays on.
+
+  The derivatives of the coefficients of the rows are calculated
+  once, with central differences (the axial permeability of the
+  layer is changed together with its permeability). The time-step
+  is that of calc_diffusion_curve_layer() with the second-order
+  stencil, without exp_clearance or uptake.
+
+  \param[in] nt Number of support points in time
+  \param[in] nz Number of rows of concentration matrix
+  \param[in] nr Number of columns of concentration matrix
+  \param[in] ncand Number of candidate probe positions
+  \param[in] icand z-indices of the candidates
+  \param[in] jcand r-indices of the candidates
+  \param[in] layers Layer table
+  \param[in] ilayer Layer of the parameters
+  \param[in] kstride Number of time-steps between recorded times
+  \param[in] dt Spacing in time
+  \param[in] dr Spacing in r (and z)
+  \param[in] sdelay Source delay (time before source starts)
+  \param[in] dfree Free diffusion coefficient
+  \param[in] s Source array
+  \param[in] invr Array for \f$ 1/r \f$ values
+  \param[out] pc Concentration at the candidates (pc[n*nsample+m] at time sdelay + m*kstride*dt)
+  \param[out] sens Sensitivities (sens[(q*ncand+n)*nsample+m] for parameter q)
+ */
+void calc_design_curves(int nt, int nz, int nr, int ncand, int *icand, int *jcand, layer_table_struct_type *layers, int ilayer, int kstride, double dt, double dr, double sdelay, double dfree, double *s, double *invr, double *pc, double *sens)
+{
+	int i, j, k, l, m, n, q;
+	int size = nz*(nr+1);
+	int nds = lround(sdelay/dt);
+	int nsample = (nt - nds - 1) / kstride + 1;
+	double h = 1.0e-4;	/* Relative step for the derivatives */
+	double u;
+	layer_table_struct_type lp, lm;
+
+	double *coef = create_array(6*nz, "design coefficients");
+	double *dcoef = create_array(3*6*nz, "design coefficient derivatives");
+	double *work = create_array(6*nz, "design work");
+	double *c = create_array(size, "design c");
+	double *dc = create_array(size, "design dc");
+	double *sq = create_array(3*size, "design sensitivities");
+	double *dsq = create_array(3*size, "design dsq");
+	double *fq = create_array(3*size, "design fq");
+	double *ds = create_array(3*size, "design ds");
+
+	/* Coefficients and their derivatives */
+	design_row_coefficients(nz, dr, dt, dfree, layers, coef);
+	for (q=0; q<3; q++) {
+		lp = *layers;
+		lm = *layers;
+		if (q == 0) {
+			lp.alpha[ilayer] *= 1.0 + h;
+			lm.alpha[ilayer] *= 1.0 - h;
+		} else if (q == 1) {
+			lp.theta[ilayer] *= 1.0 + h;
+			lp.theta_z[ilayer] *= 1.0 + h;
+			lm.theta[ilayer] *= 1.0 - h;
+			lm.theta_z[ilayer] *= 1.0 - h;
+		} else {	/* kappa_row is linear in kappa */
+			lp.kappa[ilayer] += h;
+			lm.kappa[ilayer] -= h;
+		}
+		design_row_coefficients(nz, dr, dt, dfree, &lp, dcoef + q*6*nz);
+		design_row_coefficients(nz, dr, dt, dfree, &lm, work);
+		for (i=0; i<6*nz; i++)
+			dcoef[q*6*nz+i] = (dcoef[q*6*nz+i] - work[i]) / (2.0 * h);
+
+		/* The source is divided by the alpha of its cell */
+		for (i=0; i<nz; i++)
+			for (j=0; j<nr+1; j++)
+				ds[q*size+INDEX(i,j)] = - s[INDEX(i,j)] *
+					dcoef[q*6*nz+5*nz+i] / coef[5*nz+i];
+	}
+
+	/* Loop over time from the start of the source */
+	for (k=nds, m=0; k<nt; k++) {
+		if ((k - nds) % kstride == 0) {
+			for (n=0; n<ncand; n++) {
+				l = INDEX(icand[n],jcand[n]);
+				pc[n*nsample+m] = c[l];
+				for (q=0; q<3; q++)
+					sens[(q*ncand+n)*nsample+m] = sq[q*size+l];
+			}
+			m++;
+		}
+
+		convolve_rows(nz, nr+1, c, coef, coef + nz, coef + 2*nz,
+			coef + 3*nz, invr, dc);
+
+		/* Derivative of the time-step for each parameter */
+#ifdef _OPENMP
+#pragma omp parallel for private(i, j, l, u)
+#endif
+		for (q=0; q<3; q++) {
+			double *d = dcoef + q*6*nz;
+			convolve_rows(nz, nr+1, sq + q*size, coef, coef + nz,
+				coef + 2*nz, coef + 3*nz, invr, dsq + q*size);
+			convolve_rows(nz, nr+1, c, d, d + nz, d + 2*nz, d + 3*nz,
+				invr, fq + q*size);
+			for (i=0; i<nz; i++) {
+				for (j=0; j<nr+1; j++) {
+					l = INDEX(i,j);
+					u = c[l] + dc[l] + s[l];
+					sq[q*size+l] = (sq[q*size+l] + dsq[q*size+l] + fq[q*size+l]
+						+ ds[q*size+l]) * (1. - coef[4*nz+i] * dt)
+						- u * d[4*nz+i] * dt;
+				}
+				sq[q*size+INDEX(i,0)] = sq[q*size+INDEX(i,2)];
+			}
+		}
+
+		for (i=0; i<nz; i++) {
+			for (j=0; j<nr+1; j++) {
+				l = INDEX(i,j);
+				c[l] = (c[l] + dc[l] + s[l]) * (1. - coef[4*nz+i] * dt);
+			}
+			c[INDEX(i,0)] = c[INDEX(i,2)];
+		}
+	}
+
+	free(coef);
+	free(dcoef);
+	free(work);
+	free(c);
+	free(dc);
+	free(sq);
+	free(dsq);
+	free(fq);
+	free(ds);
+}
+
+
+/**
+  \brief Evaluates the Fisher information of each candidate probe
+  position for each source duration, and returns the best duration
+  of each candidate.
+
+  \param[in] ncand Number of candidate probe positions
+  \param[in] nsample Number of recorded times of each candidate
+  \param[in] ndur Number of source durations
+  \param[in] dur_step Spacing of the durations (in recorded times)
+  \param[in] noise Standard deviation of the noise of the data (mM)
+  \param[in] sens Sensitivities from calc_design_curves()
+  \param[out] best_dur Best duration of each candidate (in recorded times, 0 if none)
+  \param[out] best_det \f$ \det F \f$ of the best duration of each candidate
+  \param[out] se Standard errors of \f$ \ln\alpha \f$ , \f$ \ln\theta \f$ , and \f$ \kappa \f$ for the best duration (3 per candidate)
+ */
+void calc_design_fisher(int ncand, int nsample, int ndur, int dur_step, double noise, double *sens, int *best_dur, double *best_det, double *se)
+{
+	int n;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (n=0; n<ncand; n++) {
+		int a, b, l, m, d;
+		double f[3][3], v[3], det, cof[3][3];
+
+		best_dur[n] = 0;
+		best_det[n] = 0.;
+		se[3*n] = se[3*n+1] = se[3*n+2] = -1.;
+		for (l=1; l<=ndur; l++) {
+			d = l * dur_step;
+			if (d >= nsample) break;
+
+			for (a=0; a<3; a++)
+				for (b=0; b<3; b++)
+					f[a][b] = 0.;
+			for (m=0; m<nsample; m++) {
+				for (a=0; a<3; a++) {
+					v[a] = sens[(a*ncand+n)*nsample+m];
+					if (m >= d) v[a] -= sens[(a*ncand+n)*nsample+m-d];
+				}
+				for (a=0; a<3; a++)
+					for (b=0; b<=a; b++)
+						f[a][b] += v[a] * v[b];
+			}
+			for (a=0; a<3; a++)
+				for (b=0; b<=a; b++)
+					f[b][a] = (f[a][b] /= SQR(noise));
+
+			/* Cofactors (F is symmetric) */
+			cof[0][0] = f[1][1]*f[2][2] - f[1][2]*f[2][1];
+			cof[0][1] = f[1][2]*f[2][0] - f[1][0]*f[2][2];
+			cof[0][2] = f[1][0]*f[2][1] - f[1][1]*f[2][0];
+			cof[1][1] = f[0][0]*f[2][2] - f[0][2]*f[2][0];
+			cof[1][2] = f[0][1]*f[2][0] - f[0][0]*f[2][1];
+			cof[2][2] = f[0][0]*f[1][1] - f[0][1]*f[1][0];
+			det = f[0][0]*cof[0][0] + f[0][1]*cof[0][1] + f[0][2]*cof[0][2];
+
+			if (det > best_det[n]) {
+				best_det[n] = det;
+				best_dur[n] = d;
+				se[3*n] = sqrt(cof[0][0] / det);
+				se[3*n+1] = sqrt(cof[1][1] / det);
+				se[3*n+2] = sqrt(cof[2][2] / det);
+			}
+		}
+	}
+}
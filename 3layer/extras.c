@@ -58,26 +58,58 @@ void print_usage(char *program)
         "\t--nz <nr>               specify nz\n"
 		"\t--nt <nt>               specify nt\n"
 		"\t--nt_scale <factor>     specify scale factor for nt\n"
+		"\t--stencil <order>       specify order of spatial discretization (2 or 4)\n"
+		"\t--no_zmirror            do not use z-mirror symmetry of the layers\n"
+		"\t--exp_clearance         integrate source and clearance exactly\n"
+		"\t--solver <2d|3d|auto>   specify the solver; auto (default) uses the 3D\n"
+		"\t                        solver only if a source is off the z-axis\n"
+		"\t--parareal <nslices>    solve the 2D model in parallel in time with\n"
+		"\t                        parareal, with nslices time slices\n"
+		"\t--parareal_tol <tol>    specify relative tolerance for parareal (1e-6)\n"
+        );
+    fprintf(stderr, 
 		"\t--probe_z <probe_z>     specify probe_z (in microns)\n"
 		"\t--probe_r <probe_r>     specify probe_r (in microns)\n"
 		"\t--ez1 <ez1>             specify z-position of bottom of cylinder (<0)\n"
 		"\t--ez2 <ez2>             specify z-position of top of cylinder (>0)\n"
+		"\t--snap_layers           snap layer boundaries midway between grid points\n"
         "\t--alpha_so <alpha_so>   specify alpha_so\n"
         "\t--alpha_sp <alpha_sp>   specify alpha_sp\n"
         "\t--alpha_sr <alpha_sr>   specify alpha_sr\n"
         "\t--theta_so <theta_so>   specify theta_so\n"
         "\t--theta_sp <theta_sp>   specify theta_sp\n"
         "\t--theta_sr <theta_sr>   specify theta_sr\n"
+        "\t--theta_z_so <t_z_so>  specify axial theta_z_so (default: theta_so)\n"
+        "\t--theta_z_sp <t_z_sp>  specify theta_z_sp (default: theta_sp)\n"
+        "\t--theta_z_sr <t_z_sr>  specify axial theta_z_sr (default: theta_sr)\n"
 		"\t--kappa_so <kappa_so>   specify kappa_so\n"
 		"\t--kappa_sp <kappa_sp>   specify kappa_sp\n"
 		"\t--kappa_sr <kappa_sr>   specify kappa_sr\n"
 		"\t--kappa_outside <k_out> specify kappa_outside (mutually excl. with -g)\n"
+		"\t--vmax_so <vmax_so>     specify Michaelis-Menten Vmax in SO (mM/s)\n"
+		"\t--vmax_sp <vmax_sp>     specify Michaelis-Menten Vmax in SP (mM/s)\n"
+		"\t--vmax_sr <vmax_sr>     specify Michaelis-Menten Vmax in SR (mM/s)\n"
+		"\t--km_so <km_so>         specify Michaelis-Menten Km in SO (mM)\n"
+		"\t--km_sp <km_sp>         specify Michaelis-Menten Km in SP (mM)\n"
+		"\t--km_sr <km_sr>         specify Michaelis-Menten Km in SR (mM)\n"
+		"\t--layer <z,a,t,k[,v,km[,t_z]]> add a layer (from the bottom up) with\n"
+		"\t                        top at z, alpha, theta, kappa (and Vmax, Km,\n"
+		"\t                        theta_z); replaces the 3 layers (repeat)\n"
         "\t--alpha_start <a_start> specify initial guess for apparent alpha\n"
         "\t--theta_start <t_start> specify initial guess for apparent theta\n"
         "\t--alpha_step <a_step>   specify initial step for apparent alpha\n"
         "\t--theta_step <t_step>   specify initial step for apparent theta\n"
+        "\t--fit_kappa             fit the apparent kappa too (point source\n"
+		"\t                        with clearance)\n"
+        "\t--kappa_start <k_start> specify initial guess for apparent kappa (0)\n"
+        "\t--kappa_step <k_step>   specify initial step for apparent kappa\n"
         "\t--tmax <tmax>           specify total duration of experiment\n"
-        "\t--fit_tol <fit_tol>     specify stopping criterion (simplex size)\n"
+        "\t--fit_tol <fit_tol>     specify stopping criterion (simplex size, or\n"
+        "\t                        relative decrease of the MSE with --lm)\n"
+        "\t--lm                    fit with Levenberg-Marquardt (analytic\n"
+        "\t                        derivatives) instead of the simplex\n"
+        "\t--optimizer <name>      specify the optimizer of the fit: nmsimplex\n"
+        "\t                        (default), nmsimplex2, or lm (same as --lm)\n"
         "\t--itermax <itermax>     specify stopping criterion (max iterations)\n"
         "\t--outfile <outfile>     specify output file (parameters and curves)\n"
         "\t--pathfile <pathfile>   specify simplex path output file (just \n"
@@ -87,6 +119,16 @@ void print_usage(char *program)
         "\t--additional_sources \"<string>\" specify additional sources\n"
 		"\t    <string> = <num_additional_sources> <source_params>\n"
 		"\t    <source_params> = <sz1> <sr1> <crnt1> [<sz2> <sr2> <crnt2> ...]\n"
+        "\t--reciprocal \"<string>\" put the source at the probe and record the\n"
+		"\t    curves of candidate sources (reciprocity)\n"
+		"\t    <string> = <num_candidates> <sz1> <sr1> [<sz2> <sr2> ...]\n"
+        "\t--design                find the probe position and source duration\n"
+		"\t                        that determine the SP parameters best\n"
+		"\t--design_dmin <dmin>    specify min. distance of candidate probes (50)\n"
+		"\t--design_dmax <dmax>    specify max. distance of candidate probes (300)\n"
+		"\t--design_spacing <d>    specify spacing of candidate probes (25 microns)\n"
+		"\t--design_durations <n>  specify number of candidate durations (10)\n"
+		"\t--design_noise <sigma>  specify noise of the data (0.01 mM)\n"
         );
     exit(EXIT_FAILURE);
 }
@@ -102,10 +144,10 @@ void print_usage(char *program)
 
   \return Pointer to the new array
  */
-double *create_array(int N, char *string)
+double *create_array(size_t N, char *string)
 {
 	double *a;
-	int i;
+	size_t i;
 
 	a = (double *)malloc(sizeof(double) * N);
 	if (a == NULL)
@@ -20,6 +20,9 @@
 #include <time.h>
 #include <math.h>
 #include <gsl/gsl_multimin.h>
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
 
 
 // Constants
@@ -36,6 +39,9 @@
 /// Maximum number of characters of command to copy to output file
 #define MAX_COMMAND_LENGTH 1000
 
+/// Maximum number of layers in the layer table
+#define MAX_LAYERS 10
+
 /// Maximum length of string argument to additional_sources option
 #define ADDITIONAL_SOURCES_STRING_LENGTH 500
 
@@ -173,17 +179,39 @@ typedef struct {
 
 
 
+/** 
+  \typedef Typedef for struct for the layer table. The layers are 
+  ordered from the bottom (smallest z) to the top, and layer k 
+  is zbound[k-1] < z < zbound[k] (the bottom and top layers 
+  extend past the ends of the cylinder).
+ */
+typedef struct {
+    int n;                         ///< Number of layers
+    double zbound[MAX_LAYERS-1];   ///< z-positions of the n-1 boundaries between layers (increasing)
+    double alpha[MAX_LAYERS];      ///< Extracellular volume fraction of each layer
+    double theta[MAX_LAYERS];      ///< Permeability of each layer (radial, within the layer)
+    double theta_z[MAX_LAYERS];    ///< Axial permeability of each layer (across the layer)
+    double kappa[MAX_LAYERS];      ///< Nonspecific clearance factor of each layer
+    double vmax[MAX_LAYERS];       ///< Maximum Michaelis-Menten uptake rate of each layer
+    double km[MAX_LAYERS];         ///< Michaelis constant of uptake of each layer
+} layer_table_struct_type;
+
+
 // Function prototypes
 
 // convo.c
 void convolve3(int M, int N, double *a, double scale1, double scale2, double *invr, double *out);
 
+void convolve_rows(int M, int N, double *a, double *scale1, double *scale2, double *scale_zm, double *scale_zp, double *invr, double *out);
+
+void convolve_rows4(int M, int N, double *a, double *scale1, double *scale_zm, double *scale_zp, double *out);
+
 // extras.c
 void error(char *errorstring, ...);
 
 void print_usage(char *program);
 
-double *create_array(int N, char *string);
+double *create_array(size_t N, char *string);
 
 //io.c
 void get_filename(char *in, char *out);
@@ -194,11 +222,51 @@ int assemble_command(int argc, char *argv[], char *command);
 
 double read_source_parameter(char *string, int nsource);
 
+int read_solver(char *string);
+
+// design.c
+void calc_design_curves(int nt, int nz, int nr, int ncand, int *icand, int *jcand, layer_table_struct_type *layers, int ilayer, int kstride, double dt, double dr, double sdelay, double dfree, double *s, double *invr, double *pc, double *sens);
+
+void calc_design_fisher(int ncand, int nsample, int ndur, int dur_step, double noise, double *sens, int *best_dur, double *best_det, double *se);
+
+// layers.c
+double layer_integral(double za, double zb, int nlayers, double *zbound, double *value, int inverse);
+
+void calc_layer_rows(int nz, double dz, layer_table_struct_type *layers, double dfree, double *alpha_row, double *dstar_row, double *kappa_row, double *g);
+
+double cell_alpha(double z, double dz, layer_table_struct_type *layers);
+
+void calc_row_average(int nz, double dz, layer_table_struct_type *layers, double *v, double *v_row);
+
+void set_three_layers(double lz1, double lz2, double alpha_so, double theta_so, double theta_z_so, double kappa_so, double vmax_so, double km_so, double alpha_sp, double theta_sp, double theta_z_sp, double kappa_sp, double vmax_sp, double km_sp, double alpha_sr, double theta_sr, double theta_z_sr, double kappa_sr, double vmax_sr, double km_sr, layer_table_struct_type *layers);
+
+void add_layer(char *string, layer_table_struct_type *layers);
+
+int layers_symmetric(layer_table_struct_type *layers, double z0, double tol);
+
 // model.c
-void calc_diffusion_curve_layer(int nt, int nz, int nr, int iprobe, int jprobe, int iz1, int iz2, int nolayer, double dt, double dr, double sdelay, double sduration, double alpha_so, double theta_so, double kappa_so, double alpha_sp, double theta_sp, double kappa_sp, double alpha_sr, double theta_sr, double kappa_sr, double dfree, double *t, double *s, double *invr, char *imagebasename, double image_spacing, double *p);
+void laplacian_rows(int stencil, int M, int N, double *a, double *scale1, double *scale2, double *scale_zm, double *scale_zp, double *invr, double *out);
+void reaction_half_step(int nz, int nr, double *c, double *s, int source_on, double *decay, double *gain);
+void update_with_uptake(int nz, int nr, double *c, double *dc, double *vmax_dt, double *km_row);
+void start_conc_images(int nz, int nr, char *imagebasename);
+void write_conc_image(int nz, int nr, double *c, double *conc_out, char *imagebasename, int image_counter, float time);
+void calc_diffusion_curve_layer(int nt, int nz, int nr, int nprobes, int *iprobe, int *jprobe, layer_table_struct_type *layers, int nolayer, int stencil, int zmirror, int exp_clearance, double dt, double dr, double sdelay, double sduration, double dfree, double *t, double *s, double *invr, char *imagebasename, double image_spacing, double *p);
+
+// model-mpi.c
+#ifdef USE_MPI
+void calc_diffusion_curve_layer_mpi(int nt, int nz, int nr, int iprobe, int jprobe, layer_table_struct_type *layers, int stencil, int zmirror, int exp_clearance, double dt, double dr, double sdelay, double sduration, double dfree, double *t, double *s, double *invr, char *imagebasename, double image_spacing, double *p);
+#endif
+
+// model3d.c
+void calc_diffusion_curve_layer_3d(int nt, int nz, int nr, int iprobe, int xprobe, layer_table_struct_type *layers, int exp_clearance, int nsources, int *isources, int *xsources, double *samounts, double dt, double dr, double sdelay, double sduration, double dfree, double *t, double *p);
+
+// parareal.c
+int calc_diffusion_curve_layer_parareal(int nt, int nz, int nr, int iprobe, int jprobe, layer_table_struct_type *layers, int stencil, int zmirror, int exp_clearance, int nslices, double tol, double dt, double dr, double sdelay, double sduration, double dfree, double *t, double *s, double *invr, double *p);
 
 // rti-theory.c
 double calc_mse_rti(const gsl_vector *x, void *params);
 
 void rti_theory(int nt, double spdist, double samplitude, double sdelay, double sduration, double kappa, double dfree, double alpha, double theta, double *t, double *p_theory);
+double rti_lm_iterate(mse_rti_params_struct_type *p, int nfit, double *mu, double *mse);
+void rti_standard_errors(mse_rti_params_struct_type *p, int nfit, double *se);
 
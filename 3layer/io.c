@@ -163,3 +163,23 @@ double read_source_parameter(char *string, int nsource)
 
 	return (value);
 }
+
+
+/**
+  \brief Reads the solver from the string argument to the solver 
+  option (or the solver line of the input file).
+
+  \param [in] string "2d" (axisymmetric solver), "3d" (3D Cartesian 
+  solver), or "auto" (3D solver only if a source is off the z-axis)
+
+  \return 2, 3, or 0 (for auto)
+ */
+int read_solver(char *string)
+{
+	if (STREQ(string, "2d") || STREQ(string, "2D")) return 2;
+	if (STREQ(string, "3d") || STREQ(string, "3D")) return 3;
+	if (STREQ(string, "auto")) return 0;
+
+	error("solver = %s, but it should be 2d, 3d, or auto", string);
+	return 0;
+}
@@ -0,0 +1,334 @@
+/**
+  \file 3layer/model-mpi.c
+
+  Function for solving the forward problem with the rows of the
+  grid divided among MPI processes.
+
+  For very large grids, the time-steps of model.c are limited by
+  the memory bandwidth of a single machine. This file has a version
+  of the explicit solver in which each MPI process (rank) owns a
+  range of rows (z) of the concentration matrix, and the rows next
+  to the range (the halo, 1 row for the second-order stencil and 2
+  rows for the fourth-order stencil) are exchanged with the
+  neighbouring ranks before each time-step. Since the layer
+  interfaces are described by the per-row coefficients of
+  calc_layer_rows() and the r=0 mirror column is part of each row,
+  they are handled by the rank that owns the row, and the result is
+  the same as that of calc_diffusion_curve_layer() (to within
+  rounding errors). The probe trace is summed over the ranks, and
+  the rows are gathered on rank 0 to write concentration images.
+
+  It is only compiled in the MPI build (make 3layer-mpi, which
+  defines USE_MPI), and it is run with e.g.
+  mpirun -np 4 ./3layer-mpi \<input_file\> .
+
+ */
+
+#include "header.h"
+
+
+/**
+  \brief Exchanges the halo rows of the local concentration matrix
+  with the neighbouring ranks.
+
+  \param[in] nr Number of columns of concentration matrix (minus 1)
+  \param[in,out] c Local concentration matrix (rows lo to hi-1 of the grid)
+  \param[in] own0 Local index of the first row owned by this rank
+  \param[in] own1 Local index of one past the last row owned by this rank
+  \param[in] h Number of halo rows
+  \param[in] below Rank that owns the rows below (or MPI_PROC_NULL)
+  \param[in] above Rank that owns the rows above (or MPI_PROC_NULL)
+ */
+static void exchange_halo(int nr, double *c, int own0, int own1, int h, int below, int above)
+{
+	int count = h * (nr+1);
+	/* The halo rows only exist if there is a neighbour (otherwise 
+	   MPI_PROC_NULL makes the transfer a no-op) */
+	double *halo_below = (below != MPI_PROC_NULL) ? c + INDEX(own0-h,0) : c;
+	double *halo_above = (above != MPI_PROC_NULL) ? c + INDEX(own1,0) : c;
+
+	/* Lowest owned rows down, upper halo from above */
+	MPI_Sendrecv(c + INDEX(own0,0), count, MPI_DOUBLE, below, 0,
+		halo_above, count, MPI_DOUBLE, above, 0,
+		MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+	/* Highest owned rows up, lower halo from below */
+	MPI_Sendrecv(c + INDEX(own1-h,0), count, MPI_DOUBLE, above, 1,
+		halo_below, count, MPI_DOUBLE, below, 1,
+		MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+}
+
+
+/**
+  \brief Calculates the concentration as a function of space and
+  time with the rows divided among the MPI ranks and returns the
+  probe concentration as a function of time (on every rank); also
+  outputs the concentration as images (from rank 0) if that option
+  was chosen.
+
+  This function solves the same equations with the same explicit
+  scheme as calc_diffusion_curve_layer(). Rank \f$ q \f$ of
+  \f$ P \f$ owns rows \f$ q n_z / P \f$ to
+  \f$ (q+1) n_z / P - 1 \f$ and keeps a copy of the halo rows of
+  its neighbours, so a step costs one exchange of the halo rows
+  with each neighbour. The ghost rows of the z-mirror symmetry are
+  on rank 0. The homogeneous model (nolayer) is solved with 
+  convolve_rows(), which gives the same result as convolve3() to 
+  within rounding errors.
+
+  \param[in] nt Number of support points in time
+  \param[in] nz Number of rows of concentration matrix
+  \param[in] nr Number of columns of concentration matrix
+  \param[in] iprobe z-index of probe location
+  \param[in] jprobe r-index of probe location
+  \param[in] layers Layer table (z-positions on the grid of the model)
+  \param[in] stencil Order of the spatial discretization (2 or 4)
+  \param[in] zmirror Number of ghost rows below the source row for z-mirror symmetry (0 = none)
+  \param[in] exp_clearance Flag for exact integration of the source and clearance
+  \param[in] dt Spacing in time (\f$ t_{i+1} = t_i + \Delta t \f$)
+  \param[in] dr Spacing in r (in this program, \f$ \Delta z = \Delta r \f$)
+  \param[in] sdelay Source delay (time before source starts)
+  \param[in] sduration Duration of source
+  \param[in] dfree Free diffusion coefficient
+  \param[in] t Time array
+  \param[in] s Source array (whole grid)
+  \param[in] invr Array for \f$ 1/r \f$ values
+  \param[in] imagebasename Basename of the concentration images
+  \param[in] image_spacing Time between the concentration images (< 0: no images)
+  \param[out] p Probe array (concentration as a function of time)
+ */
+void calc_diffusion_curve_layer_mpi(int nt, int nz, int nr, int iprobe, int jprobe, layer_table_struct_type *layers, int stencil, int zmirror, int exp_clearance, double dt, double dr, double sdelay, double sduration, double dfree, double *t, double *s, double *invr, char *imagebasename, double image_spacing, double *p)
+{
+	int i, j, k, n;
+	int rank, nranks;
+	int h = stencil / 2;	/* Number of halo rows */
+	int i0, i1;	/* Rows owned by this rank */
+	int lo, hi;	/* Rows of the local matrix (owned rows and halo) */
+	int ml;	/* Number of rows of the local matrix */
+	int own0, own1;	/* Local indices of the owned rows */
+	int below, above;	/* Neighbouring ranks */
+	int source_on;
+
+	/* Arrays internal to this function */
+	double *c;   	/* Local concentration */
+	double *dc;   	/* Local change in concentration */
+	double *sl;	/* Local source */
+	double *alpha_row;	/* alpha of each row (whole grid) */
+	double *dstar_row;	/* D* of each row */
+	double *kappa_row;	/* kappa of each row */
+	double *g;   	/* Conductance between adjacent rows */
+	double *scale1;	/* Scaling factors for convolve_rows() */
+	double *scale2;
+	double *scale_zm;
+	double *scale_zp;
+
+	/* For the exact integration of the source and clearance */
+	double *decay = NULL;
+	double *gain = NULL;
+
+	/* For the Michaelis-Menten uptake */
+	double *vmax_dt = NULL;
+	double *km_row = NULL;
+	int uptake = FALSE;
+
+	/* For optional output of concentration images (rank 0) */
+	int image_counter = 0;
+	float time;
+	double *call = NULL;	/* Concentration of the whole grid */
+	double *conc_out = NULL;
+	int *counts = NULL;	/* Number of elements owned by each rank */
+	int *displs = NULL;	/* Offset of the elements of each rank */
+
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+
+	/* Rows owned by this rank. Each rank needs at least 2h+1 rows,
+	   so that the halo comes from the neighbouring rank only and
+	   the z-mirror ghost rows are on rank 0. */
+	if (nz < nranks * (2*h + 1))
+		error("nz = %d is too small for %d MPI processes "
+			"(each needs at least %d rows)", nz, nranks, 2*h + 1);
+	i0 = (int) (((long) rank * nz) / nranks);
+	i1 = (int) (((long) (rank+1) * nz) / nranks);
+	lo = MAX(i0 - h, 0);
+	hi = MIN(i1 + h, nz);
+	ml = hi - lo;
+	own0 = i0 - lo;
+	own1 = i1 - lo;
+	below = (rank > 0) ? rank - 1 : MPI_PROC_NULL;
+	above = (rank < nranks-1) ? rank + 1 : MPI_PROC_NULL;
+
+	c = create_array(ml*(nr+1), "local concentration");
+	dc = create_array(ml*(nr+1), "local dc");
+	sl = s + lo*(nr+1);
+
+	alpha_row = create_array(nz, "alpha_row");
+	dstar_row = create_array(nz, "dstar_row");
+	kappa_row = create_array(nz, "kappa_row");
+	g = create_array(nz+1, "g");
+	scale1 = create_array(nz, "scale1");
+	scale2 = create_array(nz, "scale2");
+	scale_zm = create_array(nz, "scale_zm");
+	scale_zp = create_array(nz, "scale_zp");
+
+	/* Diffusion parameters of each row of the whole grid (the local
+	   matrix uses the rows lo to hi-1) */
+	calc_layer_rows(nz, dr, layers, dfree, alpha_row, dstar_row, kappa_row, g);
+
+	for (i=0; i<nz; i++) {
+		scale1[i] = dstar_row[i] * dt / SQR(dr);
+		scale2[i] = dstar_row[i] * dt / (2.0 * dr);
+		scale_zm[i] = g[i] * dt / (alpha_row[i] * SQR(dr));
+		scale_zp[i] = g[i+1] * dt / (alpha_row[i] * SQR(dr));
+	}
+
+	/* Decay and source gain over half a time-step for each row */
+	if (exp_clearance) {
+		decay = create_array(nz, "decay");
+		gain = create_array(nz, "gain");
+		for (i=0; i<nz; i++) {
+			decay[i] = exp(-0.5 * kappa_row[i] * dt);
+			gain[i] = (kappa_row[i] > 0.) ?
+				(1.0 - decay[i]) / (0.5 * kappa_row[i] * dt) : 1.0;
+		}
+	}
+
+	/* Uptake parameters of each row */
+	for (n=0; n<layers->n; n++)
+		if (layers->vmax[n] > 0.) uptake = TRUE;
+	if (uptake) {
+		vmax_dt = create_array(nz, "vmax_dt");
+		km_row = create_array(nz, "km_row");
+		calc_row_average(nz, dr, layers, layers->vmax, vmax_dt);
+		calc_row_average(nz, dr, layers, layers->km, km_row);
+		for (i=0; i<nz; i++)
+			vmax_dt[i] *= dt;
+	}
+
+	/* Initialize the concentration at t=0 (with exp_clearance,
+	   the source is added during the time-steps) */
+	for (i=0; i<ml*(nr+1); i++)
+		c[i] = exp_clearance ? 0. : sl[i];
+
+	/* Source delay: Concentration = 0 for sdelay seconds */
+	int nds = lround(sdelay/dt);
+	if (nds >= nt)
+		error("nds=%d, nt=%d. Delay start should be < total expt time",
+			nds, nt);
+	for (k=0; k<nt; k++)
+		p[k] = 0.0;
+
+	/* Optional concentration output images, gathered on rank 0 */
+	if (image_spacing > 0.) {
+		counts = malloc( sizeof(int) * nranks );
+		displs = malloc( sizeof(int) * nranks );
+		if ( (counts == NULL) || (displs == NULL) )
+			error("Cannot allocate memory for gathering the images");
+		for (n=0; n<nranks; n++) {
+			displs[n] = (int) (((long) n * nz) / nranks) * (nr+1);
+			counts[n] = (int) (((long) (n+1) * nz) / nranks) * (nr+1) - displs[n];
+		}
+		if (rank == 0) {
+			call = create_array(nz*(nr+1), "gathered concentration");
+			conc_out = create_array(nz*(2*nr-1), "output concentration");
+			start_conc_images(nz, nr, imagebasename);
+		}
+	}
+
+	/* Loop over time */
+	for (k=nds; k<nt; k++) {
+		if (image_spacing > 0.) {
+			time = (k - nds) * dt;	/* Time relative to start of source */
+			if (time >= image_counter * image_spacing) {
+				MPI_Gatherv(c + INDEX(own0,0), (own1 - own0)*(nr+1), MPI_DOUBLE,
+					call, counts, displs, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+				if (rank == 0)
+					write_conc_image(nz, nr, call, conc_out,
+						imagebasename, image_counter, time);
+				image_counter++ ;
+			}
+		}
+
+		if ( (iprobe >= i0) && (iprobe < i1) )
+			p[k] = c[INDEX(iprobe-lo,jprobe)];	/* record c at time t[k] */
+
+		source_on = (t[k] + dt/2.0 < sdelay + sduration);
+
+		/* First half of the source and clearance */
+		if (exp_clearance)
+			reaction_half_step(ml, nr, c, sl, source_on, decay + lo, gain + lo);
+
+		/* Halo rows from the neighbours, then the delta-c matrix
+		   (which is only correct in the owned rows) */
+		exchange_halo(nr, c, own0, own1, h, below, above);
+		laplacian_rows(stencil, ml, nr+1, c, scale1 + lo, scale2 + lo,
+			scale_zm + lo, scale_zp + lo, invr, dc);
+
+		/* Update the concentration matrix */
+		if (uptake)
+			update_with_uptake(ml, nr, c, dc, vmax_dt + lo, km_row + lo);
+		else
+			for (i=0; i<ml*(nr+1); i++)
+				c[i] += dc[i];
+
+		if (exp_clearance) {
+			/* Second half of the source and clearance */
+			reaction_half_step(ml, nr, c, sl, source_on, decay + lo, gain + lo);
+		} else {
+			if (source_on)
+				for (i=0; i<ml*(nr+1); i++)
+					c[i] += sl[i];
+			for (i=0; i<ml; i++)
+				for (j=0; j<nr+1; j++)
+					c[INDEX(i,j)] *= (1. - kappa_row[lo+i] * dt);
+		}
+
+		/* Set the i=0 row to be the same as the i=2 row
+		   (symmetry about r=0 (i=1)) */
+		for (i=0; i<ml; i++)
+			c[INDEX(i,0)] = c[INDEX(i,2)];
+
+		/* Set the ghost rows below the source row to their mirror
+		   images (z-mirror symmetry; they are on rank 0) */
+		if (rank == 0)
+			for (i=1; i<=zmirror; i++)
+				for (j=0; j<nr+1; j++)
+					c[INDEX(zmirror-i,j)] = c[INDEX(zmirror+i,j)];
+
+	} /* End of k for loop */
+
+	/* Probe trace on all ranks (only the owner of the probe row
+	   has nonzero values) */
+	MPI_Allreduce(MPI_IN_PLACE, p, nt, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+
+	/* Deallocate arrays */
+	free(c);
+	free(dc);
+	free(alpha_row);
+	free(dstar_row);
+	free(kappa_row);
+	free(g);
+	free(scale1);
+	free(scale2);
+	free(scale_zm);
+	free(scale_zp);
+	if (exp_clearance) {
+		free(decay);
+		free(gain);
+	}
+	if (uptake) {
+		free(vmax_dt);
+		free(km_row);
+	}
+	if (image_spacing > 0.) {
+		free(counts);
+		free(displs);
+		if (rank == 0) {
+			free(call);
+			free(conc_out);
+		}
+	}
+
+	return;
+}
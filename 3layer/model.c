@@ -23,6 +23,218 @@
 
 #include "header.h"
 
+/**
+  \brief Applies convolve_rows() or convolve_rows4(), depending on 
+  the order of the spatial discretization.
+ */
+void laplacian_rows(int stencil, int M, int N, double *a, double *scale1, double *scale2, double *scale_zm, double *scale_zp, double *invr, double *out)
+{
+	if (stencil == 4)
+		convolve_rows4(M, N, a, scale1, scale_zm, scale_zp, out);
+	else
+		convolve_rows(M, N, a, scale1, scale2, scale_zm, scale_zp, invr, out);
+}
+
+
+/**
+  \brief Integrates the source and the nonspecific clearance 
+  exactly over half a time-step.
+
+  In each cell, \f$ dc/dt = s/\Delta t - \kappa c \f$ over 
+  \f$ h = \Delta t/2 \f$ gives
+
+\f[
+c \leftarrow e^{-\kappa h} c + \frac{1 - e^{-\kappa h}}{\kappa h} \frac{s}{2}
+\quad .
+\f]
+
+  \param[in] nz Number of rows of concentration matrix
+  \param[in] nr Number of columns of concentration matrix
+  \param[in,out] c Concentration matrix
+  \param[in] s Source array (amount added per full time-step)
+  \param[in] source_on Flag for whether the source is on
+  \param[in] decay \f$ e^{-\kappa h} \f$ for each row
+  \param[in] gain \f$ (1 - e^{-\kappa h})/(\kappa h) \f$ for each row
+ */
+void reaction_half_step(int nz, int nr, double *c, double *s, int source_on, double *decay, double *gain)
+{
+	int i, j;
+
+	for (i=0; i<nz; i++) {
+		for (j=0; j<nr+1; j++) {
+			c[INDEX(i,j)] *= decay[i];
+			if (source_on)
+				c[INDEX(i,j)] += 0.5 * gain[i] * s[INDEX(i,j)];
+		}
+	}
+}
+
+
+/**
+  \brief Adds the delta-c matrix to the concentration matrix and 
+  applies the Michaelis-Menten uptake in the same pass.
+
+  The uptake \f$ V_{max} c / (K_m + c) \f$ is linearized about the 
+  old concentration and treated implicitly,
+
+\f[
+c \leftarrow \frac{c + \Delta c}{1 + V_{max} \Delta t / (K_m + c)}
+  = \frac{(c + \Delta c)(K_m + c)}{K_m + c + V_{max} \Delta t}
+\quad ,
+\f]
+
+  which keeps the concentration positive for any time-step. The 
+  parameters are constant along a row, so the inner loop has no 
+  branches and can be vectorized by the compiler.
+
+  \param[in] nz Number of rows of concentration matrix
+  \param[in] nr Number of columns of concentration matrix
+  \param[in,out] c Concentration matrix
+  \param[in] dc Delta-c matrix
+  \param[in] vmax_dt \f$ V_{max} \Delta t \f$ for each row
+  \param[in] km_row \f$ K_m \f$ for each row
+ */
+void update_with_uptake(int nz, int nr, double *c, double *dc, double *vmax_dt, double *km_row)
+{
+	int i, j;
+	double v, km, old;
+	double *ci, *dci;
+
+	for (i=0; i<nz; i++) {
+		v = vmax_dt[i];
+		km = km_row[i];
+		ci = c + INDEX(i,0);
+		dci = dc + INDEX(i,0);
+		for (j=0; j<nr+1; j++) {
+			old = ci[j];
+			ci[j] = (old + dci[j]) * (km + old) / (km + old + v);
+		}
+	}
+}
+
+
+/**
+  \brief Creates the image info file of the concentration images 
+  and writes the image dimensions to it.
+
+  \param[in] nz Number of rows of concentration matrix
+  \param[in] nr Number of columns of concentration matrix
+  \param[in] imagebasename Basename of the image files
+ */
+void start_conc_images(int nz, int nr, char *imagebasename)
+{
+	char infofilename[FILENAME_MAX];	/* Name of image info file */
+	memset(infofilename, '\0', FILENAME_MAX);
+	FILE *info_file_ptr = NULL;		/* File pointer for image info file */
+
+	/* Generate the filename of the image info output file */
+	snprintf(infofilename, sizeof(infofilename), 
+		"%s.info.txt", imagebasename);
+
+	/* Write image information to file */
+	if ((info_file_ptr = fopen(infofilename,"w")) == NULL) 
+		error("Error opening image info output file %s\n",
+			infofilename);
+
+	fprintf(info_file_ptr, "Information about the images:\n"
+		"\tImage dimensions: %d x %d\n"
+		"\tPixels are 64-bit floating point (doubles)\n",
+		(2*nr-1), nz);
+
+	fclose(info_file_ptr);
+}
+
+
+/**
+  \brief Writes the concentration matrix as a concentration image 
+  with -rmax < r < rmax and adds the image to the image info file.
+
+  \param[in] nz Number of rows of concentration matrix
+  \param[in] nr Number of columns of concentration matrix
+  \param[in] c Concentration matrix
+  \param[in] conc_out Work array for the image (nz*(2*nr-1) elements)
+  \param[in] imagebasename Basename of the image files
+  \param[in] image_counter Number of the image
+  \param[in] time Time relative to the start of the source
+ */
+void write_conc_image(int nz, int nr, double *c, double *conc_out, char *imagebasename, int image_counter, float time)
+{
+	int i, j;
+	double conc;
+	double conc_min;
+	double conc_max;
+	char imagefilename[FILENAME_MAX];	/* Name of output image file */
+	memset(imagefilename, '\0', FILENAME_MAX);
+	FILE *image_file_ptr = NULL;		/* File pointer for images */
+	char timestring[20];
+	memset(timestring, '\0', 20);
+	char infofilename[FILENAME_MAX];	/* Name of image info file */
+	memset(infofilename, '\0', FILENAME_MAX);
+	FILE *info_file_ptr = NULL;		/* File pointer for image info file */
+
+	/* Create a string with the time in ms */
+	snprintf(timestring, sizeof(timestring), "%ld", 
+		(lround) (time * 1000.));
+	/* Generate the filename, including the time string */
+	snprintf(imagefilename, sizeof(imagefilename), 
+		"%s.%sms.raw", imagebasename, timestring);
+
+	/* Write the concentration image (binary, double prec.) */
+	if ((image_file_ptr = fopen(imagefilename,"w")) == NULL) 
+		error("Error opening concentration image file %s\n",
+			imagefilename);
+
+	/* The concentrations are in the c array, which is in 
+	   cylindrical coordinates with 0 < r < rmax (roughly). 
+	   Copy them to the conc_out array for writing images. 
+	   The conc_out array has -rmax < r < rmax. Since the 
+	   source is on the z-axis, images are symmetric L-R. 
+	   Find and print out the min and max pixel values. */
+	conc_max = c[0];
+	conc_min = c[0];
+	for (j=0; j<nr+1; j++) {
+		for (i=0; i<nz; i++) {
+			conc = c[INDEX(i,j)];
+			conc_min = MIN(conc,conc_min);
+			conc_max = MAX(conc,conc_max);
+			conc_out[INDEX_FULL_P(i,j)] = conc;
+			conc_out[INDEX_FULL_N(i,j)] = conc;
+		}
+	}
+
+	/* Write concentration image to file. 
+	   If the number of items written is 0, warn the user; 
+	   don't abort, because the normal output file might 
+	   still get written.  (For example, the user might 
+	   have specified that the images get written to 
+	   some location that the program can't write to 
+	   because of space limitations; the normal output 
+	   file might fit or might be going somewhere else.) */
+	if (fwrite(conc_out, sizeof(double), nz*(2*nr-1), 
+	           image_file_ptr) == 0) {
+		printf("3layer: WARNING: Output image file %s "
+				"not written\n", imagefilename);
+	}
+
+	fclose(image_file_ptr);
+
+	/* Generate the filename of the image info output file */
+	snprintf(infofilename, sizeof(infofilename), 
+		"%s.info.txt", imagebasename);
+
+	/* Write image information to file */
+	if ((info_file_ptr = fopen(infofilename,"a")) == NULL) 
+		error("Error opening image info output file %s\n",
+			infofilename);
+
+	fprintf(info_file_ptr, 
+		"Image file #%d: %s: max = %lf, min = %lf\n", 
+		image_counter, imagefilename, conc_max, conc_min);
+
+	fclose(info_file_ptr);
+}
+
+
 /**
   \brief Calculates the concentration as a function of space and 
   time and returns the probe concentration as a function of time; 
@@ -67,76 +279,101 @@ where
 
 	\f$ \kappa_k \f$ = nonspecific clearance factor in layer \f$ k \f$
 
-This function calls convolve3() to compute the Laplacian in cylindrical 
-coordinates.
+The layers are given by the layer table (the SR, SP, and SO layers, 
+or the layers the user specified). This function calls 
+calc_layer_rows() to get the diffusion parameters 
+of each row of the concentration matrix, and it calls convolve_rows() 
+(or convolve_rows4() for the fourth-order stencil, or convolve3() for 
+the 1-layer model) to compute the Laplacian in 
+cylindrical coordinates. The layer boundaries do not have to fall 
+midway between grid points, and since the kernels only use the 
+per-row coefficients, the cost of a time-step does not depend on 
+the number of layers.
+
+If exp_clearance is TRUE, the source and the clearance are 
+integrated exactly (see reaction_half_step()) over half a time-step 
+before and after the diffusion step (Strang splitting). Otherwise 
+the source is added after the diffusion step and the concentration 
+is multiplied by \f$ 1 - \kappa \Delta t \f$ , which is only 
+accurate for \f$ \kappa \Delta t \ll 1 \f$ .
+
+A layer can be anisotropic, with a permeability \f$ \theta_k \f$ 
+for the radial diffusion (within the layer) and an axial permeability 
+\f$ \theta_{z,k} \f$ for the diffusion across the layer, which 
+is also used for the interfaces between layers (see calc_layer_rows()). 
+The kernels already have separate coefficients for the radial and 
+the axial terms, so this needs no extra passes.
+
+If any layer has \f$ V_{max} > 0 \f$ , there is also a 
+saturable (Michaelis-Menten) uptake 
+\f$ V_{max,k} c_k / (K_{m,k} + c_k) \f$ in each layer, which is 
+applied together with the update of the concentration matrix 
+(see update_with_uptake()).
+
+If zmirror > 0, the problem is symmetric about the plane of the 
+source, which is in row zmirror, and the rows below it are ghost 
+rows: after each time-step they are set to their mirror images 
+above the source row, so the grid only has to cover the upper half 
+of the cylinder.
+
+The concentration is recorded at nprobes probe locations (e.g. the 
+candidate source positions of the reciprocal mode of 3layer).
 
   \param[in] nt Number of support points in time
   \param[in] nz Number of rows of concentration matrix
   \param[in] nr Number of columns of concentration matrix
-  \param[in] iprobe z-index of probe location
-  \param[in] jprobe r-index of probe location 
-  \param[in] iz1 z-index of SR-SP boundary
-  \param[in] iz2 z-index of SP-SO boundary
-  \param[in] nolayer Flag for whether to model a single homogeneous environment (true) or to model a 3-layer environment
+  \param[in] nprobes Number of probes
+  \param[in] iprobe z-indices of probe locations
+  \param[in] jprobe r-indices of probe locations 
+  \param[in] layers Layer table (z-positions on the grid of the model)
+  \param[in] nolayer Flag for whether to model a single homogeneous environment (true) or to model the layers of the layer table
+  \param[in] stencil Order of the spatial discretization (2 or 4)
+  \param[in] zmirror Number of ghost rows below the source row for z-mirror symmetry (0 = none)
+  \param[in] exp_clearance Flag for exact integration of the source and clearance
   \param[in] dt Spacing in time (\f$ t_{i+1} = t_i + \Delta t \f$)
   \param[in] dr Spacing in r (in this program, \f$ \Delta z = \Delta r \f$)
   \param[in] sdelay Source delay (time before source starts)
   \param[in] sduration Duration of source
-  \param[in] alpha_so Extracellular volume fraction in SO layer
-  \param[in] theta_so Permeability in SO layer
-  \param[in] kappa_so Nonspecific clearance factor in SO layer
-  \param[in] alpha_sp Extracellular volume fraction in SP layer
-  \param[in] theta_sp Permeability in SP layer
-  \param[in] kappa_sp Nonspecific clearance factor in SP layer
-  \param[in] alpha_sr Extracellular volume fraction in SR layer
-  \param[in] theta_sr Permeability in SR layer
-  \param[in] kappa_sr Nonspecific clearance factor in SR layer
   \param[in] dfree Free diffusion coefficient
   \param[in] t Time array 
   \param[in] s Source array
   \param[in] invr Array for \f$ 1/r \f$ values
-  \param[out] p Probe array (concentration as a function of time)
+  \param[out] p Probe array (concentration as a function of time; p[n*nt+k] for probe n)
  */
 
-void calc_diffusion_curve_layer(int nt, int nz, int nr, int iprobe, int jprobe, int iz1, int iz2, int nolayer, double dt, double dr, double sdelay, double sduration, double alpha_so, double theta_so, double kappa_so, double alpha_sp, double theta_sp, double kappa_sp, double alpha_sr, double theta_sr, double kappa_sr, double dfree, double *t, double *s, double *invr, char *imagebasename, double image_spacing, double *p)
+void calc_diffusion_curve_layer(int nt, int nz, int nr, int nprobes, int *iprobe, int *jprobe, layer_table_struct_type *layers, int nolayer, int stencil, int zmirror, int exp_clearance, double dt, double dr, double sdelay, double sduration, double dfree, double *t, double *s, double *invr, char *imagebasename, double image_spacing, double *p)
 {
-	int i, j, k;
-	double dstar_so = theta_so * dfree;
-	double dstar_sp = theta_sp * dfree;
-	double dstar_sr = theta_sr * dfree;
-	double const_so1 = dstar_so * dt / SQR(dr);
-	double const_so2 = dstar_so * dt / (2.0 * dr);
-	double const_sp1 = dstar_sp * dt / SQR(dr);
-	double const_sp2 = dstar_sp * dt / (2.0 * dr);
+	int i, j, k, l;
+	double dstar_sr = layers->theta[0] * dfree;	/* Bottom layer (the only layer for nolayer) */
 	double const_sr1 = dstar_sr * dt / SQR(dr);
 	double const_sr2 = dstar_sr * dt / (2.0 * dr);
 
 	/* Arrays internal to this function */
 	double *c;   	/* concentration */
-	double *c_sr;	/* concentration (SR layer) */
-	double *c_sp;  	/* concentration (SP layer)*/
-	double *c_so;	/* concentration (SO layer)*/
-	double *cb_sr;	/* Average of rows at SR layer boundary */
-	double *cb_so;	/* Average of rows at SO layer boundary */
 	double *dc;   	/* Change in concentration */
-	double *dc_sr; 
-	double *dc_sp; 
-	double *dc_so;
+	double *alpha_row;	/* alpha of each row */
+	double *dstar_row;	/* D* of each row */
+	double *kappa_row;	/* kappa of each row */
+	double *g;   	/* Conductance between adjacent rows */
+	double *scale1;	/* Scaling factors for convolve_rows() */
+	double *scale2;
+	double *scale_zm;
+	double *scale_zp;
+
+	/* For the exact integration of the source and clearance */
+	double *decay = NULL;
+	double *gain = NULL;
+	int source_on;
+
+	/* For the Michaelis-Menten uptake */
+	double *vmax_dt = NULL;	/* Vmax * dt of each row */
+	double *km_row = NULL;	/* Km of each row */
+	int uptake = FALSE;
+	int n;
 
 	/* For optional output of concentration images */
-	double conc;
-	double conc_min;
-	double conc_max;
 	int image_counter;           		/* Count of image to output */
 	float time;                 		/* Time rel. to start of source */
-	char imagefilename[FILENAME_MAX];	/* Name of output image file */
-	memset(imagefilename, '\0', FILENAME_MAX);
-	FILE *image_file_ptr = NULL;		/* File pointer for images */
-	char timestring[20];
-	memset(timestring, '\0', 20);
-	char infofilename[FILENAME_MAX];	/* Name of image info file */
-	memset(infofilename, '\0', FILENAME_MAX);
-	FILE *info_file_ptr = NULL;		/* File pointer for image info file */
 	double *conc_out = NULL;     	/* Concentration image to output */
 
 	/* Arrays for concentrations
@@ -148,29 +385,62 @@ void calc_diffusion_curve_layer(int nt, int nz, int nr, int iprobe, int jprobe,
 	/* Arrays for concentration changes (d*) and for layers */
 	dc = create_array(nz*(nr+1), "dc");
 
-	cb_sr = create_array(nr+1, "cb_sr");
-	cb_so = create_array(nr+1, "cb_so");
-
-	c_sr = create_array((iz1+2)*(nr+1), "c_sr");
-	dc_sr = create_array((iz1+2)*(nr+1), "dc_sr");
+	alpha_row = create_array(nz, "alpha_row");
+	dstar_row = create_array(nz, "dstar_row");
+	kappa_row = create_array(nz, "kappa_row");
+	g = create_array(nz+1, "g");
+	scale1 = create_array(nz, "scale1");
+	scale2 = create_array(nz, "scale2");
+	scale_zm = create_array(nz, "scale_zm");
+	scale_zp = create_array(nz, "scale_zp");
+
+	/* Diffusion parameters of each row, including rows that 
+	   contain a layer boundary */
+	calc_layer_rows(nz, dr, layers, dfree, alpha_row, dstar_row, kappa_row, g);
+
+	for (i=0; i<nz; i++) {
+		scale1[i] = dstar_row[i] * dt / SQR(dr);
+		scale2[i] = dstar_row[i] * dt / (2.0 * dr);
+		scale_zm[i] = g[i] * dt / (alpha_row[i] * SQR(dr));
+		scale_zp[i] = g[i+1] * dt / (alpha_row[i] * SQR(dr));
+	}
 
-	c_sp = create_array((iz2-iz1+2)*(nr+1), "c_sp");
-	dc_sp = create_array((iz2-iz1+2)*(nr+1), "dc_sp");
+	/* Decay and source gain over half a time-step for each row */
+	if (exp_clearance) {
+		decay = create_array(nz, "decay");
+		gain = create_array(nz, "gain");
+		for (i=0; i<nz; i++) {
+			decay[i] = exp(-0.5 * kappa_row[i] * dt);
+			gain[i] = (kappa_row[i] > 0.) ? 
+				(1.0 - decay[i]) / (0.5 * kappa_row[i] * dt) : 1.0;
+		}
+	}
 
-	c_so = create_array((nz-iz2)*(nr+1), "c_so");
-	dc_so = create_array((nz-iz2)*(nr+1), "dc_so");
+	/* Uptake parameters of each row */
+	for (n=0; n<layers->n; n++)
+		if (layers->vmax[n] > 0.) uptake = TRUE;
+	if (uptake) {
+		vmax_dt = create_array(nz, "vmax_dt");
+		km_row = create_array(nz, "km_row");
+		calc_row_average(nz, dr, layers, layers->vmax, vmax_dt);
+		calc_row_average(nz, dr, layers, layers->km, km_row);
+		for (i=0; i<nz; i++)
+			vmax_dt[i] *= dt;
+	}
 
-	/* Initialize the concentration at t=0 */
+	/* Initialize the concentration at t=0 (with exp_clearance, 
+	   the source is added during the time-steps) */
 	for (i=0; i<nz*(nr+1); i++)
-		c[i] = s[i];
+		c[i] = exp_clearance ? 0. : s[i];
 
 	/* Source delay: Concentration = 0 for sdelay seconds */
 	int nds = lround(sdelay/dt);
 	if (nds >= nt)
 		error("nds=%d, nt=%d. Delay start should be < total expt time", 
 			nds, nt);
-	for (k=0; k<nds; k++) 
-		p[k] = 0.0;
+	for (l=0; l<nprobes; l++) 
+		for (k=0; k<nds; k++) 
+			p[l*nt+k] = 0.0;
 
 	/* Optional concentration output images */
 	image_counter = 0;         	/* Initialize counter */
@@ -179,21 +449,7 @@ void calc_diffusion_curve_layer(int nt, int nz, int nr, int iprobe, int jprobe,
 		for (i=0; i<nz*(2*nr-1); i++)
 			conc_out[i] = 0.;
 
-		/* Generate the filename of the image info output file */
-		snprintf(infofilename, sizeof(infofilename), 
-			"%s.info.txt", imagebasename);
-
-		/* Write image information to file */
-		if ((info_file_ptr = fopen(infofilename,"w")) == NULL) 
-			error("Error opening image info output file %s\n",
-				infofilename);
-
-		fprintf(info_file_ptr, "Information about the images:\n"
-			"\tImage dimensions: %d x %d\n"
-			"\tPixels are 64-bit floating point (doubles)\n",
-			(2*nr-1), nz);
-
-		fclose(info_file_ptr);
+		start_conc_images(nz, nr, imagebasename);
 	}
 
 	/* Loop over time */
@@ -202,157 +458,79 @@ void calc_diffusion_curve_layer(int nt, int nz, int nr, int iprobe, int jprobe,
 			time = (k - nds) * dt;	/* Time relative to start of source */
 			/* If it's time to output the next image, do it */
 			if (time >= image_counter * image_spacing) {
-				/* Create a string with the time in ms */
-				snprintf(timestring, sizeof(timestring), "%ld", 
-					(lround) (time * 1000.));
-				/* Generate the filename, including the time string */
-				snprintf(imagefilename, sizeof(imagefilename), 
-					"%s.%sms.raw", imagebasename, timestring);
-
-				/* Write the concentration image (binary, double prec.) */
-				if ((image_file_ptr = fopen(imagefilename,"w")) == NULL) 
-					error("Error opening concentration image file %s\n",
-						imagefilename);
-
-				/* The concentrations are in the c array, which is in 
-				   cylindrical coordinates with 0 < r < rmax (roughly). 
-				   Copy them to the conc_out array for writing images. 
-				   The conc_out array has -rmax < r < rmax. Since the 
-				   source is on the z-axis, images are symmetric L-R. 
-				   Find and print out the min and max pixel values. */
-				conc_max = c[0];
-				conc_min = c[0];
-				for (j=0; j<nr+1; j++) {
-					for (i=0; i<nz; i++) {
-						conc = c[INDEX(i,j)];
-						conc_min = MIN(conc,conc_min);
-						conc_max = MAX(conc,conc_max);
-						conc_out[INDEX_FULL_P(i,j)] = c[INDEX(i,j)];
-						conc_out[INDEX_FULL_N(i,j)] = c[INDEX(i,j)];
-					}
-				}
-
-				/* Write concentration image to file. 
-				   If the number of items written is 0, warn the user; 
-				   don't abort, because the normal output file might 
-				   still get written.  (For example, the user might 
-				   have specified that the images get written to 
-				   some location that the program can't write to 
-				   because of space limitations; the normal output 
-				   file might fit or might be going somewhere else.) */
-				if (fwrite(conc_out, sizeof(double), nz*(2*nr-1), 
-				           image_file_ptr) == 0) {
-					printf("3layer: WARNING: Output image file %s "
-							"not written\n", imagefilename);
-				}
-
-				fclose(image_file_ptr);
-
-				/* Generate the filename of the image info output file */
-				snprintf(infofilename, sizeof(infofilename), 
-					"%s.info.txt", imagebasename);
-
-				/* Write image information to file */
-				if ((info_file_ptr = fopen(infofilename,"a")) == NULL) 
-					error("Error opening image info output file %s\n",
-						infofilename);
-
-				fprintf(info_file_ptr, 
-					"Image file #%d: %s: max = %lf, min = %lf\n", 
-					image_counter, imagefilename, conc_max, conc_min);
-
-				fclose(info_file_ptr);
-
+				write_conc_image(nz, nr, c, conc_out, 
+					imagebasename, image_counter, time);
 				image_counter++ ;
 			}
 		}
 
-		p[k] = c[INDEX(iprobe,jprobe)];    	/* record c at time t[k] */
-
-		/* Calculate c at time t[k+1] = t[k] + dt */
-		if (nolayer == FALSE) {	/* 3-layer model */
-			/*
-			 * The SR/SP/SO arrays extend in z one more row 
-			 * to include extrapolated boundary values (the true 
-			 * boundary is right in the middle of node positions)
-			 */
-			for (j=0; j<nr+1; j++) {
-				cb_sr[j] = (   dstar_sr * alpha_sr * c[INDEX(iz1,j)] 
-				             + dstar_sp * alpha_sp * c[INDEX(iz1+1,j)]   )
-				           / ( dstar_sr * alpha_sr + dstar_sp * alpha_sp );
-
-				cb_so[j] = (   dstar_sp * alpha_sp * c[INDEX(iz2,j)] 
-				             + dstar_so * alpha_so * c[INDEX(iz2+1,j)]   )
-				           / ( dstar_sp * alpha_sp + dstar_so * alpha_so );
-			}
-
-			for (j=0; j<nr+1; j++) {
-				for (i=0; i<iz1+1; i++) 
-					c_sr[INDEX(i,j)] = c[INDEX(i,j)];
-				c_sr[INDEX(iz1+1,j)] = 2.0 * cb_sr[j] - c[INDEX(iz1,j)];
-
-				c_sp[INDEX(0,j)] = 2.0 * cb_sr[j] - c[INDEX(iz1+1,j)];
-				for (i=iz1+1; i<iz2+1; i++) 
-					c_sp[INDEX(i-iz1,j)] = c[INDEX(i,j)];
-				c_sp[INDEX(iz2-iz1+1,j)] = 2.0 * cb_so[j] - c[INDEX(iz2,j)];
+		for (l=0; l<nprobes; l++) {
+			/* record c at time t[k] */
+			p[l*nt+k] = c[INDEX(iprobe[l],jprobe[l])];
+		}
 
-				c_so[INDEX(0,j)] = 2.0 * cb_so[j] - c[INDEX(iz2+1,j)];
-				for (i=iz2+1; i<nz; i++) 
-					c_so[INDEX(i-iz2,j)] = c[INDEX(i,j)];
-			}
+		/* The source is on for this time-step */
+		source_on = (t[k] + dt/2.0 < sdelay + sduration);
 
-			/* Calculate the delta-c matrices */
-		    convolve3(iz1+2, nr+1, c_sr, const_sr1, const_sr2, invr, dc_sr);
+		/* First half of the source and clearance */
+		if (exp_clearance)
+			reaction_half_step(nz, nr, c, s, source_on, decay, gain);
 
-		    convolve3(iz2-iz1+2, nr+1, c_sp, const_sp1, const_sp2, invr, 
-			                                                     dc_sp);
-		    convolve3(nz-iz2, nr+1, c_so, const_so1, const_so2, invr, dc_so);
+		/* Calculate c at time t[k+1] = t[k] + dt */
+		if (nolayer == FALSE) {	/* 3-layer model */
+			/* Calculate the delta-c matrix */
+			laplacian_rows(stencil, nz, nr+1, c, 
+				scale1, scale2, scale_zm, scale_zp, invr, dc);
 
 			/* Update the concentration matrix */
-			for (j=0; j<nr+1; j++) {
-				for (i=0; i<iz1+1; i++) 
-					c[INDEX(i,j)] = c_sr[INDEX(i,j)] 
-					             + dc_sr[INDEX(i,j)];
-
-				for (i=iz1+1; i<iz2+1; i++) 
-					c[INDEX(i,j)] = c_sp[INDEX(i-iz1,j)] 
-					             + dc_sp[INDEX(i-iz1,j)];
-
-				for (i=iz2+1; i<nz; i++) 
-					c[INDEX(i,j)] = c_so[INDEX(i-iz2,j)]
-					             + dc_so[INDEX(i-iz2,j)];
-			}
+			if (uptake)
+				update_with_uptake(nz, nr, c, dc, vmax_dt, km_row);
+			else
+				for (i=0; i<nz*(nr+1); i++)
+					c[i] += dc[i];
 
 		} else {	/* 1-layer model */
 			/* Print a warning to the user */
 			if (k==0) printf("\nNOTE: nolayer = %d, "
 							"so using the 1 layer model\n\n", nolayer);
 
-			/* Calculate the delta-c matrix */
-		    convolve3(nz, nr+1, c, const_sr1, const_sr2, invr, dc);
+			/* Calculate the delta-c matrix (all rows have the SR 
+			   coefficients, so convolve_rows4() gives the 
+			   homogeneous fourth-order result; convolve3() has the 
+			   same coefficient in r and z, so an anisotropic layer 
+			   needs convolve_rows()) */
+			if (stencil == 4)
+				convolve_rows4(nz, nr+1, c, scale1, scale_zm, scale_zp, dc);
+			else if (IS_ZERO(layers->theta_z[0] - layers->theta[0]))
+				convolve3(nz, nr+1, c, const_sr1, const_sr2, invr, dc);
+			else
+				convolve_rows(nz, nr+1, c, scale1, scale2, scale_zm, scale_zp, invr, dc);
 
 			/* Update the concentration matrix */
-			for (i=0; i<nz*(nr+1); i++)
-				c[i] += dc[i];
+			if (uptake)
+				update_with_uptake(nz, nr, c, dc, vmax_dt, km_row);
+			else
+				for (i=0; i<nz*(nr+1); i++)
+					c[i] += dc[i];
 
 		}
 
 
-		/* If t < sduration, the source gets added to the 
-		   concentration matrix for the next time-step */
-		if (t[k] + dt/2.0 < sdelay + sduration) {
-			for (i=0; i<nz*(nr+1); i++)
-				c[i] += s[i];
-		} 
-
-		/* Model the non-specific clearance */
-		for (j=0; j<nr+1; j++) {
-			for (i=0; i<iz1+1; i++) 
-				c[INDEX(i,j)] *= (1. - kappa_sr * dt);
-			for (i=iz1+1; i<iz2+1; i++) 
-				c[INDEX(i,j)] *= (1. - kappa_sp * dt);
-			for (i=iz2+1; i<nz; i++) 
-				c[INDEX(i,j)] *= (1. - kappa_so * dt);
+		if (exp_clearance) {
+			/* Second half of the source and clearance */
+			reaction_half_step(nz, nr, c, s, source_on, decay, gain);
+		} else {
+			/* If t < sduration, the source gets added to the 
+			   concentration matrix for the next time-step */
+			if (source_on) {
+				for (i=0; i<nz*(nr+1); i++)
+					c[i] += s[i];
+			} 
+
+			/* Model the non-specific clearance */
+			for (i=0; i<nz; i++) 
+				for (j=0; j<nr+1; j++) 
+					c[INDEX(i,j)] *= (1. - kappa_row[i] * dt);
 		}
 
 		/* Set the i=0 row to be the same as the i=2 row 
@@ -360,22 +538,35 @@ void calc_diffusion_curve_layer(int nt, int nz, int nr, int iprobe, int jprobe,
 		for (i=0; i<nz; i++)
 			c[INDEX(i,0)] = c[INDEX(i,2)];
 
+		/* Set the ghost rows below the source row to their mirror 
+		   images (z-mirror symmetry) */
+		for (i=1; i<=zmirror; i++)
+			for (j=0; j<nr+1; j++)
+				c[INDEX(zmirror-i,j)] = c[INDEX(zmirror+i,j)];
+
 	} /* End of k for loop */
 
 
 	/* Deallocate arrays */
 	free(c);
 	free(dc);
-	free(cb_sr);
-	free(cb_so);
-	free(c_sr);
-	free(c_sp);
-	free(c_so);
-	free(dc_sr);
-	free(dc_sp);
-	free(dc_so);
+	free(alpha_row);
+	free(dstar_row);
+	free(kappa_row);
+	free(g);
+	free(scale1);
+	free(scale2);
+	free(scale_zm);
+	free(scale_zp);
 	if (image_spacing > 0.) 
 		free(conc_out);
-
+	if (exp_clearance) {
+		free(decay);
+		free(gain);
+	}
+	if (uptake) {
+		free(vmax_dt);
+		free(km_row);
+	}
 	return;
 }
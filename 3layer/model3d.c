@@ -0,0 +1,283 @@
+/**
+  \file 3layer/model3d.c
+
+  Function for solving the forward problem on a 3D Cartesian grid.
+
+  The 2D solver in model.c uses cylindrical coordinates, so a
+  source that is not on the z-axis is a ring of source around the
+  axis rather than a point source. This file has a solver for the
+  same layered cylinder on a 3D Cartesian grid, which is used when
+  there are sources off the z-axis. It uses the same layer table,
+  source, and probe conventions as the 2D solver: the layers are
+  horizontal, the z-axis goes through the (main) source, and
+  the concentration is 0 outside of the cylinder. The sources
+  and the probe are in the plane y = 0, with x taking the role
+  of r (so an additional source at r = sr is at x = sr, y = 0).
+
+  The grid has nz rows in z and (2*nr-1) points in x and y,
+  \f$ x = (j - nr + 1) \Delta r \f$ , which covers the same
+  range as the concentration images of the 2D solver. The
+  concentration array has a border of zeros on all sides, so
+  the inner loop of the update has no branches and can be
+  vectorized by the compiler. The rows in z are updated in
+  parallel with OpenMP if the program is compiled with it (the
+  number of threads is set with the OMP_NUM_THREADS environment
+  variable).
+
+ */
+
+#include "header.h"
+
+
+/**
+  \def INDEX3(i,j,l)
+  Computes the 1D index for the padded 3D concentration arrays,
+  given indices \a i (z index), \a j (x index), and \a l (y index),
+  which go from -1 to nz and -1 to nxy (the border is at -1 and at
+  nz or nxy). The index is a size_t, because the arrays can have 
+  more than INT_MAX elements.
+ */
+#define INDEX3(i,j,l) ((((size_t) (i)+1)*(nxy+2)+(j)+1)*(nxy+2)+(l)+1)
+
+
+/**
+  \brief Calculates the concentration as a function of space and
+  time on a 3D Cartesian grid and returns the probe concentration
+  as a function of time.
+
+  This function solves the same equations as
+  calc_diffusion_curve_layer(), with the Laplacian
+  computed with the 7-point stencil in Cartesian coordinates.
+  The diffusion parameters of each row come from
+  calc_layer_rows(), so the layer boundaries do not have to fall
+  midway between grid points. The Michaelis-Menten uptake (if
+  any layer has \f$ V_{max} > 0 \f$ ) is applied in the same pass
+  as the diffusion update, and if exp_clearance is TRUE the source
+  and the clearance are integrated exactly over half a time-step
+  before and after the diffusion step, as in the 2D solver.
+
+  The stability limit of the explicit time-step is the same as for
+  the second-order kernels of the 2D solver,
+  \f$ \Delta t \le \Delta r^2/(6 D^*) \f$ .
+
+  \param[in] nt Number of support points in time
+  \param[in] nz Number of rows in z
+  \param[in] nr Number of points in r of the 2D grid (the 3D grid has 2*nr-1 points in x and y)
+  \param[in] iprobe z-index of probe location
+  \param[in] xprobe x-index of probe location (y = 0)
+  \param[in] layers Layer table (z-positions on the grid of the model)
+  \param[in] exp_clearance Flag for exact integration of the source and clearance
+  \param[in] nsources Number of sources
+  \param[in] isources z-indices of the sources
+  \param[in] xsources x-indices of the sources (y = 0)
+  \param[in] samounts Amount added to the source cells per time-step (concentration)
+  \param[in] dt Spacing in time (\f$ t_{i+1} = t_i + \Delta t \f$)
+  \param[in] dr Spacing in x, y, and z
+  \param[in] sdelay Source delay (time before source starts)
+  \param[in] sduration Duration of source
+  \param[in] dfree Free diffusion coefficient
+  \param[in] t Time array
+  \param[out] p Probe array (concentration as a function of time)
+ */
+void calc_diffusion_curve_layer_3d(int nt, int nz, int nr, int iprobe, int xprobe, layer_table_struct_type *layers, int exp_clearance, int nsources, int *isources, int *xsources, double *samounts, double dt, double dr, double sdelay, double sduration, double dfree, double *t, double *p)
+{
+	int i, j, l, k, n;
+	int nxy = 2*nr - 1;	/* Number of points in x and y */
+	int ic = nr - 1;	/* Index of x = 0 and y = 0 */
+	size_t ncells = (size_t) (nz+2) * (nxy+2) * (nxy+2);
+	int row = nxy+2;	/* Offset to the next point in x */
+	int plane = (nxy+2) * (nxy+2);	/* Offset to the next point in z */
+	double *swap;
+
+	/* Arrays internal to this function */
+	double *c;	/* Concentration */
+	double *cn;	/* Concentration at the next time-step */
+	double *mask;	/* 1 inside the cylinder, 0 outside (x, y only) */
+	double *alpha_row;	/* alpha of each row */
+	double *dstar_row;	/* D* of each row */
+	double *kappa_row;	/* kappa of each row */
+	double *g;	/* Conductance between adjacent rows */
+	double *scale1;	/* D* dt / dr^2 of each row */
+	double *scale_zm;	/* Coupling to the row below */
+	double *scale_zp;	/* Coupling to the row above */
+	double *clear;	/* 1 - kappa dt (or 1 with exp_clearance) */
+
+	/* For the exact integration of the source and clearance */
+	double *decay = NULL;
+	double *gain = NULL;
+	int source_on;
+
+	/* For the Michaelis-Menten uptake */
+	double *vmax_dt = NULL;
+	double *km_row = NULL;
+	int uptake = FALSE;
+
+	c = create_array(ncells, "3D concentration");
+	cn = create_array(ncells, "3D concentration (next step)");
+	mask = create_array((nxy+2)*(nxy+2), "3D mask");
+
+	alpha_row = create_array(nz, "alpha_row");
+	dstar_row = create_array(nz, "dstar_row");
+	kappa_row = create_array(nz, "kappa_row");
+	g = create_array(nz+1, "g");
+	scale1 = create_array(nz, "scale1");
+	scale_zm = create_array(nz, "scale_zm");
+	scale_zp = create_array(nz, "scale_zp");
+	clear = create_array(nz, "clear");
+
+	/* Diffusion parameters of each row */
+	calc_layer_rows(nz, dr, layers, dfree, alpha_row, dstar_row, kappa_row, g);
+
+	for (i=0; i<nz; i++) {
+		scale1[i] = dstar_row[i] * dt / SQR(dr);
+		scale_zm[i] = g[i] * dt / (alpha_row[i] * SQR(dr));
+		scale_zp[i] = g[i+1] * dt / (alpha_row[i] * SQR(dr));
+		clear[i] = exp_clearance ? 1.0 : 1.0 - kappa_row[i] * dt;
+	}
+
+	/* Points inside the cylinder (the 2D solver has c = 0 at
+	   r = nr * dr) */
+	for (j=0; j<nxy; j++)
+		for (l=0; l<nxy; l++)
+			if (SQR(j-ic) + SQR(l-ic) < SQR(nr))
+				mask[(j+1)*(nxy+2)+l+1] = 1.0;
+
+	/* Decay and source gain over half a time-step for each row */
+	if (exp_clearance) {
+		decay = create_array(nz, "decay");
+		gain = create_array(nz, "gain");
+		for (i=0; i<nz; i++) {
+			decay[i] = exp(-0.5 * kappa_row[i] * dt);
+			gain[i] = (kappa_row[i] > 0.) ?
+				(1.0 - decay[i]) / (0.5 * kappa_row[i] * dt) : 1.0;
+		}
+	}
+
+	/* Uptake parameters of each row */
+	for (n=0; n<layers->n; n++)
+		if (layers->vmax[n] > 0.) uptake = TRUE;
+	if (uptake) {
+		vmax_dt = create_array(nz, "vmax_dt");
+		km_row = create_array(nz, "km_row");
+		calc_row_average(nz, dr, layers, layers->vmax, vmax_dt);
+		calc_row_average(nz, dr, layers, layers->km, km_row);
+		for (i=0; i<nz; i++)
+			vmax_dt[i] *= dt;
+	}
+
+	/* Initialize the concentration at t=0 (with exp_clearance,
+	   the source is added during the time-steps) */
+	if (! exp_clearance)
+		for (n=0; n<nsources; n++)
+			c[INDEX3(isources[n], xsources[n], ic)] += samounts[n];
+
+	/* Source delay: Concentration = 0 for sdelay seconds */
+	int nds = lround(sdelay/dt);
+	if (nds >= nt)
+		error("nds=%d, nt=%d. Delay start should be < total expt time",
+			nds, nt);
+	for (k=0; k<nds; k++)
+		p[k] = 0.0;
+
+	/* Loop over time */
+	for (k=nds; k<nt; k++) {
+		p[k] = c[INDEX3(iprobe, xprobe, ic)];	/* record c at time t[k] */
+
+		source_on = (t[k] + dt/2.0 < sdelay + sduration);
+
+		/* First half of the source and clearance */
+		if (exp_clearance) {
+			for (i=0; i<nz; i++)
+				for (j=0; j<nxy; j++)
+					for (l=0; l<nxy; l++)
+						c[INDEX3(i,j,l)] *= decay[i];
+			if (source_on)
+				for (n=0; n<nsources; n++)
+					c[INDEX3(isources[n], xsources[n], ic)] +=
+						0.5 * gain[isources[n]] * samounts[n];
+		}
+
+		/* Diffusion step (with the uptake and, without exp_clearance,
+		   the clearance) from c to cn. The border of c is 0, so
+		   there are no special cases at the edges of the grid. */
+#ifdef _OPENMP
+#pragma omp parallel for private(j, l)
+#endif
+		for (i=0; i<nz; i++) {
+			double a = scale1[i];
+			double zm = scale_zm[i];
+			double zp = scale_zp[i];
+			double diag = 1.0 - 4.0 * a - zm - zp;
+			double f = clear[i];
+			double v = uptake ? vmax_dt[i] : 0.;
+			double km = uptake ? km_row[i] : 1.;
+			double *ci, *cni, *mi;
+
+			for (j=0; j<nxy; j++) {
+				ci = c + INDEX3(i,j,0);
+				cni = cn + INDEX3(i,j,0);
+				mi = mask + (j+1)*(nxy+2) + 1;
+				if (uptake) {
+					for (l=0; l<nxy; l++) {
+						double old = ci[l];
+						double d = (diag - 1.0) * old
+							+ a * (ci[l-1] + ci[l+1] + ci[l-row] + ci[l+row])
+							+ zm * ci[l-plane] + zp * ci[l+plane];
+						cni[l] = mi[l] * f * (old + d) * (km + old) / (km + old + v);
+					}
+				} else {
+					for (l=0; l<nxy; l++)
+						cni[l] = mi[l] * f * ( diag * ci[l]
+							+ a * (ci[l-1] + ci[l+1] + ci[l-row] + ci[l+row])
+							+ zm * ci[l-plane] + zp * ci[l+plane] );
+				}
+			}
+		}
+		swap = c;
+		c = cn;
+		cn = swap;
+
+		if (exp_clearance) {
+			/* Second half of the source and clearance */
+			for (i=0; i<nz; i++)
+				for (j=0; j<nxy; j++)
+					for (l=0; l<nxy; l++)
+						c[INDEX3(i,j,l)] *= decay[i];
+			if (source_on)
+				for (n=0; n<nsources; n++)
+					c[INDEX3(isources[n], xsources[n], ic)] +=
+						0.5 * gain[isources[n]] * samounts[n];
+		} else if (source_on) {
+			/* The source gets added for the next time-step (after
+			   the clearance, as in the 2D solver) */
+			for (n=0; n<nsources; n++)
+				c[INDEX3(isources[n], xsources[n], ic)] +=
+					clear[isources[n]] * samounts[n];
+		}
+
+	} /* End of k for loop */
+
+
+	/* Deallocate arrays */
+	free(c);
+	free(cn);
+	free(mask);
+	free(alpha_row);
+	free(dstar_row);
+	free(kappa_row);
+	free(g);
+	free(scale1);
+	free(scale_zm);
+	free(scale_zp);
+	free(clear);
+	if (exp_clearance) {
+		free(decay);
+		free(gain);
+	}
+	if (uptake) {
+		free(vmax_dt);
+		free(km_row);
+	}
+
+	return;
+}
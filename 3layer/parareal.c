@@ -0,0 +1,481 @@
+/**
+  \file 3layer/parareal.c
+
+  Function for solving the forward problem with the parareal
+  parallel-in-time method.
+
+  A run with the default grid has thousands of time-steps, which
+  have to be done one after the other, and the grid is too small
+  for the rows to be split over many threads efficiently. The
+  parareal method divides the time into slices and solves the
+  slices at the same time: a cheap coarse propagator predicts the
+  concentration at the start of each slice, the explicit solver of
+  model.c (the fine propagator) is run on all slices in parallel
+  from these predictions, and the predictions are corrected with
+  the difference between the fine and the coarse results. This is
+  repeated until the concentrations at the starts of the slices
+  stop changing. After iteration \f$ k \f$ the first \f$ k \f$
+  slices are exact, so the result is the same as that of
+  calc_diffusion_curve_layer() (to within the tolerance), and the
+  method never needs more iterations than there are slices.
+
+  The slices are solved in parallel with OpenMP if the program is
+  compiled with it (the number of threads is set with the
+  OMP_NUM_THREADS environment variable).
+
+ */
+
+#include "header.h"
+
+
+/**
+  \def COARSE_STEPS
+  Number of time-steps of the coarse propagator in each time slice.
+ */
+#define COARSE_STEPS 10
+
+
+/**
+  \typedef Typedef for struct for the grid and the per-row
+  coefficients used by the fine and coarse propagators
+ */
+typedef struct {
+	int nz;              ///< Number of rows of concentration matrix
+	int nr;              ///< Number of columns of concentration matrix (minus 1)
+	int iprobe;          ///< z-index of probe location
+	int jprobe;          ///< r-index of probe location
+	int stencil;         ///< Order of the spatial discretization (2 or 4)
+	int zmirror;         ///< Number of ghost rows below the source row
+	int exp_clearance;   ///< Flag for exact integration of the source and clearance
+	int uptake;          ///< Flag for Michaelis-Menten uptake
+	double dt;           ///< Spacing in time
+	double sdelay;       ///< Source delay
+	double sduration;    ///< Duration of source
+	double *t;           ///< Time array
+	double *s;           ///< Source array
+	double *invr;        ///< Array of 1/r values
+	double *scale1;      ///< Scaling factors for convolve_rows()
+	double *scale2;
+	double *scale_zm;
+	double *scale_zp;
+	double *kappa_dt;    ///< kappa dt of each row
+	double *decay;       ///< Decay over half a time-step (exp_clearance)
+	double *gain;        ///< Source gain over half a time-step (exp_clearance)
+	double *vmax_dt;     ///< Vmax dt of each row (uptake)
+	double *km_row;      ///< Km of each row (uptake)
+	double *work;        ///< Work array for the tridiagonal solves (coarse propagator)
+} propagator_struct_type;
+
+
+/**
+  \brief Sets the r=0 mirror column and the z-mirror ghost rows of
+  the concentration matrix.
+ */
+static void set_mirrors(propagator_struct_type *pr, double *c)
+{
+	int i, j;
+	int nr = pr->nr;
+
+	for (i=0; i<pr->nz; i++)
+		c[INDEX(i,0)] = c[INDEX(i,2)];
+	for (i=1; i<=pr->zmirror; i++)
+		for (j=0; j<nr+1; j++)
+			c[INDEX(pr->zmirror-i,j)] = c[INDEX(pr->zmirror+i,j)];
+}
+
+
+/**
+  \brief Fine propagator: advances the concentration from time-step
+  k0 to time-step k1 with the explicit scheme of
+  calc_diffusion_curve_layer() and records the probe concentration.
+
+  \param[in] pr Grid and coefficients
+  \param[in] k0 First time-step
+  \param[in] k1 One past the last time-step
+  \param[in,out] c Concentration matrix (at t[k0] on input, t[k1] on output)
+  \param[in] dc Work array for the delta-c matrix
+  \param[out] p Probe array (elements k0 to k1-1 are set)
+ */
+static void fine_propagate(propagator_struct_type *pr, int k0, int k1, double *c, double *dc, double *p)
+{
+	int i, j, k;
+	int nz = pr->nz;
+	int nr = pr->nr;
+	int source_on;
+
+	for (k=k0; k<k1; k++) {
+		p[k] = c[INDEX(pr->iprobe,pr->jprobe)];
+
+		source_on = (pr->t[k] + pr->dt/2.0 < pr->sdelay + pr->sduration);
+
+		if (pr->exp_clearance)
+			reaction_half_step(nz, nr, c, pr->s, source_on, pr->decay, pr->gain);
+
+		laplacian_rows(pr->stencil, nz, nr+1, c, pr->scale1, pr->scale2,
+			pr->scale_zm, pr->scale_zp, pr->invr, dc);
+
+		if (pr->uptake)
+			update_with_uptake(nz, nr, c, dc, pr->vmax_dt, pr->km_row);
+		else
+			for (i=0; i<nz*(nr+1); i++)
+				c[i] += dc[i];
+
+		if (pr->exp_clearance) {
+			reaction_half_step(nz, nr, c, pr->s, source_on, pr->decay, pr->gain);
+		} else {
+			if (source_on)
+				for (i=0; i<nz*(nr+1); i++)
+					c[i] += pr->s[i];
+			for (i=0; i<nz; i++)
+				for (j=0; j<nr+1; j++)
+					c[INDEX(i,j)] *= 1. - pr->kappa_dt[i];
+		}
+
+		set_mirrors(pr, c);
+	}
+}
+
+
+/**
+  \brief Coarse propagator: advances the concentration from
+  time-step k0 to time-step k1 with COARSE_STEPS implicit
+  (backward Euler) steps.
+
+  Each coarse step of \f$ m \f$ fine time-steps adds the source of
+  the \f$ m \f$ steps and then solves
+  \f$ (1 - m L_r)(1 - m L_z + m \kappa \Delta t) c' = c \f$ ,
+  where \f$ L_r \f$ and \f$ L_z \f$ are the r and z parts of the
+  second-order operator of convolve_rows() (scaled by
+  \f$ \Delta t \f$ ). Both factors are tridiagonal, so a step costs
+  about as much as one explicit step, and it is stable for any
+  \f$ m \f$ . The coefficients in z are the same for every column,
+  so the z-solve is done a row at a time. With z-mirror symmetry
+  only the rows from the source row up are solved, and the row
+  below the source row is its mirror image (the row above it), so
+  the plane of the source reflects as in the fine propagator. The
+  uptake is linearized as in update_with_uptake().
+
+  \param[in] pr Grid and coefficients
+  \param[in] k0 First time-step
+  \param[in] k1 One past the last time-step
+  \param[in,out] c Concentration matrix (at t[k0] on input, t[k1] on output)
+ */
+static void coarse_propagate(propagator_struct_type *pr, int k0, int k1, double *c)
+{
+	int i, j, k, q;
+	int nz = pr->nz;
+	int nr = pr->nr;
+	int n = nr + 1;
+	int ncoarse = MIN(COARSE_STEPS, k1 - k0);
+	int i0 = pr->zmirror;	/* Source row with z-mirror symmetry (else 0) */
+	int kb0, kb1, n_on;
+	double m, s1, s2, a, b, u, den;
+	double *cp = pr->work;	/* Modified upper diagonal */
+	double *ci, *cim;
+
+	for (q=0; q<ncoarse; q++) {
+		kb0 = k0 + (q * (k1 - k0)) / ncoarse;
+		kb1 = k0 + ((q+1) * (k1 - k0)) / ncoarse;
+		m = kb1 - kb0;
+
+		/* Source of the m time-steps */
+		n_on = 0;
+		for (k=kb0; k<kb1; k++)
+			if (pr->t[k] + pr->dt/2.0 < pr->sdelay + pr->sduration) n_on++;
+		if (n_on > 0)
+			for (i=0; i<nz*n; i++)
+				c[i] += n_on * pr->s[i];
+
+		/* Implicit step in r for each row (j=1 to nr, with the
+		   j=0 column replaced by its mirror image j=2) */
+		for (i=i0; i<nz; i++) {
+			ci = c + INDEX(i,0);
+			s1 = m * pr->scale1[i];
+			s2 = m * pr->scale2[i];
+			cp[1] = -4.0 * s1 / (1.0 + 4.0 * s1);
+			ci[1] /= 1.0 + 4.0 * s1;
+			for (j=2; j<n; j++) {
+				a = -(s1 - s2 * pr->invr[j]);
+				den = 1.0 + 2.0 * s1 - a * cp[j-1];
+				cp[j] = (j < n-1) ? -(s1 + s2 * pr->invr[j]) / den : 0.;
+				ci[j] = (ci[j] - a * ci[j-1]) / den;
+			}
+			for (j=n-2; j>=1; j--)
+				ci[j] -= cp[j] * ci[j+1];
+			ci[0] = ci[2];
+		}
+
+		/* Implicit step in z (with the clearance) for all columns. 
+		   With z-mirror symmetry, the flux from below into the 
+		   source row comes from the mirror image of the row above. */
+		for (i=i0; i<nz; i++) {
+			ci = c + INDEX(i,0);
+			b = 1.0 + m * (pr->scale_zm[i] + pr->scale_zp[i] + pr->kappa_dt[i]);
+			a = (i > i0) ? -m * pr->scale_zm[i] : 0.;
+			u = (i < nz-1) ? -m * pr->scale_zp[i] : 0.;
+			if ( (i == i0) && (i0 > 0) )
+				u -= m * pr->scale_zm[i];
+			den = b - a * ((i > i0) ? cp[i-1] : 0.);
+			cp[i] = u / den;
+			if (i > i0) {
+				cim = c + INDEX(i-1,0);
+				for (j=0; j<n; j++)
+					ci[j] = (ci[j] - a * cim[j]) / den;
+			} else {
+				for (j=0; j<n; j++)
+					ci[j] /= den;
+			}
+		}
+		for (i=nz-2; i>=i0; i--) {
+			ci = c + INDEX(i,0);
+			cim = c + INDEX(i+1,0);
+			for (j=0; j<n; j++)
+				ci[j] -= cp[i] * cim[j];
+		}
+
+		/* Uptake over the m time-steps */
+		if (pr->uptake)
+			for (i=i0; i<nz; i++)
+				for (j=0; j<n; j++)
+					c[INDEX(i,j)] *= (pr->km_row[i] + c[INDEX(i,j)]) /
+						(pr->km_row[i] + c[INDEX(i,j)] + m * pr->vmax_dt[i]);
+
+		set_mirrors(pr, c);
+	}
+}
+
+
+/**
+  \brief Calculates the probe concentration as a function of time
+  with the parareal method; the result is the same as that of
+  calc_diffusion_curve_layer() to within the tolerance.
+
+  The time-steps after the source delay are divided into nslices
+  slices. The coarse propagator (coarse_propagate()) first gives
+  the concentrations \f$ U_n \f$ at the start of each slice. Each
+  iteration then runs the fine propagator \f$ F \f$
+  (fine_propagate(), the explicit scheme of
+  calc_diffusion_curve_layer()) on the slices in parallel, and
+  corrects the starting concentrations in order with
+
+\f[
+U_{n+1} \leftarrow G(U_n) + F(U_n^{old}) - G(U_n^{old})
+\quad ,
+\f]
+
+  where \f$ G \f$ is the coarse propagator. The iterations stop
+  when the largest change in \f$ U_n \f$ is less than tol times the
+  largest concentration. The slices before the first one that can
+  still change are not solved again.
+
+  Concentration images are not supported. The homogeneous model (nolayer) is solved with
+  convolve_rows(), which gives the same result as convolve3() to
+  within rounding errors.
+
+  \param[in] nt Number of support points in time
+  \param[in] nz Number of rows of concentration matrix
+  \param[in] nr Number of columns of concentration matrix
+  \param[in] iprobe z-index of probe location
+  \param[in] jprobe r-index of probe location
+  \param[in] layers Layer table (z-positions on the grid of the model)
+  \param[in] stencil Order of the spatial discretization of the fine propagator (2 or 4)
+  \param[in] zmirror Number of ghost rows below the source row for z-mirror symmetry (0 = none)
+  \param[in] exp_clearance Flag for exact integration of the source and clearance
+  \param[in] nslices Number of time slices
+  \param[in] tol Relative tolerance for the changes of the concentrations at the starts of the slices
+  \param[in] dt Spacing in time (\f$ t_{i+1} = t_i + \Delta t \f$)
+  \param[in] dr Spacing in r (in this program, \f$ \Delta z = \Delta r \f$)
+  \param[in] sdelay Source delay (time before source starts)
+  \param[in] sduration Duration of source
+  \param[in] dfree Free diffusion coefficient
+  \param[in] t Time array
+  \param[in] s Source array
+  \param[in] invr Array for \f$ 1/r \f$ values
+  \param[out] p Probe array (concentration as a function of time)
+
+  \return Number of parareal iterations
+ */
+int calc_diffusion_curve_layer_parareal(int nt, int nz, int nr, int iprobe, int jprobe, layer_table_struct_type *layers, int stencil, int zmirror, int exp_clearance, int nslices, double tol, double dt, double dr, double sdelay, double sduration, double dfree, double *t, double *s, double *invr, double *p)
+{
+	int i, k, n;
+	int size = nz*(nr+1);
+	int first;	/* First slice whose start can still change */
+	int iter = 0;
+	double change, umax, unew;
+	propagator_struct_type pr;
+
+	/* Arrays internal to this function */
+	double *alpha_row;	/* alpha of each row */
+	double *dstar_row;	/* D* of each row */
+	double *kappa_row;	/* kappa of each row */
+	double *g;	/* Conductance between adjacent rows */
+	double *u;	/* Concentrations at the starts of the slices */
+	double *f;	/* Fine results at the ends of the slices */
+	double *gold;	/* Coarse results at the ends of the slices */
+	double *dc;	/* Delta-c matrices (one for each slice) */
+	double *gnew;	/* New coarse result */
+	int *kb;	/* First time-step of each slice (and nt at the end) */
+
+	pr.nz = nz;
+	pr.nr = nr;
+	pr.iprobe = iprobe;
+	pr.jprobe = jprobe;
+	pr.stencil = stencil;
+	pr.zmirror = zmirror;
+	pr.exp_clearance = exp_clearance;
+	pr.uptake = FALSE;
+	pr.dt = dt;
+	pr.sdelay = sdelay;
+	pr.sduration = sduration;
+	pr.t = t;
+	pr.s = s;
+	pr.invr = invr;
+	pr.decay = NULL;
+	pr.gain = NULL;
+	pr.vmax_dt = NULL;
+	pr.km_row = NULL;
+
+	alpha_row = create_array(nz, "alpha_row");
+	dstar_row = create_array(nz, "dstar_row");
+	kappa_row = create_array(nz, "kappa_row");
+	g = create_array(nz+1, "g");
+	pr.scale1 = create_array(nz, "scale1");
+	pr.scale2 = create_array(nz, "scale2");
+	pr.scale_zm = create_array(nz, "scale_zm");
+	pr.scale_zp = create_array(nz, "scale_zp");
+	pr.kappa_dt = create_array(nz, "kappa_dt");
+	pr.work = create_array(MAX(nz, nr+1), "tridiagonal work");
+
+	/* Diffusion parameters of each row */
+	calc_layer_rows(nz, dr, layers, dfree, alpha_row, dstar_row, kappa_row, g);
+
+	for (i=0; i<nz; i++) {
+		pr.scale1[i] = dstar_row[i] * dt / SQR(dr);
+		pr.scale2[i] = dstar_row[i] * dt / (2.0 * dr);
+		pr.scale_zm[i] = g[i] * dt / (alpha_row[i] * SQR(dr));
+		pr.scale_zp[i] = g[i+1] * dt / (alpha_row[i] * SQR(dr));
+		pr.kappa_dt[i] = kappa_row[i] * dt;
+	}
+
+	/* Decay and source gain over half a time-step for each row */
+	if (exp_clearance) {
+		pr.decay = create_array(nz, "decay");
+		pr.gain = create_array(nz, "gain");
+		for (i=0; i<nz; i++) {
+			pr.decay[i] = exp(-0.5 * kappa_row[i] * dt);
+			pr.gain[i] = (kappa_row[i] > 0.) ?
+				(1.0 - pr.decay[i]) / (0.5 * kappa_row[i] * dt) : 1.0;
+		}
+	}
+
+	/* Uptake parameters of each row */
+	for (n=0; n<layers->n; n++)
+		if (layers->vmax[n] > 0.) pr.uptake = TRUE;
+	if (pr.uptake) {
+		pr.vmax_dt = create_array(nz, "vmax_dt");
+		pr.km_row = create_array(nz, "km_row");
+		calc_row_average(nz, dr, layers, layers->vmax, pr.vmax_dt);
+		calc_row_average(nz, dr, layers, layers->km, pr.km_row);
+		for (i=0; i<nz; i++)
+			pr.vmax_dt[i] *= dt;
+	}
+
+	/* Source delay: Concentration = 0 for sdelay seconds */
+	int nds = lround(sdelay/dt);
+	if (nds >= nt)
+		error("nds=%d, nt=%d. Delay start should be < total expt time",
+			nds, nt);
+	for (k=0; k<nds; k++)
+		p[k] = 0.0;
+
+	/* Time slices */
+	if ( (nslices < 1) || (nslices > nt - nds) )
+		error("Number of parareal time slices (%d) should be from 1 to %d",
+			nslices, nt - nds);
+	kb = malloc( sizeof(int) * (nslices+1) );
+	if (kb == NULL)
+		error("Cannot allocate memory for the time slices");
+	for (n=0; n<=nslices; n++)
+		kb[n] = nds + (int) (((long) n * (nt - nds)) / nslices);
+
+	u = create_array(nslices*size, "parareal u");
+	f = create_array(nslices*size, "parareal f");
+	gold = create_array(nslices*size, "parareal gold");
+	dc = create_array(nslices*size, "parareal dc");
+	gnew = create_array(size, "parareal gnew");
+
+	/* Concentration at the start of the source (with exp_clearance,
+	   the source is added during the time-steps) */
+	if (! exp_clearance)
+		for (i=0; i<size; i++)
+			u[i] = s[i];
+
+	/* Prediction of the starts of the slices */
+	for (n=0; n<nslices-1; n++) {
+		memcpy(u + (n+1)*size, u + n*size, size*sizeof(double));
+		coarse_propagate(&pr, kb[n], kb[n+1], u + (n+1)*size);
+		memcpy(gold + n*size, u + (n+1)*size, size*sizeof(double));
+	}
+
+	/* Parareal iterations */
+	for (first=0; first<nslices; first++) {
+		iter++;
+
+		/* Fine propagator on the slices that can still change */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (n=first; n<nslices; n++) {
+			memcpy(f + n*size, u + n*size, size*sizeof(double));
+			fine_propagate(&pr, kb[n], kb[n+1], f + n*size, dc + n*size, p);
+		}
+
+		/* Correction (after this, slice first+1 starts with the
+		   fine result of slice first, so it is exact) */
+		change = 0.;
+		umax = 0.;
+		for (n=first; n<nslices-1; n++) {
+			memcpy(gnew, u + n*size, size*sizeof(double));
+			coarse_propagate(&pr, kb[n], kb[n+1], gnew);
+			for (i=0; i<size; i++) {
+				unew = gnew[i] + f[n*size+i] - gold[n*size+i];
+				change = MAX(change, fabs(unew - u[(n+1)*size+i]));
+				umax = MAX(umax, fabs(unew));
+				u[(n+1)*size+i] = unew;
+				gold[n*size+i] = gnew[i];
+			}
+		}
+
+		if (change <= tol * umax)
+			break;
+	}
+
+
+	/* Deallocate arrays */
+	free(alpha_row);
+	free(dstar_row);
+	free(kappa_row);
+	free(g);
+	free(pr.scale1);
+	free(pr.scale2);
+	free(pr.scale_zm);
+	free(pr.scale_zp);
+	free(pr.kappa_dt);
+	free(pr.work);
+	if (exp_clearance) {
+		free(pr.decay);
+		free(pr.gain);
+	}
+	if (pr.uptake) {
+		free(pr.vmax_dt);
+		free(pr.km_row);
+	}
+	free(kb);
+	free(u);
+	free(f);
+	free(gold);
+	free(dc);
+	free(gnew);
+
+	return iter;
+}
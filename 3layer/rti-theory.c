@@ -13,6 +13,60 @@
 
 #include "header.h"
 
+/**
+  \brief Calculates one term of rti_theory(), 
+  \f$ \mathrm{erfc}(x) \f$ with \f$ x = d / (2 \sqrt{D^* \tau}) \f$ 
+  for \f$ \tau > 0 \f$ .
+ */
+static inline double rti_term(double tau, double spdist, double dstar)
+{
+	return erfc(spdist / (2.0 * sqrt(dstar * tau)));
+}
+
+
+/**
+  \brief Calculates one term of rti_theory() with nonspecific 
+  clearance, 
+
+\f[
+\frac{1}{2} \left[ e^{-m} \mathrm{erfc}(x - \sqrt{\kappa \tau}) 
+  + e^{m} \mathrm{erfc}(x + \sqrt{\kappa \tau}) \right]
+\quad , \quad 
+x = \frac{d}{2 \sqrt{D^* \tau}} \quad , \quad m = d \sqrt{\kappa / D^*}
+\f]
+
+  for \f$ \tau > 0 \f$ , which is \f$ \mathrm{erfc}(x) \f$ for 
+  \f$ \kappa = 0 \f$ .
+ */
+static inline double rti_term_kappa(double tau, double spdist, double dstar, double kappa, double m)
+{
+	double rt = sqrt(tau);
+	double x = spdist / (2.0 * sqrt(dstar) * rt);
+	double k = sqrt(kappa) * rt;
+
+	return 0.5 * (exp(-m) * erfc(x - k) + exp(m) * erfc(x + k));
+}
+
+
+/**
+  \brief Returns the index of the first time point after time t0 
+  (the time array is increasing).
+ */
+static int first_after(int nt, double *t, double t0)
+{
+	int lo = 0, hi = nt, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (t[mid] <= t0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
 /**
   \brief Mean squared error function for simplex fitting 
 
@@ -31,10 +85,11 @@
   pointer to parameters of the function to fit (rti_theory). 
 
   The second parameter actually points to a struct of parameters. 
-  The characteristic curve calculated from rti_theory is stored 
-  in the p_theory array of this struct.
+  The characteristic curve is calculated in the same pass as the 
+  squared error and is not stored; rti_theory() gives the curve 
+  of the fitted parameters.
 
-  \param[in] x Vector of doubles representing parameters to fit (alpha and theta)
+  \param[in] x Vector of doubles representing parameters to fit (alpha and theta, and kappa if it has 3 elements)
   \param[in,out] params Vector of parameters needed by rti_theory
 
   \return Mean squared error between multilayer curve and characteristic curve
@@ -50,16 +105,41 @@ double calc_mse_rti(const gsl_vector *x, void *params)
 	p->theta = gsl_vector_get(x, 1);
 	if (p->alpha <= 0.001) p->alpha = 0.001;
 	if (p->theta <= 0.001) p->theta = 0.001;
-   
-	/* Call the rti_theory function */
-	rti_theory(nt, p->spdist, p->samplitude, p->sdelay, p->sduration, p->kappa, p->dfree, 
-	           p->alpha, p->theta, p->t, p->p_theory);
+	if (x->size > 2) {
+		p->kappa = gsl_vector_get(x, 2);
+		if (p->kappa < 0.) p->kappa = 0.;
+	}
 
+	/* Calculate the characteristic curve and the squared error in 
+	   the same pass (without storing the curve). The curve is 0 
+	   before the source starts and has a second term after it 
+	   stops, so each part of the time array gets its own loop. */
+	double dstar = p->theta * p->dfree;
+	double ampl = p->samplitude / (4.0 * PI * p->alpha * dstar * p->spdist);
+	double *t = p->t;
+	double *pm = p->p_model;
+	double m = p->spdist * sqrt(p->kappa / dstar);
+	int i1 = MAX(first_after(nt, t, p->sdelay), 1);
+	int i2 = MAX(first_after(nt, t, p->sdelay + p->sduration), i1);
 	double mse = 0.;
 
-	for (i=1; i<nt; i++) {
-		mse += SQR(p->p_model[i] - p->p_theory[i]);
+	for (i=1; i<i1; i++)
+		mse += SQR(pm[i]);
+	if (p->kappa > 0.) {
+		for (i=i1; i<i2; i++)
+			mse += SQR(pm[i] - ampl * rti_term_kappa(t[i] - p->sdelay, p->spdist, 
+				dstar, p->kappa, m));
+		for (i=i2; i<nt; i++)
+			mse += SQR(pm[i] - ampl * (rti_term_kappa(t[i] - p->sdelay, p->spdist, 
+				dstar, p->kappa, m) - rti_term_kappa(t[i] - (p->sdelay + p->sduration), 
+				p->spdist, dstar, p->kappa, m)));
+		return mse / nt;
 	}
+	for (i=i1; i<i2; i++)
+		mse += SQR(pm[i] - ampl * rti_term(t[i] - p->sdelay, p->spdist, dstar));
+	for (i=i2; i<nt; i++)
+		mse += SQR(pm[i] - ampl * (rti_term(t[i] - p->sdelay, p->spdist, dstar) 
+			- rti_term(t[i] - (p->sdelay + p->sduration), p->spdist, dstar)));
 	mse /= nt;
 
 	return mse;
@@ -70,7 +150,12 @@ double calc_mse_rti(const gsl_vector *x, void *params)
   \brief Calculates RTI data for diffusion in an isotropic, 
          homogeneous environment (direct calculation from an equation)
 
-  \todo Change formula to take kappa into account
+  With nonspecific clearance (kappa > 0), this is the point-source 
+  solution with linear clearance (see rti_term_kappa()).
+
+  The time array is split into the parts before the source, while 
+  it is on, and after it stops, so each part has its own loop 
+  without a test of the time.
 
   \param[in] nt Number of time points of calculation
   \param[in] spdist Distance between source and probe
@@ -92,16 +177,338 @@ void rti_theory(int nt, double spdist, double samplitude, double sdelay, double
 	double dstar = theta * dfree;
 	double ampl = samplitude / (4.0 * PI * alpha * dstar * spdist);
 
+	int i1 = first_after(nt, t, sdelay);
+	int i2 = MAX(first_after(nt, t, sdelay + sduration), i1);
+
+	for (i=0; i<i1; i++)
+		p_theory[i] = 0.;
+	if (kappa > 0.) {
+		double m = spdist * sqrt(kappa / dstar);
+		for (i=i1; i<i2; i++)
+			p_theory[i] = ampl * rti_term_kappa(t[i] - sdelay, spdist, dstar, kappa, m);
+		for (i=i2; i<nt; i++)
+			p_theory[i] = ampl * (rti_term_kappa(t[i] - sdelay, spdist, dstar, kappa, m) 
+				- rti_term_kappa(t[i] - (sdelay + sduration), spdist, dstar, kappa, m));
+		return;
+	}
+	for (i=i1; i<i2; i++)
+		p_theory[i] = ampl * rti_term(t[i] - sdelay, spdist, dstar);
+	for (i=i2; i<nt; i++)
+		p_theory[i] = ampl * (rti_term(t[i] - sdelay, spdist, dstar) 
+			- rti_term(t[i] - (sdelay + sduration), spdist, dstar));
+}
+
+
+/**
+  \brief Calculates one term of rti_theory() (see rti_term_kappa()) 
+  and its derivatives with respect to \f$ \ln D^* \f$ and 
+  \f$ \kappa \f$ .
+
+  With \f$ B = \frac{m}{4} \left[ e^{-m} \mathrm{erfc}(x - k) 
+  - e^{m} \mathrm{erfc}(x + k) \right] \f$ and 
+  \f$ k = \sqrt{\kappa \tau} \f$ , the derivatives are 
+  \f$ B + x e^{-x^2 - k^2} / \sqrt{\pi} \f$ and \f$ -B / \kappa \f$ 
+  (the derivatives of the erfc arguments cancel in the second). 
+  For small \f$ m \f$ , the second is replaced by its value at 
+  \f$ \kappa = 0 \f$ , 
+  \f$ 2 x \tau \left[ x \, \mathrm{erfc}(x) - e^{-x^2} / \sqrt{\pi} \right] \f$ .
+
+  \param[in] tau Time since the source started (> 0)
+  \param[in] spdist Distance between source and probe
+  \param[in] dstar Effective diffusion coefficient
+  \param[in] kappa Nonspecific clearance factor
+  \param[in] m \f$ d \sqrt{\kappa / D^*} \f$
+  \param[out] g The term and its two derivatives
+ */
+static void rti_term_grad(double tau, double spdist, double dstar, double kappa, double m, double *g)
+{
+	double rt = sqrt(tau);
+	double x = spdist / (2.0 * sqrt(dstar) * rt);
+	double k = sqrt(kappa) * rt;
+	double em = exp(-m) * erfc(x - k);
+	double ep = exp(m) * erfc(x + k);
+	double b = 0.25 * m * (em - ep);
+
+	g[0] = 0.5 * (em + ep);
+	g[1] = b + x * exp(-x*x - k*k) / sqrt(PI);
+	if (m > 1.0e-2)
+		g[2] = - b / kappa;
+	else
+		g[2] = 2.0 * x * tau * (x * erfc(x) - exp(-x*x) / sqrt(PI));
+}
+
+
+/**
+  \brief Calculates the residuals of the characteristic curve and, 
+  if jac is not NULL, their Jacobian with respect to 
+  \f$ \ln\alpha \f$ , \f$ \ln\theta \f$ , and \f$ \kappa \f$ .
+
+  The residuals are those of calc_mse_rti() (the first time point 
+  is not used, so its row is 0).
+
+  \param[in] p Parameters of the fit (alpha, theta, and kappa are used)
+  \param[in] nfit Number of fitted parameters (2, or 3 with kappa)
+  \param[out] r Residuals, data minus characteristic curve (nt elements)
+  \param[out] jac Derivatives of the characteristic curve (jac[i*nfit+a]), or NULL
+
+  \return Sum of squared residuals
+ */
+static double rti_residuals(mse_rti_params_struct_type *p, int nfit, double *r, double *jac)
+{
+	int i, a;
+	int nt = p->nt;
+	double dstar = p->theta * p->dfree;
+	double ampl = p->samplitude / (4.0 * PI * p->alpha * dstar * p->spdist);
+	double m = p->spdist * sqrt(p->kappa / dstar);
+	double g[3], g2[3], f;
+	double sse = 0.;
+
 	for (i=0; i<nt; i++) {
-		if (t[i] <= sdelay) {
-			p_theory[i] = 0.;
-		} else {
-			p_theory[i] = ampl * erfc( spdist /
-									(2.0 * sqrt(dstar * (t[i] - sdelay))) );
-			if (t[i] > sdelay + sduration)
-				p_theory[i] = p_theory[i] - ampl * erfc( spdist /
-							(2.0 * sqrt(dstar * (t[i] - (sdelay + sduration)))) );
+		g[0] = g[1] = g[2] = 0.;
+		if (i > 0 && p->t[i] > p->sdelay) {
+			rti_term_grad(p->t[i] - p->sdelay, p->spdist, dstar, p->kappa, m, g);
+			if (p->t[i] > p->sdelay + p->sduration) {
+				rti_term_grad(p->t[i] - (p->sdelay + p->sduration), p->spdist, 
+					dstar, p->kappa, m, g2);
+				for (a=0; a<3; a++)
+					g[a] -= g2[a];
+			}
+		}
+		f = ampl * g[0];
+		r[i] = (i > 0) ? p->p_model[i] - f : 0.;
+		sse += SQR(r[i]);
+		if (jac) {
+			jac[i*nfit] = - f;
+			jac[i*nfit+1] = - f + ampl * g[1];
+			if (nfit > 2)
+				jac[i*nfit+2] = ampl * g[2];
+			if (i == 0)
+				for (a=0; a<nfit; a++)
+					jac[a] = 0.;
 		}
 	}
+
+	return sse;
 }
 
+
+/**
+  \brief Solves the symmetric system \f$ A x = b \f$ of 2 or 3 
+  equations with cofactors, and returns the diagonal of 
+  \f$ A^{-1} \f$ .
+
+  \return Determinant of A
+ */
+static double solve_sym3(int n, double a[3][3], double *b, double *x, double *inv_diag)
+{
+	double c[3][3], det;
+
+	if (n == 2) {
+		det = a[0][0]*a[1][1] - a[0][1]*a[1][0];
+		c[0][0] = a[1][1];
+		c[1][1] = a[0][0];
+		c[0][1] = c[1][0] = - a[0][1];
+	} else {
+		c[0][0] = a[1][1]*a[2][2] - a[1][2]*a[2][1];
+		c[0][1] = a[1][2]*a[2][0] - a[1][0]*a[2][2];
+		c[0][2] = a[1][0]*a[2][1] - a[1][1]*a[2][0];
+		c[1][1] = a[0][0]*a[2][2] - a[0][2]*a[2][0];
+		c[1][2] = a[0][1]*a[2][0] - a[0][0]*a[2][1];
+		c[2][2] = a[0][0]*a[1][1] - a[0][1]*a[1][0];
+		c[1][0] = c[0][1];
+		c[2][0] = c[0][2];
+		c[2][1] = c[1][2];
+		det = a[0][0]*c[0][0] + a[0][1]*c[0][1] + a[0][2]*c[0][2];
+	}
+	if (det == 0.)
+		return det;
+
+	for (int i=0; i<n; i++) {
+		x[i] = 0.;
+		for (int j=0; j<n; j++)
+			x[i] += c[i][j] * b[j] / det;
+		if (inv_diag)
+			inv_diag[i] = c[i][i] / det;
+	}
+	return det;
+}
+
+
+/**
+  \brief Solves the normal equations of rti_lm_iterate() for the 
+  free parameters, with damping mu, and sets the step of the 
+  others to fixed[a].
+
+  \return Determinant of the reduced system
+ */
+static double solve_free(int nfit, int *is_free, double jtj[3][3], double *jtr, double mu, double *fixed, double *dq)
+{
+	int a, b, n = 0;
+	int idx[3];
+	double lhs[3][3], rhs[3], x[3], det;
+
+	for (a=0; a<nfit; a++) {
+		dq[a] = fixed[a];
+		if (is_free[a]) idx[n++] = a;
+	}
+	for (a=0; a<n; a++) {
+		rhs[a] = jtr[idx[a]];
+		for (b=0; b<nfit; b++)
+			if (! is_free[b])
+				rhs[a] -= jtj[idx[a]][b] * fixed[b];
+		for (b=0; b<n; b++)
+			lhs[a][b] = jtj[idx[a]][idx[b]] * ((a == b) ? 1.0 + mu : 1.0);
+	}
+	det = solve_sym3(n, lhs, rhs, x, NULL);
+	for (a=0; a<n; a++)
+		dq[idx[a]] = x[a];
+	return det;
+}
+
+
+/**
+  \brief Does one Levenberg-Marquardt iteration of the fit of the 
+  characteristic curve, with the analytic derivatives of 
+  rti_residuals().
+
+  The fit is in \f$ \ln\alpha \f$ , \f$ \ln\theta \f$ (so alpha and 
+  theta stay positive), and \f$ \kappa \f$ (which is kept 
+  \f$ \ge 0 \f$ ). The damping is multiplied by 10 until the step 
+  decreases the squared error, and divided by 10 after it.
+
+  The bound on \f$ \kappa \f$ is handled with an active set: if 
+  \f$ \kappa = 0 \f$ and the gradient points to negative values, 
+  \f$ \kappa \f$ is removed from the normal equations, and if a 
+  step would make \f$ \kappa \f$ negative, it is set to 0 and the 
+  other parameters are solved for again. So the step of alpha and 
+  theta is not spoiled by a clipped step of kappa.
+
+  The return value, for the convergence test, is the decrease of 
+  the squared error that the undamped step of the free parameters 
+  predicts, relative to the squared error, 
+  \f$ g^T (J^T J)^{-1} g / \sum r^2 \f$ with the projected 
+  gradient \f$ g = J^T r \f$ . It does not depend on the damping, 
+  and it is 0 at a minimum on the bound.
+
+  \param[in,out] p Parameters of the fit (alpha, theta, and kappa are the current values)
+  \param[in] nfit Number of fitted parameters (2, or 3 with kappa)
+  \param[in,out] mu Damping parameter
+  \param[out] mse Mean squared error of the new parameters
+
+  \return Predicted relative decrease of the squared error (0 if no step decreases the error)
+ */
+double rti_lm_iterate(mse_rti_params_struct_type *p, int nfit, double *mu, double *mse)
+{
+	int i, a, b, ntry;
+	int nt = p->nt;
+	double *r = create_array(nt, "LM residuals");
+	double *jac = create_array(nt*nfit, "LM Jacobian");
+	double jtj[3][3], jtr[3], dq[3], fixed[3] = {0., 0., 0.};
+	int is_free[3] = {TRUE, TRUE, TRUE};
+	double alpha = p->alpha, theta = p->theta, kappa = p->kappa;
+	double sse, sse_new, gain = 0.;
+
+	sse = rti_residuals(p, nfit, r, jac);
+	for (a=0; a<nfit; a++) {
+		jtr[a] = 0.;
+		for (b=0; b<nfit; b++)
+			jtj[a][b] = 0.;
+	}
+	for (i=0; i<nt; i++)
+		for (a=0; a<nfit; a++) {
+			jtr[a] += jac[i*nfit+a] * r[i];
+			for (b=0; b<=a; b++)
+				jtj[a][b] += jac[i*nfit+a] * jac[i*nfit+b];
+		}
+	for (a=0; a<nfit; a++)
+		for (b=0; b<a; b++)
+			jtj[b][a] = jtj[a][b];
+
+	/* kappa stays at 0 if the error decreases towards kappa < 0 */
+	if ( (nfit > 2) && (kappa <= 0.) && (jtr[2] <= 0.) )
+		is_free[2] = FALSE;
+
+	/* Predicted decrease of the undamped step */
+	if ( (sse > 0.) && (solve_free(nfit, is_free, jtj, jtr, 0., fixed, dq) != 0.) ) {
+		for (a=0; a<nfit; a++)
+			if (is_free[a]) gain += jtr[a] * dq[a];
+		gain /= sse;
+	}
+
+	for (ntry=0; ntry<20; ntry++) {
+		if (solve_free(nfit, is_free, jtj, jtr, *mu, fixed, dq) != 0.) {
+			/* A step past the bound: kappa is set to 0 and 
+			   alpha and theta are solved for again */
+			if ( (nfit > 2) && is_free[2] && (kappa + dq[2] < 0.) ) {
+				is_free[2] = FALSE;
+				fixed[2] = - kappa;
+				solve_free(nfit, is_free, jtj, jtr, *mu, fixed, dq);
+				is_free[2] = TRUE;
+				fixed[2] = 0.;
+			}
+			p->alpha = alpha * exp(dq[0]);
+			p->theta = theta * exp(dq[1]);
+			if (nfit > 2)
+				p->kappa = MAX(kappa + dq[2], 0.);
+			sse_new = rti_residuals(p, nfit, r, NULL);
+			if (sse_new < sse) {
+				*mu = MAX(*mu / 10.0, 1.0e-12);
+				sse = sse_new;
+				break;
+			}
+		}
+		*mu *= 10.0;
+		p->alpha = alpha;
+		p->theta = theta;
+		p->kappa = kappa;
+	}
+	if (ntry == 20)
+		gain = 0.;
+
+	*mse = sse / nt;
+	free(r);
+	free(jac);
+	return gain;
+}
+
+
+/**
+  \brief Calculates the standard errors of the apparent parameters 
+  from the Jacobian of the characteristic curve, 
+  \f$ \sigma^2 (J^T J)^{-1} \f$ with the residual variance 
+  \f$ \sigma^2 = \sum r^2 / (n - n_{fit}) \f$ .
+
+  \param[in] p Parameters of the fit (alpha, theta, and kappa are the fitted values)
+  \param[in] nfit Number of fitted parameters (2, or 3 with kappa)
+  \param[out] se Standard errors of alpha, theta (and kappa); -1 if singular
+ */
+void rti_standard_errors(mse_rti_params_struct_type *p, int nfit, double *se)
+{
+	int i, a, b;
+	int nt = p->nt;
+	double *r = create_array(nt, "LM residuals");
+	double *jac = create_array(nt*nfit, "LM Jacobian");
+	double jtj[3][3], zero[3] = {0., 0., 0.}, x[3], var[3];
+	double sse = rti_residuals(p, nfit, r, jac);
+
+	for (a=0; a<nfit; a++)
+		for (b=0; b<nfit; b++) {
+			jtj[a][b] = 0.;
+			for (i=0; i<nt; i++)
+				jtj[a][b] += jac[i*nfit+a] * jac[i*nfit+b];
+		}
+
+	for (a=0; a<nfit; a++)
+		se[a] = -1.;
+	if (solve_sym3(nfit, jtj, zero, x, var) != 0.) {
+		/* The first point is not fitted */
+		double sigma2 = sse / (nt - 1 - nfit);
+		se[0] = p->alpha * sqrt(sigma2 * var[0]);
+		se[1] = p->theta * sqrt(sigma2 * var[1]);
+		if (nfit > 2)
+			se[2] = sqrt(sigma2 * var[2]);
+	}
+
+	free(r);
+	free(jac);
+}
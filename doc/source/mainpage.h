@@ -248,8 +248,151 @@ adjusted by the program for a number of reasons:
   the origin.
 
 - Discretization:  The source and the probe positions are 
-  adjusted to fall on grid points, and the layer boundaries 
-  are adjusted to fall midway between grid points.
+  adjusted to fall on grid points.  The layer boundaries are 
+  used as specified: a grid cell that contains a boundary gets 
+  the volume-averaged properties of the layers it contains, 
+  and the diffusion across the boundary is handled with 
+  flux-conservative interface coefficients.  With the option 
+  `--snap_layers` (or `snap_layers = 1` in the input file) 
+  the layer boundaries are instead adjusted to fall midway 
+  between grid points, as in previous versions.
+
+- Spatial accuracy:  By default the Laplacian is computed with 
+  second-order accurate kernels.  With `--stencil 4` (or 
+  `stencil = 4` in the input file) fourth-order accurate kernels 
+  are used away from the layer boundaries, which gives the same 
+  accuracy at the probe with a coarser grid.  The time step 
+  is then 2/3 of the default one.
+
+- Clearance:  By default the source is added after each 
+  diffusion step and the concentration is then multiplied by 
+  (1 - *kappa dt*), which is only accurate if *kappa dt* is 
+  small.  With `--exp_clearance` (or `exp_clearance = 1` in the 
+  input file) the source and the clearance are integrated 
+  exactly over half a time step before and after each diffusion 
+  step (Strang splitting), so large values of *kappa* do not 
+  need a smaller time step.
+
+- Saturable uptake:  Besides the linear clearance *kappa*, each 
+  layer can have a Michaelis-Menten uptake 
+  *Vmax c / (Km + c)*, with `vmax_so`, `vmax_sp`, `vmax_sr` in 
+  mM/s and `km_so`, `km_sp`, `km_sr` in mM (input file or 
+  command line).  The uptake is applied in the same pass as 
+  the diffusion update and is stable for any time step.  It is 
+  off when all the *Vmax* values are 0 (the default).
+
+- Any number of layers:  Instead of the 3 layers, the layers 
+  can be listed from the bottom up with lines 
+  `layer = z,alpha,theta,kappa` in the input file (or options 
+  `--layer z,alpha,theta,kappa`), where *z* is the top of the 
+  layer in microns relative to the source (it is ignored for 
+  the top layer).  *Vmax* and *Km* can be added as a 5th and 
+  6th value.  Up to 10 layers can be used, and the run time 
+  does not depend on the number of layers.
+
+- Anisotropic layers:  The permeability *theta* of a layer is 
+  for diffusion along the layer (in *r*).  Diffusion across the 
+  layer (in *z*) can have a different permeability, given with 
+  `theta_z_so`, `theta_z_sp`, `theta_z_sr` (input file or 
+  command line), or as a 7th value of a `layer` line.  By 
+  default *theta_z* is the same as *theta*.  The *r* and *z* 
+  terms of the stencil already have their own coefficients, so 
+  this does not add any work, but the time step is set by the 
+  larger of *theta* and *theta_z*.
+
+- 3D solver:  The model is solved in cylindrical coordinates, 
+  where an additional source off the *z*-axis is a ring of 
+  source around the axis.  If there is such a source, the 
+  model is instead solved on a 3D Cartesian grid with 
+  (2 nr - 1) x (2 nr - 1) x nz points, with the sources and the 
+  probe in the plane *y* = 0 (*r* becomes *x*).  This takes much 
+  more memory and time, so a smaller nr and nz should be used. 
+  The 3D solver runs on several threads with OpenMP (set the 
+  number with the environment variable OMP_NUM_THREADS).  It 
+  only has the second-order stencil, and it cannot output 
+  concentration images.  The option `--solver 2d`, `3d`, or 
+  `auto` (or `solver = ...` in the input file) chooses the 
+  solver; `auto` (the default) uses the 3D solver only when it 
+  is needed.
+
+- Reciprocal mode:  The concentration at the probe from a 
+  source at *X* is the same as the concentration at *X* from the 
+  same source at the probe, because the diffusion operator 
+  (weighted with *alpha*) is self-adjoint.  With 
+  `--reciprocal "n sz1 sr1 sz2 sr2 ..."` (positions in microns, 
+  relative to the source, like `--additional_sources`) the source 
+  is put at the probe, and one run of the 2D model gives the 
+  curves at the probe of sources at the *n* candidate positions, 
+  which are written to the output file as extra columns.  The 
+  candidates can be off the *z*-axis without the 3D solver (the 
+  probe on the axis sees a point source and a ring source of the 
+  same amount alike), and concentration images show the response 
+  to a source anywhere in the tissue, so scanning electrode 
+  placements costs one simulation.  The probe must be on the 
+  *z*-axis, and the model must be linear, so it cannot be used 
+  with uptake, additional sources, `--parareal`, MPI, or the 
+  3D solver.  With the second-order stencil the 
+  curves are the same as those of separate runs; the 
+  fourth-order stencil is not exactly symmetric, so they differ 
+  by about its discretization error.
+
+- Experimental design:  With `--design`, 3layer also finds the 
+  probe position and source duration that determine *alpha*, 
+  *theta*, and *kappa* of the SP layer best.  The sensitivities 
+  of the concentration to these parameters are calculated along 
+  with the concentration, by differentiating each time step, 
+  and are recorded at candidate probe positions on a grid around 
+  the source (`--design_spacing`, default 25 microns, at 
+  `--design_dmin` to `--design_dmax`, default 50 to 300 microns, 
+  from the source).  Since the model is linear, the curves of 
+  `--design_durations` (default 10) source durations all follow 
+  from the curve of one step of the source.  For each position 
+  and duration the Fisher information of the curve is calculated 
+  for data with Gaussian noise of `--design_noise` mM (default 
+  0.01), and the design with the largest determinant (the 
+  smallest confidence region) is reported, with the expected 
+  standard errors of the parameters, in the output file.  The 
+  best duration and the standard errors of every candidate are 
+  listed as well.  This takes about four times as long as one 
+  run, instead of one run per trial.  It needs the 3-layer model 
+  with the second-order stencil, and it cannot be used with 
+  uptake, additional sources, `--exp_clearance`, `--parareal`, 
+  MPI, or the 3D solver.
+
+- Parallel in time:  With `--parareal n` (or `parareal = n` in 
+  the input file) the 2D model is solved with the parareal 
+  method.  The time after the source delay is divided into *n* 
+  slices, a cheap implicit solver with large time steps predicts 
+  the concentration at the start of each slice, and the usual 
+  explicit solver is run on all slices at the same time (with 
+  OpenMP), followed by a correction of the predictions.  This is 
+  repeated until the predictions change by less than 
+  `--parareal_tol` (default 1e-6) times the largest 
+  concentration, which usually takes 3 or 4 iterations, so with 
+  *n* threads a long run can be several times faster.  The result 
+  is the same as without parareal to within the tolerance.  It 
+  cannot be used with the 3D solver or concentration images.
+
+- Distributed memory (MPI):  `make 3layer-mpi` builds a version 
+  of 3layer with MPI (with `mpicc`).  Run with e.g. 
+  `mpirun -np 4 ./3layer-mpi sample.par`, the rows (z) of the 2D 
+  model are divided among the processes, and each process 
+  exchanges the rows next to its own with its neighbours at every 
+  time step, so grids that are too large or too slow for one 
+  machine can be spread over several.  Only the first process 
+  writes the output.  The result is the same as with `3layer`.  
+  It cannot be used with `--parareal` or the 3D solver, and 
+  each process needs at least 3 rows (5 with `--stencil 4`).
+
+- Z-mirror symmetry:  If the SR and SO layers have the same 
+  parameters, the SP layer is centered on the source, and the 
+  source is in the middle of the cylinder (as with the default 
+  parameters), the concentration is symmetric about the plane of 
+  the source.  Then only the upper half of the cylinder is 
+  solved, which halves the memory and the run time.  The option 
+  `--no_zmirror` (or `zmirror = 0` in the input file) turns 
+  this off.  Symmetry is not used with concentration images or 
+  additional sources.
 
 - Equal resolutions in \f$r\f$ and \f$z\f$:  The cylinder radius 
   is adjusted if necessary to make the spatial resolutions in 
@@ -269,6 +412,18 @@ average values of the "apparent parameters" from several data
 sets were used to parametrize a characteristic curve which was
 then input to fit-layer to find the diffusion parameters of
 the SP layer.
+The apparent alpha and theta are fitted with no clearance.  With
+--fit_kappa, the characteristic curve is the point-source solution
+with linear clearance, and an apparent kappa is fitted as well.
+The fit uses the downhill simplex (--optimizer nmsimplex2 selects
+the variant of GSL with O(n) updates), or with --lm (or
+--optimizer lm) the Levenberg-Marquardt method with the analytic derivatives of the
+characteristic curve, which usually converges in a few iterations.
+Levenberg-Marquardt stops when the decrease of the MSE that the 
+gradient predicts is less than --fit_tol times the MSE, and an 
+apparent kappa of 0 is kept out of the step while the MSE 
+decreases towards negative values.
+The output file has the standard errors of the apparent parameters.
 
 The 3layer directory also has an example output file,
 "sample.dat.orig".  We generated the file from 3layer with
@@ -429,8 +584,190 @@ program for a number of reasons:
   the origin.
 
 - Discretization:  The source and the probe positions are 
-  adjusted to fall on grid points, and the layer boundaries 
-  are adjusted to fall midway between grid points.
+  adjusted to fall on grid points.  The layer boundaries are 
+  used as specified: a grid cell that contains a boundary gets 
+  the volume-averaged properties of the layers it contains, 
+  and the diffusion across the boundary is handled with 
+  flux-conservative interface coefficients.  With the option 
+  `--snap_layers` (or `snap_layers = 1` in the input file) 
+  the layer boundaries are instead adjusted to fall midway 
+  between grid points, as in previous versions.
+
+- Spatial accuracy:  By default the Laplacian is computed with 
+  second-order accurate kernels.  With `--stencil 4` (or 
+  `stencil = 4` in the input file) fourth-order accurate kernels 
+  are used away from the layer boundaries, which gives the same 
+  accuracy at the probe with a coarser grid.  The time step 
+  is then 2/3 of the default one.
+
+- Clearance:  By default the source is added after each 
+  diffusion step and the concentration is then multiplied by 
+  (1 - *kappa dt*), which is only accurate if *kappa dt* is 
+  small.  With `--exp_clearance` (or `exp_clearance = 1` in the 
+  input file) the source and the clearance are integrated 
+  exactly over half a time step before and after each diffusion 
+  step (Strang splitting), so large values of *kappa* do not 
+  need a smaller time step.
+
+- Saturable uptake:  Besides the linear clearance *kappa*, each 
+  layer can have a Michaelis-Menten uptake 
+  *Vmax c / (Km + c)*, with `vmax_so`, `vmax_sp`, `vmax_sr` in 
+  mM/s and `km_so`, `km_sp`, `km_sr` in mM (input file or 
+  command line).  The uptake is applied in the same pass as 
+  the diffusion update and is stable for any time step.  It is 
+  off when all the *Vmax* values are 0 (the default).  With 
+  `--fit_uptake` 
+  *Vmax* and *Km* of the SP layer are fitted as well (starting 
+  from `--vmax_sp` and `--km_sp`).
+
+- Any number of layers:  Instead of the 3 layers, the layers 
+  can be listed from the bottom up with lines 
+  `layer = z,alpha,theta,kappa` in the input file (or options 
+  `--layer z,alpha,theta,kappa`), where *z* is the top of the 
+  layer in microns relative to the source (it is ignored for 
+  the top layer).  *Vmax* and *Km* can be added as a 5th and 
+  6th value.  Up to 10 layers can be used, and the run time 
+  does not depend on the number of layers.  The layer that 
+  contains the source is fitted, unless another one is chosen 
+  with `--fit_layer n` (or `fit_layer = n` in the input file).
+
+- Anisotropic layers:  The permeability *theta* of a layer is 
+  for diffusion along the layer (in *r*).  Diffusion across the 
+  layer (in *z*) can have a different permeability, given with 
+  `theta_z_so`, `theta_z_sp`, `theta_z_sr` (input file or 
+  command line), or as a 7th value of a `layer` line.  By 
+  default *theta_z* is the same as *theta*.  The *r* and *z* 
+  terms of the stencil already have their own coefficients, so 
+  this does not add any work, but the time step is set by the 
+  larger of *theta* and *theta_z*.
+  With `--fit_theta_z`, *theta_z* of the fitted layer is fitted 
+  as well; otherwise its ratio to *theta* is kept fixed.
+
+- Profile likelihood:  With `--profile n`, the fit is followed by 
+  the profile likelihood of *alpha*, *theta*, and *kappa* of the 
+  fitted layer:  each of them is fixed at *n* values on each side 
+  of the fit (spaced by `--profile_scale`, default 0.05, times 
+  the initial step of the simplex) and the other parameters are 
+  refitted.  Each profile point starts from the solution of its 
+  neighbour, and the six sides of the profiles are fitted in 
+  parallel with OpenMP, so with six threads this takes about as 
+  long as one more fit.  The profiles and the 95% confidence 
+  intervals (where the deviance *N* ln(MSE/MSE_fit) crosses 3.84) 
+  are written to the output file.
+
+- Joint fit:  With `--recording <file>` (repeated for up to 9 
+  files), fit-layer fits the same layer parameters to the input 
+  file and to further recordings in the same tissue, e.g. at 
+  other probe distances or with other currents.  A recording 
+  file has the format of the input file, but only its `probe_z`, 
+  `probe_r`, `current`, `trn`, `delay`, and `duration` are read 
+  (the others are those of the input file), and it must cover 
+  the same `tmax`.  The MSE is taken over the data of all 
+  recordings.  Recordings with the same source delay and 
+  duration share one forward solve with several probes; without 
+  uptake the model is linear in the current, so their curves are 
+  scaled by the ratio of the currents.  The other forward solves 
+  are calculated in parallel with OpenMP.  The model and data 
+  curves of each recording are written to the output file.
+
+- IOI image stacks:  With `--frames <file>`, fit-layer also fits 
+  a stack of integrative optical imaging frames.  The text file 
+  gives the frame size (`width`, `height`), the `pixel` size, 
+  the position of the source in the frame (`source_col`, 
+  `source_row`), the half thickness `depth` of the tissue seen 
+  by the camera, the standard deviation `blur` of the point 
+  spread function, the `gain` (0 to fit it), and one line 
+  `frame = <time> <file>` per frame; the frame files are raw 
+  doubles like the images of 3layer.  The model concentration is 
+  saved at the times of the frames, projected along the line of 
+  sight (the projection of each row is a fixed combination of 
+  its columns, computed once), and blurred with a separable 
+  Gaussian.  The gain is the least-squares gain of the model 
+  frames.  The squared residuals of all pixels, summed in 
+  parallel with OpenMP and weighted by `--frames_weight` 
+  (default 1), are added to those of the curves.  The fitted gain 
+  and the MSE of each frame are written to the output file.
+
+- Bounds without penalties:  By default, a penalty proportional 
+  to the violation of the bounds (`--minalpha` ... `--maxkm`) 
+  is added to the MSE.  With `--transform`, the simplex works in 
+  coordinates \f$u\f$ that map to the parameters as 
+  \f$x = x_{min} + w \, [\ln(1 + e^{(u - x_{min})/w}) - 
+  \ln(1 + e^{(u - x_{max})/w})]\f$, with \f$w\f$ 0.1% of the range 
+  of the bounds.  The map is the identity between the bounds and 
+  bends into each bound within about \f$w\f$, so every evaluated 
+  point is within the bounds, the MSE has no kinks, and a 
+  parameter whose fit is close to, but not on, a bound (such as 
+  a small kappa) is fitted as without the transform.  The 
+  starting values must be within the bounds.
+
+- Optimizers:  With `--optimizer`, the fit uses another 
+  minimizer than the Nelder-Mead simplex (`nmsimplex`, the 
+  default): `nmsimplex2`, restarted at the best point until a 
+  restart does not improve the fit; `trust`, a derivative-free 
+  trust region method in the spirit of BOBYQA (Powell, 2009), 
+  whose quadratic model interpolates the MSE at a set of points 
+  that each step updates by one point; `lm`, Levenberg-Marquardt 
+  on the residuals with a Jacobian by finite differences and an 
+  active set for the bounds; or `cmaes`, 
+  the covariance matrix adaptation evolution strategy (Hansen, 
+  2016).  The new optimizers keep the parameters within the 
+  bounds, and the number of evaluations of the model is written 
+  to the output file.  With `--benchmark n`, fit-layer replaces 
+  the data by \f$n\f$ synthetic recordings (the model at parameters 
+  drawn within one initial step of the starting values, plus 
+  Gaussian noise of `--benchmark_noise` mM), fits each of them 
+  with every optimizer from the starting values, and writes the 
+  number of forward solves, the time, the final MSE, and the 
+  errors of the parameters of each fit, and their means.  It 
+  cannot be used with `--frames` or `--transform`.
+
+- Warm start:  With `--fitdb file`, the fit starts from previous 
+  fits in a database (a text file, created if it does not exist). 
+  Each converged fit is appended to the database as one line with 
+  its condition tag (`--fitdb_tag`, one word, `default` if not 
+  given), the geometry of the recording (the bottom and the top 
+  of the fitted layer and the probe \f$z\f$ and \f$r\f$ position, in 
+  microns relative to the source), the fitted alpha, theta, and 
+  kappa, the MSE, the number of iterations, and the input file. 
+  The fits with the same tag are the cohort of the recording.  The 
+  fit starts from the fit of the cohort with the nearest geometry 
+  (theta_z keeps its ratio to theta), and if the cohort has at 
+  least 3 fits, the initial steps of the simplex are twice the 
+  standard deviations of the cohort, from a tenth of the steps 
+  (`--alpha_step` ...) up to the steps.  Only the starting point 
+  of the fit changes; the model (the layer table and the source) 
+  is that of the input file, so the database does not change the 
+  function that is minimized.  The output file gives the size of 
+  the cohort and the distance of the nearest fit. 
+
+- Posterior distribution:  With `--mcmc n`, the fit is followed 
+  by sampling of the posterior distribution of the fitted 
+  parameters with an affine-invariant ensemble of *n* walkers 
+  (Goodman and Weare, 2010).  The prior is uniform between the 
+  `--minalpha` ... `--maxkappa` bounds, and the noise of the 
+  data is Gaussian with standard deviation `--mcmc_sigma` (by 
+  default, the rms residual of the fit).  The walkers of each 
+  half of the ensemble are moved at the same time, so their 
+  forward models are calculated in parallel with OpenMP (set the 
+  number of threads with OMP_NUM_THREADS).  The posterior mean 
+  and standard deviation of each parameter (after `--mcmc_burn` 
+  steps, by default half of `--mcmc_steps`) are written to the 
+  output file.  The chains are written to the binary file 
+  `<basename>.chain` (or `--chainfile`): three ints (number of 
+  walkers, number of steps, number of columns) followed by the 
+  parameters and the log-posterior of each walker at each step 
+  (doubles), e.g. in Python 
+  `numpy.fromfile(f, 'f8', offset=12).reshape(nsteps, nwalkers, ncols)`.
+
+- Z-mirror symmetry:  If the SR and SO layers have the same 
+  parameters, the SP layer is centered on the source, and the 
+  source is in the middle of the cylinder (as with the default 
+  parameters), the concentration is symmetric about the plane of 
+  the source.  Then only the upper half of the cylinder is 
+  solved, which halves the memory and the run time.  The option 
+  `--no_zmirror` (or `zmirror = 0` in the input file) turns 
+  this off.
 
 - Equal resolutions in \f$r\f$ and \f$z\f$:  The cylinder radius 
   is adjusted if necessary to make the spatial resolutions in 
@@ -59,27 +59,52 @@ void print_usage_fit_layer(char *program)
         "\t--nz <nz>               specify nz\n"
         "\t--nt <nt>               specify nt\n"
         "\t--nt_scale <factor>     specify scale factor for nt\n"
+        "\t--stencil <order>       specify order of spatial discretization (2 or 4)\n"
+        "\t--no_zmirror            do not use z-mirror symmetry of the layers\n"
+        "\t--exp_clearance         integrate source and clearance exactly\n"
 		"\t--ez1 <ez1>             specify z-position of bottom of cylinder (<0)\n"
 		"\t--ez2 <ez2>             specify z-position of top of cylinder (>0)\n"
+		"\t--snap_layers           snap layer boundaries midway between grid points\n"
         "\t--alpha_so <alpha_so>   specify alpha_so\n"
         "\t--alpha_sp <alpha_sp>   specify initial alpha_sp\n"
         "\t--alpha_sr <alpha_sr>   specify alpha_sr\n"
         "\t--theta_so <theta_so>   specify theta_so\n"
         "\t--theta_sp <theta_sp>   specify initial theta_sp\n"
         "\t--theta_sr <theta_sr>   specify theta_sr\n"
+        "\t--theta_z_so <t_z_so>  specify axial theta_z_so (default: theta_so)\n"
+        "\t--theta_z_sp <t_z_sp>  specify initial theta_z_sp (default: theta_sp)\n"
+        "\t--theta_z_sr <t_z_sr>  specify axial theta_z_sr (default: theta_sr)\n"
         "\t--kappa_so <kappa_so>   specify kappa_so\n"
         "\t--kappa_sp <kappa_sp>   specify initial kappa_sp\n"
         "\t--kappa_sr <kappa_sr>   specify kappa_sr\n"
         "\t--kappa_outside <k_out> specify kappa_outside (mutually excl. with -g)\n"
+        "\t--vmax_so <vmax_so>     specify Michaelis-Menten Vmax in SO (mM/s)\n"
+        "\t--vmax_sp <vmax_sp>     specify (initial) Michaelis-Menten Vmax in SP\n"
+        "\t--vmax_sr <vmax_sr>     specify Michaelis-Menten Vmax in SR (mM/s)\n"
+        "\t--km_so <km_so>         specify Michaelis-Menten Km in SO (mM)\n"
+        "\t--km_sp <km_sp>         specify (initial) Michaelis-Menten Km in SP\n"
+        "\t--km_sr <km_sr>         specify Michaelis-Menten Km in SR (mM)\n"
+        "\t--layer <z,a,t,k[,v,km[,t_z]]> add a layer (from the bottom up) with\n"
+        "\t                        top at z, alpha, theta, kappa (and Vmax, Km,\n"
+        "\t                        theta_z); replaces the 3 layers (repeat)\n"
+        "\t--fit_layer <n>         fit layer n (default: SP, or the layer with the source)\n"
+        "\t--fit_uptake            also fit vmax_sp and km_sp\n"
+        "\t--fit_theta_z           also fit theta_z_sp (otherwise theta_z_sp/theta_sp is fixed)\n"
         "\t--alpha_step <a_step>   specify initial step in alpha_sp direction\n"
         "\t--theta_step <t_step>   specify initial step in theta_sp direction\n"
         "\t--kappa_step <k_step>   specify initial step in kappa_sp direction\n"
+        "\t--vmax_step <v_step>    specify initial step in vmax_sp direction\n"
+        "\t--km_step <km_step>     specify initial step in km_sp direction\n"
         "\t--minalpha <minalpha>   specify minimum value of alpha_sp\n"
         "\t--maxalpha <maxalpha>   specify maximum value of alpha_sp\n"
         "\t--mintheta <mintheta>   specify minimum value of theta_sp\n"
         "\t--maxtheta <maxtheta>   specify maximum value of theta_sp\n"
         "\t--minkappa <minkappa>   specify minimum value of kappa_sp\n"
         "\t--maxkappa <maxkappa>   specify maximum value of kappa_sp\n"
+        "\t--minvmax <minvmax>     specify minimum value of vmax_sp\n"
+        "\t--maxvmax <maxvmax>     specify maximum value of vmax_sp\n"
+        "\t--minkm <minkm>         specify minimum value of km_sp\n"
+        "\t--maxkm <maxkm>         specify maximum value of km_sp\n"
         "\t--tmax <tmax>           specify total duration of experiment\n"
         "\t--fit_tol <fit_tol>     specify stopping criterion (simplex size)\n"
         "\t--itermax <itermax>     specify stopping criterion (max iterations)\n"
@@ -87,6 +112,46 @@ void print_usage_fit_layer(char *program)
         "\t--pathfile <pathfile>   specify simplex path output file (just \n"
         "\t                        one vertex of the simplex per iteration)\n"
         );
+    fprintf(stderr, 
+        "\t--mcmc <nwalkers>       after the fit, sample the posterior with an\n"
+        "\t                        ensemble of nwalkers walkers (even, >= 2 x\n"
+        "\t                        number of fitted parameters)\n"
+        "\t--mcmc_steps <n>        specify number of MCMC steps (1000)\n"
+        "\t--mcmc_burn <n>         specify number of burn-in steps (half)\n"
+        "\t--mcmc_sigma <sigma>    specify noise of the data in mM (default:\n"
+        "\t                        rms residual of the fit)\n"
+        "\t--mcmc_seed <seed>      specify seed of the random numbers (1)\n"
+        "\t--profile <npoints>     after the fit, calculate the profile likelihood\n"
+        "\t                        of alpha_sp, theta_sp, kappa_sp with npoints\n"
+        "\t                        points on each side of the fit\n"
+        "\t--profile_scale <f>     specify spacing of the profile points as a\n"
+        "\t                        fraction of the initial steps (0.05)\n"
+        "\t--chainfile <file>      specify binary MCMC chain file (<basename>.chain)\n"
+        "\t--recording <file>      fit also the recording in file (same format as\n"
+        "\t                        the input file, same tissue and tmax; repeat\n"
+        "\t                        for more recordings)\n"
+        "\t--frames <file>         fit also the IOI image stack described in file\n"
+        "\t                        (frames of the source of the input file)\n"
+        "\t--frames_weight <w>     specify weight of the pixel residuals (1)\n"
+        "\t--transform             fit in coordinates that map to the bounds\n"
+        "\t                        (--minalpha ... --maxkm) instead of penalties\n"
+        );
+    fprintf(stderr, 
+        "\t--optimizer <name>      specify the optimizer of the fit: nmsimplex\n"
+        "\t                        (default), nmsimplex2 (with restarts), trust\n"
+        "\t                        (derivative-free trust region), lm\n"
+        "\t                        (Levenberg-Marquardt), or cmaes (uses the seed\n"
+        "\t                        of --mcmc_seed)\n"
+        "\t--benchmark <n>         instead of the fit, fit n synthetic recordings\n"
+        "\t                        with each optimizer and compare the number of\n"
+        "\t                        forward solves, the time, and the errors\n"
+        "\t--benchmark_noise <s>   specify noise of the synthetic recordings in\n"
+        "\t                        mM (0.001)\n"
+        "\t--fitdb <file>          start the fit from the nearest previous fit in\n"
+        "\t                        the database file and append the fit to it\n"
+        "\t--fitdb_tag <tag>       specify the condition tag (one word) of the\n"
+        "\t                        fits in the database (default)\n"
+        );
     exit(EXIT_FAILURE);
 }
 
@@ -121,10 +186,10 @@ void check_filename(char *in, char *out)
 
   \return Pointer to the new array
  */
-double *create_array(int N, char *string)
+double *create_array(size_t N, char *string)
 {
 	double *a;
-	int i;
+	size_t i;
 
 	a = (double *)malloc(sizeof(double) * N);
 	if (a == NULL)
@@ -2,7 +2,8 @@
   \file fit-layer.c
 
   Fits the 3-layer model to RTI data to determine alpha,  
-  theta, and kappa of the SP layer.
+  theta, and kappa of the SP layer (and optionally the 
+  Michaelis-Menten uptake parameters Vmax and Km of the SP layer).
 
   Usage:
 
@@ -49,46 +50,75 @@
 #include <strings.h>
 #include <time.h>
 #include <gsl/gsl_multimin.h>
+#include <gsl/gsl_rng.h>
+#include <gsl/gsl_randist.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "header.h"
 
+/// Typedef for struct for a recording (data) of the fit
+typedef struct {
+	int nd;                ///< Number of data points.
+	int solve;             ///< Index of the forward solve that gives the model curve.
+	int probe;             ///< Index of the probe of the recording in its forward solve.
+	double scale;          ///< Source amplitude of the recording / that of its forward solve.
+	double *t_data;        ///< Time array for data.
+	double *p_data;        ///< Probe concentration data.
+} recording_struct_type;
+
+/// Typedef for struct for a forward solve (recordings with the same source)
+typedef struct {
+	int nprobes;                  ///< Number of probes.
+	int iprobe[MAX_RECORDINGS];   ///< z-indices of probe locations.
+	int jprobe[MAX_RECORDINGS];   ///< r-indices of probe locations.
+	double sd;             ///< Source delay (time before source starts).
+	double st;             ///< Duration of source.
+	double sa;             ///< Source amplitude.
+	double *s;             ///< Source array.
+	double *p;             ///< Probe concentrations calculated from model (p[n*nt+k] for probe n).
+} solve_struct_type;
+
 /// Typedef for struct for passing parameters and arrays to mse function
 typedef struct {
     int nt;                ///< Number of support points in time.
-	int nd;                ///< Number of data points.
+	int nrec;              ///< Number of recordings (1, or more for a joint fit).
+	recording_struct_type rec[MAX_RECORDINGS];  ///< Recordings.
+	int nsolves;           ///< Number of forward solves.
+	solve_struct_type solve[MAX_RECORDINGS];  ///< Forward solves.
 	int nz;                ///< Number of support points in z (rows of concentration matrix).
 	int nr;                ///< Number of support points in r (columns of concentration matrix).
-	int iprobe;            ///< z-index of probe location.
-	int jprobe;            ///< r-index of probe location.
-	int iz1;               ///< z-index of SR-SP boundary.
-	int iz2;               ///< z-index of SP-SO boundary.
+	layer_table_struct_type layers;  ///< Layer table (boundaries on the model grid).
+	int fit_layer;         ///< Index of the fitted layer in the layer table.
 	int nolayer;           ///< Flag for no layer (homogenous environment).
+	int stencil;           ///< Order of the spatial discretization (2 or 4).
+	int zmirror;           ///< Number of ghost rows below the source for z-mirror symmetry.
+	int exp_clearance;     ///< Flag for exact integration of the source and clearance.
 	int opt_global_kappa;  ///< True if user specifies that kappa be the same in all layers.
+	int fit_uptake;        ///< True if Vmax and Km of the fitted layer are also fitted.
+	int fit_theta_z;       ///< True if theta_z of the fitted layer is also fitted (last parameter).
+	double theta_z_ratio;  ///< theta_z / theta of the fitted layer if theta_z is not fitted.
     double dt;             ///< Spacing in time.
     double dr;             ///< Spacing in r (in this program, same as spacing in z).
-    double sd;             ///< Source delay (time before source starts).
-    double st;             ///< Duration of source.
-	double alpha_so;       ///< Extracellular volume fraction in SO layer.
-	double theta_so;       ///< Permeability in SO layer.
-	double kappa_so;       ///< Nonspecific clearance factor in SO layer.
-	double alpha_sp;       ///< Extracellular volume fraction in SP layer.
-	double theta_sp;       ///< Permeability in SP layer.
-	double kappa_sp;       ///< Nonspecific clearance factor in SP layer.
-	double alpha_sr;       ///< Extracellular volume fraction in SR layer.
-	double theta_sr;       ///< Permeability in SR layer.
-	double kappa_sr;       ///< Nonspecific clearance factor in SR layer.
-	double minalpha;       ///< Lower boundary for alpha_sp (add penalty if alpha_sp is out of bounds).
-	double maxalpha;       ///< Upper boundary for alpha_sp (add penalty if alpha_sp is out of bounds).
-	double mintheta;       ///< Lower boundary for theta_sp (add penalty if theta_sp is out of bounds).
-	double maxtheta;       ///< Upper boundary for theta_sp (add penalty if theta_sp is out of bounds).
-	double minkappa;       ///< Lower boundary for kappa_sp (add penalty if kappa_sp is out of bounds).
-	double maxkappa;       ///< Upper boundary for kappa_sp (add penalty if kappa_sp is out of bounds).
+	double minalpha;       ///< Lower boundary for alpha of the fitted layer (add penalty if out of bounds).
+	double maxalpha;       ///< Upper boundary for alpha of the fitted layer (add penalty if out of bounds).
+	double mintheta;       ///< Lower boundary for theta of the fitted layer (add penalty if out of bounds).
+	double maxtheta;       ///< Upper boundary for theta of the fitted layer (add penalty if out of bounds).
+	double minkappa;       ///< Lower boundary for kappa of the fitted layer (add penalty if out of bounds).
+	double maxkappa;       ///< Upper boundary for kappa of the fitted layer (add penalty if out of bounds).
+	double minvmax;        ///< Lower boundary for vmax of the fitted layer (add penalty if out of bounds).
+	double maxvmax;        ///< Upper boundary for vmax of the fitted layer (add penalty if out of bounds).
+	double minkm;          ///< Lower boundary for km of the fitted layer (add penalty if out of bounds).
+	double maxkm;          ///< Upper boundary for km of the fitted layer (add penalty if out of bounds).
     double dfree;          ///< Free diffusion coefficient.
     double *t;             ///< Time array for model.
-    double *s;             ///< Source array.
     double *invr;          ///< Array of 1/r values.
-    double *t_data;        ///< Time array for data.
-    double *p_data;        ///< Probe concentration data.
-    double *p;             ///< Probe concentration calculated from model.
+	frames_struct_type *frames;  ///< Image stack (frames of the first recording), or NULL.
+	double frames_weight;  ///< Weight of the squared residuals of the frames.
+	double frames_gain;    ///< Gain of the model frames.
+	double *c_frames;      ///< Concentration matrices at the frames.
+	double *model_frames;  ///< Model frames.
+	double *res;           ///< Residuals of the fit (see calc_residuals_fit_layer()), or NULL.
 } param_struct_type;
 
 
@@ -108,7 +138,21 @@ typedef struct {
 
   \author Dave Lewis, CABI, NKI
 
-  \param [in,out] x Vector of parameters to fit (alpha, theta, kappa of SP)
+  In a joint fit of several recordings, the MSE is taken over 
+  the data points of all recordings. Recordings that share a 
+  forward solve (see solve_struct_type) get their curves from 
+  its probes, and the other forward solves are calculated in 
+  parallel with OpenMP. 
+
+  With an image stack (--frames), the weighted squared residuals of 
+  all pixels of all frames are added (see frames.c), and the MSE is 
+  taken over the data points and the pixels. 
+
+  If theta_z is not fitted, the axial permeability of the fitted 
+  layer keeps its starting ratio to theta, so an isotropic layer 
+  stays isotropic. 
+
+  \param [in,out] x Vector of parameters to fit (alpha, theta, kappa of the fitted layer, its Vmax, Km if fit_uptake, and its theta_z if fit_theta_z)
   \param [in,out] params Struct of parameters and arrays (e.g., geometry of environment, nt, time array, data array, model curve array)
 
   \return Mean squared error between model and data; the model data is returned in an array in the params struct
@@ -116,69 +160,421 @@ typedef struct {
 double calc_mse_fit_layer(const gsl_vector *x, void *params)
 {
 	int i = -1;
+	int r = -1;
 	param_struct_type *p = (param_struct_type *) params;
 	int nt = p->nt;
-	int nd = p->nd;
+	int nd = -1;
+	int nres = 0;  // Number of residuals
+	double *pm = NULL;  // Model curve of a recording
+	recording_struct_type *rec = NULL;
 	int p_index = -1;
 	double index_scale = -1.;
-
-
-	p->alpha_sp = gsl_vector_get(x, 0);
-	p->theta_sp = gsl_vector_get(x, 1);
-	p->kappa_sp = gsl_vector_get(x, 2);
-	if (p->alpha_sp <= 0.001) p->alpha_sp = 0.001;
-	if (p->theta_sp <= 0.001) p->theta_sp = 0.001;
-
-	if (p->opt_global_kappa) {
-		p->kappa_sr = p->kappa_sp;
-		p->kappa_so = p->kappa_sp;
+	int fl = p->fit_layer;
+	layer_table_struct_type *layers = &p->layers;
+
+
+	layers->alpha[fl] = gsl_vector_get(x, 0);
+	layers->theta[fl] = gsl_vector_get(x, 1);
+	layers->kappa[fl] = gsl_vector_get(x, 2);
+	if (layers->alpha[fl] <= 0.001) layers->alpha[fl] = 0.001;
+	if (layers->theta[fl] <= 0.001) layers->theta[fl] = 0.001;
+	if (p->fit_uptake) {
+		layers->vmax[fl] = gsl_vector_get(x, 3);
+		layers->km[fl] = gsl_vector_get(x, 4);
+		if (layers->vmax[fl] < 0.) layers->vmax[fl] = 0.;
+		if (layers->km[fl] <= 0.001) layers->km[fl] = 0.001;
 	}
+	if (p->fit_theta_z) {
+		layers->theta_z[fl] = gsl_vector_get(x, x->size - 1);
+		if (layers->theta_z[fl] <= 0.001) layers->theta_z[fl] = 0.001;
+	} else
+		layers->theta_z[fl] = layers->theta[fl] * p->theta_z_ratio;
+
+	if (p->opt_global_kappa) 
+		for (i=0; i<layers->n; i++) 
+			layers->kappa[i] = layers->kappa[fl];
    
-	calc_diffusion_curve_layer_fit_layer(p->nt, p->nz, p->nr, 
-		p->iprobe, p->jprobe, p->iz1, p->iz2, 
-		p->nolayer, p->dt, p->dr, p->sd, p->st, 
-		p->alpha_so, p->theta_so, p->kappa_so, 
-		p->alpha_sp, p->theta_sp, p->kappa_sp, 
-		p->alpha_sr, p->theta_sr, p->kappa_sr, 
-		p->dfree, p->t, p->s, p->invr, p->p);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if (p->nsolves > 1)
+#endif
+	for (i=0; i<p->nsolves; i++) {
+		solve_struct_type *sv = &p->solve[i];
+		calc_diffusion_curve_layer_fit_layer(p->nt, p->nz, p->nr, 
+			sv->nprobes, sv->iprobe, sv->jprobe, layers, 
+			p->nolayer, p->stencil, p->zmirror, 
+			p->exp_clearance, 
+			p->dt, p->dr, sv->sd, sv->st, 
+			p->dfree, p->t, sv->s, p->invr, 
+			((i == 0) && p->frames) ? p->frames->n : 0, 
+			(p->frames) ? p->frames->step : NULL, p->c_frames, sv->p);
+	}
 
 	double mse = 0.;
-
-	if (nt > nd) {
-		index_scale = (double) nt / (double) nd;
-		for (i=1; i<nd; i++) {
-			p_index = (lround) (i * index_scale);
-			mse += SQR(p->p[p_index] - p->p_data[i]);
+	double res = 0.;
+	double *resp = p->res;  // Residuals of the recordings (i = 0 is not used)
+
+	for (r=0; r<p->nrec; r++) {
+		rec = &p->rec[r];
+		nd = rec->nd;
+		pm = p->solve[rec->solve].p + rec->probe * nt;
+		if (nt > nd) {
+			index_scale = (double) nt / (double) nd;
+			for (i=1; i<nd; i++) {
+				p_index = (lround) (i * index_scale);
+				res = rec->scale * pm[p_index] - rec->p_data[i];
+				mse += SQR(res);
+				if (resp) resp[i] = res;
+			}
+			nres += nd;
+		} else {
+			index_scale = (double) nd / (double) nt;
+			for (i=1; i<nt; i++) {
+				p_index = (lround) (i * index_scale);
+				res = rec->scale * pm[i] - rec->p_data[p_index];
+				mse += SQR(res);
+				if (resp) resp[i] = res;
+			}
+			nres += nt;
 		}
-		mse /= nd;
-	} else {
-		index_scale = (double) nd / (double) nt;
-		for (i=1; i<nt; i++) {
-			p_index = (lround) (i * index_scale);
-			mse += SQR(p->p[i] - p->p_data[p_index]);
+		if (resp) {
+			resp[0] = 0.;
+			resp += MIN(nt, nd);
 		}
-		mse /= nt;
 	}
+	if (p->frames) {
+		res = p->frames_weight * frames_sse(p->nz, p->nr, p->c_frames, 
+			p->frames, p->model_frames, &p->frames_gain);
+		mse += res;
+		nres += p->frames->n * p->frames->width * p->frames->height;
+		if (resp) resp[0] = sqrt(res);
+	}
+	mse /= nres;
 
 	double penalty_factor = 10.;  // Hard-coding this 
 
-	if (p->alpha_sp < p->minalpha) 
-		mse += (p->minalpha - p->alpha_sp) * penalty_factor;
-	if (p->alpha_sp > p->maxalpha) 
-		mse += (p->alpha_sp - p->maxalpha) * penalty_factor;
-	if (p->theta_sp < p->mintheta) 
-		mse += (p->mintheta - p->theta_sp) * penalty_factor;
-	if (p->theta_sp > p->maxtheta) 
-		mse += (p->theta_sp - p->maxtheta) * penalty_factor;
-	if (p->kappa_sp < p->minkappa) 
-		mse += (p->minkappa - p->kappa_sp) * penalty_factor;
-	if (p->kappa_sp > p->maxkappa) 
-		mse += (p->kappa_sp - p->maxkappa) * penalty_factor;
+	if (layers->alpha[fl] < p->minalpha) 
+		mse += (p->minalpha - layers->alpha[fl]) * penalty_factor;
+	if (layers->alpha[fl] > p->maxalpha) 
+		mse += (layers->alpha[fl] - p->maxalpha) * penalty_factor;
+	if (layers->theta[fl] < p->mintheta) 
+		mse += (p->mintheta - layers->theta[fl]) * penalty_factor;
+	if (layers->theta[fl] > p->maxtheta) 
+		mse += (layers->theta[fl] - p->maxtheta) * penalty_factor;
+	if (p->fit_theta_z) {
+		if (layers->theta_z[fl] < p->mintheta) 
+			mse += (p->mintheta - layers->theta_z[fl]) * penalty_factor;
+		if (layers->theta_z[fl] > p->maxtheta) 
+			mse += (layers->theta_z[fl] - p->maxtheta) * penalty_factor;
+	}
+	if (layers->kappa[fl] < p->minkappa) 
+		mse += (p->minkappa - layers->kappa[fl]) * penalty_factor;
+	if (layers->kappa[fl] > p->maxkappa) 
+		mse += (layers->kappa[fl] - p->maxkappa) * penalty_factor;
+	if (p->fit_uptake) {
+		if (layers->vmax[fl] < p->minvmax) 
+			mse += (p->minvmax - layers->vmax[fl]) * penalty_factor;
+		if (layers->vmax[fl] > p->maxvmax) 
+			mse += (layers->vmax[fl] - p->maxvmax) * penalty_factor;
+		if (layers->km[fl] < p->minkm) 
+			mse += (p->minkm - layers->km[fl]) * penalty_factor;
+		if (layers->km[fl] > p->maxkm) 
+			mse += (layers->km[fl] - p->maxkm) * penalty_factor;
+	}
+
+	return mse;
+}
+
+
+/**
+  \brief Residuals function for Levenberg-Marquardt fitting 
+  (--optimizer lm). 
+
+  The residuals are the model minus the data of the recordings (in 
+  the order of the recordings, MIN(nt, nd) per recording, the first 
+  of which is 0), and the square root of the weighted sum of squared 
+  residuals of the frames (if --frames). Their sum of squares is the 
+  MSE times the number of residuals of calc_mse_fit_layer(), without 
+  the penalties. 
+
+  \param [in] x Vector of parameters to fit (see calc_mse_fit_layer())
+  \param [in,out] params Struct of parameters and arrays
+  \param [out] r Residuals
+
+  \return Mean squared error between model and data (calc_mse_fit_layer())
+ */
+double calc_residuals_fit_layer(const gsl_vector *x, void *params, double *r)
+{
+	param_struct_type *p = (param_struct_type *) params;
+	double mse;
+
+	p->res = r;
+	mse = calc_mse_fit_layer(x, params);
+	p->res = NULL;
 
 	return mse;
 }
 
 
+/**
+  \brief Gets the bounds of the fitted parameters (in the order of the 
+  parameter vector of calc_mse_fit_layer()).
+
+  \param [in] p Struct of parameters (minalpha ... maxkm)
+  \param [in] nfit Number of fitted parameters
+  \param [out] xmin Lower bounds
+  \param [out] xmax Upper bounds
+ */
+static void fit_bounds(param_struct_type *p, int nfit, double *xmin, double *xmax)
+{
+	xmin[0] = p->minalpha;  xmax[0] = p->maxalpha;
+	xmin[1] = p->mintheta;  xmax[1] = p->maxtheta;
+	xmin[2] = p->minkappa;  xmax[2] = p->maxkappa;
+	if (p->fit_uptake) {
+		xmin[3] = p->minvmax;  xmax[3] = p->maxvmax;
+		xmin[4] = p->minkm;  xmax[4] = p->maxkm;
+	}
+	if (p->fit_theta_z) {
+		xmin[nfit-1] = p->mintheta;  xmax[nfit-1] = p->maxtheta;
+	}
+}
+
+
+/**
+  \def TRANSFORM_WIDTH
+  Width of the bends of the map of bounded_params() at the bounds, as 
+  a fraction of the range of the bounds.
+ */
+#define TRANSFORM_WIDTH 0.001
+
+
+/**
+  \brief Softplus function \f$ \ln(1 + e^t) \f$ , without overflow 
+  for large \a t.
+
+  \param [in] t Argument
+
+  \return \f$ \ln(1 + e^t) \f$
+ */
+static double softplus(double t)
+{
+	return (t > 0.) ? t + log1p(exp(-t)) : log1p(exp(t));
+}
+
+
+/**
+  \brief Maps the transformed coordinates of the fit (--transform) to 
+  the parameters, 
+  \f$ x = x_{min} + w \, [\ln(1 + e^{(u - x_{min})/w}) - 
+  \ln(1 + e^{(u - x_{max})/w})] \f$ 
+  with \f$ w \f$ TRANSFORM_WIDTH of the range of the bounds.  The map 
+  is the identity between the bounds and bends into each bound over 
+  a width \f$ w \f$ (its derivative is the difference of two 
+  logistic functions of width \f$ w \f$ ), so every point that the 
+  simplex evaluates is within the bounds, and the MSE is only 
+  flattened within about \f$ w \f$ of a bound. 
+
+  \param [in] u Transformed coordinates
+  \param [in] p Struct of parameters (bounds of the fitted parameters)
+  \param [out] x Parameters
+  \param [out] dxdu Derivatives \f$ dx/du \f$ (or NULL)
+ */
+static void bounded_params(const gsl_vector *u, param_struct_type *p, gsl_vector *x, double *dxdu)
+{
+	int a;
+	int n = u->size;
+	double xmin[6], xmax[6], w, lo, hi;
+
+	fit_bounds(p, n, xmin, xmax);
+	for (a=0; a<n; a++) {
+		w = TRANSFORM_WIDTH * (xmax[a] - xmin[a]);
+		lo = (gsl_vector_get(u, a) - xmin[a]) / w;
+		hi = (gsl_vector_get(u, a) - xmax[a]) / w;
+		gsl_vector_set(x, a, xmin[a] + w * (softplus(lo) - softplus(hi)));
+		if (dxdu) 
+			dxdu[a] = 1.0 / (1.0 + exp(-lo)) - 1.0 / (1.0 + exp(-hi));
+	}
+}
+
+
+/**
+  \brief Inverse of the map of bounded_params() for one parameter:  
+  the transformed coordinate of a parameter strictly within its bounds.
+
+  \param [in] x Parameter
+  \param [in] xmin Lower bound
+  \param [in] xmax Upper bound
+
+  \return Transformed coordinate \f$ u \f$
+ */
+static double bounded_coord(double x, double xmin, double xmax)
+{
+	double w = TRANSFORM_WIDTH * (xmax - xmin);
+	double t = (x - xmin) / w;
+
+	return xmin + w * (t + log(- expm1(-t)) - log(- expm1((x - xmax) / w)));
+}
+
+
+/**
+  \brief Mean squared error function for simplex fitting in the 
+  transformed coordinates (--transform): calc_mse_fit_layer() at the 
+  parameters of bounded_params(). The penalties of 
+  calc_mse_fit_layer() are 0, so the function is smooth.
+
+  \param [in] u Transformed coordinates of the fitted parameters
+  \param [in,out] params Struct of parameters and arrays
+
+  \return Mean squared error between model and data
+ */
+double calc_mse_fit_layer_bounded(const gsl_vector *u, void *params)
+{
+	gsl_vector *x = gsl_vector_alloc(u->size);
+	double mse;
+
+	bounded_params(u, (param_struct_type *) params, x, NULL);
+	mse = calc_mse_fit_layer(x, params);
+	gsl_vector_free(x);
+
+	return mse;
+}
+
+
+/**
+  \brief Benchmark of the optimizer backends (--benchmark). 
+
+  The data of the recordings are replaced by synthetic data: the 
+  model curves at "true" parameters, drawn uniformly within one 
+  initial step of the starting values (and within the bounds), plus 
+  Gaussian noise. Each synthetic data set is fitted with every backend 
+  of optimize.c from the starting values. The number of evaluations 
+  (each is a forward solve of every forward solve of the fit), the wall 
+  time, the final MSE, and the errors of alpha and theta (relative) 
+  and kappa (absolute) are written for each fit, and their means (and 
+  the number of fits that converged) for each backend. 
+
+  \param [in,out] p Struct of parameters and arrays (the data are changed)
+  \param [in] nfit Number of fitted parameters
+  \param [in] x_start Starting values of the fitted parameters
+  \param [in] steps Initial steps of the fitted parameters
+  \param [in] fit_tol Stopping criterion (size)
+  \param [in] itermax Stopping criterion (maximum number of iterations)
+  \param [in] nres Number of residuals
+  \param [in] ncases Number of synthetic data sets
+  \param [in] noise Standard deviation of the noise (mM)
+  \param [in] seed Seed of the random numbers
+  \param [in] file_ptr Output file (the results are also printed)
+ */
+static void benchmark_optimizers(param_struct_type *p, int nfit, double *x_start, double *steps, double fit_tol, int itermax, int nres, int ncases, double noise, unsigned long seed, FILE *file_ptr)
+{
+	int a, c, i, m, o, r, niter, nevals, status, nd;
+	int nt = p->nt;
+	double xmin[6], xmax[6], x_true[6], x[6], err[3];
+	double fval, size, wall;
+	double sum_evals[NUM_OPTIMIZERS], sum_wall[NUM_OPTIMIZERS];
+	double sum_mse[NUM_OPTIMIZERS], sum_err[NUM_OPTIMIZERS][3];
+	int nconverged[NUM_OPTIMIZERS];
+	double *pm = NULL;
+	double index_scale = -1.;
+	recording_struct_type *rec = NULL;
+	gsl_vector *xv = gsl_vector_alloc(nfit);
+	gsl_rng *rng = gsl_rng_alloc(gsl_rng_mt19937);
+	FILE *out[2];
+
+	out[0] = stdout;
+	out[1] = file_ptr;
+	gsl_rng_set(rng, seed);
+	fit_bounds(p, nfit, xmin, xmax);
+	for (o=0; o<NUM_OPTIMIZERS; o++) {
+		sum_evals[o] = sum_wall[o] = sum_mse[o] = 0.;
+		sum_err[o][0] = sum_err[o][1] = sum_err[o][2] = 0.;
+		nconverged[o] = 0;
+	}
+
+	for (m=0; m<2; m++) {
+		fprintf(out[m], "# Benchmark of the optimizers: %d synthetic data sets, "
+			"noise = %g mM, seed = %lu\n", ncases, noise, seed);
+		fprintf(out[m], "# Benchmark: optimizer\tcase\tevaluations\tforward solves"
+			"\ttime (s)\tfinal MSE\talpha error\ttheta error\tkappa error"
+			"\tconverged\n");
+	}
+
+	for (c=0; c<ncases; c++) {
+		// Synthetic data (the model curves are downsampled to the data 
+		// points as in calc_mse_fit_layer()) 
+		for (a=0; a<nfit; a++) {
+			x_true[a] = x_start[a] + steps[a] * (2.0 * gsl_rng_uniform(rng) - 1.0);
+			x_true[a] = MIN(MAX(x_true[a], xmin[a]), xmax[a]);
+			gsl_vector_set(xv, a, x_true[a]);
+		}
+		calc_mse_fit_layer(xv, p);
+		for (r=0; r<p->nrec; r++) {
+			rec = &p->rec[r];
+			nd = rec->nd;
+			pm = p->solve[rec->solve].p + rec->probe * nt;
+			if (nt > nd) {
+				index_scale = (double) nt / (double) nd;
+				for (i=0; i<nd; i++) 
+					rec->p_data[i] = rec->scale * pm[lround(i * index_scale)] 
+						+ gsl_ran_gaussian(rng, noise);
+			} else {
+				index_scale = (double) nd / (double) nt;
+				for (i=0; i<nt; i++) 
+					rec->p_data[lround(i * index_scale)] = rec->scale * pm[i] 
+						+ gsl_ran_gaussian(rng, noise);
+			}
+		}
+
+		for (o=0; o<NUM_OPTIMIZERS; o++) {
+			memcpy(x, x_start, nfit*sizeof(double));
+#ifdef _OPENMP
+			wall = omp_get_wtime();
+#else
+			wall = (double) clock() / CLOCKS_PER_SEC;
+#endif
+			status = optimize(o, nfit, x, steps, xmin, xmax, fit_tol, itermax, 
+				calc_mse_fit_layer, calc_residuals_fit_layer, p, nres, seed + c, 
+				FALSE, NULL, &fval, &size, &niter, &nevals);
+#ifdef _OPENMP
+			wall = omp_get_wtime() - wall;
+#else
+			wall = (double) clock() / CLOCKS_PER_SEC - wall;
+#endif
+			err[0] = fabs(x[0] - x_true[0]) / x_true[0];
+			err[1] = fabs(x[1] - x_true[1]) / x_true[1];
+			err[2] = fabs(x[2] - x_true[2]);
+
+			sum_evals[o] += nevals;
+			sum_wall[o] += wall;
+			sum_mse[o] += fval;
+			for (a=0; a<3; a++) 
+				sum_err[o][a] += err[a];
+			if (status == GSL_SUCCESS) nconverged[o]++;
+			for (m=0; m<2; m++) 
+				fprintf(out[m], "# Benchmark: %s\t%d\t%d\t%d\t%f\t%g\t%g\t%g\t%g\t%s\n", 
+					optimizer_name(o), c+1, nevals, nevals * p->nsolves, wall, 
+					fval, err[0], err[1], err[2], 
+					(status == GSL_SUCCESS) ? "yes" : "no");
+		}
+	}
+
+	for (m=0; m<2; m++) {
+		fprintf(out[m], "# Benchmark means: optimizer\tevaluations\tforward solves"
+			"\ttime (s)\tfinal MSE\talpha error\ttheta error\tkappa error"
+			"\tconverged\n");
+		for (o=0; o<NUM_OPTIMIZERS; o++) 
+			fprintf(out[m], "# Benchmark means: %s\t%.1f\t%.1f\t%f\t%g\t%g\t%g\t%g\t%d/%d\n", 
+				optimizer_name(o), sum_evals[o] / ncases, 
+				sum_evals[o] * p->nsolves / ncases, sum_wall[o] / ncases, 
+				sum_mse[o] / ncases, sum_err[o][0] / ncases, 
+				sum_err[o][1] / ncases, sum_err[o][2] / ncases, 
+				nconverged[o], ncases);
+	}
+
+	gsl_vector_free(xv);
+	gsl_rng_free(rng);
+}
+
+
 /// Main program
 int main(int argc, char *argv[])
 {
@@ -236,6 +632,8 @@ int main(int argc, char *argv[])
 	int specified_lz2 = FALSE;  // True if user specifies lz1
 	int iz1 = -1;  // z-index of lower boundary of SP 
 	int iz2 = -1;  // z-index of upper boundary of SP 
+	int snap_layers = FALSE; // Flag for snapping the layer boundaries 
+	                         // to fall midway between grid points
 	int nolayer = FALSE; // Flag for no layer (homogenous environment)
 
 	double ez1 = -1.;   // Location of lower edge of cylinder 
@@ -257,6 +655,11 @@ int main(int argc, char *argv[])
 	double dr = -1.;
 	double dz = -1.;
 	double dt = -1.;
+	int stencil = 2;  // Order of the spatial discretization (2 or 4)
+	int use_zmirror = TRUE;  // Flag for using z-mirror symmetry if possible
+	int exp_clearance = FALSE;  // Flag for exact integration of source and clearance
+	int zmirror = 0;  // Number of ghost rows below the source (0 = no symmetry)
+	int izshift = 0;  // Row of the full grid that is row 0 of the model grid
 
 	// Source 
 	double trn = 0.35;  // Transport number of the source electrode
@@ -280,8 +683,32 @@ int main(int argc, char *argv[])
 	double pr = 0.0;  // Probe r coordinate
 	double pz = -1.;  // Probe z coordinate
 	int specified_pz = FALSE;  // True if user specifies pz
-	int iprobe, jprobe;  // z- and r-indices of probe position
-	iprobe = jprobe = -1;
+	int iprobe = -1;  // z-index of probe position
+
+	// Joint fit of several recordings (--recording). Recording 0 is 
+	// the input file; the others have their own probe position and 
+	// source, but the same tissue and grid. 
+	int nrec = 1;  // Number of recordings
+	char recfilename[MAX_RECORDINGS][FILENAME_MAX];  // Recording files (0: input file)
+	double rec_pz[MAX_RECORDINGS], rec_pr[MAX_RECORDINGS];  // Probe positions (m)
+	double rec_crnt[MAX_RECORDINGS], rec_trn[MAX_RECORDINGS];  // Currents (A), transport numbers
+	double rec_sd[MAX_RECORDINGS], rec_st[MAX_RECORDINGS];  // Source delays and durations (s)
+	double rec_sa[MAX_RECORDINGS];  // Source amplitudes (mol/s)
+	int rec_iprobe[MAX_RECORDINGS], rec_jprobe[MAX_RECORDINGS];  // Probe indices on the model grid
+	int rec_nd[MAX_RECORDINGS];  // Numbers of data points
+	double *rec_tdata[MAX_RECORDINGS], *rec_pdata[MAX_RECORDINGS];  // Data
+	int nres = 0;  // Number of residuals of the fit (all recordings)
+	int nonlinear = FALSE;  // Model not linear in the source amplitude (uptake)
+	solve_struct_type *solve = NULL;
+	recording_struct_type *rec = NULL;
+
+	// Image stack of the first recording (--frames) 
+	char framesfilename[FILENAME_MAX];  // Frames file (empty: no frames)
+	memset(framesfilename, '\0', FILENAME_MAX);
+	frames_struct_type frames;
+	frames.n = 0;
+	double frames_weight = 1.0;  // Weight of the squared residuals of the pixels
+	int npix = 0;  // Number of pixels of all frames
 
 	// ECS parameters -- got defaults from paper -- p. 12 and Table 1 
 	// of manuscript submitted in summer 2011 
@@ -295,20 +722,40 @@ int main(int argc, char *argv[])
 	double alpha_sr = 0.218;
 	double theta_sr = 0.447;
 	double kappa_sr = 0.007;
+	double theta_z_so = -1.;  // Axial permeabilities (< 0: same as theta)
+	double theta_z_sp = -1.;
+	double theta_z_sr = -1.;
+	int fit_theta_z = FALSE;  // True if user wants theta_z of SP fitted
+	int anisotropic = FALSE;  // Flag for theta_z != theta in any layer
 	double kappa_outside = 0.007;  // Used when user specifies kappa outside the SP layer (= kappa_so = kappa_sr)
 	int specified_kappa_outside = FALSE;  // True when user specifies 
 	                                      // kappa outside the SP layer
+	// Michaelis-Menten uptake: Vmax in mM/s, Km in mM (no uptake if Vmax = 0)
+	int fit_uptake = FALSE;  // True if user wants Vmax and Km of SP fitted
+	double vmax_so = 0.0;
+	double km_so = 1.0;
+	double vmax_sp = 0.0;
+	double km_sp = 1.0;
+	double vmax_sr = 0.0;
+	double km_sr = 1.0;
 	// dstar = dfree * theta 
 	// dstar_max is used in calculating dt from the von Neumann criterion
-	double dstar_so, dstar_sp, dstar_sr, dstar_max;  
-	dstar_so = dstar_sp = dstar_sr = dstar_max = -1.;
+	double dstar_max = -1.;  
+
+	// Layer table. By default it has the SR, SP, and SO layers; 
+	// if the user specifies layers (from the bottom up), they 
+	// replace the 3 layers. 
+	layer_table_struct_type layers;
+	layers.n = 0;
+	int specified_layers = FALSE;  // Layers specified by the user
+	int cmdline_layers = FALSE;  // Layers specified on the command line
+	int fit_layer = -1;  // Index of the fitted layer (SP by default)
 
 	double dfree = 1.24e-09;  // Free diffusion coefficient 
 
 	// Arrays 
 	double *t = NULL;  // Time
 //	double *s = NULL;  // Source(z,r)
-	double *p = NULL;  // Probe (calculated from 3-layer model)
 	double *alphas = NULL;  // alpha(z,r)
 //	double *invr = NULL;  // 1/r
 
@@ -321,43 +768,42 @@ int main(int argc, char *argv[])
 	param_struct_type param_struct;
 
 	param_struct.nt = -1;
-	param_struct.nd = -1;
+	param_struct.nrec = 0;
+	param_struct.nsolves = 0;
 	param_struct.nz = -1;
 	param_struct.nr = -1;
-	param_struct.iprobe = -1;
-	param_struct.jprobe = -1;
-	param_struct.iz1 = -1;
-	param_struct.iz2 = -1;
+	param_struct.layers.n = 0;
+	param_struct.fit_layer = -1;
 	param_struct.nolayer = -1;
+	param_struct.stencil = -1;
+	param_struct.zmirror = -1;
+	param_struct.exp_clearance = -1;
 	param_struct.opt_global_kappa = -1;
+	param_struct.fit_uptake = -1;
+	param_struct.fit_theta_z = -1;
+	param_struct.theta_z_ratio = -1.;
 
 	param_struct.dt = -1.;
 	param_struct.dr = -1.;
-	param_struct.sd = -1.;
-	param_struct.st = -1.;
-	param_struct.alpha_so = -1.;
-	param_struct.theta_so = -1.;
-	param_struct.kappa_so = -1.;
-	param_struct.alpha_sp = -1.;
-	param_struct.theta_sp = -1.;
-	param_struct.kappa_sp = -1.;
-	param_struct.alpha_sr = -1.;
-	param_struct.theta_sr = -1.;
-	param_struct.kappa_sr = -1.;
 	param_struct.minalpha = -1.;
 	param_struct.maxalpha = -1.;
 	param_struct.mintheta = -1.;
 	param_struct.maxtheta = -1.;
 	param_struct.minkappa = -1.;
 	param_struct.maxkappa = -1.;
+	param_struct.minvmax = -1.;
+	param_struct.maxvmax = -1.;
+	param_struct.minkm = -1.;
+	param_struct.maxkm = -1.;
 	param_struct.dfree = -1.;
 
 	param_struct.t = NULL;
-	param_struct.s = NULL;
 	param_struct.invr = NULL;
-	param_struct.p = NULL;
-	param_struct.t_data = NULL;
-	param_struct.p_data = NULL;
+	param_struct.frames = NULL;
+	param_struct.frames_weight = -1.;
+	param_struct.frames_gain = -1.;
+	param_struct.c_frames = NULL;
+	param_struct.model_frames = NULL;
 
 
 	// Parameters for curve fitting 
@@ -367,15 +813,25 @@ int main(int argc, char *argv[])
 	double maxtheta = 0.75;
 	double minkappa = 0.0;    // Add penalty if kappa_sp outside range
 	double maxkappa = 0.1;
+	double minvmax = 0.0;     // Add penalty if vmax_sp outside range (--fit_uptake)
+	double maxvmax = 1.0;
+	double minkm = 0.001;     // Add penalty if km_sp outside range (--fit_uptake)
+	double maxkm = 100.0;
 	double alpha_fit = -1.;  // Value of alpha_sp from fit
 	double theta_fit = -1.;  // Value of theta_sp from fit
 	double kappa_fit = -1.;  // Value of kappa_sp from fit
+	double vmax_fit = -1.;   // Value of vmax_sp from fit (--fit_uptake)
+	double km_fit = -1.;     // Value of km_sp from fit (--fit_uptake)
+	double theta_z_fit = -1.;  // Value of theta_z_sp from fit (--fit_theta_z)
+	size_t nfit = 3;         // Number of parameters to fit
 	double mse = -1.;        // Mean squared error from fit
 	gsl_vector *steps = NULL;  // Step sizes for simplex
 	gsl_vector *simplex = NULL;  // Simplex for minimization
 	double alpha_step = 0.1;  // Initial step size for alpha_sp
 	double theta_step = 0.2;  // Initial step size for theta_sp
 	double kappa_step = 0.002;  // Initial step size for kappa_sp
+	double vmax_step = 0.01;  // Initial step size for vmax_sp
+	double km_step = 0.5;  // Initial step size for km_sp
 	// The following are used by the GSL minimization algorithm
 	const gsl_multimin_fminimizer_type *fit_algorithm = 
 		gsl_multimin_fminimizer_nmsimplex;
@@ -389,6 +845,54 @@ int main(int argc, char *argv[])
 	                         // a lower fit_tol gives a more precise 
 	                         // (but not necessarily more accurate) fit
 
+	// Ensemble MCMC sampling of the posterior after the fit (--mcmc)
+	int mcmc_walkers = 0;  // Number of walkers (0 = no sampling)
+	int mcmc_steps = 1000;  // Number of steps of each walker
+	int mcmc_burn = -1;  // Number of burn-in steps (< 0: half of the steps)
+	double mcmc_sigma = -1.;  // Noise of the data in mM (< 0: rms residual of the fit)
+	unsigned long mcmc_seed = 1;  // Seed of the random number generator
+	double mcmc_acceptance = -1.;  // Acceptance fraction of the moves
+	double mcmc_mean[6];  // Posterior means of the fitted parameters
+	double mcmc_sd[6];  // Posterior standard deviations of the fitted parameters
+	char chainfilename[FILENAME_MAX];  // Binary file for the chains
+	memset(chainfilename, '\0', FILENAME_MAX);
+
+	// Profile likelihood of alpha, theta, and kappa after the fit (--profile)
+	int profile_points = 0;  // Number of profile points on each side of the fit (0 = none)
+	double profile_scale = 0.05;  // Spacing of the profile points / initial step
+	double *profile_values = NULL;  // Values of the parameters at the profile points
+	double *profile_mses = NULL;  // MSE of the constrained fits at the profile points
+	double profile_lower[3], profile_upper[3];  // 95% confidence intervals
+	int profile_found_lower[3], profile_found_upper[3];  // Ends of the intervals found
+
+	// Shared by --profile and --mcmc
+	int nthreads = 1;  // Number of OpenMP threads
+	param_struct_type *thread_params = NULL;  // Copy of param_struct for each thread
+	void **thread_param_ptrs = NULL;
+	double x_fit[6];  // Fitted parameters
+	double xmin_fit[6], xmax_fit[6];  // Bounds of the fitted parameters
+	int opt_transform = FALSE;  // Fit in coordinates that respect the bounds
+	gsl_vector *fit_x = NULL;  // Fitted parameters (fit_state->x without --transform)
+	double fit_dxdu[6];  // Derivatives of the parameters in the transformed coordinates
+	double fit_u;  // Fraction of the bounds of a starting value
+	double fit_steps[6];  // Initial steps (array for optimize())
+	char fit_names[6][8];  // Names of the fitted parameters
+
+	// Optimizer backends (--optimizer) and their benchmark (--benchmark)
+	int optimizer = OPTIMIZER_NMSIMPLEX;  // Backend of the fit
+	int fit_evals = 0;  // Number of evaluations of the model by the backend
+	int nresid = 0;  // Number of residuals of calc_residuals_fit_layer()
+	int benchmark_cases = 0;  // Number of synthetic fits (0 = no benchmark)
+	double benchmark_noise = 0.001;  // Noise of the synthetic recordings (mM)
+
+	// Warm start from the database of previous fits (--fitdb)
+	char fitdbfilename[FILENAME_MAX];  // Database of fits (empty: none)
+	memset(fitdbfilename, '\0', FILENAME_MAX);
+	char fitdb_tag[MAX_LINELENGTH] = "default";  // Condition tag of the recording
+	double fitdb_geometry[FITDB_NGEOM];  // Geometry of the recording (microns)
+	fitdb_struct_type fitdb_start;  // Nearest previous fit and spread of the cohort
+	fitdb_start.n = 0;
+
 
 	// Get start time of program 
 	start_time = time(NULL);
@@ -511,6 +1015,7 @@ Currently it just checks if the first character of the last arg is -
 				pr *= 1e-6;	// Input in microns; convert to m 
 			}
 			if (STREQ(parameter, "nolayer")) nolayer = atoi(value);
+			if (STREQ(parameter, "snap_layers")) snap_layers = atoi(value);
 			if (STREQ(parameter, "lz1")) {
 				lz1 = atof(value);
 				specified_lz1 = TRUE;
@@ -535,8 +1040,19 @@ Currently it just checks if the first character of the last arg is -
 			if (STREQ(parameter, "alpha_sr")) alpha_sr = atof(value);
 			if (STREQ(parameter, "theta_so")) theta_so = atof(value);
 			if (STREQ(parameter, "theta_sr")) theta_sr = atof(value);
+			if (STREQ(parameter, "theta_z_so")) theta_z_so = atof(value);
+			if (STREQ(parameter, "theta_z_sr")) theta_z_sr = atof(value);
 			if (STREQ(parameter, "kappa_so")) kappa_so = atof(value);
 			if (STREQ(parameter, "kappa_sr")) kappa_sr = atof(value);
+			if (STREQ(parameter, "vmax_so")) vmax_so = atof(value);
+			if (STREQ(parameter, "vmax_sr")) vmax_sr = atof(value);
+			if (STREQ(parameter, "km_so")) km_so = atof(value);
+			if (STREQ(parameter, "km_sr")) km_sr = atof(value);
+			if (STREQ(parameter, "layer")) {
+				add_layer(value, &layers);
+				specified_layers = TRUE;
+			}
+			if (STREQ(parameter, "fit_layer")) fit_layer = atoi(value) - 1;
 /* Removing kappa_outside option from input file
    - could lead to confusion
    - not very useful
@@ -550,6 +1066,9 @@ Currently it just checks if the first character of the last arg is -
 				nt = atoi(value);
 				specified_nt = TRUE;
 			}
+			if (STREQ(parameter, "stencil")) stencil = atoi(value);
+			if (STREQ(parameter, "zmirror")) use_zmirror = atoi(value);
+			if (STREQ(parameter, "exp_clearance")) exp_clearance = atoi(value);
 			if (STREQ(parameter, "nt_scale")) {
 				nt_scale = atof(value);
 				specified_nt_scale = TRUE;
@@ -629,32 +1148,72 @@ printf("The number of data points is %d\n", nd);
 		{"nz", required_argument, NULL, 0},
 		{"nt", required_argument, NULL, 0},
 		{"nt_scale", required_argument, NULL, 0},
+		{"stencil", required_argument, NULL, 0},
+		{"no_zmirror", no_argument, NULL, 0},
+		{"exp_clearance", no_argument, NULL, 0},
 		{"ez1", required_argument, NULL, 0},
 		{"ez2", required_argument, NULL, 0},
+		{"snap_layers", no_argument, NULL, 0},
 		{"alpha_so", required_argument, NULL, 0},
 		{"alpha_sp", required_argument, NULL, 0},
 		{"alpha_sr", required_argument, NULL, 0},
 		{"theta_so", required_argument, NULL, 0},
 		{"theta_sp", required_argument, NULL, 0},
 		{"theta_sr", required_argument, NULL, 0},
+		{"theta_z_so", required_argument, NULL, 0},
+		{"theta_z_sp", required_argument, NULL, 0},
+		{"theta_z_sr", required_argument, NULL, 0},
 		{"kappa_so", required_argument, NULL, 0},
 		{"kappa_sp", required_argument, NULL, 0},
 		{"kappa_sr", required_argument, NULL, 0},
 		{"kappa_outside", required_argument, NULL, 0},
+		{"vmax_so", required_argument, NULL, 0},
+		{"vmax_sp", required_argument, NULL, 0},
+		{"vmax_sr", required_argument, NULL, 0},
+		{"km_so", required_argument, NULL, 0},
+		{"km_sp", required_argument, NULL, 0},
+		{"km_sr", required_argument, NULL, 0},
+		{"layer", required_argument, NULL, 0},
+		{"fit_layer", required_argument, NULL, 0},
+		{"fit_uptake", no_argument, NULL, 0},
+		{"fit_theta_z", no_argument, NULL, 0},
 		{"alpha_step", required_argument, NULL, 0},
 		{"theta_step", required_argument, NULL, 0},
 		{"kappa_step", required_argument, NULL, 0},
+		{"vmax_step", required_argument, NULL, 0},
+		{"km_step", required_argument, NULL, 0},
 		{"minalpha", required_argument, NULL, 0},
 		{"maxalpha", required_argument, NULL, 0},
 		{"mintheta", required_argument, NULL, 0},
 		{"maxtheta", required_argument, NULL, 0},
 		{"minkappa", required_argument, NULL, 0},
 		{"maxkappa", required_argument, NULL, 0},
+		{"minvmax", required_argument, NULL, 0},
+		{"maxvmax", required_argument, NULL, 0},
+		{"minkm", required_argument, NULL, 0},
+		{"maxkm", required_argument, NULL, 0},
 		{"tmax", required_argument, NULL, 0},
 		{"fit_tol", required_argument, NULL, 0},
 		{"itermax", required_argument, NULL, 0},
 		{"outfile", required_argument, NULL, 0},
 		{"pathfile", required_argument, NULL, 0},
+		{"mcmc", required_argument, NULL, 0},
+		{"mcmc_steps", required_argument, NULL, 0},
+		{"mcmc_burn", required_argument, NULL, 0},
+		{"mcmc_sigma", required_argument, NULL, 0},
+		{"mcmc_seed", required_argument, NULL, 0},
+		{"chainfile", required_argument, NULL, 0},
+		{"profile", required_argument, NULL, 0},
+		{"recording", required_argument, NULL, 0},
+		{"frames", required_argument, NULL, 0},
+		{"frames_weight", required_argument, NULL, 0},
+		{"profile_scale", required_argument, NULL, 0},
+		{"transform", no_argument, NULL, 0},
+		{"optimizer", required_argument, NULL, 0},
+		{"benchmark", required_argument, NULL, 0},
+		{"benchmark_noise", required_argument, NULL, 0},
+		{"fitdb", required_argument, NULL, 0},
+		{"fitdb_tag", required_argument, NULL, 0},
 		{NULL, no_argument, NULL, 0}
 	};
 
@@ -685,6 +1244,12 @@ printf("The number of data points is %d\n", nd);
 			} else if (STREQ("nt_scale", long_opts[opt_index].name)) {
 				nt_scale = atof(optarg);
 				specified_nt_scale = TRUE;
+			} else if (STREQ("stencil", long_opts[opt_index].name)) {
+				stencil = atoi(optarg);
+			} else if (STREQ("no_zmirror", long_opts[opt_index].name)) {
+				use_zmirror = FALSE;
+			} else if (STREQ("exp_clearance", long_opts[opt_index].name)) {
+				exp_clearance = TRUE;
 			} else if (STREQ("ez1", long_opts[opt_index].name)) {
 				ez1 = atof(optarg);
 				specified_ez1 = TRUE;
@@ -693,6 +1258,8 @@ printf("The number of data points is %d\n", nd);
 				ez2 = atof(optarg);
 				specified_ez2 = TRUE;
 				ez2 *= 1e-6;    // Input in microns; convert to m 
+			} else if (STREQ("snap_layers", long_opts[opt_index].name)) {
+				snap_layers = TRUE;
 			} else if (STREQ("alpha_so", long_opts[opt_index].name)) {
 				alpha_so = atof(optarg);
 			} else if (STREQ("alpha_sp", long_opts[opt_index].name)) {
@@ -705,6 +1272,12 @@ printf("The number of data points is %d\n", nd);
 				theta_sp = atof(optarg);
 			} else if (STREQ("theta_sr", long_opts[opt_index].name)) {
 				theta_sr = atof(optarg);
+			} else if (STREQ("theta_z_so", long_opts[opt_index].name)) {
+				theta_z_so = atof(optarg);
+			} else if (STREQ("theta_z_sp", long_opts[opt_index].name)) {
+				theta_z_sp = atof(optarg);
+			} else if (STREQ("theta_z_sr", long_opts[opt_index].name)) {
+				theta_z_sr = atof(optarg);
 			} else if (STREQ("kappa_so", long_opts[opt_index].name)) {
 				kappa_so = atof(optarg);
 			} else if (STREQ("kappa_sp", long_opts[opt_index].name)) {
@@ -714,12 +1287,41 @@ printf("The number of data points is %d\n", nd);
 			} else if (STREQ("kappa_outside", long_opts[opt_index].name)) {
 				kappa_outside = atof(optarg);
 				specified_kappa_outside = TRUE;
+			} else if (STREQ("vmax_so", long_opts[opt_index].name)) {
+				vmax_so = atof(optarg);
+			} else if (STREQ("vmax_sp", long_opts[opt_index].name)) {
+				vmax_sp = atof(optarg);
+			} else if (STREQ("vmax_sr", long_opts[opt_index].name)) {
+				vmax_sr = atof(optarg);
+			} else if (STREQ("km_so", long_opts[opt_index].name)) {
+				km_so = atof(optarg);
+			} else if (STREQ("km_sp", long_opts[opt_index].name)) {
+				km_sp = atof(optarg);
+			} else if (STREQ("km_sr", long_opts[opt_index].name)) {
+				km_sr = atof(optarg);
+			} else if (STREQ("layer", long_opts[opt_index].name)) {
+				// Layers on the command line replace the layers 
+				// in the input file 
+				if (! cmdline_layers) layers.n = 0;
+				cmdline_layers = TRUE;
+				add_layer(optarg, &layers);
+				specified_layers = TRUE;
+			} else if (STREQ("fit_layer", long_opts[opt_index].name)) {
+				fit_layer = atoi(optarg) - 1;
+			} else if (STREQ("fit_uptake", long_opts[opt_index].name)) {
+				fit_uptake = TRUE;
+			} else if (STREQ("fit_theta_z", long_opts[opt_index].name)) {
+				fit_theta_z = TRUE;
 			} else if (STREQ("alpha_step", long_opts[opt_index].name)) {
 				alpha_step = atof(optarg);
 			} else if (STREQ("theta_step", long_opts[opt_index].name)) {
 				theta_step = atof(optarg);
 			} else if (STREQ("kappa_step", long_opts[opt_index].name)) {
 				kappa_step = atof(optarg);
+			} else if (STREQ("vmax_step", long_opts[opt_index].name)) {
+				vmax_step = atof(optarg);
+			} else if (STREQ("km_step", long_opts[opt_index].name)) {
+				km_step = atof(optarg);
 			} else if (STREQ("minalpha", long_opts[opt_index].name)) {
 				minalpha = atof(optarg);
 			} else if (STREQ("maxalpha", long_opts[opt_index].name)) {
@@ -732,6 +1334,14 @@ printf("The number of data points is %d\n", nd);
 				minkappa = atof(optarg);
 			} else if (STREQ("maxkappa", long_opts[opt_index].name)) {
 				maxkappa = atof(optarg);
+			} else if (STREQ("minvmax", long_opts[opt_index].name)) {
+				minvmax = atof(optarg);
+			} else if (STREQ("maxvmax", long_opts[opt_index].name)) {
+				maxvmax = atof(optarg);
+			} else if (STREQ("minkm", long_opts[opt_index].name)) {
+				minkm = atof(optarg);
+			} else if (STREQ("maxkm", long_opts[opt_index].name)) {
+				maxkm = atof(optarg);
 			} else if (STREQ("tmax", long_opts[opt_index].name)) {
 				tmax = atof(optarg);
 			} else if (STREQ("fit_tol", long_opts[opt_index].name)) {
@@ -743,6 +1353,48 @@ printf("The number of data points is %d\n", nd);
 			} else if (STREQ("pathfile", long_opts[opt_index].name)) {
 				check_filename(optarg, pathfilename);
 				opt_pathfile = TRUE;
+			} else if (STREQ("mcmc", long_opts[opt_index].name)) {
+				mcmc_walkers = atoi(optarg);
+			} else if (STREQ("mcmc_steps", long_opts[opt_index].name)) {
+				mcmc_steps = atoi(optarg);
+			} else if (STREQ("mcmc_burn", long_opts[opt_index].name)) {
+				mcmc_burn = atoi(optarg);
+			} else if (STREQ("mcmc_sigma", long_opts[opt_index].name)) {
+				mcmc_sigma = atof(optarg);
+			} else if (STREQ("mcmc_seed", long_opts[opt_index].name)) {
+				mcmc_seed = strtoul(optarg, NULL, 10);
+			} else if (STREQ("chainfile", long_opts[opt_index].name)) {
+				check_filename(optarg, chainfilename);
+			} else if (STREQ("recording", long_opts[opt_index].name)) {
+				if (nrec >= MAX_RECORDINGS) 
+					error("Too many recordings (maximum %d)", MAX_RECORDINGS);
+				check_filename(optarg, recfilename[nrec]);
+				nrec++;
+			} else if (STREQ("frames", long_opts[opt_index].name)) {
+				check_filename(optarg, framesfilename);
+			} else if (STREQ("frames_weight", long_opts[opt_index].name)) {
+				frames_weight = atof(optarg);
+			} else if (STREQ("profile", long_opts[opt_index].name)) {
+				profile_points = atoi(optarg);
+			} else if (STREQ("profile_scale", long_opts[opt_index].name)) {
+				profile_scale = atof(optarg);
+			} else if (STREQ("transform", long_opts[opt_index].name)) {
+				opt_transform = TRUE;
+			} else if (STREQ("optimizer", long_opts[opt_index].name)) {
+				optimizer = optimizer_code(optarg);
+				if (optimizer < 0)
+					error("Unknown optimizer %s", optarg);
+			} else if (STREQ("benchmark", long_opts[opt_index].name)) {
+				benchmark_cases = atoi(optarg);
+			} else if (STREQ("benchmark_noise", long_opts[opt_index].name)) {
+				benchmark_noise = atof(optarg);
+			} else if (STREQ("fitdb", long_opts[opt_index].name)) {
+				check_filename(optarg, fitdbfilename);
+			} else if (STREQ("fitdb_tag", long_opts[opt_index].name)) {
+				if ( (strlen(optarg) >= MAX_LINELENGTH) || (optarg[0] == '\0') 
+				  || (strpbrk(optarg, " \t\n") != NULL) )
+					error("fitdb_tag should be one word");
+				strcpy(fitdb_tag, optarg);
 			}
 			break;
 
@@ -767,12 +1419,25 @@ printf("The number of data points is %d\n", nd);
 		print_usage_fit_layer(argv[0]);
 
 
+	// The chains of the MCMC sampler go to <basename>.chain by default 
+	if ( mcmc_walkers && (chainfilename[0] == '\0') ) {
+		strcpy(chainfilename, outfilename);
+		strng = rindex(chainfilename, '.');
+		if (strng == NULL)
+			strcat(chainfilename, ".chain");
+		else
+			strcpy(strng, ".chain");
+	}
+
 	if (opt_verbose) {
 		printf("The name of the input file is %s\n", infilename);
 		printf("The name of the output file will be %s\n", outfilename);
 		if (opt_pathfile) 
 			printf("The name of the simplex path file will be %s\n", 
 				pathfilename);
+		if (mcmc_walkers) 
+			printf("The name of the MCMC chain file will be %s\n", 
+				chainfilename);
 	}
 
 	// Check for conflicts
@@ -782,6 +1447,28 @@ printf("The number of data points is %d\n", nd);
 		error("The input and simplex path filenames cannot be the same.");
 	if (STREQ(outfilename, pathfilename)) 
 		error("The output and simplex path filenames cannot be the same.");
+	if ( mcmc_walkers && ( STREQ(chainfilename, infilename) || 
+		STREQ(chainfilename, outfilename) || STREQ(chainfilename, pathfilename) ) )
+		error("The MCMC chain filename cannot be the same as another filename.");
+
+	// Each half of the ensemble needs at least as many walkers 
+	// as there are fitted parameters 
+	if (mcmc_walkers) {
+		k = 3 + (fit_uptake ? 2 : 0) + (fit_theta_z ? 1 : 0);
+		if ( (mcmc_walkers < 2*k) || (mcmc_walkers % 2) )
+			error("The number of MCMC walkers should be even and at "
+				"least %d", 2*k);
+		if (mcmc_steps < 1)
+			error("mcmc_steps should be > 0");
+		if (mcmc_burn < 0) 
+			mcmc_burn = mcmc_steps / 2;
+		if (mcmc_burn >= mcmc_steps)
+			error("mcmc_burn should be less than mcmc_steps");
+	}
+	if (profile_points < 0)
+		error("profile (number of points on each side) should be >= 0");
+	if ( profile_points && (profile_scale <= 0.) )
+		error("profile_scale should be > 0");
 
     if (specified_ez1 && !specified_ez2)
         error("You specified ez1 but did not specify ez2");
@@ -793,10 +1480,28 @@ printf("The number of data points is %d\n", nd);
 	if (specified_ez1) {
 		if (ez1 > 0) error("Bottom of cylinder ez1 = %f > 0\n", ez1);
 		if (ez2 < 0) error("Top of cylinder ez2 = %f < 0\n", ez2);
-		if (ez1 > lz1) error("Bottom of cylinder ez1 = %f > lz1 = %f\n",
-		                      ez1, lz1);
-		if (ez2 < lz2) error("Top of cylinder ez2 = %f < lz2 = %f\n",
-		                      ez2, lz2);
+		if (specified_layers) {
+			if ( (layers.n > 1) && (ez1 > layers.zbound[0]) ) 
+				error("Bottom of cylinder ez1 = %f > lowest layer "
+					"boundary = %f\n", ez1, layers.zbound[0]);
+			if ( (layers.n > 1) && (ez2 < layers.zbound[layers.n-2]) ) 
+				error("Top of cylinder ez2 = %f < highest layer "
+					"boundary = %f\n", ez2, layers.zbound[layers.n-2]);
+		} else {
+			if (ez1 > lz1) error("Bottom of cylinder ez1 = %f > lz1 = %f\n",
+			                      ez1, lz1);
+			if (ez2 < lz2) error("Top of cylinder ez2 = %f < lz2 = %f\n",
+			                      ez2, lz2);
+		}
+	}
+
+	// The layers of a layer table have their own kappa values 
+	// (with -g, the fitted kappa is used in all of them) 
+	if (specified_layers) {
+		if (nolayer)
+			error("nolayer cannot be used with specified layers");
+		if (specified_kappa_outside)
+			error("kappa_outside cannot be used with specified layers");
 	}
 
 
@@ -809,6 +1514,31 @@ if (opt_verbose)
 			pz, 1e6*pz);
 	}
 
+	// Additional recordings of a joint fit. The probe position and 
+	// source parameters that are not in a recording file are those 
+	// of the input file. 
+	for (k=1; k<nrec; k++) {
+		rec_pz[k] = pz;
+		rec_pr[k] = pr;
+		rec_crnt[k] = crnt;
+		rec_trn[k] = trn;
+		rec_sd[k] = sd;
+		rec_st[k] = st;
+		rec_tdata[k] = create_array(MAXNUM_LINES, "recording tdata");
+		rec_pdata[k] = create_array(MAXNUM_LINES, "recording pdata");
+		rec_nd[k] = read_recording(recfilename[k], &rec_pz[k], &rec_pr[k], 
+			&rec_crnt[k], &rec_trn[k], &rec_sd[k], &rec_st[k], 
+			rec_tdata[k], rec_pdata[k]);
+	}
+
+	// IOI image stack 
+	if (framesfilename[0] != '\0') {
+		read_frames(framesfilename, &frames);
+		npix = frames.n * frames.width * frames.height;
+		if (frames_weight < 0.)
+			error("frames_weight should be >= 0");
+	}
+
 	if (specified_lz1 == FALSE) {
 		lz1 = - 50.0e-6 / 2.0; 
 if (opt_verbose)
@@ -846,8 +1576,14 @@ if (opt_verbose)
         alpha_sp = alpha_sr;
         theta_so = theta_sr;
         theta_sp = theta_sr;
+        theta_z_so = theta_z_sr;
+        theta_z_sp = theta_z_sr;
         kappa_so = kappa_sr;
         kappa_sp = kappa_sr;
+        vmax_so = vmax_sr;
+        vmax_sp = vmax_sr;
+        km_so = km_sr;
+        km_sp = km_sr;
         if (opt_verbose)
             printf("\nNOTE: nolayer option given; the diffusion "
                     "parameters of \nthe homogeneous environment "
@@ -886,6 +1622,11 @@ if (opt_verbose)
 	if (specified_ez1) {
 		zmax = ez2 + (-ez1);    // Calculate the cylinder length 
 		coord_shift = (-ez1);
+	} else if (specified_layers) {
+		// Center the boundaries of the specified layers 
+		coord_shift = (layers.n > 1) ? 
+			(zmax - (layers.zbound[0] + layers.zbound[layers.n-2]))/2. : 
+			zmax/2.;
 	} else {
 		coord_shift = (zmax - (lz1+lz2))/2.;
 	}
@@ -893,6 +1634,9 @@ if (opt_verbose)
 	pz += coord_shift;
 	lz1 += coord_shift;
 	lz2 += coord_shift;
+	if (specified_layers) 
+		for (k=0; k<layers.n-1; k++) 
+			layers.zbound[k] += coord_shift;
 
 
 	// Discretization intervals in r, z 
@@ -907,29 +1651,184 @@ if (opt_verbose)
 	pz = round(pz / dz) * dz;
 	pr = round(pr / dr) * dr;
 
-	// Layer geometry 
-	iz1 = (long) (lz1 / dz);
-	lz1 = iz1 * dz + dz / 2.0;
+	rec_pz[0] = pz;
+	rec_pr[0] = pr;
+	for (k=1; k<nrec; k++) {
+		rec_pz[k] = round((rec_pz[k] + coord_shift) / dz) * dz;
+		rec_pr[k] = round(rec_pr[k] / dr) * dr;
+		if ( (lround(rec_pz[k]/dz) < 0) || (lround(rec_pz[k]/dz) >= nz) 
+		  || (lround(rec_pr[k]/dr) >= nr) ) 
+			error("Probe of recording %s is outside the cylinder", 
+				recfilename[k]);
+	}
 
-	iz2 = (long) (lz2 / dz);
-	lz2 = iz2 * dz + dz / 2.0;
+	// Layer geometry. The layer boundaries are used as specified, 
+	// and rows that contain a boundary get interface coefficients 
+	// (see layers.c), unless the user wants the boundaries to be 
+	// snapped to fall midway between grid points, as in previous 
+	// versions of this program. iz1 and iz2 are the indices of 
+	// the last rows below the boundaries. 
+	if (snap_layers) {
+		iz1 = (long) (lz1 / dz);
+		lz1 = iz1 * dz + dz / 2.0;
+
+		iz2 = (long) (lz2 / dz);
+		lz2 = iz2 * dz + dz / 2.0;
+	} else {
+		iz1 = (int) ceil(lz1 / dz) - 1;
+		iz2 = (int) ceil(lz2 / dz) - 1;
+	}
+
+
+	// Set up the layer table of the 3 layers (with nolayer, only 
+	// the bottom layer, SR, is kept), or check the specified layers. 
+	// By default the SP layer, or the specified layer that contains 
+	// the source, is fitted. 
+	if (specified_layers) {
+		for (k=0; k<layers.n; k++) {
+			if ( (layers.alpha[k] <= 0.) || (layers.theta[k] <= 0.) 
+			  || (layers.theta_z[k] <= 0.) )
+				error("Layer %d: alpha, theta, and theta_z should be > 0", k+1);
+			if (k == layers.n-1) break;
+			if (snap_layers) 
+				layers.zbound[k] = floor(layers.zbound[k] / dz) * dz + dz / 2.0;
+			if ( (k > 0) && (layers.zbound[k] <= layers.zbound[k-1]) )
+				error("Layer %d: thickness (%f microns) should be > 0", 
+					k+1, 1.0e6 * (layers.zbound[k] - layers.zbound[k-1]));
+		}
+		if (fit_layer < 0) 
+			for (fit_layer=0; fit_layer<layers.n-1; fit_layer++) 
+				if (sz < layers.zbound[fit_layer]) break;
+	} else {
+		if (theta_z_so < 0.) theta_z_so = theta_so;
+		if (theta_z_sp < 0.) theta_z_sp = theta_sp;
+		if (theta_z_sr < 0.) theta_z_sr = theta_sr;
+		if ( IS_ZERO(theta_z_so) || IS_ZERO(theta_z_sp) || IS_ZERO(theta_z_sr) )
+			error("theta_z should be > 0");
+		set_three_layers(lz1, lz2, 
+			alpha_so, theta_so, theta_z_so, kappa_so, vmax_so, km_so, 
+			alpha_sp, theta_sp, theta_z_sp, kappa_sp, vmax_sp, km_sp, 
+			alpha_sr, theta_sr, theta_z_sr, kappa_sr, vmax_sr, km_sr, &layers);
+		if (nolayer) layers.n = 1;
+		if (fit_layer < 0) fit_layer = (nolayer) ? 0 : 1;
+	}
+	if ( (fit_layer < 0) || (fit_layer >= layers.n) )
+		error("fit_layer = %d, but it should be from 1 to %d", 
+			fit_layer+1, layers.n);
+
+	// Starting values of the fit are the values of the fitted layer 
+	// (with -g, its kappa is used in all layers) 
+	alpha_sp = layers.alpha[fit_layer];
+	theta_sp = layers.theta[fit_layer];
+	theta_z_sp = layers.theta_z[fit_layer];
+	kappa_sp = layers.kappa[fit_layer];
+	vmax_sp = layers.vmax[fit_layer];
+	km_sp = layers.km[fit_layer];
+	if (opt_global_kappa) 
+		for (k=0; k<layers.n; k++) 
+			layers.kappa[k] = kappa_sp;
+
+	// Warm start (--fitdb): the fit starts from the nearest previous 
+	// fit with the same condition tag (within the bounds; theta_z 
+	// keeps its ratio to theta), and if the cohort has at least 3 
+	// fits, the initial steps are twice its standard deviations, from 
+	// a tenth of the steps up to the steps.  Only the starting values 
+	// change:  the layer table (and so the source and the model 
+	// outside the fitted parameters) is that of the input file. 
+	if (fitdbfilename[0] != '\0') {
+		fitdb_geometry[0] = 1e6 * ( ((fit_layer > 0) ? 
+			layers.zbound[fit_layer-1] : 0.) - sz );
+		fitdb_geometry[1] = 1e6 * ( ((fit_layer < layers.n-1) ? 
+			layers.zbound[fit_layer] : zmax) - sz );
+		fitdb_geometry[2] = 1e6 * (pz - sz);
+		fitdb_geometry[3] = 1e6 * pr;
+		read_fitdb(fitdbfilename, fitdb_tag, fitdb_geometry, &fitdb_start);
+		if (fitdb_start.n > 0) {
+			double theta_start = MIN(MAX(fitdb_start.x[1], mintheta), maxtheta);
+			theta_z_sp *= theta_start / theta_sp;
+			theta_sp = theta_start;
+			alpha_sp = MIN(MAX(fitdb_start.x[0], minalpha), maxalpha);
+			kappa_sp = MIN(MAX(fitdb_start.x[2], minkappa), maxkappa);
+		}
+		if (fitdb_start.n >= 3) {
+			alpha_step = MIN(MAX(2.0 * fitdb_start.sd[0], 0.1 * alpha_step), alpha_step);
+			theta_step = MIN(MAX(2.0 * fitdb_start.sd[1], 0.1 * theta_step), theta_step);
+			kappa_step = MIN(MAX(2.0 * fitdb_start.sd[2], 0.1 * kappa_step), kappa_step);
+		}
+	}
 
 
 	// D* 
-	dstar_so = theta_so * dfree;
-	dstar_sp = theta_sp * dfree;
-	dstar_sr = theta_sr * dfree;
-	dstar_max = MAX(dstar_so, dstar_sp);
-	dstar_max = MAX(dstar_max, dstar_sr);
+	for (k=0; k<layers.n; k++)
+		dstar_max = MAX(dstar_max, MAX(layers.theta[k], layers.theta_z[k]) * dfree);
 
 
 	// Check if layer thickness is numerically reasonable 
-	if ( ((iz2 - iz1) < 2) && (nolayer == 0) ) 
+	if ( (lz2 <= lz1) && (nolayer == 0) && (! specified_layers) ) 
+		error("Layer thickness (%f microns) should be > 0", 
+			1.0e6 * (lz2 - lz1));
+	if ( snap_layers && ((iz2 - iz1) < 2) && (nolayer == 0) && (! specified_layers) ) 
 		error("Layer has too few discrete steps to continue.");
 
-	// Calculate time step from nt or from von Neumann criterion 
+	// Check the order of the spatial discretization 
+	if ( (stencil != 2) && (stencil != 4) )
+		error("stencil = %d, but it should be 2 or 4", stencil);
+
+	// Check the Michaelis-Menten uptake parameters 
+	for (k=0; k<layers.n; k++) {
+		if (layers.vmax[k] < 0.)
+			error("Vmax should be >= 0");
+		if (layers.km[k] <= 0.)
+			error("Km should be > 0");
+		if (! IS_ZERO(layers.theta_z[k] - layers.theta[k]))
+			anisotropic = TRUE;
+	}
+	if ( fit_uptake && nolayer )
+		error("fit_uptake cannot be used with nolayer");
+
+	// Z-mirror symmetry. If the layers are symmetric about the 
+	// source (e.g. SR and SO have the same parameters and the SP 
+	// layer is centered on the source) and the source is in the middle 
+	// of the cylinder, the concentration is symmetric about the 
+	// plane of the source. Then only the rows from the source up 
+	// are solved, and the model keeps zmirror ghost rows below the 
+	// source row equal to their mirror images above it. (If nz is 
+	// even, this moves the bottom of the cylinder by one row.) 
+	// A probe below the source is replaced by its mirror image 
+	// (the probes of all recordings of a joint fit must be on the 
+	// model grid). The fit only changes the parameters of the fitted 
+	// layer (and with -g kappa in all layers), so the symmetry holds 
+	// for the whole fit if the fitted layer is the middle layer. 
+	isource = lround(sz/dz);
+	if ( use_zmirror && (abs(nz - 1 - 2*isource) <= 1) 
+	  && (2*fit_layer == layers.n-1) 
+	  && layers_symmetric(&layers, sz, 1.0e-6 * dz) ) {
+		for (k=0; k<nrec; k++) {
+			iprobe = lround(rec_pz[k]/dz);
+			if ( ((iprobe < isource) ? 2*isource - iprobe : iprobe) >= nz )
+				break;
+		}
+		if (k == nrec) {
+			zmirror = stencil / 2;
+			izshift = isource - zmirror;
+		}
+	}
+	for (k=0; k<nrec; k++) {
+		rec_iprobe[k] = lround(rec_pz[k]/dz);
+		rec_jprobe[k] = 1+lround(rec_pr[k]/dr);
+		if ( zmirror && (rec_iprobe[k] < isource) )
+			rec_iprobe[k] = 2*isource - rec_iprobe[k];
+		rec_iprobe[k] -= izshift;
+	}
+
+	// Calculate time step from nt or from von Neumann criterion. 
+	// The fourth-order kernels have a 1.5 times larger maximum 
+	// eigenvalue than the second-order ones (mostly because of 
+	// the r=0 row), so dt is smaller by 2/3. 
 	if (specified_nt == TRUE)
 		dt = tmax / nt;
+	else if (stencil == 4)
+		dt = 0.9 * dr*dr / (9.0 * dstar_max);
 	else
 		dt = 0.9 * dr*dr / (6.0 * dstar_max);
 
@@ -961,6 +1860,21 @@ if (opt_verbose)
 	sa = crnt * trn / FARADAY; // source strength in mol/s 
 	                           // (not a concentration) 
 
+	// Source timing and amplitude of the recordings of a joint fit 
+	rec_crnt[0] = crnt;
+	rec_sd[0] = sd;
+	rec_st[0] = st;
+	rec_sa[0] = sa;
+	for (k=1; k<nrec; k++) {
+		rec_st[k] = dt * lround(rec_st[k] / dt);
+		rec_sd[k] = dt * lround(rec_sd[k] / dt);
+		if (rec_sd[k]+rec_st[k] >= tmax) 
+			error("Recording %s: source delay (%f) + duration (%f) "
+				"should be < tmax (%f)", recfilename[k], 
+				rec_sd[k], rec_st[k], tmax);
+		rec_sa[k] = rec_crnt[k] * rec_trn[k] / FARADAY;
+	}
+
 
 	// Assemble string with command that user input 
 	i = assemble_command(argc, argv, comments.command);
@@ -987,35 +1901,89 @@ if (opt_verbose)
 		printf("dr x dz = %f x %f microns\n", 1.0e6 * dr, 1.0e6 * dz);
 		printf("(sr, sz) = (%f, %f) microns\n", 1.0e6 * sr, 1.0e6 * sz);
 		printf("(pr, pz) = (%f, %f) microns\n", 1.0e6 * pr, 1.0e6 * pz);
+		for (k=1; k<nrec; k++) 
+			printf("Recording %d: %s, (pr, pz) = (%f, %f) microns, "
+				"current = %f nA, delay = %f s, duration = %f s\n", k+1, 
+				recfilename[k], 1.0e6 * rec_pr[k], 1.0e6 * rec_pz[k], 
+				1.0e9 * rec_crnt[k], rec_sd[k], rec_st[k]);
 		printf("Electrode distance = %f microns\n", 
 			1.0e6 * sqrt(SQR(pr-sr) + SQR(pz-sz)));
-		printf("(iz1, iz2) = (%d, %d)\n", iz1, iz2);
-		printf("(lz1, lz2) = (%f, %f) microns\n", 1.0e6 * lz1, 1.0e6 * lz2);
-		printf("Layer thickness = %f microns\n", 1.0e6 * (lz2 - lz1));
-		printf("Layer discrete steps = %d\n", iz2 - iz1);
+		if (! specified_layers) {
+			printf("(iz1, iz2) = (%d, %d)\n", iz1, iz2);
+			printf("(lz1, lz2) = (%f, %f) microns\n", 1.0e6 * lz1, 1.0e6 * lz2);
+			printf("Layer thickness = %f microns\n", 1.0e6 * (lz2 - lz1));
+			printf("Layer discrete steps = %d\n", iz2 - iz1);
+		}
+		if (snap_layers)
+			printf("Layer boundaries snapped to fall midway between grid points\n");
 		printf("Nolayer flag = %d\n" , nolayer);
+		printf("Stencil order = %d\n" , stencil);
+		if (exp_clearance)
+			printf("Exact integration of source and clearance\n");
+		if (zmirror)
+			printf("Z-mirror symmetry: solving rows %d to %d\n", izshift + zmirror, nz-1);
 		printf("dfree = %g m^2/s\n", dfree);
-		printf("alpha_so = %.4f, theta_so = %.4f, "
-			"lambda_so = %.4f, kappa_so = %.6f\n", 
-			alpha_so, theta_so, 1.0/sqrt(theta_so), kappa_so);
+		if (specified_layers) {
+			printf("Layers (from the bottom up):\n");
+			for (k=0; k<layers.n; k++) {
+				printf("Layer %d: alpha = %.4f, theta = %.4f, lambda = %.4f, "
+					"kappa = %.6f", k+1, layers.alpha[k], layers.theta[k], 
+					1.0/sqrt(layers.theta[k]), layers.kappa[k]);
+				if (! IS_ZERO(layers.theta_z[k] - layers.theta[k]))
+					printf(", theta_z = %.4f", layers.theta_z[k]);
+				if (layers.vmax[k] > 0.)
+					printf(", vmax = %g mM/s, km = %g mM", layers.vmax[k], layers.km[k]);
+				if (k < layers.n-1)
+					printf(", top at z = %f microns", 1.0e6 * layers.zbound[k]);
+				printf("\n");
+			}
+			printf("Fitted layer = %d\n", fit_layer+1);
+		} else {
+			printf("alpha_so = %.4f, theta_so = %.4f, "
+				"lambda_so = %.4f, kappa_so = %.6f\n", 
+				alpha_so, theta_so, 1.0/sqrt(theta_so), kappa_so);
+		}
 		printf("Starting alpha_sp = %.4f, theta_sp = %.4f, "
 			"lambda_sp = %.4f, kappa_sp = %.6f\n", 
 			alpha_sp, theta_sp, 1.0/sqrt(theta_sp), kappa_sp);
+		if ( anisotropic || fit_theta_z )
+			printf("Starting theta_z_sp = %.4f\n", theta_z_sp);
 		printf("Starting alpha_step = %.4f, theta_step = %.4f\n", 
 			alpha_step, theta_step);
+		if (fitdbfilename[0] != '\0')
+			printf("Warm start from %s: %d previous fits with tag %s, "
+				"nearest at %.1f microns, kappa_step = %.6f\n", fitdbfilename, 
+				fitdb_start.n, fitdb_tag, fitdb_start.distance, kappa_step);
 		printf("Constraints: minalpha = %.8f, maxalpha = %.8f\n", 
 			minalpha, maxalpha);
 		printf("Constraints: mintheta = %.8f, maxtheta = %.8f\n", 
 			mintheta, maxtheta);
 		printf("Constraints: minkappa = %.8f, maxkappa = %.8f\n", 
 			minkappa, maxkappa);
+		if (fit_uptake) {
+			printf("Starting vmax_sp = %g mM/s, km_sp = %g mM\n", 
+				vmax_sp, km_sp);
+			printf("Constraints: minvmax = %g, maxvmax = %g, "
+				"minkm = %g, maxkm = %g\n", minvmax, maxvmax, minkm, maxkm);
+		}
 		printf("Stopping criteria: simplex size < %g or # iterations = %d\n", 
 			fit_tol, itermax);
-		printf("alpha_sr = %.4f, theta_sr = %.4f, "
-			"lambda_sr = %.4f, kappa_sr = %.6f\n", 
-			alpha_sr, theta_sr, 1.0/sqrt(theta_sr), kappa_sr);
-		if (opt_global_kappa) 
-			printf("NOTE: kappa_sr and kappa_so set to kappa_sp (-g)\n");
+		if (! specified_layers) {
+			printf("alpha_sr = %.4f, theta_sr = %.4f, "
+				"lambda_sr = %.4f, kappa_sr = %.6f\n", 
+				alpha_sr, theta_sr, 1.0/sqrt(theta_sr), kappa_sr);
+			if (anisotropic)
+				printf("Axial permeability: theta_z_so = %.4f, theta_z_sr = %.4f\n", 
+					theta_z_so, theta_z_sr);
+			if (opt_global_kappa) 
+				printf("NOTE: kappa_sr and kappa_so set to kappa_sp (-g)\n");
+			if ( fit_uptake || (vmax_so > 0.) || (vmax_sp > 0.) || (vmax_sr > 0.) ) {
+				printf("Michaelis-Menten uptake:\n");
+				printf("vmax_so = %g mM/s, km_so = %g mM\n", vmax_so, km_so);
+				printf("vmax_sp = %g mM/s, km_sp = %g mM\n", vmax_sp, km_sp);
+				printf("vmax_sr = %g mM/s, km_sr = %g mM\n", vmax_sr, km_sr);
+			}
+		}
 		printf("nt = %d\n", nt);
 		printf("tmax = %f s\n", tmax);
 		printf("dt = %f ms\n", 1.0e3 * dt);
@@ -1066,35 +2034,97 @@ if (opt_verbose)
 	fprintf(file_ptr, "# dr x dz = %f x %f microns\n", 1.0e6 * dr, 1.0e6 * dz);
 	fprintf(file_ptr, "# (sr, sz) = (%f, %f) microns\n", 1.0e6 * sr, 1.0e6 * sz);
 	fprintf(file_ptr, "# (pr, pz) = (%f, %f) microns\n", 1.0e6 * pr, 1.0e6 * pz);
+	for (k=1; k<nrec; k++) 
+		fprintf(file_ptr, "# Recording %d: %s, (pr, pz) = (%f, %f) microns, "
+			"current = %f nA, delay = %f s, duration = %f s\n", k+1, 
+			recfilename[k], 1.0e6 * rec_pr[k], 1.0e6 * rec_pz[k], 
+			1.0e9 * rec_crnt[k], rec_sd[k], rec_st[k]);
+	if (frames.n > 0) {
+		fprintf(file_ptr, "# Frames: %s, %d frames of %d x %d pixels of %f microns\n", 
+			framesfilename, frames.n, frames.width, frames.height, 
+			1.0e6 * frames.pixel);
+		fprintf(file_ptr, "# Frames: source at (col, row) = (%f, %f), depth = %f microns, "
+			"blur = %f microns, weight = %g\n", frames.source_col, frames.source_row, 
+			1.0e6 * frames.depth, 1.0e6 * frames.blur, frames_weight);
+	}
 	fprintf(file_ptr, "# Electrode distance = %f microns\n", 
 		1.0e6 * sqrt(SQR(pr-sr) + SQR(pz-sz)));
-	fprintf(file_ptr, "# (iz1, iz2) = (%d, %d)\n", iz1, iz2);
-	fprintf(file_ptr, "# (lz1, lz2) = (%f, %f) microns\n", 1.0e6 * lz1, 1.0e6 * lz2);
-	fprintf(file_ptr, "# Layer thickness = %f microns\n", 1.0e6 * (lz2 - lz1));
-	fprintf(file_ptr, "# Layer discrete steps = %d\n", iz2 - iz1);
+	if (! specified_layers) {
+		fprintf(file_ptr, "# (iz1, iz2) = (%d, %d)\n", iz1, iz2);
+		fprintf(file_ptr, "# (lz1, lz2) = (%f, %f) microns\n", 1.0e6 * lz1, 1.0e6 * lz2);
+		fprintf(file_ptr, "# Layer thickness = %f microns\n", 1.0e6 * (lz2 - lz1));
+		fprintf(file_ptr, "# Layer discrete steps = %d\n", iz2 - iz1);
+	}
+	if (snap_layers)
+		fprintf(file_ptr, "# Layer boundaries snapped to fall midway between grid points\n");
 	fprintf(file_ptr, "# Nolayer flag = %d\n" , nolayer);
+	fprintf(file_ptr, "# Stencil order = %d\n" , stencil);
+	if (exp_clearance)
+		fprintf(file_ptr, "# Exact integration of source and clearance\n");
+	if (zmirror)
+		fprintf(file_ptr, "# Z-mirror symmetry: solving rows %d to %d\n", izshift + zmirror, nz-1);
 	fprintf(file_ptr, "# dfree = %g m^2/s\n", dfree);
-	fprintf(file_ptr, "# alpha_so = %.4f, theta_so = %.4f, "
-			"lambda_so = %.4f, kappa_so = %.6f\n", 
-			alpha_so, theta_so, 1.0/sqrt(theta_so), kappa_so);
+	if (specified_layers) {
+		fprintf(file_ptr, "# Layers (from the bottom up):\n");
+		for (k=0; k<layers.n; k++) {
+			fprintf(file_ptr, "# Layer %d: alpha = %.4f, theta = %.4f, lambda = %.4f, "
+				"kappa = %.6f", k+1, layers.alpha[k], layers.theta[k], 
+				1.0/sqrt(layers.theta[k]), layers.kappa[k]);
+			if (! IS_ZERO(layers.theta_z[k] - layers.theta[k]))
+				fprintf(file_ptr, ", theta_z = %.4f", layers.theta_z[k]);
+			if (layers.vmax[k] > 0.)
+				fprintf(file_ptr, ", vmax = %g mM/s, km = %g mM", layers.vmax[k], layers.km[k]);
+			if (k < layers.n-1)
+				fprintf(file_ptr, ", top at z = %f microns", 1.0e6 * layers.zbound[k]);
+			fprintf(file_ptr, "\n");
+		}
+		fprintf(file_ptr, "# Fitted layer = %d\n", fit_layer+1);
+	} else {
+		fprintf(file_ptr, "# alpha_so = %.4f, theta_so = %.4f, "
+				"lambda_so = %.4f, kappa_so = %.6f\n", 
+				alpha_so, theta_so, 1.0/sqrt(theta_so), kappa_so);
+	}
 	fprintf(file_ptr, "# Starting alpha_sp = %.4f, theta_sp = %.4f, "
 			"lambda_sp = %.4f, kappa_sp = %.6f\n", 
 			alpha_sp, theta_sp, 1.0/sqrt(theta_sp), kappa_sp);
+	if ( anisotropic || fit_theta_z )
+		fprintf(file_ptr, "# Starting theta_z_sp = %.4f\n", theta_z_sp);
 	fprintf(file_ptr, "# Starting alpha_step = %.4f, theta_step = %.4f\n", 
 			alpha_step, theta_step);
+	if (fitdbfilename[0] != '\0')
+		fprintf(file_ptr, "# Warm start from %s: %d previous fits with tag %s, "
+			"nearest at %.1f microns, kappa_step = %.6f\n", fitdbfilename, 
+			fitdb_start.n, fitdb_tag, fitdb_start.distance, kappa_step);
 	fprintf(file_ptr, "# Constraints: minalpha = %.8f, maxalpha = %.8f\n", 
 			minalpha, maxalpha);
 	fprintf(file_ptr, "# Constraints: mintheta = %.8f, maxtheta = %.8f\n", 
 			mintheta, maxtheta);
 	fprintf(file_ptr, "# Constraints: minkappa = %.8f, maxkappa = %.8f\n", 
 			minkappa, maxkappa);
+	if (fit_uptake) {
+		fprintf(file_ptr, "# Starting vmax_sp = %g mM/s, km_sp = %g mM\n", 
+			vmax_sp, km_sp);
+		fprintf(file_ptr, "# Constraints: minvmax = %g, maxvmax = %g, "
+			"minkm = %g, maxkm = %g\n", minvmax, maxvmax, minkm, maxkm);
+	}
 	fprintf(file_ptr, "# Stopping criteria: simplex size < %g or # iterations = %d\n", 
 			fit_tol, itermax);
-	fprintf(file_ptr, "# alpha_sr = %.4f, theta_sr = %.4f, "
-			"lambda_sr = %.4f, kappa_sr = %.6f\n", 
-			alpha_sr, theta_sr, 1.0/sqrt(theta_sr), kappa_sr);
-	if (opt_global_kappa) 
-		fprintf(file_ptr, "# NOTE: kappa_sr and kappa_so set to kappa_sp (-g)\n");
+	if (! specified_layers) {
+		fprintf(file_ptr, "# alpha_sr = %.4f, theta_sr = %.4f, "
+				"lambda_sr = %.4f, kappa_sr = %.6f\n", 
+				alpha_sr, theta_sr, 1.0/sqrt(theta_sr), kappa_sr);
+		if (anisotropic)
+			fprintf(file_ptr, "# Axial permeability: theta_z_so = %.4f, theta_z_sr = %.4f\n", 
+				theta_z_so, theta_z_sr);
+		if (opt_global_kappa) 
+			fprintf(file_ptr, "# NOTE: kappa_sr and kappa_so set to kappa_sp (-g)\n");
+		if ( fit_uptake || (vmax_so > 0.) || (vmax_sp > 0.) || (vmax_sr > 0.) ) {
+			fprintf(file_ptr, "# Michaelis-Menten uptake:\n");
+			fprintf(file_ptr, "# vmax_so = %g mM/s, km_so = %g mM\n", vmax_so, km_so);
+			fprintf(file_ptr, "# vmax_sp = %g mM/s, km_sp = %g mM\n", vmax_sp, km_sp);
+			fprintf(file_ptr, "# vmax_sr = %g mM/s, km_sr = %g mM\n", vmax_sr, km_sr);
+		}
+	}
 	fprintf(file_ptr, "# nt = %d\n", nt);
 	fprintf(file_ptr, "# tmax = %f s\n", tmax);
 	fprintf(file_ptr, "# dt = %f ms\n", 1.0e3 * dt);
@@ -1111,12 +2141,12 @@ if (opt_verbose)
 	fclose(file_ptr);
 
 	// Array of alpha values -- use 1D index to access elements of 
-	// the 2D array, so a[i*(nr+1)+j] = a[i][j] (use macro INDEX(i,j) 
+	// the 2D array, so a[i*(nr+1)+j] = a[i][j] (use macro INDEX(i,j). 
+	// Rows that contain a layer boundary get the volume average. 
     alphas = create_array(nz*(nr+1), "alphas array");
-	for (j=0; j<nr+1; j++) {
-		for (i=0;     i<iz1+1; i++) alphas[INDEX(i,j)] = alpha_sr;
-		for (i=iz1+1; i<iz2+1; i++) alphas[INDEX(i,j)] = alpha_sp;
-		for (i=iz2+1; i<nz;    i++) alphas[INDEX(i,j)] = alpha_so;
+	for (i=0; i<nz; i++) {
+		alphas[INDEX(i,0)] = cell_alpha(i * dz, dz, &layers);
+		for (j=1; j<nr+1; j++) alphas[INDEX(i,j)] = alphas[INDEX(i,0)];
 	}
 
 	// Array of 1/r values, except it is 0 for r=0 
@@ -1130,23 +2160,93 @@ if (opt_verbose)
 	}
 
 
-	// Source 
-    param_struct.s = create_array(nz*(nr+1), "param s array");
+	// Source. The cell on the z-axis has a volume of 
+	// PI * dr^2 * dz / 4 for the second-order kernels and 
+	// PI * dr^2 * dz / 6 for the fourth-order kernels (see convo.c) 
+	double axis_factor = (stencil == 4) ? 6.0 : 4.0;
 	isource = lround(sz/dz);   	// index to z position of source 
 	jsource = 1+lround(sr/dr);	// index to r position of source 
-	param_struct.s[INDEX(isource,jsource)] 
-		= (1.0 / alphas[INDEX(isource,jsource)]) * 
-			sa * dt * 4.0 / (PI * SQR(dr) * dz);
 
 
-	// Time and probe arrays 
+	// Time array 
 	t = create_array(nt, "time");
-	p = create_array(nt, "p");
 	for (k=0; k<nt; k++) 
 		t[k] = dt * k;
 
-	iprobe = lround(pz/dz);   	// index to z position of probe 
-	jprobe = 1+lround(pr/dr);	// index to r position of probe 
+
+	// Forward solves. Recordings with the same source delay and 
+	// duration share a forward solve, in which each of them is a 
+	// probe. Without uptake the model is linear in the source 
+	// amplitude, so the curve of a recording with another current 
+	// is that of the solve scaled by the ratio of the amplitudes. 
+	// With z-mirror symmetry, the model grid starts izshift rows 
+	// above the bottom of the cylinder. 
+	nonlinear = fit_uptake;
+	for (k=0; k<layers.n; k++) 
+		if (layers.vmax[k] > 0.) nonlinear = TRUE;
+	strcpy(recfilename[0], infilename);
+	rec_nd[0] = nd;
+	rec_tdata[0] = tdata;
+	rec_pdata[0] = pdata;
+	solve = param_struct.solve;
+	rec = param_struct.rec;
+	for (k=0; k<nrec; k++) {
+		for (l=0; l<param_struct.nsolves; l++) 
+			if ( (rec_sd[k] == solve[l].sd) && (rec_st[k] == solve[l].st) 
+			  && ( (rec_sa[k] == solve[l].sa) 
+			    || ((! nonlinear) && (solve[l].sa != 0.)) ) )
+				break;
+		if (l == param_struct.nsolves) {
+			solve[l].nprobes = 0;
+			solve[l].sd = rec_sd[k];
+			solve[l].st = rec_st[k];
+			solve[l].sa = rec_sa[k];
+			solve[l].s = create_array(nz*(nr+1), "param s array");
+			solve[l].s[INDEX(isource,jsource)] 
+				= (1.0 / alphas[INDEX(isource,jsource)]) * 
+					solve[l].sa * dt * axis_factor / (PI * SQR(dr) * dz);
+			if (zmirror) 
+				memmove(solve[l].s, solve[l].s + izshift*(nr+1), 
+					(nz - izshift)*(nr+1)*sizeof(double));
+			param_struct.nsolves++;
+		}
+		for (j=0; j<solve[l].nprobes; j++) 
+			if ( (solve[l].iprobe[j] == rec_iprobe[k]) 
+			  && (solve[l].jprobe[j] == rec_jprobe[k]) )
+				break;
+		if (j == solve[l].nprobes) {
+			solve[l].iprobe[j] = rec_iprobe[k];
+			solve[l].jprobe[j] = rec_jprobe[k];
+			solve[l].nprobes++;
+		}
+		rec[k].nd = rec_nd[k];
+		rec[k].solve = l;
+		rec[k].probe = j;
+		rec[k].scale = (rec_sa[k] == solve[l].sa) ? 1. : rec_sa[k] / solve[l].sa;
+		rec[k].t_data = create_array(rec_nd[k], "param t_data array");
+		rec[k].p_data = create_array(rec_nd[k], "param p_data array");
+		for (i=0; i<rec_nd[k]; i++) {
+			rec[k].t_data[i] = rec_tdata[k][i];
+			rec[k].p_data[i] = rec_pdata[k][i];
+		}
+		nres += MIN(nt, rec_nd[k]);
+	}
+	param_struct.nrec = nrec;
+	for (l=0; l<param_struct.nsolves; l++) 
+		solve[l].p = create_array(solve[l].nprobes*nt, "param p array");
+
+	// The frames are projections of the concentration of the first 
+	// forward solve (the source of the input file) 
+	if (frames.n > 0) {
+		setup_frames(nz - izshift, nr, nt, dr, dt, isource - izshift, 
+			zmirror, &frames);
+		param_struct.frames = &frames;
+		param_struct.frames_weight = frames_weight;
+		param_struct.c_frames = create_array(frames.n*(nz - izshift)*(nr+1), 
+			"param c_frames array");
+		param_struct.model_frames = create_array(npix, "param model_frames array");
+		nres += npix;
+	}
 
 
 
@@ -1178,103 +2278,206 @@ if (opt_verbose)
 	}
 
 	param_struct.nt = nt;
-	param_struct.nd = nd;
-	param_struct.nz = nz;
+	param_struct.nz = nz - izshift;
 	param_struct.nr = nr;
-	param_struct.iprobe = iprobe;
-	param_struct.jprobe = jprobe;
-	param_struct.iz1 = iz1;
-	param_struct.iz2 = iz2;
+	param_struct.layers = layers;
+	for (k=0; k<layers.n-1; k++)
+		param_struct.layers.zbound[k] -= izshift*dz;
+	param_struct.fit_layer = fit_layer;
 	param_struct.nolayer = nolayer;
+	param_struct.stencil = stencil;
+	param_struct.zmirror = zmirror;
+	param_struct.exp_clearance = exp_clearance;
 	param_struct.opt_global_kappa = opt_global_kappa;
+	param_struct.fit_uptake = fit_uptake;
+	param_struct.fit_theta_z = fit_theta_z;
+	param_struct.theta_z_ratio = theta_z_sp / theta_sp;
 
 	param_struct.dt = dt;
 	param_struct.dr = dr;
-	param_struct.sd = sd;
-	param_struct.st = st;
-	param_struct.alpha_so = alpha_so;
-	param_struct.theta_so = theta_so;
-	param_struct.kappa_so = kappa_so;
-	param_struct.alpha_sp = alpha_sp;
-	param_struct.theta_sp = theta_sp;
-	param_struct.kappa_sp = kappa_sp;
-	param_struct.alpha_sr = alpha_sr;
-	param_struct.theta_sr = theta_sr;
-	param_struct.kappa_sr = kappa_sr;
 	param_struct.minalpha = minalpha;
 	param_struct.maxalpha = maxalpha;
 	param_struct.mintheta = mintheta;
 	param_struct.maxtheta = maxtheta;
 	param_struct.minkappa = minkappa;
 	param_struct.maxkappa = maxkappa;
+	param_struct.minvmax = minvmax;
+	param_struct.maxvmax = maxvmax;
+	param_struct.minkm = minkm;
+	param_struct.maxkm = maxkm;
 	param_struct.dfree = dfree;
 
     param_struct.t = create_array(nt, "param t array");
-
-    param_struct.p = create_array(nt, "param p array");
-    param_struct.t_data = create_array(nd, "param t_data array");
-    param_struct.p_data = create_array(nd, "param p_data array");
-	for (k=0; k<nt; k++) {
+	for (k=0; k<nt; k++) 
     	param_struct.t[k] = t[k];
-    	param_struct.p[k] = p[k];
-	}
-
-	// Fill t_data and p_data 
-	for (k=0; k<nd; k++) {
-    	param_struct.t_data[k] = tdata[k];
-    	param_struct.p_data[k] = pdata[k];
-	}
 
 /*****************************************
  Fit the model to determine the parameters
  *****************************************/
-	// Initialize the simplex 
-	simplex = gsl_vector_alloc(3);
+	// Initialize the simplex with the values of the fitted layer 
+	// (its Vmax and Km are the 4th and 5th parameters if they are fitted, 
+	// and theta_z is the last parameter if it is fitted)
+	if (fit_uptake) nfit = 5;
+	if (fit_theta_z) nfit++;
+	simplex = gsl_vector_alloc(nfit);
 	gsl_vector_set(simplex, 0, alpha_sp);
 	gsl_vector_set(simplex, 1, theta_sp);
 	gsl_vector_set(simplex, 2, kappa_sp);
+	if (fit_uptake) {
+		gsl_vector_set(simplex, 3, vmax_sp);
+		gsl_vector_set(simplex, 4, km_sp);
+	}
+	if (fit_theta_z) 
+		gsl_vector_set(simplex, nfit-1, theta_z_sp);
 
 	// Initialize step sizes 
-	steps = gsl_vector_alloc(3);
+	steps = gsl_vector_alloc(nfit);
 	gsl_vector_set(steps, 0, alpha_step);
 	gsl_vector_set(steps, 1, theta_step);
 	gsl_vector_set(steps, 2, kappa_step);
+	if (fit_uptake) {
+		gsl_vector_set(steps, 3, vmax_step);
+		gsl_vector_set(steps, 4, km_step);
+	}
+	if (fit_theta_z) 
+		gsl_vector_set(steps, nfit-1, theta_step);
 
 	// Set up minimization method 
-	fit_func.n = 3;  // 3 parameters to fit 
+	fit_func.n = nfit;  // 3 to 6 parameters to fit 
 	fit_func.f = calc_mse_fit_layer;  // function to minimize 
 	fit_func.params = &param_struct;  // extra parameters to function 
+	fit_x = gsl_vector_alloc(nfit);
+
+	// Benchmark of the backends on synthetic recordings instead of the fit 
+	if (benchmark_cases > 0) {
+		if ( (frames.n > 0) || opt_transform )
+			error("benchmark cannot be used with frames or transform");
+		for (k=0; k<(int)nfit; k++) {
+			x_fit[k] = gsl_vector_get(simplex, k);
+			fit_steps[k] = gsl_vector_get(steps, k);
+		}
+		if ((file_ptr = fopen(outfilename,"a")) == NULL) {
+			fprintf(stderr, "Error opening output file %s\n", outfilename);
+			exit(EXIT_FAILURE);
+		}
+		benchmark_optimizers(&param_struct, nfit, x_fit, fit_steps, fit_tol, 
+			itermax, nres, benchmark_cases, benchmark_noise, mcmc_seed, file_ptr);
+		fclose(file_ptr);
+		exit(EXIT_SUCCESS);
+	}
 
-	fit_state = gsl_multimin_fminimizer_alloc(fit_algorithm, 3);
-	gsl_multimin_fminimizer_set(fit_state, &fit_func, simplex, steps);
-
-	// Run minimization
-	do {
-		fit_iter++;
-		fit_status = gsl_multimin_fminimizer_iterate(fit_state);
-
-		if (fit_status) break;
-
-		fit_size = gsl_multimin_fminimizer_size(fit_state);
-		fit_status = gsl_multimin_test_size(fit_size, fit_tol);
+	if (opt_transform && (optimizer != OPTIMIZER_NMSIMPLEX))
+		error("transform can only be used with the nmsimplex optimizer");
+
+	// With --transform, the simplex is in the coordinates of 
+	// bounded_params(). A starting value on a bound is moved 0.1% of 
+	// the range inside, and the initial steps are those of the 
+	// parameters at the starting point (at most half the range). 
+	if (opt_transform) {
+		fit_func.f = calc_mse_fit_layer_bounded;
+		fit_bounds(&param_struct, nfit, xmin_fit, xmax_fit);
+		for (k=0; k<(int)nfit; k++) {
+			if (xmax_fit[k] <= xmin_fit[k])
+				error("transform: the bounds of parameter %d are empty", k+1);
+			fit_u = (gsl_vector_get(simplex, k) - xmin_fit[k]) / 
+				(xmax_fit[k] - xmin_fit[k]);
+			if ( (fit_u < 0.) || (fit_u > 1.) )
+				error("transform: starting value of parameter %d is outside "
+					"the bounds", k+1);
+			fit_u = MIN(MAX(fit_u, 0.001), 0.999);
+			gsl_vector_set(simplex, k, bounded_coord(xmin_fit[k] + fit_u * 
+				(xmax_fit[k] - xmin_fit[k]), xmin_fit[k], xmax_fit[k]));
+		}
+		bounded_params(simplex, &param_struct, fit_x, fit_dxdu);
+		for (k=0; k<(int)nfit; k++) 
+			gsl_vector_set(fit_x, k, MIN(0.5 * (xmax_fit[k] - xmin_fit[k]), 
+				gsl_vector_get(steps, k) / fit_dxdu[k]));
+	}
 
+	// The other backends (see optimize.c) keep the parameters within 
+	// the bounds and print the iterations like the loop below. The 
+	// frames are one residual of Levenberg-Marquardt. 
+	if (optimizer != OPTIMIZER_NMSIMPLEX) {
+		nresid = (frames.n > 0) ? nres - npix + 1 : nres;
+		fit_bounds(&param_struct, nfit, xmin_fit, xmax_fit);
+		for (k=0; k<(int)nfit; k++) {
+			x_fit[k] = gsl_vector_get(simplex, k);
+			fit_steps[k] = gsl_vector_get(steps, k);
+		}
+		fit_status = optimize(optimizer, nfit, x_fit, fit_steps, xmin_fit, 
+			xmax_fit, fit_tol, itermax, calc_mse_fit_layer, 
+			calc_residuals_fit_layer, &param_struct, nresid, mcmc_seed, 
+			opt_verbose, (opt_pathfile) ? pathfile_ptr : NULL, 
+			&mse, &fit_size, &i, &fit_evals);
+		fit_iter = i;
+		for (k=0; k<(int)nfit; k++) 
+			gsl_vector_set(fit_x, k, x_fit[k]);
 		if (opt_verbose)
 			if (fit_status == GSL_SUCCESS) printf("Finished fit\n");
 
-		alpha_fit = gsl_vector_get(fit_state->x, 0);
-		theta_fit = gsl_vector_get(fit_state->x, 1);
-		kappa_fit = gsl_vector_get(fit_state->x, 2);
-		mse = fit_state->fval;
+		alpha_fit = gsl_vector_get(fit_x, 0);
+		theta_fit = gsl_vector_get(fit_x, 1);
+		kappa_fit = gsl_vector_get(fit_x, 2);
+		if (fit_uptake) {
+			vmax_fit = gsl_vector_get(fit_x, 3);
+			km_fit = gsl_vector_get(fit_x, 4);
+		}
+		if (fit_theta_z) 
+			theta_z_fit = gsl_vector_get(fit_x, nfit-1);
+	} else {
+		fit_state = gsl_multimin_fminimizer_alloc(fit_algorithm, nfit);
+		gsl_multimin_fminimizer_set(fit_state, &fit_func, simplex, 
+			(opt_transform) ? fit_x : steps);
+
+		// Run minimization
+		do {
+			fit_iter++;
+			fit_status = gsl_multimin_fminimizer_iterate(fit_state);
+
+			if (fit_status) break;
+
+			fit_size = gsl_multimin_fminimizer_size(fit_state);
+
+			// The simplex size in the transformed coordinates is converted 
+			// with the largest derivative of the parameters at the best point 
+			if (opt_transform) {
+				bounded_params(fit_state->x, &param_struct, fit_x, fit_dxdu);
+				for (k=0, fit_u=0.; k<(int)nfit; k++) 
+					fit_u = MAX(fit_u, fit_dxdu[k]);
+				fit_size *= fit_u;
+			} else
+				gsl_vector_memcpy(fit_x, fit_state->x);
+			fit_status = gsl_multimin_test_size(fit_size, fit_tol);
+
+			if (opt_verbose)
+				if (fit_status == GSL_SUCCESS) printf("Finished fit\n");
+
+			alpha_fit = gsl_vector_get(fit_x, 0);
+			theta_fit = gsl_vector_get(fit_x, 1);
+			kappa_fit = gsl_vector_get(fit_x, 2);
+			if (fit_uptake) {
+				vmax_fit = gsl_vector_get(fit_x, 3);
+				km_fit = gsl_vector_get(fit_x, 4);
+			}
+			if (fit_theta_z) 
+				theta_z_fit = gsl_vector_get(fit_x, nfit-1);
+			mse = fit_state->fval;
 
-		if (opt_verbose)
-			printf("%d\t%f\t%f\t%f\t%g\t%g\n", 
-				(int) fit_iter, alpha_fit, theta_fit, kappa_fit, mse, fit_size);
+			if (opt_verbose)
+				printf("%d\t%f\t%f\t%f\t%g\t%g\n", 
+					(int) fit_iter, alpha_fit, theta_fit, kappa_fit, mse, fit_size);
 
-		if (opt_pathfile) 
-			fprintf(pathfile_ptr, "%d\t%f\t%f\t%f\t%g\t%g\n", 
-				(int) fit_iter, alpha_fit, theta_fit, kappa_fit, mse, fit_size);
+			if (opt_pathfile) 
+				fprintf(pathfile_ptr, "%d\t%f\t%f\t%f\t%g\t%g\n", 
+					(int) fit_iter, alpha_fit, theta_fit, kappa_fit, mse, fit_size);
 
-	} while (fit_status == GSL_CONTINUE && fit_iter < itermax);
+			if (opt_verbose && fit_uptake)
+				printf("\tvmax_fit = %g, km_fit = %g\n", vmax_fit, km_fit);
+			if (opt_verbose && fit_theta_z)
+				printf("\ttheta_z_fit = %f\n", theta_z_fit);
+
+		} while (fit_status == GSL_CONTINUE && fit_iter < itermax);
+	}
 
 	if (fit_status != GSL_SUCCESS) {
 		printf("Warning: failed to converge, status = %d, "
@@ -1297,6 +2500,161 @@ if (opt_verbose)
 			printf("Fitted kappa = %f s^-1 (in all layers)\n", kappa_fit);
 		else
 			printf("Fitted kappa = %f s^-1\n", kappa_fit);
+		if (fit_uptake) {
+			printf("Fitted vmax = %g mM/s\n", vmax_fit);
+			printf("Fitted km = %g mM\n", km_fit);
+		}
+		if (fit_theta_z)
+			printf("Fitted theta_z = %f  (lambda_z = %f)\n", 
+				theta_z_fit, 1./sqrt(theta_z_fit));
+	}
+
+	// A converged fit is added to the database 
+	if ( (fitdbfilename[0] != '\0') && (fit_status == GSL_SUCCESS) )
+		append_fitdb(fitdbfilename, fitdb_tag, fitdb_geometry, alpha_fit, 
+			theta_fit, kappa_fit, mse, (int) fit_iter, infilename);
+
+
+/******************************************************************
+ Uncertainty of the parameters (--profile and --mcmc)
+ ******************************************************************/
+	// Both run many forward models in parallel, and each thread has 
+	// its own copy of the parameter struct (the model curve and the 
+	// layer table are changed by calc_mse_fit_layer). The min and 
+	// max bounds of the fit are the bounds of the profiles and the 
+	// prior of the MCMC sampler. 
+	if ( profile_points || mcmc_walkers ) {
+#ifdef _OPENMP
+		nthreads = omp_get_max_threads();
+#endif
+		strcpy(fit_names[0], "alpha");
+		strcpy(fit_names[1], "theta");
+		strcpy(fit_names[2], "kappa");
+		xmin_fit[0] = minalpha;  xmax_fit[0] = maxalpha;
+		xmin_fit[1] = mintheta;  xmax_fit[1] = maxtheta;
+		xmin_fit[2] = minkappa;  xmax_fit[2] = maxkappa;
+		if (fit_uptake) {
+			strcpy(fit_names[3], "vmax");
+			strcpy(fit_names[4], "km");
+			xmin_fit[3] = minvmax;  xmax_fit[3] = maxvmax;
+			xmin_fit[4] = minkm;  xmax_fit[4] = maxkm;
+		}
+		if (fit_theta_z) {
+			strcpy(fit_names[nfit-1], "theta_z");
+			xmin_fit[nfit-1] = mintheta;  xmax_fit[nfit-1] = maxtheta;
+		}
+		for (k=0; k<(int)nfit; k++) {
+			x_fit[k] = gsl_vector_get(fit_x, k);
+			if ( (x_fit[k] < xmin_fit[k]) || (x_fit[k] > xmax_fit[k]) )
+				error("Fitted %s = %g is outside the bounds", 
+					fit_names[k], x_fit[k]);
+		}
+
+		thread_params = (param_struct_type *) malloc(nthreads * sizeof(param_struct_type));
+		thread_param_ptrs = (void **) malloc(nthreads * sizeof(void *));
+		if ( (thread_params == NULL) || (thread_param_ptrs == NULL) )
+			error("Could not allocate memory for the thread parameters");
+		for (k=0; k<nthreads; k++) {
+			thread_params[k] = param_struct;
+			for (l=0; l<param_struct.nsolves; l++) 
+				thread_params[k].solve[l].p = create_array(
+					solve[l].nprobes*nt, "thread p array");
+			if (frames.n > 0) {
+				thread_params[k].c_frames = create_array(
+					frames.n*(nz - izshift)*(nr+1), "thread c_frames array");
+				thread_params[k].model_frames = create_array(
+					npix, "thread model_frames array");
+			}
+			thread_param_ptrs[k] = &thread_params[k];
+		}
+	}
+
+	// Profile likelihood of alpha, theta, and kappa: the other 
+	// parameters are refitted at profile_points values on each side 
+	// of the fit, spaced by profile_scale times the initial steps 
+	if (profile_points) {
+		double h[3], x_step[6];
+		int np = 2*profile_points + 1;
+
+		if (opt_verbose)
+			printf("\nProfile likelihood: %d points on each side, "
+				"%d threads\n", profile_points, nthreads);
+
+		for (k=0; k<(int)nfit; k++) 
+			x_step[k] = profile_scale * gsl_vector_get(steps, k);
+		for (k=0; k<3; k++) 
+			h[k] = x_step[k];
+		profile_values = create_array(3*np, "profile values");
+		profile_mses = create_array(3*np, "profile mses");
+		profile_likelihood(nfit, 3, profile_points, h, x_fit, mse, 
+			x_step, xmin_fit, xmax_fit, fit_tol, itermax, 
+			calc_mse_fit_layer, thread_param_ptrs, nthreads, 
+			profile_values, profile_mses);
+		for (k=0; k<3; k++) 
+			profile_interval(profile_points, profile_values + k*np, 
+				profile_mses + k*np, mse, nres, 
+				&profile_lower[k], &profile_upper[k], 
+				&profile_found_lower[k], &profile_found_upper[k]);
+
+		if (opt_verbose) 
+			for (k=0; k<3; k++) 
+				printf("95%% interval of %s = [%g%s, %g%s]\n", fit_names[k], 
+					profile_lower[k], profile_found_lower[k] ? "" : " (not reached)", 
+					profile_upper[k], profile_found_upper[k] ? "" : " (not reached)");
+	}
+
+	// Ensemble MCMC sampling of the posterior: the prior is uniform 
+	// between the bounds and the noise of the data is Gaussian with 
+	// standard deviation mcmc_sigma (by default, the rms residual of 
+	// the fit). The walkers start close to the fit. 
+	if (mcmc_walkers) {
+		double x_scale[6];
+		FILE *chain_ptr = NULL;
+
+		if (mcmc_sigma < 0.) 
+			mcmc_sigma = sqrt(mse);
+		if (IS_ZERO(mcmc_sigma))
+			error("mcmc_sigma is 0 (perfect fit); specify it with --mcmc_sigma");
+		for (k=0; k<(int)nfit; k++) 
+			x_scale[k] = 0.01 * gsl_vector_get(steps, k);
+
+		if ((chain_ptr = fopen(chainfilename,"wb")) == NULL) {
+			fprintf(stderr, "Error opening MCMC chain file %s\n", 
+				chainfilename);
+			exit(EXIT_FAILURE);
+		}
+
+		if (opt_verbose)
+			printf("\nMCMC sampling: %d walkers, %d steps (%d burn-in), "
+				"sigma = %g mM, %d threads\n", mcmc_walkers, mcmc_steps, 
+				mcmc_burn, mcmc_sigma, nthreads);
+
+		// log-likelihood = -(number of residuals) * MSE / (2 sigma^2) 
+		mcmc_acceptance = ensemble_mcmc(nfit, mcmc_walkers, mcmc_steps, 
+			mcmc_burn, x_fit, x_scale, xmin_fit, xmax_fit, 
+			nres / (2.0 * SQR(mcmc_sigma)), mcmc_seed, 
+			calc_mse_fit_layer, thread_param_ptrs, nthreads, opt_verbose, 
+			chain_ptr, mcmc_mean, mcmc_sd);
+
+		fclose(chain_ptr);
+
+		if (opt_verbose) {
+			printf("MCMC acceptance fraction = %f\n", mcmc_acceptance);
+			for (k=0; k<(int)nfit; k++) 
+				printf("Posterior %s = %g +- %g\n", fit_names[k], 
+					mcmc_mean[k], mcmc_sd[k]);
+		}
+	}
+
+	if ( profile_points || mcmc_walkers ) {
+		for (k=0; k<nthreads; k++) {
+			for (l=0; l<param_struct.nsolves; l++) 
+				free(thread_params[k].solve[l].p);
+			free(thread_params[k].c_frames);
+			free(thread_params[k].model_frames);
+		}
+		free(thread_params);
+		free(thread_param_ptrs);
 	}
 
 
@@ -1337,8 +2695,63 @@ if (opt_verbose)
 		fprintf(file_ptr, "# Fitted kappa = %f s^-1 (in all layers)\n", kappa_fit);
 	else
 		fprintf(file_ptr, "# Fitted kappa = %f s^-1\n", kappa_fit);
+	if (fit_uptake) {
+		fprintf(file_ptr, "# Fitted vmax = %g mM/s\n", vmax_fit);
+		fprintf(file_ptr, "# Fitted km = %g mM\n", km_fit);
+	}
+	if (fit_theta_z)
+		fprintf(file_ptr, "# Fitted theta_z = %f  (lambda_z = %f)\n", 
+			theta_z_fit, 1./sqrt(theta_z_fit));
 	fprintf(file_ptr, "# Final mean squared error = %g\n", mse);
 	fprintf(file_ptr, "# Final simplex size = %g\n", fit_size);
+	if (optimizer != OPTIMIZER_NMSIMPLEX)
+		fprintf(file_ptr, "# Optimizer = %s, %d evaluations of the model\n", 
+			optimizer_name(optimizer), fit_evals);
+	if (nrec > 1) 
+		fprintf(file_ptr, "# Joint fit of %d recordings with %d forward solves\n", 
+			nrec, param_struct.nsolves);
+	if (frames.n > 0) {
+		// Model frames at the fit 
+		calc_mse_fit_layer(fit_x, &param_struct);
+		fprintf(file_ptr, "# Frames: gain = %g (%s)\n", param_struct.frames_gain, 
+			(frames.gain > 0.) ? "given" : "fitted");
+		fprintf(file_ptr, "# Frame\t  time (s)\t  MSE of the pixels\n");
+		for (k=0; k<frames.n; k++) {
+			double frame_mse = 0.;
+			for (i=0; i<frames.width*frames.height; i++) 
+				frame_mse += SQR(param_struct.model_frames[k*frames.width*frames.height + i] 
+					- frames.data[k*frames.width*frames.height + i]);
+			fprintf(file_ptr, "# %d\t%f\t%g\n", k+1, frames.time[k], 
+				frame_mse / (frames.width*frames.height));
+		}
+	}
+	if (profile_points) {
+		fprintf(file_ptr, "# Profile likelihood: %d points on each side, "
+			"spacing = %g x initial step\n", profile_points, profile_scale);
+		fprintf(file_ptr, "# Profile: parameter\t   value\t     MSE\tdeviance\n");
+		for (k=0; k<3; k++) 
+			for (i=0; i<2*profile_points+1; i++) {
+				j = k*(2*profile_points+1) + i;
+				if (profile_mses[j] >= 0.)
+					fprintf(file_ptr, "# Profile: %s\t%g\t%g\t%g\n", fit_names[k], 
+						profile_values[j], profile_mses[j], 
+						nres * log(profile_mses[j] / mse));
+			}
+		for (k=0; k<3; k++) 
+			fprintf(file_ptr, "# 95%% interval of %s = [%g%s, %g%s]\n", fit_names[k], 
+				profile_lower[k], profile_found_lower[k] ? "" : " (not reached)", 
+				profile_upper[k], profile_found_upper[k] ? "" : " (not reached)");
+	}
+	if (mcmc_walkers) {
+		fprintf(file_ptr, "# MCMC: %d walkers, %d steps (%d burn-in), "
+			"sigma = %g mM, seed = %lu\n", mcmc_walkers, mcmc_steps, 
+			mcmc_burn, mcmc_sigma, mcmc_seed);
+		fprintf(file_ptr, "# MCMC chain file = %s\n", chainfilename);
+		fprintf(file_ptr, "# MCMC acceptance fraction = %f\n", mcmc_acceptance);
+		for (k=0; k<(int)nfit; k++) 
+			fprintf(file_ptr, "# Posterior %s = %g +- %g\n", fit_names[k], 
+				mcmc_mean[k], mcmc_sd[k]);
+	}
 
 	fprintf(file_ptr, "# Solution: alpha_sp\ttheta_sp\tlambda_sp\tkappa_sp"
 	                  "\t     MSE\tsimplex size\t# iter.\tTime (s)"
@@ -1348,27 +2761,35 @@ if (opt_verbose)
 		mse, fit_size, (int) fit_iter, 
 		(int) round(total_time), total_time/60., total_time/3600.);
 	fprintf(file_ptr, "# --------------------------------------\n");
-	fprintf(file_ptr, "# Probe concentration data:\n");
-	fprintf(file_ptr, "#   time      \t  c (model) \t  t (data) "
-		"\t    c (data) \n");
 
-
-	// Print concentration arrays to output file 
+	// Print concentration arrays to output file, one block for 
+	// each recording (the model curve of a recording is the curve 
+	// of its probe in its forward solve, scaled by its current). 
 	// If there are more than 1000 points in the concentration values 
 	// from the model (normally nt >> 1000), downsample to 1000 points
-	if (nt > 1000) 
-		for (i=0; i<1000; i++) {
-			k = (i * nt) / 1000;
-			l = (i * nd) / 1000;
-			fprintf(file_ptr, "%#12.8g\t%#12.8g\t%#12.8g\t%#12.8g\n", param_struct.t[k], param_struct.p[k], 
-				param_struct.t_data[l], param_struct.p_data[l]);
-		}
-	else
-		for (i=0; i<nt; i++) {
-			fprintf(file_ptr, "%#12.8g\t%#12.8g\t%#12.8g\t%#12.8g\n", param_struct.t[i], param_struct.p[i], 
-				param_struct.t_data[i], param_struct.p_data[i]);
-		}
-	fprintf(file_ptr, "\n\n\n");
+	for (j=0; j<nrec; j++) {
+		double *pm = solve[rec[j].solve].p + rec[j].probe * nt;
+		if (j == 0)
+			fprintf(file_ptr, "# Probe concentration data:\n");
+		else
+			fprintf(file_ptr, "# Probe concentration data of recording %d (%s):\n", 
+				j+1, recfilename[j]);
+		fprintf(file_ptr, "#   time      \t  c (model) \t  t (data) "
+			"\t    c (data) \n");
+		if (nt > 1000) 
+			for (i=0; i<1000; i++) {
+				k = (i * nt) / 1000;
+				l = (i * rec[j].nd) / 1000;
+				fprintf(file_ptr, "%#12.8g\t%#12.8g\t%#12.8g\t%#12.8g\n", param_struct.t[k], 
+					rec[j].scale * pm[k], rec[j].t_data[l], rec[j].p_data[l]);
+			}
+		else
+			for (i=0; i<nt; i++) {
+				fprintf(file_ptr, "%#12.8g\t%#12.8g\t%#12.8g\t%#12.8g\n", param_struct.t[i], 
+					rec[j].scale * pm[i], rec[j].t_data[i], rec[j].p_data[i]);
+			}
+		fprintf(file_ptr, "\n\n\n");
+	}
 
 	// Close the file 
 	fclose(file_ptr);
@@ -1377,23 +2798,40 @@ if (opt_verbose)
 
 	// Deallocate arrays 
 	free(t);
-	free(p);
 //	free(s);
 	free(tdata);
 	free(pdata);
 	free(alphas);
 //	free(invr);
 
+	for (k=1; k<nrec; k++) {
+		free(rec_tdata[k]);
+		free(rec_pdata[k]);
+	}
+
 	free(param_struct.t);
-	free(param_struct.s);
 	free(param_struct.invr);
-	free(param_struct.t_data);
-	free(param_struct.p_data);
-	free(param_struct.p);
+	for (k=0; k<nrec; k++) {
+		free(rec[k].t_data);
+		free(rec[k].p_data);
+	}
+	for (l=0; l<param_struct.nsolves; l++) {
+		free(solve[l].s);
+		free(solve[l].p);
+	}
+	if (frames.n > 0) {
+		free_frames(&frames);
+		free(param_struct.c_frames);
+		free(param_struct.model_frames);
+	}
+	free(profile_values);
+	free(profile_mses);
 
 	gsl_vector_free(simplex);
 	gsl_vector_free(steps);
-	gsl_multimin_fminimizer_free(fit_state);
+	if (fit_state)
+		gsl_multimin_fminimizer_free(fit_state);
+	gsl_vector_free(fit_x);
 
 if (opt_verbose)
 	printf("All done\n");
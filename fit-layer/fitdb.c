@@ -0,0 +1,139 @@
+/**
+  \file fit-layer/fitdb.c
+
+  Functions for the database of previous fits (--fitdb), which gives
+  the starting values of a fit (warm start).
+
+  The database is a text file with one line per fit: the condition
+  tag (--fitdb_tag), the geometry of the recording, the fitted alpha,
+  theta, and kappa, the MSE, the number of iterations, and the input
+  file. The geometry is the bottom and the top of the fitted layer
+  and the probe z and r position, in microns relative to the source
+  (the bottom and the top of the cylinder for the bottom and the top
+  layer). Lines that begin with '#' are comments.
+
+  The fits with the same tag are the cohort of a recording. The fit
+  starts from the fit of the cohort with the nearest geometry
+  (Euclidean distance; the latest fit if several are equally near),
+  and the standard deviations of alpha, theta, and kappa in the
+  cohort give the initial steps of the simplex. Each converged fit
+  is appended to the database as one write, so several fits can
+  share the database.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "header.h"
+
+
+/// Maximum length of a line of the database
+#define FITDB_LINELENGTH 1024
+
+
+/**
+  \brief Reads the fits with a condition tag from the database and
+  finds the nearest one. A database that does not exist has no fits.
+
+  \param[in] filename Name of the database
+  \param[in] tag Condition tag
+  \param[in] geometry Geometry of the recording (FITDB_NGEOM values, microns)
+  \param[out] start Nearest fit and the spread of the cohort
+ */
+void read_fitdb(char *filename, char *tag, double *geometry, fitdb_struct_type *start)
+{
+	int a, nread;
+	int line = 0;
+	char string[FITDB_LINELENGTH];
+	char entry_tag[FITDB_LINELENGTH];
+	double g[FITDB_NGEOM], x[3], dist;
+	double sum[3] = {0., 0., 0.};
+	double sum2[3] = {0., 0., 0.};
+	FILE *file_ptr;
+
+	start->n = 0;
+	start->distance = -1.;
+	for (a=0; a<3; a++) {
+		start->x[a] = -1.;
+		start->sd[a] = -1.;
+	}
+	if ((file_ptr = fopen(filename,"r")) == NULL)
+		return;
+
+	while (fgets(string, FITDB_LINELENGTH, file_ptr) != NULL) {
+		line++;
+		if ( (string[0] == '#') || (strlen(string) < 3) )
+			continue;
+		nread = sscanf(string, "%s %lf %lf %lf %lf %lf %lf %lf", entry_tag,
+			&g[0], &g[1], &g[2], &g[3], &x[0], &x[1], &x[2]);
+		if (nread != 8) {
+			fprintf(stderr, "Warning: line %d of %s is not a fit\n", line, filename);
+			continue;
+		}
+		if (! STREQ(entry_tag, tag))
+			continue;
+
+		for (a=0, dist=0.; a<FITDB_NGEOM; a++)
+			dist += SQR(g[a] - geometry[a]);
+		dist = sqrt(dist);
+		if ( (start->n == 0) || (dist <= start->distance) ) {
+			start->distance = dist;
+			for (a=0; a<3; a++)
+				start->x[a] = x[a];
+		}
+		for (a=0; a<3; a++) {
+			sum[a] += x[a];
+			sum2[a] += SQR(x[a]);
+		}
+		start->n++;
+	}
+	fclose(file_ptr);
+
+	if (start->n > 1)
+		for (a=0; a<3; a++)
+			start->sd[a] = sqrt(MAX(0., (sum2[a] - SQR(sum[a]) / start->n)
+				/ (start->n - 1)));
+}
+
+
+/**
+  \brief Appends a fit to the database (with a heading line if the
+  database is new).
+
+  \param[in] filename Name of the database
+  \param[in] tag Condition tag
+  \param[in] geometry Geometry of the recording (FITDB_NGEOM values, microns)
+  \param[in] alpha Fitted alpha
+  \param[in] theta Fitted theta
+  \param[in] kappa Fitted kappa (s^-1)
+  \param[in] mse Final mean squared error
+  \param[in] iterations Number of iterations of the fit
+  \param[in] infilename Input file of the fit
+ */
+void append_fitdb(char *filename, char *tag, double *geometry, double alpha, double theta, double kappa, double mse, int iterations, char *infilename)
+{
+	char string[FITDB_LINELENGTH];
+	FILE *file_ptr;
+
+	if ((file_ptr = fopen(filename,"r")) == NULL) {
+		if ((file_ptr = fopen(filename,"w")) == NULL)
+			error("Error opening fit database %s", filename);
+		fprintf(file_ptr, "# Database of fits of fit-layer (geometry in microns "
+			"relative to the source)\n");
+		fprintf(file_ptr, "# tag\tlayer bottom\tlayer top\tprobe z\tprobe r"
+			"\talpha\ttheta\tkappa\tMSE\titerations\tinput file\n");
+	}
+	fclose(file_ptr);
+
+	/* One write, so that fits that share the database do not mix
+	   their lines */
+	snprintf(string, FITDB_LINELENGTH, "%s\t%f\t%f\t%f\t%f\t%f\t%f\t%f\t%g\t%d\t%s\n",
+		tag, geometry[0], geometry[1], geometry[2], geometry[3],
+		alpha, theta, kappa, mse, iterations, infilename);
+	if ((file_ptr = fopen(filename,"a")) == NULL)
+		error("Error opening fit database %s", filename);
+	fputs(string, file_ptr);
+	fclose(file_ptr);
+}
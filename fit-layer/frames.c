@@ -0,0 +1,382 @@
+/**
+  \file fit-layer/frames.c
+
+  Functions for fitting the model to a stack of IOI (integrative
+  optical imaging) frames.
+
+  In IOI, a fluorescent molecule is released from the source, and
+  a camera takes images of the fluorescence. A frame is the
+  concentration integrated along the line of sight (which is
+  perpendicular to the z-axis) through the thickness of tissue seen
+  by the camera, blurred by the point spread function of the optics.
+  The model frames are calculated from the concentration matrix of
+  the model at the times of the frames: because the concentration
+  is axially symmetric, the projection of each row of the matrix is
+  a fixed linear combination of its columns (an Abel projection),
+  followed by a Gaussian blur. The residuals of all pixels of all
+  frames are summed, so the whole image sequence is fitted at once.
+
+  The frames are described by a text file with lines
+  "parameter = value [optional text]" (and comment lines beginning
+  with '#'):
+
+  - width, height: number of columns (x) and rows (z) of a frame
+  - pixel: pixel size (microns)
+  - source_col, source_row: position of the source in the frame
+    (pixels from the first column and row, may be fractional)
+  - depth: half thickness of the tissue seen along the line of
+    sight (microns; default: the whole cylinder)
+  - blur: standard deviation of the point spread function
+    (microns; default 0)
+  - gain: intensity per mM (default 0, for a gain that is fitted)
+  - frame: time of the frame (s) and name of its file, e.g.
+    "frame = 20.5 stack.20500ms.raw"
+
+  Each frame file has width*height pixels as 64-bit floating point
+  numbers (doubles), row by row, like the concentration images of
+  3layer.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "header.h"
+
+
+/**
+  \brief Reads the description and the frames of an image stack.
+
+  \param[in] filename Name of the text file that describes the stack
+  \param[out] frames Struct for the frames (the projection is set up by setup_frames())
+ */
+void read_frames(char *filename, frames_struct_type *frames)
+{
+	int i, npix;
+	char string[MAX_LINELENGTH];
+	char parameter[MAX_LINELENGTH];
+	char value[MAX_LINELENGTH];
+	char framefilename[MAX_LINELENGTH];
+	double time;
+	FILE *file_ptr;
+	FILE *frame_ptr;
+
+	frames->n = 0;
+	frames->width = frames->height = -1;
+	frames->pixel = -1.;
+	frames->source_col = frames->source_row = -1.;
+	frames->depth = -1.;
+	frames->blur = 0.;
+	frames->gain = 0.;
+	frames->data = NULL;
+	frames->row0 = NULL;
+	frames->roww = NULL;
+	frames->colj0 = NULL;
+	frames->colw = NULL;
+	frames->kradius = 0;
+	frames->kernel = NULL;
+
+	if ((file_ptr = fopen(filename,"r")) == NULL)
+		error("Error opening frames file %s", filename);
+
+	/* First pass: the parameters and the number of frames */
+	while (fgets(string, MAX_LINELENGTH, file_ptr) != NULL) {
+		if ( (string[0] == '#') || (strlen(string) < 3) )
+			continue;
+		if (sscanf(string, "%s = %s", parameter, value) < 2)
+			continue;
+		if (STREQ(parameter, "width")) frames->width = atoi(value);
+		if (STREQ(parameter, "height")) frames->height = atoi(value);
+		if (STREQ(parameter, "pixel")) frames->pixel = 1e-6 * atof(value);
+		if (STREQ(parameter, "source_col")) frames->source_col = atof(value);
+		if (STREQ(parameter, "source_row")) frames->source_row = atof(value);
+		if (STREQ(parameter, "depth")) frames->depth = 1e-6 * atof(value);
+		if (STREQ(parameter, "blur")) frames->blur = 1e-6 * atof(value);
+		if (STREQ(parameter, "gain")) frames->gain = atof(value);
+		if (STREQ(parameter, "frame")) {
+			if (frames->n >= MAX_FRAMES)
+				error("Too many frames in %s (maximum %d)", filename, MAX_FRAMES);
+			frames->n++;
+		}
+	}
+
+	if ( (frames->width < 1) || (frames->height < 1) )
+		error("Frames file %s: width and height should be > 0", filename);
+	if (frames->pixel <= 0.)
+		error("Frames file %s: pixel should be > 0", filename);
+	if ( (frames->source_col < 0.) || (frames->source_row < 0.) )
+		error("Frames file %s: source_col and source_row should be given", filename);
+	if (frames->blur < 0.)
+		error("Frames file %s: blur should be >= 0", filename);
+	if (frames->n == 0)
+		error("Frames file %s has no frames", filename);
+
+	npix = frames->width * frames->height;
+	frames->data = create_array(frames->n * npix, "frames");
+
+	/* Second pass: the frames */
+	rewind(file_ptr);
+	i = 0;
+	while (fgets(string, MAX_LINELENGTH, file_ptr) != NULL) {
+		if (string[0] == '#')
+			continue;
+		if (sscanf(string, "%s = %lf %s", parameter, &time, framefilename) < 3)
+			continue;
+		if (! STREQ(parameter, "frame"))
+			continue;
+		frames->time[i] = time;
+		if ((frame_ptr = fopen(framefilename,"rb")) == NULL)
+			error("Error opening frame file %s", framefilename);
+		if (fread(frames->data + i*npix, sizeof(double), npix, frame_ptr)
+		  != (size_t) npix)
+			error("Frame file %s has fewer than %d x %d pixels",
+				framefilename, frames->width, frames->height);
+		fclose(frame_ptr);
+		i++;
+	}
+	if (i != frames->n)
+		error("Frames file %s: could not read %d frame lines",
+			filename, frames->n - i);
+
+	fclose(file_ptr);
+}
+
+
+/**
+  \brief Sets up the projection of the model onto the frames.
+
+  A pixel is the mean concentration along the line of sight through
+  its center, \f$ y = -d \f$ to \f$ d \f$ (d = depth), at
+  \f$ r = \sqrt{x^2 + y^2} \f$ (interpolated linearly between the
+  columns of the matrix, and 0 outside the cylinder), interpolated
+  linearly between the rows of the matrix. With z-mirror symmetry,
+  the rows below the source are the mirror images of those above it.
+
+  \param[in] nz Number of rows of the concentration matrix (model grid)
+  \param[in] nr Number of columns of the concentration matrix
+  \param[in] nt Number of time steps of the model
+  \param[in] dr Spacing in r and z
+  \param[in] dt Time step
+  \param[in] isource Row of the source on the model grid
+  \param[in] zmirror Number of ghost rows for z-mirror symmetry (0 = none)
+  \param[in,out] frames Struct for the frames
+ */
+void setup_frames(int nz, int nr, int nt, double dr, double dt, int isource, int zmirror, frames_struct_type *frames)
+{
+	int i, j, k, m, ny;
+	double x, y, z, u, f, h, depth;
+	double ksum;
+	int w = frames->width;
+
+	/* Time steps of the frames */
+	for (k=0; k<frames->n; k++) {
+		frames->step[k] = lround(frames->time[k] / dt);
+		if ( (frames->step[k] < 0) || (frames->step[k] >= nt) )
+			error("Frame %d at t = %f s is outside 0 < t < tmax",
+				k+1, frames->time[k]);
+	}
+
+	/* Rows: linear interpolation between two rows of the matrix */
+	frames->row0 = (int *) malloc(frames->height * sizeof(int));
+	frames->roww = create_array(frames->height, "frame row weights");
+	if (frames->row0 == NULL)
+		error("Could not allocate memory for the frame rows");
+	for (i=0; i<frames->height; i++) {
+		z = (i - frames->source_row) * frames->pixel / dr;
+		if (zmirror)
+			z = fabs(z);
+		u = isource + z;
+		if ( (u < 0.) || (u > nz-1) )
+			error("Row %d of the frames is outside of the cylinder", i);
+		frames->row0[i] = MIN((int) floor(u), nz-2);
+		frames->roww[i] = u - frames->row0[i];
+	}
+
+	/* Columns: mean over the line of sight with a spacing of dr/4 */
+	depth = (frames->depth > 0.) ? frames->depth : (nr - 1) * dr;
+	ny = (int) ceil(2.0 * depth / (0.25 * dr));
+	h = 2.0 * depth / ny;
+	frames->colj0 = (int *) malloc(w * sizeof(int));
+	frames->colw = create_array(w * (nr+1), "frame column weights");
+	if (frames->colj0 == NULL)
+		error("Could not allocate memory for the frame columns");
+	for (j=0; j<w; j++) {
+		x = (j - frames->source_col) * frames->pixel;
+		frames->colj0[j] = MIN(1 + (int) floor(fabs(x) / dr), nr);
+		for (m=0; m<ny; m++) {
+			y = -depth + (m + 0.5) * h;
+			u = sqrt(SQR(x) + SQR(y)) / dr;
+			k = 1 + (int) floor(u);
+			f = u - floor(u);
+			if (k < nr) {
+				frames->colw[j*(nr+1) + k] += (1. - f) / ny;
+				frames->colw[j*(nr+1) + k+1] += f / ny;
+			} else if (k == nr) {
+				frames->colw[j*(nr+1) + k] += (1. - f) / ny;
+			}
+		}
+	}
+
+	/* Blur kernel (Gaussian, to 3 standard deviations) */
+	if (frames->blur > 0.)
+		frames->kradius = (int) ceil(3.0 * frames->blur / frames->pixel);
+	frames->kernel = create_array(frames->kradius + 1, "blur kernel");
+	ksum = 0.;
+	for (k=0; k<=frames->kradius; k++) {
+		frames->kernel[k] = (frames->blur > 0.) ?
+			exp(-0.5 * SQR(k * frames->pixel / frames->blur)) : 1.;
+		ksum += (k == 0) ? frames->kernel[k] : 2. * frames->kernel[k];
+	}
+	for (k=0; k<=frames->kradius; k++)
+		frames->kernel[k] /= ksum;
+}
+
+
+/**
+  \brief Blurs a frame with the (separable) kernel, first along the
+  rows and then along the columns. Near the edges, the kernel is
+  normalized to the pixels inside the frame.
+
+  \param[in] frames Struct for the frames (size and kernel)
+  \param[in,out] img Frame
+  \param[out] work Work array (width*height elements)
+ */
+static void blur_frame(frames_struct_type *frames, double *img, double *work)
+{
+	int i, j, k;
+	int w = frames->width;
+	int hgt = frames->height;
+	int kr = frames->kradius;
+	double *kern = frames->kernel;
+	double sum, wsum;
+
+	if (kr == 0)
+		return;
+
+	for (i=0; i<hgt; i++)
+		for (j=0; j<w; j++) {
+			sum = kern[0] * img[i*w+j];
+			wsum = kern[0];
+			for (k=1; k<=kr; k++) {
+				if (j-k >= 0) { sum += kern[k] * img[i*w+j-k]; wsum += kern[k]; }
+				if (j+k < w) { sum += kern[k] * img[i*w+j+k]; wsum += kern[k]; }
+			}
+			work[i*w+j] = sum / wsum;
+		}
+
+	for (i=0; i<hgt; i++)
+		for (j=0; j<w; j++) {
+			sum = kern[0] * work[i*w+j];
+			wsum = kern[0];
+			for (k=1; k<=kr; k++) {
+				if (i-k >= 0) { sum += kern[k] * work[(i-k)*w+j]; wsum += kern[k]; }
+				if (i+k < hgt) { sum += kern[k] * work[(i+k)*w+j]; wsum += kern[k]; }
+			}
+			img[i*w+j] = sum / wsum;
+		}
+}
+
+
+/**
+  \brief Calculates the model frames and the sum of the squared
+  residuals of all pixels of all frames.
+
+  The frames are projected and blurred in parallel (OpenMP), and the
+  sums over the pixels are parallel reductions. If the gain of the
+  stack is not given, it is the least-squares gain
+  \f$ \sum m d / \sum m^2 \f$ of the model frames m and data d.
+
+  \param[in] nz Number of rows of the concentration matrix (model grid)
+  \param[in] nr Number of columns of the concentration matrix
+  \param[in] c_frames Concentration matrices at the frames
+  \param[in] frames Struct for the frames (set up by setup_frames())
+  \param[out] model_frames Model frames (times the gain; n*width*height elements)
+  \param[out] gain Gain of the model frames
+
+  \return Sum of the squared residuals
+ */
+double frames_sse(int nz, int nr, double *c_frames, frames_struct_type *frames, double *model_frames, double *gain)
+{
+	int f, n;
+	int w = frames->width;
+	int npix = frames->width * frames->height;
+	int ntot = frames->n * npix;
+	double smd = 0.;
+	double smm = 0.;
+	double sse = 0.;
+	double g;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (f=0; f<frames->n; f++) {
+		int i, j, jj;
+		double sum, fz;
+		double *c = c_frames + f*nz*(nr+1);
+		double *img = model_frames + f*npix;
+		double *row = create_array(nr+1, "frame row");
+		double *work = create_array(npix, "frame work");
+
+		for (i=0; i<frames->height; i++) {
+			int i0 = frames->row0[i];
+			fz = frames->roww[i];
+			for (jj=0; jj<nr+1; jj++)
+				row[jj] = (1. - fz) * c[INDEX(i0,jj)] + fz * c[INDEX(i0+1,jj)];
+			for (j=0; j<w; j++) {
+				double *cw = frames->colw + j*(nr+1);
+				sum = 0.;
+				for (jj=frames->colj0[j]; jj<nr+1; jj++)
+					sum += cw[jj] * row[jj];
+				img[i*w+j] = sum;
+			}
+		}
+		blur_frame(frames, img, work);
+
+		free(row);
+		free(work);
+	}
+
+	if (frames->gain > 0.) {
+		g = frames->gain;
+	} else {
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:smd,smm)
+#endif
+		for (n=0; n<ntot; n++) {
+			smd += model_frames[n] * frames->data[n];
+			smm += SQR(model_frames[n]);
+		}
+		g = (smm > 0.) ? smd / smm : 0.;
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:sse)
+#endif
+	for (n=0; n<ntot; n++) {
+		model_frames[n] *= g;
+		sse += SQR(model_frames[n] - frames->data[n]);
+	}
+
+	*gain = g;
+	return sse;
+}
+
+
+/**
+  \brief Frees the arrays of an image stack.
+
+  \param[in,out] frames Struct for the frames
+ */
+void free_frames(frames_struct_type *frames)
+{
+	free(frames->data);
+	free(frames->row0);
+	free(frames->roww);
+	free(frames->colj0);
+	free(frames->colw);
+	free(frames->kernel);
+}
@@ -9,6 +9,9 @@
 
  */
 
+// Includes
+#include <gsl/gsl_vector.h>
+
 // Constants
 
 /// Maximum number of lines in input file 
@@ -23,6 +26,28 @@
 /// Maximum number of characters of command to copy to output file
 #define MAX_COMMAND_LENGTH 1000
 
+/// Maximum number of layers in the layer table
+#define MAX_LAYERS 10
+
+/// Maximum number of recordings of a joint fit
+#define MAX_RECORDINGS 10
+
+/// Maximum number of frames of an image stack
+#define MAX_FRAMES 200
+
+/// Optimizer backends (see optimize.c)
+#define OPTIMIZER_NMSIMPLEX 0
+#define OPTIMIZER_NMSIMPLEX2 1
+#define OPTIMIZER_TRUST 2
+#define OPTIMIZER_LM 3
+#define OPTIMIZER_CMAES 4
+
+/// Number of optimizer backends
+#define NUM_OPTIMIZERS 5
+
+/// Number of values of the geometry of a fit in the database of fits
+#define FITDB_NGEOM 4
+
 /// FALSE assigned to 0
 #define FALSE 0
 
@@ -95,10 +120,71 @@
 #define INDEX(i,j) ((i)*(nr+1)+(j))
 
 
+/** 
+  \typedef Typedef for struct for the layer table. The layers are 
+  ordered from the bottom (smallest z) to the top, and layer k 
+  is zbound[k-1] < z < zbound[k] (the bottom and top layers 
+  extend past the ends of the cylinder).
+ */
+typedef struct {
+    int n;                         ///< Number of layers
+    double zbound[MAX_LAYERS-1];   ///< z-positions of the n-1 boundaries between layers (increasing)
+    double alpha[MAX_LAYERS];      ///< Extracellular volume fraction of each layer
+    double theta[MAX_LAYERS];      ///< Permeability of each layer (radial, within the layer)
+    double theta_z[MAX_LAYERS];    ///< Axial permeability of each layer (across the layer)
+    double kappa[MAX_LAYERS];      ///< Nonspecific clearance factor of each layer
+    double vmax[MAX_LAYERS];       ///< Maximum Michaelis-Menten uptake rate of each layer
+    double km[MAX_LAYERS];         ///< Michaelis constant of uptake of each layer
+} layer_table_struct_type;
+
+
+/** 
+  \typedef Typedef for struct for a stack of IOI (integrative optical 
+  imaging) frames and the projection of the model onto them. Pixel 
+  (row, col) of a frame is element row*width+col; the rows are along 
+  z and the columns along x (perpendicular to the line of sight). 
+ */
+typedef struct {
+    int n;                         ///< Number of frames
+    int width;                     ///< Number of columns (x) of a frame
+    int height;                    ///< Number of rows (z) of a frame
+    double pixel;                  ///< Pixel size (m)
+    double source_col;             ///< Column of the source (pixels, may be fractional)
+    double source_row;             ///< Row of the source (pixels, may be fractional)
+    double depth;                  ///< Half thickness of the line of sight (m; <= 0 for the whole cylinder)
+    double blur;                   ///< Standard deviation of the point spread function (m)
+    double gain;                   ///< Intensity per mM (<= 0: fitted)
+    double time[MAX_FRAMES];       ///< Times of the frames (s)
+    int step[MAX_FRAMES];          ///< Time steps of the model at the frames
+    double *data;                  ///< Frames (n*width*height pixels)
+    int *row0;                     ///< Lower model row of each image row
+    double *roww;                  ///< Weight of the upper model row of each image row
+    int *colj0;                    ///< First model column with a weight for each image column
+    double *colw;                  ///< Projection weights (width*(nr+1)) of the model columns
+    int kradius;                   ///< Radius of the blur kernel (pixels)
+    double *kernel;                ///< Blur kernel (kradius+1 elements, from the center out)
+} frames_struct_type;
+
+
+/** 
+  \typedef Typedef for struct for the warm start of a fit from the 
+  database of previous fits (see fitdb.c). 
+ */
+typedef struct {
+    int n;                         ///< Number of fits with the condition tag (the cohort)
+    double distance;               ///< Distance of the geometry of the nearest fit (microns)
+    double x[3];                   ///< alpha, theta, kappa of the nearest fit
+    double sd[3];                  ///< Standard deviations of alpha, theta, kappa in the cohort (n > 1)
+} fitdb_struct_type;
+
+
 // Function prototypes
 
 // convo.c
 void convolve3(int M, int N, double *a, double scale1, double scale2, double *invr, double *out);
+void convolve_rows(int M, int N, double *a, double *scale1, double *scale2, double *scale_zm, double *scale_zp, double *invr, double *out);
+
+void convolve_rows4(int M, int N, double *a, double *scale1, double *scale_zm, double *scale_zp, double *out);
 
 // extras.c
 void error(char *errorstring, ...);
@@ -107,10 +193,56 @@ void print_usage_fit_layer(char *program);
 
 void check_filename(char *in, char *out);
 
-double *create_array(int N, char *string);
+double *create_array(size_t N, char *string);
 
 int assemble_command(int argc, char *argv[], char *command);
 
+// layers.c
+double layer_integral(double za, double zb, int nlayers, double *zbound, double *value, int inverse);
+
+void calc_layer_rows(int nz, double dz, layer_table_struct_type *layers, double dfree, double *alpha_row, double *dstar_row, double *kappa_row, double *g);
+
+double cell_alpha(double z, double dz, layer_table_struct_type *layers);
+
+void calc_row_average(int nz, double dz, layer_table_struct_type *layers, double *v, double *v_row);
+
+void set_three_layers(double lz1, double lz2, double alpha_so, double theta_so, double theta_z_so, double kappa_so, double vmax_so, double km_so, double alpha_sp, double theta_sp, double theta_z_sp, double kappa_sp, double vmax_sp, double km_sp, double alpha_sr, double theta_sr, double theta_z_sr, double kappa_sr, double vmax_sr, double km_sr, layer_table_struct_type *layers);
+
+void add_layer(char *string, layer_table_struct_type *layers);
+
+int layers_symmetric(layer_table_struct_type *layers, double z0, double tol);
+
 // model.c
-void calc_diffusion_curve_layer_fit_layer(int nt, int nz, int nr, int iprobe, int jprobe, int iz1, int iz2, int nolayer, double dt, double dr, double sd, double st, double alpha_so, double theta_so, double kappa_so, double alpha_sp, double theta_sp, double kappa_sp, double alpha_sr, double theta_sr, double kappa_sr, double dfree, double *t, double *s, double *invr, double *p);
+void calc_diffusion_curve_layer_fit_layer(int nt, int nz, int nr, int nprobes, int *iprobe, int *jprobe, layer_table_struct_type *layers, int nolayer, int stencil, int zmirror, int exp_clearance, double dt, double dr, double sd, double st, double dfree, double *t, double *s, double *invr, int nframes, int *frame_steps, double *c_frames, double *p);
+
+// mcmc.c
+double ensemble_mcmc(int ndim, int nwalkers, int nsteps, int nburn, double *x0, double *x_scale, double *xmin, double *xmax, double scale_ll, unsigned long seed, double (*mse_func)(const gsl_vector *, void *), void **params, int nparams, int verbose, FILE *chain_ptr, double *mean, double *sd);
+
+// profile.c
+void profile_likelihood(int ndim, int nprof, int npoints, double *h, double *x_fit, double mse_fit, double *steps, double *xmin, double *xmax, double fit_tol, int itermax, double (*mse_func)(const gsl_vector *, void *), void **params, int nparams, double *values, double *mses);
+
+void profile_interval(int npoints, double *values, double *mses, double mse_fit, int nres, double *lower, double *upper, int *found_lower, int *found_upper);
+
+// recordings.c
+int read_recording(char *filename, double *pz, double *pr, double *crnt, double *trn, double *sd, double *st, double *t_data, double *p_data);
+
+// frames.c
+void read_frames(char *filename, frames_struct_type *frames);
+
+void setup_frames(int nz, int nr, int nt, double dr, double dt, int isource, int zmirror, frames_struct_type *frames);
+
+double frames_sse(int nz, int nr, double *c_frames, frames_struct_type *frames, double *model_frames, double *gain);
+
+void free_frames(frames_struct_type *frames);
+
+// optimize.c
+int optimizer_code(char *name);
+
+const char *optimizer_name(int code);
+
+int optimize(int method, int ndim, double *x, double *steps, double *xmin, double *xmax, double fit_tol, int itermax, double (*mse_func)(const gsl_vector *, void *), double (*res_func)(const gsl_vector *, void *, double *), void *params, int nres, unsigned long seed, int verbose, FILE *path_ptr, double *fval, double *size, int *niter, int *nevals);
+
+// fitdb.c
+void read_fitdb(char *filename, char *tag, double *geometry, fitdb_struct_type *start);
 
+void append_fitdb(char *filename, char *tag, double *geometry, double alpha, double theta, double kappa, double mse, int iterations, char *infilename);
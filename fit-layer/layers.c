@@ -0,0 +1,334 @@
+/**
+  \file fit-layer/layers.c
+
+  Functions for describing the layered environment on the
+  finite difference grid.
+
+  The environment is described by a layer table (see 
+  layer_table_struct_type), which has the SR, SP, and SO layers 
+  by default but can have up to MAX_LAYERS layers.
+
+  Row \f$ i \f$ of the concentration matrix is centered at
+  \f$ z_i = i \Delta z \f$ and represents the cell
+  \f$ z_i - \Delta z/2 < z < z_i + \Delta z/2 \f$ . The layer
+  boundaries do not have to fall midway between
+  grid points. If a boundary falls inside a cell, the cell gets
+  the volume-averaged \f$ \alpha \f$ and \f$ \alpha \kappa \f$
+  of the layers it contains, and the diffusion between two
+  adjacent rows is described by a flux-conservative interface
+  coefficient (the series combination of the
+  \f$ \alpha D^* \f$ values along the path between the two
+  grid points). When a boundary falls midway between grid
+  points, this reduces to the weighted average of the boundary
+  values used in the original IDL implementation.
+
+  \author David Lewis, CABI, NKI
+  \copyright GNU Public License
+  \date 2012-2013
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "header.h"
+
+/**
+  \brief Integrates a piecewise-constant function of z over
+  an interval.
+
+  The function has the value value[k] in layer \f$ k \f$ , where
+  layer \f$ k \f$ is zbound[k-1] < z < zbound[k] (the first layer
+  extends to \f$ -\infty \f$ and the last layer extends to
+  \f$ +\infty \f$ ). If the flag inverse is TRUE, 1/value[k] is
+  integrated instead of value[k].
+
+  \param[in] za Lower limit of integration
+  \param[in] zb Upper limit of integration (zb >= za)
+  \param[in] nlayers Number of layers
+  \param[in] zbound Array of the nlayers-1 layer boundaries (increasing)
+  \param[in] value Array of the values of the function in each layer
+  \param[in] inverse Flag for integrating 1/value rather than value
+
+  \return Value of the integral
+ */
+double layer_integral(double za, double zb, int nlayers, double *zbound, double *value, int inverse)
+{
+	int k;
+	double lo = za;
+	double hi;
+	double sum = 0.;
+
+	for (k=0; k<nlayers; k++) {
+		hi = (k < nlayers-1) ? MIN(zb, zbound[k]) : zb;
+		if (hi > lo) {
+			sum += (inverse ? 1.0/value[k] : value[k]) * (hi - lo);
+			lo = hi;
+		}
+	}
+
+	return sum;
+}
+
+/**
+  \brief Sets up the layer table for the 3-layer environment 
+  (SR at the bottom, SP in the middle, SO at the top).
+
+  \param[in] lz1 z-position of SR-SP boundary
+  \param[in] lz2 z-position of SP-SO boundary
+  \param[in] alpha_so Extracellular volume fraction in SO layer
+  \param[in] theta_so Permeability in SO layer (radial, within the layer)
+  \param[in] theta_z_so Axial permeability in SO layer (across the layer)
+  \param[in] kappa_so Nonspecific clearance factor in SO layer
+  \param[in] vmax_so Maximum uptake rate in SO layer
+  \param[in] km_so Michaelis constant of uptake in SO layer
+  \param[in] alpha_sp Extracellular volume fraction in SP layer
+  \param[in] theta_sp Permeability in SP layer (radial, within the layer)
+  \param[in] theta_z_sp Axial permeability in SP layer (across the layer)
+  \param[in] kappa_sp Nonspecific clearance factor in SP layer
+  \param[in] vmax_sp Maximum uptake rate in SP layer
+  \param[in] km_sp Michaelis constant of uptake in SP layer
+  \param[in] alpha_sr Extracellular volume fraction in SR layer
+  \param[in] theta_sr Permeability in SR layer (radial, within the layer)
+  \param[in] theta_z_sr Axial permeability in SR layer (across the layer)
+  \param[in] kappa_sr Nonspecific clearance factor in SR layer
+  \param[in] vmax_sr Maximum uptake rate in SR layer
+  \param[in] km_sr Michaelis constant of uptake in SR layer
+  \param[out] layers Layer table
+ */
+void set_three_layers(double lz1, double lz2, double alpha_so, double theta_so, double theta_z_so, double kappa_so, double vmax_so, double km_so, double alpha_sp, double theta_sp, double theta_z_sp, double kappa_sp, double vmax_sp, double km_sp, double alpha_sr, double theta_sr, double theta_z_sr, double kappa_sr, double vmax_sr, double km_sr, layer_table_struct_type *layers)
+{
+	layers->n = 3;
+
+	layers->zbound[0] = lz1;
+	layers->zbound[1] = lz2;
+
+	layers->alpha[0] = alpha_sr;
+	layers->theta[0] = theta_sr;
+	layers->theta_z[0] = theta_z_sr;
+	layers->kappa[0] = kappa_sr;
+	layers->vmax[0] = vmax_sr;
+	layers->km[0] = km_sr;
+
+	layers->alpha[1] = alpha_sp;
+	layers->theta[1] = theta_sp;
+	layers->theta_z[1] = theta_z_sp;
+	layers->kappa[1] = kappa_sp;
+	layers->vmax[1] = vmax_sp;
+	layers->km[1] = km_sp;
+
+	layers->alpha[2] = alpha_so;
+	layers->theta[2] = theta_so;
+	layers->theta_z[2] = theta_z_so;
+	layers->kappa[2] = kappa_so;
+	layers->vmax[2] = vmax_so;
+	layers->km[2] = km_so;
+}
+
+
+/**
+  \brief Adds a layer on top of the layers in the layer table.
+
+  The string has the form "z_top,alpha,theta,kappa[,vmax,km[,theta_z]]", 
+  where z_top is the z-position of the top of the layer in 
+  microns (not used for the top layer, e.g. "inf"). Without 
+  vmax and km the layer has no Michaelis-Menten uptake, and 
+  without theta_z the layer is isotropic (theta_z = theta).
+
+  \param[in] string String with the parameters of the layer
+  \param[in,out] layers Layer table
+ */
+void add_layer(char *string, layer_table_struct_type *layers)
+{
+	int n = layers->n;
+	int nread;
+	double z_top;
+
+	if (n >= MAX_LAYERS)
+		error("Too many layers (maximum is %d)", MAX_LAYERS);
+
+	layers->vmax[n] = 0.0;
+	layers->km[n] = 1.0;
+	layers->theta_z[n] = -1.;
+	nread = sscanf(string, "%lf,%lf,%lf,%lf,%lf,%lf,%lf", &z_top, 
+		&layers->alpha[n], &layers->theta[n], &layers->kappa[n], 
+		&layers->vmax[n], &layers->km[n], &layers->theta_z[n]);
+	if ( (nread != 4) && (nread != 6) && (nread != 7) )
+		error("Cannot read layer %d from \"%s\"; the format is "
+			"z_top,alpha,theta,kappa[,vmax,km[,theta_z]]", n+1, string);
+	if (nread < 7)
+		layers->theta_z[n] = layers->theta[n];
+
+	if (n < MAX_LAYERS-1)
+		layers->zbound[n] = z_top * 1e-6;	/* Input in microns; convert to m */
+	layers->n++;
+}
+
+
+/**
+  \brief Checks whether the layer table is symmetric about the 
+  plane z = z0.
+
+  \param[in] layers Layer table
+  \param[in] z0 z-position of the plane
+  \param[in] tol Tolerance for the positions of the boundaries
+
+  \return TRUE if the layers are symmetric about z0, FALSE if not
+ */
+int layers_symmetric(layer_table_struct_type *layers, double z0, double tol)
+{
+	int k;
+	int n = layers->n;
+
+	for (k=0; k<n; k++) {
+		if ( ! ( IS_ZERO(layers->alpha[k] - layers->alpha[n-1-k]) 
+		      && IS_ZERO(layers->theta[k] - layers->theta[n-1-k]) 
+		      && IS_ZERO(layers->theta_z[k] - layers->theta_z[n-1-k]) 
+		      && IS_ZERO(layers->kappa[k] - layers->kappa[n-1-k]) 
+		      && IS_ZERO(layers->vmax[k] - layers->vmax[n-1-k]) 
+		      && IS_ZERO(layers->km[k] - layers->km[n-1-k]) ) )
+			return FALSE;
+		if ( (k < n-1) 
+		  && (fabs(layers->zbound[k] + layers->zbound[n-2-k] - 2.0 * z0) > tol) )
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+/**
+  \brief Calculates the diffusion parameters of each row of the
+  concentration matrix for the layered environment.
+
+  For the cell of row \f$ i \f$ this function calculates the
+  volume-averaged volume fraction
+
+\f[
+\bar\alpha_i = \frac{1}{\Delta z} \int_{cell} \alpha \, dz
+\quad ,
+\f]
+
+  the radial diffusion coefficient (from the radial permeability 
+  \f$ \theta \f$ ) and the clearance factor
+
+\f[
+\bar D_i = \frac{1}{\bar\alpha_i \Delta z} \int_{cell} \alpha D^* \, dz
+\quad , \quad
+\bar\kappa_i = \frac{1}{\bar\alpha_i \Delta z} \int_{cell} \alpha \kappa \, dz
+\quad ,
+\f]
+
+  and, for the interface between rows \f$ i-1 \f$ and \f$ i \f$ ,
+  the conductance
+
+\f[
+g_i = \Delta z \left( \int_{z_{i-1}}^{z_i} \frac{dz}{\alpha D^*_z} \right)^{-1}
+\quad ,
+\f]
+
+  where \f$ D^*_z \f$ is the axial diffusion coefficient (from the 
+  axial permeability \f$ \theta_z \f$ , which is equal to 
+  \f$ \theta \f$ in an isotropic layer). The kernels use 
+  dstar_row for the radial terms and g for the axial terms, so an 
+  anisotropic layer costs nothing extra.
+
+  The flux of substance from row \f$ i-1 \f$ to row \f$ i \f$ is
+  then \f$ g_i (c_{i-1} - c_i) / \Delta z \f$ . The outermost
+  layers extend past the ends of the cylinder, so g has nz+1
+  elements. Since the model only uses these per-row values, 
+  the cost of a time-step does not depend on the number of layers.
+
+  \param[in] nz Number of rows of concentration matrix
+  \param[in] dz Spacing in z
+  \param[in] layers Layer table
+  \param[in] dfree Free diffusion coefficient
+  \param[out] alpha_row Volume-averaged alpha of each row (nz elements)
+  \param[out] dstar_row Radial diffusion coefficient of each row (nz elements)
+  \param[out] kappa_row Clearance factor of each row (nz elements)
+  \param[out] g Conductance between adjacent rows (nz+1 elements)
+ */
+void calc_layer_rows(int nz, double dz, layer_table_struct_type *layers, double dfree, double *alpha_row, double *dstar_row, double *kappa_row, double *g)
+{
+	int i, k;
+	int n = layers->n;
+	double z;
+	double alpha_dstar[MAX_LAYERS];
+	double alpha_dstar_z[MAX_LAYERS];
+	double alpha_kappa[MAX_LAYERS];
+
+	for (k=0; k<n; k++) {
+		alpha_dstar[k] = layers->alpha[k] * layers->theta[k] * dfree;
+		alpha_dstar_z[k] = layers->alpha[k] * layers->theta_z[k] * dfree;
+		alpha_kappa[k] = layers->alpha[k] * layers->kappa[k];
+	}
+
+	for (i=0; i<nz; i++) {
+		z = i * dz;
+		alpha_row[i] = layer_integral(z - dz/2., z + dz/2., n, layers->zbound,
+		                              layers->alpha, FALSE) / dz;
+		dstar_row[i] = layer_integral(z - dz/2., z + dz/2., n, layers->zbound,
+		                              alpha_dstar, FALSE) / (dz * alpha_row[i]);
+		kappa_row[i] = layer_integral(z - dz/2., z + dz/2., n, layers->zbound,
+		                              alpha_kappa, FALSE) / (dz * alpha_row[i]);
+	}
+
+	for (i=0; i<nz+1; i++) {
+		z = i * dz;
+		g[i] = dz / layer_integral(z - dz, z, n, layers->zbound, alpha_dstar_z, TRUE);
+	}
+}
+
+
+/**
+  \brief Calculates the volume-averaged alpha of the cell 
+  centered at z.
+
+  \param[in] z z-position of the center of the cell
+  \param[in] dz Spacing in z (height of the cell)
+  \param[in] layers Layer table
+
+  \return Volume-averaged alpha of the cell
+ */
+double cell_alpha(double z, double dz, layer_table_struct_type *layers)
+{
+	return layer_integral(z - dz/2., z + dz/2., layers->n, layers->zbound, 
+	                      layers->alpha, FALSE) / dz;
+}
+
+
+/**
+  \brief Calculates the alpha-weighted average of a layer 
+  parameter over the cell of each row of the concentration matrix.
+
+  Like the clearance factor in calc_layer_rows(), a parameter that 
+  acts on the extracellular concentration (e.g. the maximum uptake 
+  rate) is averaged over the extracellular volume of the cell,
+
+\f[
+\bar v_i = \frac{1}{\bar\alpha_i \Delta z} \int_{cell} \alpha v \, dz
+\quad .
+\f]
+
+  \param[in] nz Number of rows of concentration matrix
+  \param[in] dz Spacing in z
+  \param[in] layers Layer table
+  \param[in] v Value of the parameter in each layer of the table
+  \param[out] v_row Average value of the parameter in each row (nz elements)
+ */
+void calc_row_average(int nz, double dz, layer_table_struct_type *layers, double *v, double *v_row)
+{
+	int i, k;
+	int n = layers->n;
+	double z;
+	double alpha_v[MAX_LAYERS];
+
+	for (k=0; k<n; k++)
+		alpha_v[k] = layers->alpha[k] * v[k];
+
+	for (i=0; i<nz; i++) {
+		z = i * dz;
+		v_row[i] = layer_integral(z - dz/2., z + dz/2., n, layers->zbound, alpha_v, FALSE) 
+		         / layer_integral(z - dz/2., z + dz/2., n, layers->zbound, layers->alpha, FALSE);
+	}
+}
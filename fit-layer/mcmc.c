@@ -0,0 +1,263 @@
+/**
+  \file fit-layer/mcmc.c
+
+  Affine-invariant ensemble sampler for the posterior distribution
+  of the fitted parameters.
+
+  The simplex fit gives a point estimate only. This file samples
+  the posterior distribution of the parameters with the ensemble
+  sampler of Goodman and Weare (2010), which is insensitive to the
+  very different scales of alpha, theta, and kappa: an ensemble of
+  walkers moves by "stretch moves", in which a walker is moved
+  along the line through its position and that of a walker picked
+  at random from the other half of the ensemble. The walkers of
+  one half can then be moved at the same time, so their forward
+  models are calculated in parallel with OpenMP if the program is
+  compiled with it (the number of threads is set with the
+  OMP_NUM_THREADS environment variable). The random numbers are
+  drawn before each half-step, so the chains do not depend on the
+  number of threads.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_rng.h>
+#include <gsl/gsl_randist.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "header.h"
+
+
+/**
+  \def STRETCH_A
+  Scale parameter \f$ a \f$ of the stretch move (the stretch factor
+  is between \f$ 1/a \f$ and \f$ a \f$).
+ */
+#define STRETCH_A 2.0
+
+/**
+  \def MAX_INIT_TRIES
+  Maximum number of draws of the starting position of a walker
+  inside the bounds.
+ */
+#define MAX_INIT_TRIES 1000
+
+
+/**
+  \brief Log of the posterior probability density (up to a constant)
+  of a set of parameters.
+
+  The prior is uniform between the bounds, and the noise of the data
+  is Gaussian, so inside the bounds the log of the posterior is
+  \f$ -N \, \mathrm{MSE} / (2 \sigma^2) \f$ = -scale_ll * MSE.
+  The forward model is not calculated outside the bounds.
+
+  \param[in] ndim Number of parameters
+  \param[in] x Parameters
+  \param[in] xmin Lower bounds of the parameters
+  \param[in] xmax Upper bounds of the parameters
+  \param[in] scale_ll Factor that converts the MSE to the log-likelihood
+  \param[in] mse_func Mean squared error function (calc_mse_fit_layer())
+  \param[in,out] params Struct of parameters and arrays for mse_func
+
+  \return Log of the posterior (-HUGE_VAL outside the bounds)
+ */
+static double log_posterior(int ndim, double *x, double *xmin, double *xmax, double scale_ll, double (*mse_func)(const gsl_vector *, void *), void *params)
+{
+	int i;
+	double mse;
+	gsl_vector *v;
+
+	for (i=0; i<ndim; i++)
+		if ( (x[i] < xmin[i]) || (x[i] > xmax[i]) )
+			return -HUGE_VAL;
+
+	v = gsl_vector_alloc(ndim);
+	for (i=0; i<ndim; i++)
+		gsl_vector_set(v, i, x[i]);
+	mse = mse_func(v, params);
+	gsl_vector_free(v);
+
+	return -scale_ll * mse;
+}
+
+
+/**
+  \brief Samples the posterior distribution of the parameters with
+  an affine-invariant ensemble of walkers.
+
+  The walkers start in a Gaussian ball around x0 (inside the bounds).
+  In each step, each half of the ensemble makes stretch moves with
+  respect to the other half, and the positions of all walkers and
+  the log of their posteriors are written to the chain file. The
+  mean and standard deviation of each parameter are calculated from
+  the steps after the burn-in.
+
+  The chain file is binary: three ints (nwalkers, nsteps, and
+  ndim+1) followed, for each step and each walker, by ndim+1 doubles
+  (the parameters and the log of the posterior).
+
+  \param[in] ndim Number of parameters
+  \param[in] nwalkers Number of walkers (even, at least 2*ndim)
+  \param[in] nsteps Number of steps of each walker
+  \param[in] nburn Number of steps discarded (burn-in) from the statistics
+  \param[in] x0 Center of the starting positions (e.g., the best fit)
+  \param[in] x_scale Standard deviation of the starting positions
+  \param[in] xmin Lower bounds of the parameters (prior)
+  \param[in] xmax Upper bounds of the parameters (prior)
+  \param[in] scale_ll Factor that converts the MSE to the log-likelihood
+  \param[in] seed Seed of the random number generator
+  \param[in] mse_func Mean squared error function (calc_mse_fit_layer())
+  \param[in,out] params Array of nparams structs for mse_func (one for each thread)
+  \param[in] nparams Number of structs in params (at least the number of threads)
+  \param[in] verbose Flag for printing the progress
+  \param[in] chain_ptr Chain file (binary)
+  \param[out] mean Posterior mean of each parameter
+  \param[out] sd Posterior standard deviation of each parameter
+
+  \return Acceptance fraction of the moves
+ */
+double ensemble_mcmc(int ndim, int nwalkers, int nsteps, int nburn, double *x0, double *x_scale, double *xmin, double *xmax, double scale_ll, unsigned long seed, double (*mse_func)(const gsl_vector *, void *), void **params, int nparams, int verbose, FILE *chain_ptr, double *mean, double *sd)
+{
+	int i, k, n, w, half;
+	int header[3];
+	int nhalf = nwalkers / 2;
+	long accepted = 0;
+	long nsamples = 0;
+	gsl_rng *rng;
+
+	/* Positions and log-posteriors of the walkers */
+	double *x = create_array(nwalkers*ndim, "walker positions");
+	double *lnp = create_array(nwalkers, "walker log-posteriors");
+	/* Proposals and random numbers of the walkers of one half */
+	double *y = create_array(nwalkers*ndim, "walker proposals");
+	double *z = create_array(nhalf, "stretch factors");
+	double *lnu = create_array(nhalf, "acceptance draws");
+	int *partner = (int *) malloc(nhalf * sizeof(int));
+	int *accept = (int *) malloc(nhalf * sizeof(int));
+	double *row = create_array(nwalkers*(ndim+1), "chain row");
+
+	if ( (partner == NULL) || (accept == NULL) )
+		error("Could not allocate memory for the walkers");
+
+	rng = gsl_rng_alloc(gsl_rng_mt19937);
+	gsl_rng_set(rng, seed);
+
+	/* Starting positions: a Gaussian ball around x0, inside the bounds */
+	for (w=0; w<nwalkers; w++)
+		for (i=0; i<ndim; i++) {
+			for (k=0; k<MAX_INIT_TRIES; k++) {
+				x[w*ndim+i] = x0[i] + gsl_ran_gaussian(rng, x_scale[i]);
+				if ( (x[w*ndim+i] >= xmin[i]) && (x[w*ndim+i] <= xmax[i]) )
+					break;
+			}
+			if (k == MAX_INIT_TRIES)
+				error("Could not start walker %d inside the bounds of "
+					"parameter %d", w, i);
+		}
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (w=0; w<nwalkers; w++) {
+		int tid = 0;
+#ifdef _OPENMP
+		tid = omp_get_thread_num();
+#endif
+		lnp[w] = log_posterior(ndim, x + w*ndim, xmin, xmax, scale_ll,
+			mse_func, params[tid % nparams]);
+	}
+
+	header[0] = nwalkers;
+	header[1] = nsteps;
+	header[2] = ndim + 1;
+	fwrite(header, sizeof(int), 3, chain_ptr);
+
+	for (i=0; i<ndim; i++)
+		mean[i] = sd[i] = 0.;
+
+	for (n=0; n<nsteps; n++) {
+		for (half=0; half<2; half++) {
+			int first = half * nhalf;  /* First walker of this half */
+			int other = (1 - half) * nhalf;  /* First walker of the other half */
+
+			/* Draw the random numbers of this half */
+			for (k=0; k<nhalf; k++) {
+				partner[k] = other + (int) gsl_rng_uniform_int(rng, nhalf);
+				z[k] = SQR((STRETCH_A - 1.) * gsl_rng_uniform(rng) + 1.)
+					/ STRETCH_A;
+				lnu[k] = log(gsl_rng_uniform_pos(rng));
+			}
+
+			/* Stretch moves of the walkers of this half */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) private(i)
+#endif
+			for (k=0; k<nhalf; k++) {
+				int tid = 0;
+				double lnp_y;
+				double *xw = x + (first+k)*ndim;
+				double *xp = x + partner[k]*ndim;
+				double *yw = y + k*ndim;
+#ifdef _OPENMP
+				tid = omp_get_thread_num();
+#endif
+				for (i=0; i<ndim; i++)
+					yw[i] = xp[i] + z[k] * (xw[i] - xp[i]);
+				lnp_y = log_posterior(ndim, yw, xmin, xmax, scale_ll,
+					mse_func, params[tid % nparams]);
+				accept[k] = (lnu[k] < (ndim - 1.) * log(z[k]) + lnp_y - lnp[first+k]);
+				if (accept[k]) {
+					memcpy(xw, yw, ndim * sizeof(double));
+					lnp[first+k] = lnp_y;
+				}
+			}
+			for (k=0; k<nhalf; k++)
+				accepted += accept[k];
+		}
+
+		/* Write the step to the chain file */
+		for (w=0; w<nwalkers; w++) {
+			memcpy(row + w*(ndim+1), x + w*ndim, ndim * sizeof(double));
+			row[w*(ndim+1) + ndim] = lnp[w];
+		}
+		fwrite(row, sizeof(double), nwalkers*(ndim+1), chain_ptr);
+		fflush(chain_ptr);
+
+		/* Statistics after the burn-in */
+		if (n >= nburn) {
+			for (w=0; w<nwalkers; w++)
+				for (i=0; i<ndim; i++) {
+					mean[i] += x[w*ndim+i];
+					sd[i] += SQR(x[w*ndim+i]);
+				}
+			nsamples += nwalkers;
+		}
+
+		if ( verbose && ((n+1) % MAX(nsteps/10, 1) == 0) )
+			printf("MCMC step %d of %d, acceptance fraction = %f\n",
+				n+1, nsteps, (double) accepted / ((n+1.) * nwalkers));
+	}
+
+	if (nsamples > 0)
+		for (i=0; i<ndim; i++) {
+			mean[i] /= nsamples;
+			sd[i] = sqrt(MAX(sd[i] / nsamples - SQR(mean[i]), 0.));
+		}
+
+	gsl_rng_free(rng);
+	free(x);
+	free(lnp);
+	free(y);
+	free(z);
+	free(lnu);
+	free(partner);
+	free(accept);
+	free(row);
+
+	return (double) accepted / ((double) nsteps * nwalkers);
+}
@@ -0,0 +1,1061 @@
+/**
+  \file fit-layer/optimize.c
+
+  Optimizer backends for the fit of the layered model (--optimizer).
+
+  Every evaluation of the mean squared error is a forward solve of
+  the model, so the backends are compared by the number of
+  evaluations they need (see the benchmark of fit-layer):
+
+  - nmsimplex: the Nelder-Mead simplex of GSL (the default, which
+    fit-layer runs in its main loop).
+  - nmsimplex2: the simplex of GSL with O(n) updates, restarted
+    from the best point with the initial steps after it converges
+    until a restart does not improve the fit (a collapsed simplex
+    can stop short of the minimum).
+  - trust: a derivative-free trust region method in the spirit of
+    BOBYQA. The MSE is modelled by the quadratic that interpolates
+    it at a set of (n+1)(n+2)/2 points, and each iteration
+    evaluates the minimum of the model in the trust region and the
+    bounds, which replaces one point of the set (so an iteration
+    costs one evaluation, apart from the geometry steps that keep
+    the set able to determine the model).
+  - lm: Levenberg-Marquardt on the residuals, with a Jacobian by
+    forward differences (n evaluations per iteration) and an
+    active set for the bounds.
+  - cmaes: the covariance matrix adaptation evolution strategy
+    (Hansen, 2016) with the default population size
+    \f$ 4 + \lfloor 3 \ln n \rfloor \f$ .
+
+  All backends work in the units of the initial steps of the fit,
+  and the new backends keep the parameters within the bounds of
+  the fit (the penalties of calc_mse_fit_layer() are then 0). The
+  size of a backend (the stopping criterion, compared with fit_tol)
+  is in the units of the parameters: the simplex size, the lower
+  bound of the trust region radius, the largest change of a parameter in an iteration
+  (lm), or the largest standard deviation of the samples (cmaes).
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_multimin.h>
+#include <gsl/gsl_rng.h>
+#include <gsl/gsl_randist.h>
+#include "header.h"
+
+
+/// Maximum number of fitted parameters
+#define OPT_MAXDIM 6
+
+/// Maximum number of restarts of nmsimplex2
+#define OPT_MAX_RESTARTS 5
+
+
+/// Names of the backends (in the order of the OPTIMIZER_* codes)
+static const char *optimizer_names[NUM_OPTIMIZERS] =
+	{"nmsimplex", "nmsimplex2", "trust", "lm", "cmaes"};
+
+
+/**
+  \typedef Typedef for struct for counting the evaluations of the
+  mse function
+ */
+typedef struct {
+	double (*mse_func)(const gsl_vector *, void *);  ///< Mean squared error function
+	void *params;        ///< Struct of parameters and arrays for mse_func
+	int nevals;          ///< Number of evaluations
+	gsl_vector *x;       ///< Work vector of the parameters
+} objective_struct_type;
+
+
+/**
+  \brief Returns the code of the backend with the given name, or -1.
+ */
+int optimizer_code(char *name)
+{
+	int i;
+
+	for (i=0; i<NUM_OPTIMIZERS; i++)
+		if (STREQ(name, optimizer_names[i]))
+			return i;
+	return -1;
+}
+
+
+/**
+  \brief Returns the name of a backend.
+ */
+const char *optimizer_name(int code)
+{
+	return optimizer_names[code];
+}
+
+
+/// Mean squared error function for GSL that counts the evaluations
+static double counted_mse(const gsl_vector *x, void *params)
+{
+	objective_struct_type *o = (objective_struct_type *) params;
+
+	o->nevals++;
+	return o->mse_func(x, o->params);
+}
+
+
+/// Evaluates the mean squared error at the parameters x (array)
+static double objective(objective_struct_type *o, int ndim, double *x)
+{
+	int a;
+
+	for (a=0; a<ndim; a++)
+		gsl_vector_set(o->x, a, x[a]);
+	o->nevals++;
+	return o->mse_func(o->x, o->params);
+}
+
+
+/// Prints an iteration as in the main loop of fit-layer
+static void report_iteration(int verbose, FILE *path_ptr, int iter, double *x, double fval, double size)
+{
+	if (verbose)
+		printf("%d\t%f\t%f\t%f\t%g\t%g\n", iter, x[0], x[1], x[2], fval, size);
+	if (path_ptr)
+		fprintf(path_ptr, "%d\t%f\t%f\t%f\t%g\t%g\n", iter, x[0], x[1], x[2],
+			fval, size);
+}
+
+
+/**
+  \brief Solves \f$ A x = b \f$ (n equations) by Gaussian elimination
+  with partial pivoting. A and b are overwritten, and b becomes x.
+
+  \return FALSE if A is singular
+ */
+static int solve_linear(int n, double *a, double *b)
+{
+	int i, j, k, piv;
+	double f, amax = 0.;
+
+	for (i=0; i<n*n; i++)
+		amax = MAX(amax, fabs(a[i]));
+	for (k=0; k<n; k++) {
+		piv = k;
+		for (i=k+1; i<n; i++)
+			if (fabs(a[i*n+k]) > fabs(a[piv*n+k])) piv = i;
+		if (fabs(a[piv*n+k]) <= 1.0e-12 * amax)
+			return FALSE;
+		if (piv != k) {
+			for (j=0; j<n; j++) {
+				f = a[k*n+j];  a[k*n+j] = a[piv*n+j];  a[piv*n+j] = f;
+			}
+			f = b[k];  b[k] = b[piv];  b[piv] = f;
+		}
+		for (i=k+1; i<n; i++) {
+			f = a[i*n+k] / a[k*n+k];
+			for (j=k; j<n; j++)
+				a[i*n+j] -= f * a[k*n+j];
+			b[i] -= f * b[k];
+		}
+	}
+	for (k=n-1; k>=0; k--) {
+		for (j=k+1; j<n; j++)
+			b[k] -= a[k*n+j] * b[j];
+		b[k] /= a[k*n+k];
+	}
+	return TRUE;
+}
+
+
+/**
+  \brief Eigen decomposition of a symmetric matrix by cyclic Jacobi
+  rotations, \f$ C = B \, \mathrm{diag}(d) \, B^T \f$ .
+
+  \param[in] n Size of the matrix
+  \param[in] c Matrix (n*n, row-major; not changed)
+  \param[out] b Eigenvectors (columns)
+  \param[out] d Eigenvalues
+ */
+static void jacobi_eigen(int n, double *c, double *b, double *d)
+{
+	int i, j, k, sweep;
+	double a[OPT_MAXDIM*OPT_MAXDIM];
+	double off, theta, t, cs, sn, g, h;
+
+	memcpy(a, c, n*n*sizeof(double));
+	for (i=0; i<n; i++)
+		for (j=0; j<n; j++)
+			b[i*n+j] = (i == j) ? 1. : 0.;
+
+	for (sweep=0; sweep<50; sweep++) {
+		off = 0.;
+		for (i=0; i<n; i++)
+			for (j=i+1; j<n; j++)
+				off += SQR(a[i*n+j]);
+		if (off < 1.0e-30)
+			break;
+		for (i=0; i<n; i++)
+			for (j=i+1; j<n; j++) {
+				if (a[i*n+j] == 0.) continue;
+				theta = (a[j*n+j] - a[i*n+i]) / (2.0 * a[i*n+j]);
+				t = ((theta >= 0.) ? 1. : -1.) / (fabs(theta) + sqrt(SQR(theta) + 1.));
+				cs = 1.0 / sqrt(SQR(t) + 1.);
+				sn = t * cs;
+				for (k=0; k<n; k++) {	/* A <- A J */
+					g = a[k*n+i];  h = a[k*n+j];
+					a[k*n+i] = cs * g - sn * h;
+					a[k*n+j] = sn * g + cs * h;
+				}
+				for (k=0; k<n; k++) {	/* A <- J^T A */
+					g = a[i*n+k];  h = a[j*n+k];
+					a[i*n+k] = cs * g - sn * h;
+					a[j*n+k] = sn * g + cs * h;
+				}
+				for (k=0; k<n; k++) {	/* B <- B J */
+					g = b[k*n+i];  h = b[k*n+j];
+					b[k*n+i] = cs * g - sn * h;
+					b[k*n+j] = sn * g + cs * h;
+				}
+			}
+	}
+	for (i=0; i<n; i++)
+		d[i] = a[i*n+i];
+}
+
+
+/**
+  \brief Nelder-Mead simplex of GSL, with restarts for nmsimplex2.
+ */
+static int optimize_simplex(int restarts, int ndim, double *x, double *steps, double fit_tol, int itermax, objective_struct_type *o, int verbose, FILE *path_ptr, double *fval, double *size, int *niter)
+{
+	int a, nrestart;
+	int iter = 0;
+	int status = GSL_CONTINUE;
+	double f_prev = 0.;
+	gsl_multimin_function func;
+	gsl_multimin_fminimizer *state;
+	gsl_vector *xv = gsl_vector_alloc(ndim);
+	gsl_vector *sv = gsl_vector_alloc(ndim);
+
+	func.n = ndim;
+	func.f = counted_mse;
+	func.params = o;
+	state = gsl_multimin_fminimizer_alloc((restarts) ?
+		gsl_multimin_fminimizer_nmsimplex2 : gsl_multimin_fminimizer_nmsimplex, ndim);
+	for (a=0; a<ndim; a++) {
+		gsl_vector_set(xv, a, x[a]);
+		gsl_vector_set(sv, a, steps[a]);
+	}
+
+	for (nrestart=0; ; nrestart++) {
+		gsl_multimin_fminimizer_set(state, &func, xv, sv);
+		do {
+			iter++;
+			status = gsl_multimin_fminimizer_iterate(state);
+			if (status) break;
+			*size = gsl_multimin_fminimizer_size(state);
+			status = gsl_multimin_test_size(*size, fit_tol);
+			for (a=0; a<ndim; a++)
+				x[a] = gsl_vector_get(state->x, a);
+			*fval = state->fval;
+			report_iteration(verbose, path_ptr, iter, x, *fval, *size);
+		} while (status == GSL_CONTINUE && iter < itermax);
+
+		if ( (! restarts) || (status != GSL_SUCCESS) || (iter >= itermax)
+		  || (nrestart == OPT_MAX_RESTARTS)
+		  || ((nrestart > 0) && (*fval > f_prev * (1.0 - 1.0e-6))) )
+			break;
+		f_prev = *fval;
+		gsl_vector_memcpy(xv, state->x);
+	}
+
+	gsl_multimin_fminimizer_free(state);
+	gsl_vector_free(xv);
+	gsl_vector_free(sv);
+	*niter = iter;
+	return (status == GSL_SUCCESS) ? GSL_SUCCESS : GSL_CONTINUE;
+}
+
+
+/// Maximum number of points of the quadratic interpolation (trust)
+#define OPT_MAXPTS ((OPT_MAXDIM+1)*(OPT_MAXDIM+2)/2)
+
+
+/**
+  \typedef Typedef for struct for the interpolation set of the trust
+  region method (in the units of the initial steps)
+ */
+typedef struct {
+	int n;               ///< Number of points, (ndim+1)(ndim+2)/2
+	int kopt;            ///< Index of the point with the lowest MSE
+	double y[OPT_MAXPTS*OPT_MAXDIM];  ///< Points
+	double f[OPT_MAXPTS];             ///< Mean squared errors
+} interp_struct_type;
+
+
+/// Evaluates the point y (units of the steps) into point k of the set
+static double trust_eval(interp_struct_type *s, objective_struct_type *o, int ndim, int k, double *y, double *steps)
+{
+	int a;
+	double x[OPT_MAXDIM];
+
+	for (a=0; a<ndim; a++) {
+		x[a] = y[a] * steps[a];
+		s->y[k*OPT_MAXDIM+a] = y[a];
+	}
+	s->f[k] = objective(o, ndim, x);
+	return s->f[k];
+}
+
+
+/// Distance (max. norm) of point k of the set from the best point
+static double trust_dist(interp_struct_type *s, int ndim, int k)
+{
+	int a;
+	double dist = 0.;
+
+	for (a=0; a<ndim; a++)
+		dist = MAX(dist, fabs(s->y[k*OPT_MAXDIM+a] - s->y[s->kopt*OPT_MAXDIM+a]));
+	return dist;
+}
+
+
+/**
+  \brief Basis of the quadratic polynomials at the displacement d
+  from the best point: 1, the components of d, and the quadratic
+  terms \f$ d_a^2/2 \f$ and \f$ d_a d_b \f$ .
+ */
+static void trust_basis(int ndim, double *d, double *phi)
+{
+	int a, b, k = ndim + 1;
+
+	phi[0] = 1.;
+	for (a=0; a<ndim; a++) {
+		phi[a+1] = d[a];
+		for (b=a; b<ndim; b++)
+			phi[k++] = (a == b) ? 0.5 * SQR(d[a]) : d[a] * d[b];
+	}
+}
+
+
+/**
+  \brief Interpolation matrix of the set: row k is the basis at point
+  k, in units of the distance of the farthest point from the best
+  point (so the entries are at most 1). With transpose, the matrix is
+  transposed.
+
+  \return Distance of the farthest point (the unit of the basis)
+ */
+static double trust_matrix(interp_struct_type *s, int ndim, int transpose, double *mat)
+{
+	int a, k, l;
+	double d[OPT_MAXDIM], phi[OPT_MAXPTS];
+	double scale = 0.;
+
+	for (k=0; k<s->n; k++)
+		scale = MAX(scale, trust_dist(s, ndim, k));
+	for (k=0; k<s->n; k++) {
+		for (a=0; a<ndim; a++)
+			d[a] = (s->y[k*OPT_MAXDIM+a] - s->y[s->kopt*OPT_MAXDIM+a]) / scale;
+		trust_basis(ndim, d, phi);
+		for (l=0; l<s->n; l++) {
+			if (transpose) mat[l*s->n+k] = phi[l];
+			else mat[k*s->n+l] = phi[l];
+		}
+	}
+	return scale;
+}
+
+
+/**
+  \brief Quadratic model \f$ f_{opt} + g \cdot d + \frac{1}{2} d^T H d \f$
+  that interpolates the MSE at the points of the set (d from the best
+  point).
+
+  \return FALSE if the points do not determine the model
+ */
+static int trust_model(interp_struct_type *s, int ndim, double *g, double *hess)
+{
+	int a, b, k;
+	double mat[OPT_MAXPTS*OPT_MAXPTS], c[OPT_MAXPTS];
+	double scale = trust_matrix(s, ndim, FALSE, mat);
+
+	for (k=0; k<s->n; k++)
+		c[k] = s->f[k] - s->f[s->kopt];
+	if (! solve_linear(s->n, mat, c))
+		return FALSE;
+
+	for (a=0, k=ndim+1; a<ndim; a++) {
+		g[a] = c[a+1] / scale;
+		for (b=a; b<ndim; b++)
+			hess[a*ndim+b] = hess[b*ndim+a] = c[k++] / SQR(scale);
+	}
+	return TRUE;
+}
+
+
+/**
+  \brief Values of the Lagrange functions of the set at the point y:
+  \f$ l_k(y) \f$ is the quadratic that is 1 at point k and 0 at the
+  other points.
+
+  \return FALSE if the points do not determine the quadratics
+ */
+static int trust_lagrange_values(interp_struct_type *s, int ndim, double *y, double *lval)
+{
+	int a;
+	double mat[OPT_MAXPTS*OPT_MAXPTS], d[OPT_MAXDIM];
+	double scale = trust_matrix(s, ndim, TRUE, mat);
+
+	for (a=0; a<ndim; a++)
+		d[a] = (y[a] - s->y[s->kopt*OPT_MAXDIM+a]) / scale;
+	trust_basis(ndim, d, lval);
+	return solve_linear(s->n, mat, lval);
+}
+
+
+/**
+  \brief Geometry step: replaces point k of the set (far from the best
+  point) with the point at the distance delta from the best point,
+  along an axis or a diagonal, where the Lagrange function of point k
+  is largest in absolute value. A coordinate beyond a bound is
+  replaced by the coordinate 1.5 times as far on the other side (a
+  value that the other points are unlikely to have).
+
+  \return FALSE if no such point keeps the set able to determine the model
+ */
+static int trust_geometry(interp_struct_type *s, objective_struct_type *o, int ndim, int k, double *ylo, double *yhi, double delta, double *steps)
+{
+	int a, b, sa, sb, l;
+	double mat[OPT_MAXPTS*OPT_MAXPTS], v[OPT_MAXPTS], phi[OPT_MAXPTS];
+	double d[OPT_MAXDIM], y[OPT_MAXDIM], y_best[OPT_MAXDIM];
+	double *yopt = s->y + s->kopt*OPT_MAXDIM;
+	double lk, lk_best = -1.;
+	double scale = trust_matrix(s, ndim, FALSE, mat);
+
+	for (l=0; l<s->n; l++)
+		v[l] = (l == k) ? 1. : 0.;
+	if (! solve_linear(s->n, mat, v))
+		return FALSE;
+
+	/* Candidates: +-e_a and +-e_a +-e_b (b > a, or b == a for the axes) */
+	for (a=0; a<ndim; a++)
+		for (b=a; b<ndim; b++)
+			for (sa=-1; sa<=1; sa+=2)
+				for (sb=-1; sb<=1; sb+=2) {
+					if ( (b == a) && (sb > 0) ) continue;
+					memset(d, 0, ndim*sizeof(double));
+					d[a] = sa;
+					if (b != a) d[b] = sb;
+					for (l=0; l<ndim; l++) {
+						y[l] = yopt[l] + delta * d[l];
+						if ( (y[l] < ylo[l]) || (y[l] > yhi[l]) ) {
+							d[l] *= -1.5;
+							y[l] = yopt[l] + delta * d[l];
+						}
+						if ( (y[l] < ylo[l]) || (y[l] > yhi[l]) ) break;
+					}
+					if (l < ndim) continue;
+					for (l=0; l<ndim; l++)
+						d[l] *= delta / scale;
+					trust_basis(ndim, d, phi);
+					for (l=0, lk=0.; l<s->n; l++)
+						lk += phi[l] * v[l];
+					if (fabs(lk) > lk_best) {
+						lk_best = fabs(lk);
+						memcpy(y_best, y, ndim*sizeof(double));
+					}
+				}
+	if (lk_best < 1.0e-4)
+		return FALSE;
+	memcpy(y, y_best, ndim*sizeof(double));
+	if (trust_eval(s, o, ndim, k, y, steps) < s->f[s->kopt])
+		s->kopt = k;
+	return TRUE;
+}
+
+
+/**
+  \brief Initial set of the trust region method around point 0 of the
+  set (already evaluated): the points at the distance delta along the
+  axes (a point beyond a bound is replaced by the point twice as far
+  on the other side), and along the diagonals towards the better
+  point of each axis.
+ */
+static void trust_init(interp_struct_type *s, objective_struct_type *o, int ndim, double *ylo, double *yhi, double delta, double *steps)
+{
+	int a, b, k;
+	double y[OPT_MAXDIM], *y0 = s->y;
+
+	for (a=0; a<ndim; a++) {
+		memcpy(y, y0, ndim*sizeof(double));
+		y[a] = (y0[a] + delta <= yhi[a]) ? y0[a] + delta
+			: MAX(y0[a] - 2.0 * delta, ylo[a]);
+		trust_eval(s, o, ndim, 2*a+1, y, steps);
+		y[a] = (y0[a] - delta >= ylo[a]) ? y0[a] - delta
+			: MIN(y0[a] + 2.0 * delta, yhi[a]);
+		trust_eval(s, o, ndim, 2*a+2, y, steps);
+	}
+	for (a=0, k=2*ndim+1; a<ndim; a++)
+		for (b=a+1; b<ndim; b++) {
+			memcpy(y, y0, ndim*sizeof(double));
+			y[a] = s->y[((s->f[2*a+1] < s->f[2*a+2]) ? 2*a+1 : 2*a+2)*OPT_MAXDIM+a];
+			y[b] = s->y[((s->f[2*b+1] < s->f[2*b+2]) ? 2*b+1 : 2*b+2)*OPT_MAXDIM+b];
+			trust_eval(s, o, ndim, k++, y, steps);
+		}
+	for (k=0, s->kopt=0; k<s->n; k++)
+		if (s->f[k] < s->f[s->kopt])
+			s->kopt = k;
+}
+
+
+/// Returns the change of the quadratic model for the step d
+static double trust_model_value(int ndim, double *g, double *hess, double *d)
+{
+	int a, b;
+	double q = 0.;
+
+	for (a=0; a<ndim; a++) {
+		q += g[a] * d[a];
+		for (b=0; b<ndim; b++)
+			q += 0.5 * d[a] * hess[a*ndim+b] * d[b];
+	}
+	return q;
+}
+
+
+/**
+  \brief Derivative-free trust region method (see the description of
+  the file).
+
+  As in BOBYQA, the quadratic model interpolates the MSE at a set of
+  points (here the (n+1)(n+2)/2 points that determine a full
+  quadratic), which starts with the points along the axes and the
+  diagonals of the starting point, and each step of the model
+  replaces one point of the set: the one whose Lagrange function,
+  weighted by its distance from the best point, is largest at the
+  new point. The radius delta of the trust region has a lower bound
+  rho, the resolution of the method. The radius is halved (down to
+  rho) after steps that the model does not predict. When the steps
+  fail at the radius rho, the point of the set farthest from the
+  best point is replaced by a geometry step if it is farther than
+  twice delta, and otherwise rho is reduced. A set that no longer
+  determines the model is rebuilt around the best point. The method
+  stops when rho is below fit_tol (in the units of the parameters),
+  and the size is rho.
+ */
+static int optimize_trust(int ndim, double *x, double *steps, double *xmin, double *xmax, double fit_tol, int itermax, objective_struct_type *o, int verbose, FILE *path_ptr, double *fval, double *size, int *niter)
+{
+	int a, b, k, knew, sweep;
+	int iter = 0;
+	int status = GSL_CONTINUE;
+	int improved;
+	int rebuilt;	/* The set was just built around the best point */
+	int rebuild = FALSE;	/* A geometry step failed */
+	double ylo[OPT_MAXDIM], yhi[OPT_MAXDIM], y[OPT_MAXDIM], *yopt;
+	double d[OPT_MAXDIM], g[OPT_MAXDIM], hess[OPT_MAXDIM*OPT_MAXDIM];
+	double dn[OPT_MAXDIM], lhs[OPT_MAXDIM*OPT_MAXDIM], lval[OPT_MAXPTS];
+	double fopt, ft, pred, ratio, dnorm, dist, ga, lo, hi, t, w, wmax;
+	double delta = 1.0;	/* Trust region radius (units of the steps) */
+	double rho = 1.0;	/* Lower bound of delta */
+	double rho_end;
+	double smax = 0.;
+	interp_struct_type s;
+
+	for (a=0; a<ndim; a++) {
+		y[a] = x[a] / steps[a];
+		ylo[a] = xmin[a] / steps[a];
+		yhi[a] = xmax[a] / steps[a];
+		smax = MAX(smax, steps[a]);
+	}
+	rho_end = fit_tol / smax;
+
+	s.n = (ndim+1) * (ndim+2) / 2;
+	trust_eval(&s, o, ndim, 0, y, steps);
+	trust_init(&s, o, ndim, ylo, yhi, delta, steps);
+	rebuilt = TRUE;
+
+	while (iter < itermax) {
+		iter++;
+		yopt = s.y + s.kopt*OPT_MAXDIM;
+		fopt = s.f[s.kopt];
+		improved = FALSE;
+
+		/* The set is rebuilt around the best point if it does not
+		   determine the model or a geometry step failed (the steps
+		   along a bound can leave too few distinct values of a
+		   parameter) */
+		if ( rebuild || ! trust_model(&s, ndim, g, hess) ) {
+			if (rebuilt)
+				break;
+			rebuild = FALSE;
+			memmove(s.y, yopt, ndim*sizeof(double));
+			s.f[0] = fopt;
+			trust_init(&s, o, ndim, ylo, yhi, delta, steps);
+			rebuilt = TRUE;
+			continue;
+		}
+		rebuilt = FALSE;
+
+		/* Minimum of the model in the trust region and the bounds:
+		   coordinate descent on the model, or the Newton step of the
+		   model (shortened to the trust region and the bounds) if its
+		   model value is lower */
+		for (a=0; a<ndim; a++)
+			d[a] = 0.;
+		for (sweep=0; sweep<50; sweep++)
+			for (a=0; a<ndim; a++) {
+				for (b=0, ga=g[a]; b<ndim; b++)
+					if (b != a) ga += hess[a*ndim+b] * d[b];
+				lo = MAX(-delta, ylo[a] - yopt[a]);
+				hi = MIN(delta, yhi[a] - yopt[a]);
+				if (hess[a*ndim+a] > 0.)
+					d[a] = MIN(MAX(- ga / hess[a*ndim+a], lo), hi);
+				else
+					d[a] = (ga*lo + 0.5*hess[a*ndim+a]*SQR(lo)
+						< ga*hi + 0.5*hess[a*ndim+a]*SQR(hi)) ? lo : hi;
+			}
+		pred = - trust_model_value(ndim, g, hess, d);
+		memcpy(lhs, hess, ndim*ndim*sizeof(double));
+		for (a=0; a<ndim; a++)
+			dn[a] = - g[a];
+		if (solve_linear(ndim, lhs, dn)) {
+			for (a=0, t=1.; a<ndim; a++) {
+				lo = MAX(-delta, ylo[a] - yopt[a]);
+				hi = MIN(delta, yhi[a] - yopt[a]);
+				if (dn[a] * t > hi) t = hi / dn[a];
+				if (dn[a] * t < lo) t = lo / dn[a];
+			}
+			for (a=0; a<ndim; a++)
+				dn[a] *= t;
+			if (- trust_model_value(ndim, g, hess, dn) > pred) {
+				memcpy(d, dn, ndim*sizeof(double));
+				pred = - trust_model_value(ndim, g, hess, d);
+			}
+		}
+		for (a=0, dnorm=0.; a<ndim; a++)
+			dnorm = MAX(dnorm, fabs(d[a]));
+
+		if ( (pred > 0.) && (dnorm >= 0.5 * rho) ) {
+			/* The step replaces the point of the set with the largest
+			   weighted Lagrange function at the new point (the best
+			   point only if the step improves on it) */
+			for (a=0; a<ndim; a++)
+				y[a] = yopt[a] + d[a];
+			if (! trust_lagrange_values(&s, ndim, y, lval))
+				break;
+			for (k=0, knew=-1, wmax=0.; k<s.n; k++) {
+				dist = trust_dist(&s, ndim, k);
+				w = fabs(lval[k]) * MAX(1.0, SQR(dist / delta));
+				if ( (k != s.kopt) && (w > wmax) ) {
+					wmax = w;
+					knew = k;
+				}
+			}
+			if (knew < 0)
+				break;
+			ft = trust_eval(&s, o, ndim, knew, y, steps);
+			ratio = (fopt - ft) / pred;
+			if (ft < fopt)
+				s.kopt = knew;
+			if ( (ratio > 0.7) && (dnorm > 0.9 * delta) )
+				delta *= 2.0;
+			else if (ratio < 0.1)
+				delta = MAX(0.5 * delta, rho);
+			improved = (ratio >= 0.1);
+		} else {
+			/* The model has its minimum near the best point */
+			delta = (0.1 * delta > 1.5 * rho) ? 0.1 * delta : rho;
+			ratio = -1.;
+		}
+
+		/* A failed step at the radius rho: a geometry step for the
+		   farthest point of the set, or a reduction of rho */
+		if ( (! improved) && (delta <= rho) ) {
+			for (k=0, knew=-1, wmax=2.0*delta; k<s.n; k++) {
+				dist = trust_dist(&s, ndim, k);
+				if (dist > wmax) {
+					wmax = dist;
+					knew = k;
+				}
+			}
+			if (knew >= 0) {
+				rebuild = ! trust_geometry(&s, o, ndim, knew, ylo, yhi, delta, steps);
+			} else if (rho <= rho_end) {
+				status = GSL_SUCCESS;
+			} else {
+				if (rho <= 16.0 * rho_end) t = rho_end;
+				else if (rho <= 250.0 * rho_end) t = sqrt(rho * rho_end);
+				else t = 0.1 * rho;
+				delta = MAX(0.5 * rho, t);
+				rho = t;
+			}
+		}
+
+		*size = rho * smax;
+		for (a=0; a<ndim; a++)
+			x[a] = s.y[s.kopt*OPT_MAXDIM+a] * steps[a];
+		*fval = s.f[s.kopt];
+		report_iteration(verbose, path_ptr, iter, x, *fval, *size);
+		if (status == GSL_SUCCESS)
+			break;
+	}
+
+	for (a=0; a<ndim; a++)
+		x[a] = s.y[s.kopt*OPT_MAXDIM+a] * steps[a];
+	*fval = s.f[s.kopt];
+	*niter = iter;
+	return status;
+}
+
+
+/**
+  \brief Solves the damped normal equations of optimize_lm() for the
+  free parameters, and sets the step of the others to fixed[a].
+
+  \return FALSE if the reduced system is singular
+ */
+static int lm_solve_free(int ndim, int *is_free, double *jtj, double *jtr, double mu, double *fixed, double *dx)
+{
+	int a, b, n = 0;
+	int idx[OPT_MAXDIM];
+	double lhs[OPT_MAXDIM*OPT_MAXDIM], rhs[OPT_MAXDIM];
+
+	for (a=0; a<ndim; a++) {
+		dx[a] = fixed[a];
+		if (is_free[a]) idx[n++] = a;
+	}
+	for (a=0; a<n; a++) {
+		rhs[a] = jtr[idx[a]];
+		for (b=0; b<ndim; b++)
+			if (! is_free[b])
+				rhs[a] -= jtj[idx[a]*ndim+b] * fixed[b];
+		for (b=0; b<n; b++)
+			lhs[a*n+b] = jtj[idx[a]*ndim+idx[b]] * ((a == b) ? 1.0 + mu : 1.0);
+	}
+	if ( (n > 0) && (! solve_linear(n, lhs, rhs)) )
+		return FALSE;
+	for (a=0; a<n; a++)
+		dx[idx[a]] = rhs[a];
+	return TRUE;
+}
+
+
+/**
+  \brief Levenberg-Marquardt with a Jacobian by forward differences.
+
+  The bounds are handled with an active set, as in the fit of the
+  characteristic curve of 3layer: a parameter on a bound whose
+  gradient points out of the bounds is removed from the normal
+  equations, and a parameter whose step would cross a bound is set
+  to the bound and the others are solved for again. So the step of
+  the free parameters is not spoiled by a clipped step.
+ */
+static int optimize_lm(int ndim, double *x, double *steps, double *xmin, double *xmax, double fit_tol, int itermax, double (*res_func)(const gsl_vector *, void *, double *), int nres, objective_struct_type *o, int verbose, FILE *path_ptr, double *fval, double *size, int *niter)
+{
+	int a, b, i, ntry;
+	int iter = 0;
+	int status = GSL_CONTINUE;
+	double *r = create_array(nres, "LM residuals");
+	double *rt = create_array(nres, "LM trial residuals");
+	double *jac = create_array(nres*ndim, "LM Jacobian");
+	double jtj[OPT_MAXDIM*OPT_MAXDIM];
+	double jtr[OPT_MAXDIM], dx[OPT_MAXDIM], xt[OPT_MAXDIM];
+	double fixed[OPT_MAXDIM];
+	int is_free[OPT_MAXDIM], not_active[OPT_MAXDIM], crossed;
+	double mu = 1.0e-3, f, ft, hstep;
+
+	for (a=0; a<ndim; a++)
+		gsl_vector_set(o->x, a, x[a]);
+	o->nevals++;
+	f = res_func(o->x, o->params, r);
+
+	while (iter < itermax) {
+		iter++;
+
+		/* Jacobian (the difference goes into the bounds) */
+		for (a=0; a<ndim; a++) {
+			hstep = 1.0e-3 * steps[a];
+			if (x[a] + hstep > xmax[a]) hstep = - hstep;
+			for (b=0; b<ndim; b++)
+				gsl_vector_set(o->x, b, x[b] + ((b == a) ? hstep : 0.));
+			o->nevals++;
+			res_func(o->x, o->params, rt);
+			for (i=0; i<nres; i++)
+				jac[i*ndim+a] = (rt[i] - r[i]) / hstep;
+		}
+		for (a=0; a<ndim; a++) {
+			jtr[a] = 0.;
+			for (b=0; b<ndim; b++)
+				jtj[a*ndim+b] = 0.;
+		}
+		for (i=0; i<nres; i++)
+			for (a=0; a<ndim; a++) {
+				jtr[a] -= jac[i*ndim+a] * r[i];
+				for (b=0; b<ndim; b++)
+					jtj[a*ndim+b] += jac[i*ndim+a] * jac[i*ndim+b];
+			}
+
+		/* Parameters on a bound stay there if the MSE decreases
+		   out of the bounds */
+		for (a=0; a<ndim; a++) {
+			fixed[a] = 0.;
+			not_active[a] = ! ( ((x[a] <= xmin[a]) && (jtr[a] <= 0.))
+				|| ((x[a] >= xmax[a]) && (jtr[a] >= 0.)) );
+			is_free[a] = not_active[a];
+		}
+
+		/* Increase the damping until the step decreases the MSE */
+		for (ntry=0; ntry<10; ntry++) {
+			if (lm_solve_free(ndim, is_free, jtj, jtr, mu, fixed, dx)) {
+				/* A step past a bound: the parameter is set to the
+				   bound and the others are solved for again */
+				do {
+					crossed = FALSE;
+					for (a=0; a<ndim; a++)
+						if ( is_free[a] && ((x[a] + dx[a] < xmin[a])
+						  || (x[a] + dx[a] > xmax[a])) ) {
+							is_free[a] = FALSE;
+							fixed[a] = ((x[a] + dx[a] < xmin[a]) ? xmin[a] : xmax[a]) - x[a];
+							crossed = TRUE;
+						}
+				} while (crossed && lm_solve_free(ndim, is_free, jtj, jtr, mu, fixed, dx));
+				for (a=0; a<ndim; a++) {	/* (MIN and MAX for the rounding) */
+					xt[a] = MIN(MAX(x[a] + dx[a], xmin[a]), xmax[a]);
+					gsl_vector_set(o->x, a, xt[a]);
+				}
+				o->nevals++;
+				ft = res_func(o->x, o->params, rt);
+				if (ft < f)
+					break;
+				/* The crossed bounds are free again for the next damping */
+				for (a=0; a<ndim; a++) {
+					is_free[a] = not_active[a];
+					fixed[a] = 0.;
+				}
+			}
+			mu *= 10.0;
+		}
+		if (ntry == 10) {	/* No step decreases the MSE */
+			status = GSL_SUCCESS;
+			break;
+		}
+
+		mu = MAX(mu / 10.0, 1.0e-12);
+		for (a=0, *size=0.; a<ndim; a++) {
+			*size = MAX(*size, fabs(xt[a] - x[a]));
+			x[a] = xt[a];
+		}
+		f = ft;
+		memcpy(r, rt, nres*sizeof(double));
+		report_iteration(verbose, path_ptr, iter, x, f, *size);
+		if (*size < fit_tol) {
+			status = GSL_SUCCESS;
+			break;
+		}
+	}
+
+	*fval = f;
+	free(r);
+	free(rt);
+	free(jac);
+	*niter = iter;
+	return status;
+}
+
+
+/**
+  \brief CMA-ES (see the description of the file). The samples are
+  projected onto the bounds for the evaluation.
+ */
+static int optimize_cmaes(int ndim, double *x, double *steps, double *xmin, double *xmax, double fit_tol, int itermax, unsigned long seed, objective_struct_type *o, int verbose, FILE *path_ptr, double *fval, double *size, int *niter)
+{
+	int n = ndim;
+	int lambda = 4 + (int) (3.0 * log((double) n));
+	int mu = lambda / 2;
+	int a, b, i, k, iter = 0;
+	int status = GSL_CONTINUE;
+	int idx[4 + 3*OPT_MAXDIM];
+	double w[4 + 3*OPT_MAXDIM], fk[4 + 3*OPT_MAXDIM];
+	double yk[(4 + 3*OPT_MAXDIM) * OPT_MAXDIM];
+	double m[OPT_MAXDIM], m_old[OPT_MAXDIM], ps[OPT_MAXDIM], pc[OPT_MAXDIM];
+	double c[OPT_MAXDIM*OPT_MAXDIM], bm[OPT_MAXDIM*OPT_MAXDIM], dvec[OPT_MAXDIM];
+	double z[OPT_MAXDIM], u[OPT_MAXDIM], xe[OPT_MAXDIM], x_best[OPT_MAXDIM];
+	double sigma = 0.5;	/* Units of the steps */
+	double wsum = 0., mueff = 0., cs, ds, cc, c1, cmu, chin, nps, hsig, f_best;
+	gsl_rng *rng = gsl_rng_alloc(gsl_rng_mt19937);
+
+	gsl_rng_set(rng, seed);
+	for (i=0; i<mu; i++) {
+		w[i] = log(mu + 0.5) - log(i + 1.0);
+		wsum += w[i];
+	}
+	for (i=0; i<mu; i++) {
+		w[i] /= wsum;
+		mueff += SQR(w[i]);
+	}
+	mueff = 1.0 / mueff;
+	cs = (mueff + 2.0) / (n + mueff + 5.0);
+	ds = 1.0 + 2.0 * MAX(0., sqrt((mueff - 1.0) / (n + 1.0)) - 1.0) + cs;
+	cc = (4.0 + mueff / n) / (n + 4.0 + 2.0 * mueff / n);
+	c1 = 2.0 / (SQR(n + 1.3) + mueff);
+	cmu = MIN(1.0 - c1, 2.0 * (mueff - 2.0 + 1.0 / mueff) / (SQR(n + 2.0) + mueff));
+	chin = sqrt((double) n) * (1.0 - 1.0 / (4.0 * n) + 1.0 / (21.0 * SQR(n)));
+
+	for (a=0; a<n; a++) {
+		m[a] = x[a] / steps[a];
+		ps[a] = pc[a] = 0.;
+		for (b=0; b<n; b++)
+			c[a*n+b] = (a == b) ? 1. : 0.;
+		x_best[a] = x[a];
+	}
+	f_best = objective(o, n, x);
+
+	while (iter < itermax) {
+		iter++;
+		jacobi_eigen(n, c, bm, dvec);
+		for (a=0; a<n; a++)
+			dvec[a] = sqrt(MAX(dvec[a], 1.0e-20));
+
+		/* Samples y = m + sigma B D z */
+		for (k=0; k<lambda; k++) {
+			for (a=0; a<n; a++)
+				z[a] = gsl_ran_gaussian(rng, 1.0);
+			for (a=0; a<n; a++) {
+				for (b=0, yk[k*n+a]=m[a]; b<n; b++)
+					yk[k*n+a] += sigma * bm[a*n+b] * dvec[b] * z[b];
+				xe[a] = MIN(MAX(yk[k*n+a] * steps[a], xmin[a]), xmax[a]);
+			}
+			fk[k] = objective(o, n, xe);
+			if (fk[k] < f_best) {
+				f_best = fk[k];
+				memcpy(x_best, xe, n*sizeof(double));
+			}
+		}
+
+		/* Ranking (insertion sort) */
+		for (k=0; k<lambda; k++) {
+			for (i=k; (i > 0) && (fk[idx[i-1]] > fk[k]); i--)
+				idx[i] = idx[i-1];
+			idx[i] = k;
+		}
+
+		/* Mean and evolution paths */
+		memcpy(m_old, m, n*sizeof(double));
+		for (a=0; a<n; a++)
+			for (i=0, m[a]=0.; i<mu; i++)
+				m[a] += w[i] * yk[idx[i]*n+a];
+		for (b=0; b<n; b++) {	/* u = C^(-1/2) (m - m_old) / sigma */
+			for (a=0, z[b]=0.; a<n; a++)
+				z[b] += bm[a*n+b] * (m[a] - m_old[a]) / sigma;
+			z[b] /= dvec[b];
+		}
+		for (a=0, nps=0.; a<n; a++) {
+			for (b=0, u[a]=0.; b<n; b++)
+				u[a] += bm[a*n+b] * z[b];
+			ps[a] = (1.0 - cs) * ps[a] + sqrt(cs * (2.0 - cs) * mueff) * u[a];
+			nps += SQR(ps[a]);
+		}
+		nps = sqrt(nps);
+		hsig = (nps / sqrt(1.0 - pow(1.0 - cs, 2.0 * iter)) / chin
+			< 1.4 + 2.0 / (n + 1.0)) ? 1. : 0.;
+		for (a=0; a<n; a++)
+			pc[a] = (1.0 - cc) * pc[a] + hsig * sqrt(cc * (2.0 - cc) * mueff)
+				* (m[a] - m_old[a]) / sigma;
+
+		/* Covariance matrix and step size */
+		for (a=0; a<n; a++)
+			for (b=0; b<n; b++) {
+				double rank_mu = 0.;
+				for (i=0; i<mu; i++)
+					rank_mu += w[i] * (yk[idx[i]*n+a] - m_old[a])
+						* (yk[idx[i]*n+b] - m_old[b]) / SQR(sigma);
+				c[a*n+b] = (1.0 - c1 - cmu) * c[a*n+b]
+					+ c1 * (pc[a] * pc[b] + (1.0 - hsig) * cc * (2.0 - cc) * c[a*n+b])
+					+ cmu * rank_mu;
+			}
+		sigma *= exp((cs / ds) * (nps / chin - 1.0));
+
+		for (a=0, *size=0.; a<n; a++)
+			*size = MAX(*size, sigma * sqrt(c[a*n+a]) * steps[a]);
+		*fval = f_best;
+		report_iteration(verbose, path_ptr, iter, x_best, f_best, *size);
+		if (*size < fit_tol) {
+			status = GSL_SUCCESS;
+			break;
+		}
+	}
+
+	memcpy(x, x_best, n*sizeof(double));
+	*fval = f_best;
+	gsl_rng_free(rng);
+	*niter = iter;
+	return status;
+}
+
+
+/**
+  \brief Minimizes the mean squared error with one of the backends.
+
+  \param[in] method Backend (OPTIMIZER_*)
+  \param[in] ndim Number of parameters (at most 6)
+  \param[in,out] x Starting parameters; fitted parameters
+  \param[in] steps Initial steps (scales of the parameters)
+  \param[in] xmin Lower bounds of the parameters
+  \param[in] xmax Upper bounds of the parameters
+  \param[in] fit_tol Stopping criterion (size, in the units of the parameters)
+  \param[in] itermax Stopping criterion (maximum number of iterations)
+  \param[in] mse_func Mean squared error function (calc_mse_fit_layer())
+  \param[in] res_func Function that also returns the residuals (lm)
+  \param[in,out] params Struct of parameters and arrays for mse_func and res_func
+  \param[in] nres Number of residuals of res_func
+  \param[in] seed Seed of the random numbers (cmaes)
+  \param[in] verbose Flag for printing the iterations
+  \param[in] path_ptr File for the iterations (or NULL)
+  \param[out] fval Mean squared error of the fitted parameters
+  \param[out] size Final size
+  \param[out] niter Number of iterations
+  \param[out] nevals Number of evaluations of the model
+
+  \return GSL_SUCCESS if the size is below fit_tol (or lm cannot improve the fit), GSL_CONTINUE if not
+ */
+int optimize(int method, int ndim, double *x, double *steps, double *xmin, double *xmax, double fit_tol, int itermax, double (*mse_func)(const gsl_vector *, void *), double (*res_func)(const gsl_vector *, void *, double *), void *params, int nres, unsigned long seed, int verbose, FILE *path_ptr, double *fval, double *size, int *niter, int *nevals)
+{
+	int status = GSL_CONTINUE;
+	objective_struct_type o;
+
+	if (ndim > OPT_MAXDIM)
+		error("optimize: too many parameters (%d)", ndim);
+	o.mse_func = mse_func;
+	o.params = params;
+	o.nevals = 0;
+	o.x = gsl_vector_alloc(ndim);
+	*size = -1.;
+
+	switch (method) {
+	case OPTIMIZER_NMSIMPLEX:
+	case OPTIMIZER_NMSIMPLEX2:
+		status = optimize_simplex(method == OPTIMIZER_NMSIMPLEX2, ndim, x, steps,
+			fit_tol, itermax, &o, verbose, path_ptr, fval, size, niter);
+		break;
+	case OPTIMIZER_TRUST:
+		status = optimize_trust(ndim, x, steps, xmin, xmax, fit_tol, itermax,
+			&o, verbose, path_ptr, fval, size, niter);
+		break;
+	case OPTIMIZER_LM:
+		status = optimize_lm(ndim, x, steps, xmin, xmax, fit_tol, itermax,
+			res_func, nres, &o, verbose, path_ptr, fval, size, niter);
+		break;
+	case OPTIMIZER_CMAES:
+		status = optimize_cmaes(ndim, x, steps, xmin, xmax, fit_tol, itermax,
+			seed, &o, verbose, path_ptr, fval, size, niter);
+		break;
+	default:
+		error("optimize: unknown optimizer %d", method);
+	}
+
+	*nevals = o.nevals;
+	gsl_vector_free(o.x);
+	return status;
+}
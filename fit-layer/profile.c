@@ -0,0 +1,264 @@
+/**
+  \file fit-layer/profile.c
+
+  Profile likelihood of the fitted parameters.
+
+  The profile of a parameter is the best fit of the other parameters
+  with that parameter fixed at a series of values around the fit.
+  With Gaussian noise of unknown variance, the deviance of a profile
+  point is \f$ N \ln(\mathrm{MSE} / \mathrm{MSE}_{fit}) \f$ (N is the
+  number of residuals), and the 95% confidence interval of the
+  parameter is where the deviance is below the 95% point of the
+  \f$ \chi^2 \f$ distribution with one degree of freedom.
+
+  The points on each side of the fit are fitted one after the other,
+  each starting from the solution of its neighbour (which is much
+  closer than the fit itself), so the constrained fits need only a
+  few iterations. The two sides of the profiles of all parameters
+  are independent, so they are fitted in parallel with OpenMP if
+  the program is compiled with it (the number of threads is set
+  with the OMP_NUM_THREADS environment variable).
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_multimin.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "header.h"
+
+
+/**
+  \def PROFILE_CHI2
+  95% point of the \f$ \chi^2 \f$ distribution with one degree of
+  freedom (threshold of the deviance for the confidence interval).
+ */
+#define PROFILE_CHI2 3.841459
+
+
+/**
+  \typedef Typedef for struct for passing the fixed parameter and
+  the mse function to calc_mse_constrained()
+ */
+typedef struct {
+	int ndim;            ///< Number of parameters (fixed and free)
+	int fixed;           ///< Index of the fixed parameter
+	double value;        ///< Value of the fixed parameter
+	double (*mse_func)(const gsl_vector *, void *);  ///< Mean squared error function of all parameters
+	void *params;        ///< Struct of parameters and arrays for mse_func
+	gsl_vector *x;       ///< Work vector of all parameters
+} constrained_struct_type;
+
+
+/**
+  \brief Mean squared error as a function of the free parameters,
+  with one parameter fixed.
+
+  \param[in] y Vector of the free parameters (all but the fixed one, in order)
+  \param[in,out] params Struct with the fixed parameter and the mse function
+
+  \return Mean squared error
+ */
+static double calc_mse_constrained(const gsl_vector *y, void *params)
+{
+	int i, k;
+	constrained_struct_type *c = (constrained_struct_type *) params;
+
+	for (i=0, k=0; i<c->ndim; i++)
+		gsl_vector_set(c->x, i, (i == c->fixed) ? c->value : gsl_vector_get(y, k++));
+
+	return c->mse_func(c->x, c->params);
+}
+
+
+/**
+  \brief Fits the parameters along one side of the profile of one
+  parameter.
+
+  \param[in] ndim Number of parameters
+  \param[in] fixed Index of the profiled parameter
+  \param[in] npoints Number of profile points
+  \param[in] h Spacing of the profile points (< 0 for the points below the fit)
+  \param[in] x_fit Fitted parameters
+  \param[in] steps Initial steps of the simplex of the constrained fits
+  \param[in] xmin Lower bounds of the parameters
+  \param[in] xmax Upper bounds of the parameters
+  \param[in] fit_tol Stopping criterion (simplex size)
+  \param[in] itermax Stopping criterion (maximum number of iterations)
+  \param[in] mse_func Mean squared error function (calc_mse_fit_layer())
+  \param[in,out] params Struct of parameters and arrays for mse_func
+  \param[out] values Values of the profiled parameter
+  \param[out] mses Mean squared errors of the constrained fits (< 0 if outside the bounds)
+ */
+static void profile_side(int ndim, int fixed, int npoints, double h, double *x_fit, double *steps, double *xmin, double *xmax, double fit_tol, int itermax, double (*mse_func)(const gsl_vector *, void *), void *params, double *values, double *mses)
+{
+	int i, k, n, iter, status;
+	constrained_struct_type c;
+	gsl_multimin_function func;
+	gsl_multimin_fminimizer *state;
+	gsl_vector *y = gsl_vector_alloc(ndim - 1);
+	gsl_vector *ystep = gsl_vector_alloc(ndim - 1);
+
+	c.ndim = ndim;
+	c.fixed = fixed;
+	c.mse_func = mse_func;
+	c.params = params;
+	c.x = gsl_vector_alloc(ndim);
+
+	func.n = ndim - 1;
+	func.f = calc_mse_constrained;
+	func.params = &c;
+	state = gsl_multimin_fminimizer_alloc(gsl_multimin_fminimizer_nmsimplex, ndim - 1);
+
+	/* The first point starts from the fit */
+	for (i=0, k=0; i<ndim; i++)
+		if (i != fixed) {
+			gsl_vector_set(y, k, x_fit[i]);
+			gsl_vector_set(ystep, k, steps[i]);
+			k++;
+		}
+
+	for (n=0; n<npoints; n++) {
+		values[n] = x_fit[fixed] + (n+1) * h;
+		mses[n] = -1.;
+		if ( (values[n] < xmin[fixed]) || (values[n] > xmax[fixed]) )
+			continue;
+		c.value = values[n];
+
+		gsl_multimin_fminimizer_set(state, &func, y, ystep);
+		iter = 0;
+		do {
+			iter++;
+			status = gsl_multimin_fminimizer_iterate(state);
+			if (status) break;
+			status = gsl_multimin_test_size(
+				gsl_multimin_fminimizer_size(state), fit_tol);
+		} while (status == GSL_CONTINUE && iter < itermax);
+
+		mses[n] = state->fval;
+		/* The next point starts from this one */
+		gsl_vector_memcpy(y, state->x);
+	}
+
+	gsl_multimin_fminimizer_free(state);
+	gsl_vector_free(y);
+	gsl_vector_free(ystep);
+	gsl_vector_free(c.x);
+}
+
+
+/**
+  \brief Calculates the profile likelihood of the first nprof
+  parameters.
+
+  For parameter i, the profile has 2*npoints+1 points with the
+  values x_fit[i] + j*h[i] (j = -npoints to npoints); point j of
+  parameter i is element i*(2*npoints+1) + npoints + j of values and
+  mses (the middle point is the fit itself). The 2*nprof sides of
+  the profiles are fitted in parallel.
+
+  \param[in] ndim Number of parameters
+  \param[in] nprof Number of profiled parameters (the first nprof)
+  \param[in] npoints Number of profile points on each side of the fit
+  \param[in] h Spacing of the profile points of each parameter
+  \param[in] x_fit Fitted parameters
+  \param[in] mse_fit Mean squared error of the fit
+  \param[in] steps Initial steps of the simplex of the constrained fits
+  \param[in] xmin Lower bounds of the parameters
+  \param[in] xmax Upper bounds of the parameters
+  \param[in] fit_tol Stopping criterion (simplex size)
+  \param[in] itermax Stopping criterion (maximum number of iterations)
+  \param[in] mse_func Mean squared error function (calc_mse_fit_layer())
+  \param[in,out] params Array of nparams structs for mse_func (one for each thread)
+  \param[in] nparams Number of structs in params (at least the number of threads)
+  \param[out] values Values of the profiled parameters
+  \param[out] mses Mean squared errors of the constrained fits (< 0 if outside the bounds)
+ */
+void profile_likelihood(int ndim, int nprof, int npoints, double *h, double *x_fit, double mse_fit, double *steps, double *xmin, double *xmax, double fit_tol, int itermax, double (*mse_func)(const gsl_vector *, void *), void **params, int nparams, double *values, double *mses)
+{
+	int b;
+	int np = 2*npoints + 1;
+	double *side_values = create_array(2*nprof*npoints, "profile values");
+	double *side_mses = create_array(2*nprof*npoints, "profile mses");
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (b=0; b<2*nprof; b++) {
+		int tid = 0;
+#ifdef _OPENMP
+		tid = omp_get_thread_num();
+#endif
+		profile_side(ndim, b/2, npoints, (b % 2) ? h[b/2] : -h[b/2],
+			x_fit, steps, xmin, xmax, fit_tol, itermax, mse_func,
+			params[tid % nparams], side_values + b*npoints,
+			side_mses + b*npoints);
+	}
+
+	for (b=0; b<2*nprof; b++) {
+		int i = b/2;
+		int n;
+		for (n=0; n<npoints; n++) {
+			int j = (b % 2) ? n+1 : -(n+1);
+			values[i*np + npoints + j] = side_values[b*npoints + n];
+			mses[i*np + npoints + j] = side_mses[b*npoints + n];
+		}
+		values[i*np + npoints] = x_fit[i];
+		mses[i*np + npoints] = mse_fit;
+	}
+
+	free(side_values);
+	free(side_mses);
+}
+
+
+/**
+  \brief Calculates the 95% confidence interval of a parameter from
+  its profile.
+
+  The ends of the interval are where the deviance
+  \f$ N \ln(\mathrm{MSE} / \mathrm{MSE}_{fit}) \f$ crosses the 95%
+  point of \f$ \chi^2_1 \f$, interpolated linearly between the profile
+  points. If the deviance stays below the threshold on one side, that
+  end of the interval is not found.
+
+  \param[in] npoints Number of profile points on each side of the fit
+  \param[in] values Values of the parameter at the 2*npoints+1 profile points
+  \param[in] mses Mean squared errors at the profile points (< 0 if not calculated)
+  \param[in] mse_fit Mean squared error of the fit
+  \param[in] nres Number of residuals
+  \param[out] lower Lower end of the interval
+  \param[out] upper Upper end of the interval
+  \param[out] found_lower TRUE if the lower end was found
+  \param[out] found_upper TRUE if the upper end was found
+ */
+void profile_interval(int npoints, double *values, double *mses, double mse_fit, int nres, double *lower, double *upper, int *found_lower, int *found_upper)
+{
+	int j, side;
+	double d0, d1;
+
+	*found_lower = *found_upper = FALSE;
+	*lower = *upper = values[npoints];
+
+	for (side=-1; side<=1; side+=2) {
+		d0 = 0.;
+		for (j=1; j<=npoints; j++) {
+			int k = npoints + side*j;
+			if (mses[k] < 0.) break;
+			*((side < 0) ? lower : upper) = values[k];
+			d1 = nres * log(mses[k] / mse_fit);
+			if (d1 >= PROFILE_CHI2) {
+				double v0 = values[k - side];
+				*((side < 0) ? lower : upper) = v0 +
+					(values[k] - v0) * (PROFILE_CHI2 - d0) / (d1 - d0);
+				*((side < 0) ? found_lower : found_upper) = TRUE;
+				break;
+			}
+			d0 = d1;
+		}
+	}
+}
@@ -0,0 +1,110 @@
+/**
+  \file fit-layer/recordings.c
+
+  Function for reading the additional recordings of a joint fit.
+
+  A joint fit fits the parameters of the fitted layer to several
+  recordings in the same tissue, e.g. at different probe distances
+  or with different currents. The first recording is the input file
+  of fit-layer, which also has the tissue and the grid; each
+  additional recording (--recording) is a file in the same format,
+  of which only the parameters of the recording itself are read.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "header.h"
+
+
+/**
+  \brief Reads an additional recording of a joint fit.
+
+  The file has the same format as the input file of fit-layer: a
+  header with comment lines (beginning with '#') and lines
+  "parameter = value [optional trailing text]", two blank lines, a
+  heading line, and the data in 2 (or more) columns (time in s,
+  concentration in mM). Of the parameters, only probe_z, probe_r
+  (microns, relative to the source), current (nA), trn, delay and
+  duration (s) are read; the others are ignored. The probe position
+  and the source parameters that are not in the file keep the values
+  that are passed in (those of the first recording).
+
+  \param[in] filename Name of the file
+  \param[in,out] pz z-position of probe relative to the source (m)
+  \param[in,out] pr r-position of probe (m)
+  \param[in,out] crnt Iontophoretic current (A)
+  \param[in,out] trn Transport number of the source electrode
+  \param[in,out] sd Source delay (s)
+  \param[in,out] st Source duration (s)
+  \param[out] t_data Time array for data (MAXNUM_LINES elements)
+  \param[out] p_data Probe concentration data (MAXNUM_LINES elements)
+
+  \return Number of data points
+ */
+int read_recording(char *filename, double *pz, double *pr, double *crnt, double *trn, double *sd, double *st, double *t_data, double *p_data)
+{
+	int i, nd;
+	int linelength;
+	int found_header_end = FALSE;
+	char string[MAX_LINELENGTH];
+	char parameter[MAX_LINELENGTH];
+	char value[MAX_LINELENGTH];
+	char junk_char = '\0';
+	FILE *file_ptr;
+
+	if ((file_ptr = fopen(filename,"r")) == NULL)
+		error("Error opening recording file %s", filename);
+
+	/* Header */
+	for (i=0; i<MAXNUM_LINES; i++) {
+		if (fgets(string,MAX_LINELENGTH,file_ptr) == NULL)
+			break;
+		linelength = strlen(string);
+
+		if (string[0] == '#') {
+			continue;
+		} else if (linelength < 3) {
+			found_header_end = TRUE;
+			break;
+		} else if (linelength >= MAX_LINELENGTH-1) {
+			fprintf(stderr, "Warning: Line %d of %s seems to be too long\n",
+				i+1, filename);
+			if (fscanf(file_ptr, "%*[^\n] %[\n]", &junk_char) == EOF)
+				error("fscanf returned EOF");
+		} else {
+			if (sscanf(string, "%s = %s", parameter, value) == EOF)
+				error("scanf returned EOF");
+			if (STREQ(parameter, "probe_z")) *pz = 1e-6 * atof(value);
+			if (STREQ(parameter, "probe_r")) *pr = 1e-6 * atof(value);
+			if (STREQ(parameter, "current")) *crnt = 1e-9 * atof(value);
+			if (STREQ(parameter, "trn")) *trn = atof(value);
+			if (STREQ(parameter, "delay")) *sd = atof(value);
+			if (STREQ(parameter, "duration")) *st = atof(value);
+		}
+	}
+	if (!found_header_end)
+		error("Did not find blank line after header of %s", filename);
+
+	/* Blank line and heading of the data */
+	if ( (fgets(string,MAX_LINELENGTH,file_ptr) == NULL) ||
+	     (fgets(string,MAX_LINELENGTH,file_ptr) == NULL) )
+		error("EOF (or error) reached before reading data of %s", filename);
+
+	/* Data */
+	for (nd=0; nd<MAXNUM_LINES; nd++)
+		if (fscanf(file_ptr, "%lf%lf%*[^\n] %[\n]",
+			&t_data[nd], &p_data[nd], &junk_char) == EOF)
+			break;
+	if (nd == MAXNUM_LINES)
+		error("Read maximum number of lines of %s (%d)\n"
+			"but did not reach end of file", filename, nd);
+	if (nd < 2)
+		error("Recording %s has fewer than 2 data points", filename);
+
+	fclose(file_ptr);
+
+	return nd;
+}